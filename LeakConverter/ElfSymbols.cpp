@@ -0,0 +1,774 @@
+#include "ElfSymbols.h"
+
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+
+#include <elf.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cxxabi.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Standard opcodes of the line number program.
+enum LineStandardOpcode : uint8_t
+{
+   DW_LNS_copy                = 0x01,
+   DW_LNS_advance_pc          = 0x02,
+   DW_LNS_advance_line        = 0x03,
+   DW_LNS_set_file            = 0x04,
+   DW_LNS_set_column          = 0x05,
+   DW_LNS_negate_stmt         = 0x06,
+   DW_LNS_set_basic_block     = 0x07,
+   DW_LNS_const_add_pc        = 0x08,
+   DW_LNS_fixed_advance_pc    = 0x09,
+   DW_LNS_set_prologue_end    = 0x0a,
+   DW_LNS_set_epilogue_begin  = 0x0b,
+   DW_LNS_set_isa             = 0x0c,
+};
+
+// Extended opcodes of the line number program.
+enum LineExtendedOpcode : uint8_t
+{
+   DW_LNE_end_sequence        = 0x01,
+   DW_LNE_set_address         = 0x02,
+   DW_LNE_define_file         = 0x03,
+};
+
+// Content types and forms of the directory and file tables (DWARF 5).
+enum LineContentType : uint64_t
+{
+   DW_LNCT_path               = 0x1,
+   DW_LNCT_directory_index    = 0x2,
+};
+
+enum AttributeForm : uint64_t
+{
+   DW_FORM_block2             = 0x03,
+   DW_FORM_block4             = 0x04,
+   DW_FORM_data2              = 0x05,
+   DW_FORM_data4              = 0x06,
+   DW_FORM_data8              = 0x07,
+   DW_FORM_string             = 0x08,
+   DW_FORM_block              = 0x09,
+   DW_FORM_block1             = 0x0a,
+   DW_FORM_data1              = 0x0b,
+   DW_FORM_sdata              = 0x0d,
+   DW_FORM_strp               = 0x0e,
+   DW_FORM_udata              = 0x0f,
+   DW_FORM_data16             = 0x1e,
+   DW_FORM_line_strp          = 0x1f,
+};
+
+///
+/// MappedFile
+/// Read-only mapping of a file.
+///
+class MappedFile
+{
+   const uint8_t* mData = nullptr;
+   size_t mSize = 0;
+
+public:
+   ~MappedFile ()
+   {
+      if (mData)
+         munmap ((void*)mData, mSize);
+   }
+
+   bool open (const std::string& path)
+   {
+      const int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+         return false;
+
+      struct stat info;
+      if (fstat (fd, &info) == 0 && info.st_size > 0)
+      {
+         void* mapping = mmap (nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (mapping != MAP_FAILED)
+         {
+            mData = (const uint8_t*)mapping;
+            mSize = (size_t)info.st_size;
+         }
+      }
+
+      close (fd);
+      return mData != nullptr;
+   }
+
+   const uint8_t* data () const { return mData; }
+   size_t size () const { return mSize; }
+};
+
+///
+/// SectionReader
+/// Bounds-checked reader of a section. Reading past the end sets the failed state
+/// and returns zeros.
+///
+class SectionReader
+{
+   const uint8_t* mData;
+   size_t mSize;
+   size_t mOffset;
+   bool mFailed;
+
+public:
+   SectionReader (const uint8_t* data, size_t size, size_t offset = 0)
+      : mData (data)
+      , mSize (size)
+      , mOffset (offset)
+      , mFailed (offset > size)
+   {
+   }
+
+   template <typename T> T read ()
+   {
+      T value{};
+      if (mFailed || mSize - mOffset < sizeof (T))
+      {
+         mFailed = true;
+         return value;
+      }
+
+      memcpy (&value, mData + mOffset, sizeof (T));
+      mOffset += sizeof (T);
+      return value;
+   }
+
+   uint64_t uleb ()
+   {
+      uint64_t value = 0;
+      for (unsigned int shift = 0; ; shift += 7)
+      {
+         const uint8_t byte = read<uint8_t> ();
+         if (shift < 64)
+            value |= (uint64_t)(byte & 0x7f) << shift;
+
+         if ((byte & 0x80) == 0 || mFailed)
+            return value;
+      }
+   }
+
+   int64_t sleb ()
+   {
+      int64_t value = 0;
+      unsigned int shift = 0;
+      uint8_t byte = 0;
+      do
+      {
+         byte = read<uint8_t> ();
+         if (shift < 64)
+            value |= (int64_t)(byte & 0x7f) << shift;
+
+         shift += 7;
+      } while ((byte & 0x80) != 0 && !mFailed);
+
+      if (shift < 64 && (byte & 0x40) != 0)
+         value |= -((int64_t)1 << shift);
+
+      return value;
+   }
+
+   /// Reads a null-terminated string; returns an empty string if it is not terminated.
+   const char* cstr ()
+   {
+      const uint8_t* end = mFailed ? nullptr : (const uint8_t*)memchr (mData + mOffset, 0, mSize - mOffset);
+      if (end == nullptr)
+      {
+         mFailed = true;
+         return "";
+      }
+
+      const char* value = (const char*)(mData + mOffset);
+      mOffset = (size_t)(end - mData) + 1;
+      return value;
+   }
+
+   uint64_t address (uint8_t size)
+   {
+      switch (size)
+      {
+      case 4: return read<uint32_t> ();
+      case 8: return read<uint64_t> ();
+      default: skip (size); return 0;
+      }
+   }
+
+   void skip (uint64_t size)
+   {
+      if (mFailed || mSize - mOffset < size)
+         mFailed = true;
+      else
+         mOffset += (size_t)size;
+   }
+
+   void seek (size_t offset)
+   {
+      if (offset > mSize)
+         mFailed = true;
+      else
+         mOffset = offset;
+   }
+
+   size_t offset () const { return mOffset; }
+   bool failed () const { return mFailed; }
+   bool eof () const { return mFailed || mOffset >= mSize; }
+};
+
+class ElfSymbols::Private
+{
+   friend class ::ElfSymbols;
+
+   /// A function of the symbol tables; 'name' points into the mapped string table.
+   typedef struct FUNCTION_ {
+      uint64_t address;
+      uint64_t size;
+      const char* name;
+   } FUNCTION;
+
+   /// A row of the line table; 'file' is NoFile for the end of a sequence.
+   typedef struct LINE_ {
+      uint64_t address;
+      uint32_t file;
+      uint32_t line;
+   } LINE;
+
+   static constexpr uint32_t NoFile = UINT32_MAX;
+
+   /// The sections of a mapped ELF file used by the symbolizer.
+   typedef struct ELF_SECTIONS_ {
+      SectionReader symtab, symtab_strings;
+      SectionReader dynsym, dynsym_strings;
+      SectionReader debug_line, debug_line_str, debug_str;
+      SectionReader debuglink;
+   } ELF_SECTIONS;
+
+   std::vector<std::unique_ptr<MappedFile>> files;      // The binary and its debug file
+   std::vector<uint8_t> build_id;
+   uint64_t address_bias = 0;                            // Virtual address minus file offset of the first segment
+   std::vector<FUNCTION> functions;
+   std::vector<LINE> lines;
+   std::vector<std::string> file_names;
+
+   bool open (const std::string& path)
+   {
+      auto file = std::make_unique<MappedFile> ();
+      const Elf64_Ehdr* header = file->open (path) ? GetHeader (*file) : nullptr;
+      if (header == nullptr)
+         return false;
+
+      // Frames are relative to the start of the file; symbols to the virtual addresses.
+      const Elf64_Phdr* segments = (const Elf64_Phdr*)(file->data () + header->e_phoff);
+      for (unsigned int i = 0; i < header->e_phnum; i++)
+      {
+         if (segments[i].p_type == PT_LOAD)
+         {
+            address_bias = segments[i].p_vaddr - segments[i].p_offset;
+            break;
+         }
+      }
+
+      for (unsigned int i = 0; i < header->e_phnum && build_id.empty (); i++)
+      {
+         if (segments[i].p_type == PT_NOTE && segments[i].p_offset + segments[i].p_filesz <= file->size ())
+            build_id = ReadBuildId (SectionReader (file->data () + segments[i].p_offset, segments[i].p_filesz));
+      }
+
+      ELF_SECTIONS sections = GetSections (*file, *header);
+      load_symbols (sections.symtab, sections.symtab_strings);
+      load_symbols (sections.dynsym, sections.dynsym_strings);
+      load_lines (sections);
+
+      const bool stripped = sections.symtab.eof () || sections.debug_line.eof ();
+      const std::string debuglink = sections.debuglink.eof () ? std::string () : sections.debuglink.cstr ();
+      files.push_back (std::move (file));
+
+      // Stripped binaries; the symbols and lines are part of the separate debug file.
+      if (stripped)
+      {
+         for (const auto& candidate : GetDebugFileCandidates (path, debuglink))
+         {
+            auto debug = std::make_unique<MappedFile> ();
+            const Elf64_Ehdr* debug_header = debug->open (candidate) ? GetHeader (*debug) : nullptr;
+            if (debug_header == nullptr)
+               continue;
+
+            ELF_SECTIONS debug_sections = GetSections (*debug, *debug_header);
+            if (sections.symtab.eof ())
+               load_symbols (debug_sections.symtab, debug_sections.symtab_strings);
+
+            if (sections.debug_line.eof ())
+               load_lines (debug_sections);
+
+            files.push_back (std::move (debug));
+            break;
+         }
+      }
+
+      // Sorted by address; .symtab before .dynsym for equal addresses.
+      std::stable_sort (functions.begin (), functions.end (), [] (const FUNCTION& a, const FUNCTION& b) { return a.address < b.address; });
+      functions.erase (std::unique (functions.begin (), functions.end (), [] (const FUNCTION& a, const FUNCTION& b) { return a.address == b.address; }), functions.end ());
+
+      // The end of a sequence sorts before a row of the next sequence at the same address.
+      std::stable_sort (lines.begin (), lines.end (), [] (const LINE& a, const LINE& b) {
+         return a.address < b.address || (a.address == b.address && a.file == NoFile && b.file != NoFile);
+      });
+
+      return true;
+   }
+
+   bool resolve (uint64_t offset, libLeak::SYMBOL_ENTRY& entry) const
+   {
+      // The frame is a return address; the call is the instruction before.
+      const uint64_t address = offset + address_bias - 1;
+
+      auto function = std::upper_bound (functions.begin (), functions.end (), address, [] (uint64_t value, const FUNCTION& f) { return value < f.address; });
+      if (function == functions.begin ())
+         return false;
+
+      --function;
+      if (function->size != 0 && address >= function->address + function->size)
+         return false;
+
+      entry.name = Demangle (function->name);
+      entry.file.clear ();
+      entry.line = 0;
+
+      auto line = std::upper_bound (lines.begin (), lines.end (), address, [] (uint64_t value, const LINE& l) { return value < l.address; });
+      if (line != lines.begin () && (--line)->file != NoFile)
+      {
+         entry.file = file_names[line->file];
+         entry.line = line->line;
+      }
+
+      return true;
+   }
+
+   void load_symbols (SectionReader symbols, SectionReader strings)
+   {
+      while (!symbols.eof ())
+      {
+         const Elf64_Sym symbol = symbols.read<Elf64_Sym> ();
+         if (symbols.failed ())
+            break;
+
+         const unsigned char type = ELF64_ST_TYPE (symbol.st_info);
+         if ((type != STT_FUNC && type != STT_GNU_IFUNC) || symbol.st_shndx == SHN_UNDEF || symbol.st_value == 0)
+            continue;
+
+         SectionReader name = strings;
+         name.seek (symbol.st_name);
+         const char* text = name.cstr ();
+         if (*text)
+            functions.push_back ({ symbol.st_value, symbol.st_size, text });
+      }
+   }
+
+   ///
+   /// Runs the line number programs of all units of .debug_line and appends their rows.
+   ///
+   void load_lines (const ELF_SECTIONS& sections)
+   {
+      SectionReader reader = sections.debug_line;
+      while (!reader.eof ())
+      {
+         // Unit header.
+         uint64_t unit_length = reader.read<uint32_t> ();
+         const bool dwarf64 = unit_length == 0xffffffff;
+         if (dwarf64)
+            unit_length = reader.read<uint64_t> ();
+
+         const size_t unit_end = reader.offset () + (size_t)unit_length;
+         if (reader.failed () || unit_length == 0)
+            break;
+
+         load_line_unit (reader, unit_end, dwarf64, sections);
+         reader.seek (unit_end);
+      }
+   }
+
+   void load_line_unit (SectionReader reader, size_t unit_end, bool dwarf64, const ELF_SECTIONS& sections)
+   {
+      const uint16_t version = reader.read<uint16_t> ();
+      if (version < 2 || version > 5)
+         return;
+
+      uint8_t address_size = 8;
+      if (version >= 5)
+      {
+         address_size = reader.read<uint8_t> ();
+         reader.read<uint8_t> ();                              // segment_selector_size
+      }
+
+      const uint64_t header_length = dwarf64 ? reader.read<uint64_t> () : reader.read<uint32_t> ();
+      const size_t program_start = reader.offset () + (size_t)header_length;
+
+      const uint8_t minimum_instruction_length = reader.read<uint8_t> ();
+      if (version >= 4)
+         reader.read<uint8_t> ();                              // maximum_operations_per_instruction
+
+      reader.read<uint8_t> ();                                 // default_is_stmt
+      const int8_t line_base = reader.read<int8_t> ();
+      const uint8_t line_range = reader.read<uint8_t> ();
+      const uint8_t opcode_base = reader.read<uint8_t> ();
+      if (line_range == 0 || opcode_base == 0)
+         return;
+
+      std::vector<uint8_t> standard_opcode_lengths (opcode_base);
+      for (uint8_t i = 1; i < opcode_base; i++)
+         standard_opcode_lengths[i] = reader.read<uint8_t> ();
+
+      // File table of the unit; indices refer to file_names. The files of DWARF 5 count from 0.
+      std::vector<uint32_t> files;
+      if (version >= 5)
+      {
+         std::vector<std::string> directories;
+         for (const auto& entry : ReadEntryTable (reader, dwarf64, sections))
+            directories.push_back (entry.first);
+
+         for (const auto& entry : ReadEntryTable (reader, dwarf64, sections))
+            files.push_back (add_file (entry.first, entry.second < directories.size () ? directories[entry.second] : std::string ()));
+      }
+      else
+      {
+         std::vector<std::string> directories (1);
+         for (const char* directory = reader.cstr (); *directory; directory = reader.cstr ())
+            directories.push_back (directory);
+
+         files.push_back (NoFile);
+         for (const char* name = reader.cstr (); *name; name = reader.cstr ())
+         {
+            const uint64_t directory = reader.uleb ();
+            reader.uleb ();                                    // modification time
+            reader.uleb ();                                    // length
+            files.push_back (add_file (name, directory < directories.size () ? directories[directory] : std::string ()));
+         }
+      }
+
+      if (reader.failed ())
+         return;
+
+      // Line number program.
+      reader.seek (program_start);
+
+      uint64_t address = 0;
+      uint64_t file = 1;
+      int64_t line = 1;
+      bool valid = false;                                      // Sequences of discarded code start at 0 or ~0
+
+      auto append_row = [&] ()
+      {
+         if (valid)
+            lines.push_back ({ address, file < files.size () ? files[file] : NoFile, (uint32_t)line });
+      };
+
+      while (reader.offset () < unit_end && !reader.failed ())
+      {
+         const uint8_t opcode = reader.read<uint8_t> ();
+         if (opcode >= opcode_base)
+         {
+            // Special opcode.
+            const uint8_t adjusted = opcode - opcode_base;
+            address += (uint64_t)(adjusted / line_range) * minimum_instruction_length;
+            line += line_base + adjusted % line_range;
+            append_row ();
+            continue;
+         }
+
+         switch (opcode)
+         {
+         case 0:
+         {
+            const uint64_t length = reader.uleb ();
+            const size_t end = reader.offset () + (size_t)length;
+            const uint8_t extended = length ? reader.read<uint8_t> () : 0;
+            if (extended == DW_LNE_end_sequence)
+            {
+               if (valid)
+                  lines.push_back ({ address, NoFile, 0 });
+
+               address = 0;
+               file = 1;
+               line = 1;
+               valid = false;
+            }
+            else if (extended == DW_LNE_set_address)
+            {
+               address = reader.address ((uint8_t)(length - 1));
+               valid = address != 0 && address != (address_size == 4 ? 0xffffffffULL : ~0ULL);
+            }
+
+            // DW_LNE_define_file, DW_LNE_set_discriminator and vendor extensions.
+            reader.seek (end);
+            break;
+         }
+         case DW_LNS_copy:
+            append_row ();
+            break;
+         case DW_LNS_advance_pc:
+            address += reader.uleb () * minimum_instruction_length;
+            break;
+         case DW_LNS_advance_line:
+            line += reader.sleb ();
+            break;
+         case DW_LNS_set_file:
+            file = reader.uleb ();
+            break;
+         case DW_LNS_const_add_pc:
+            address += (uint64_t)((255 - opcode_base) / line_range) * minimum_instruction_length;
+            break;
+         case DW_LNS_fixed_advance_pc:
+            address += reader.read<uint16_t> ();
+            break;
+         case DW_LNS_negate_stmt:
+         case DW_LNS_set_basic_block:
+         case DW_LNS_set_prologue_end:
+         case DW_LNS_set_epilogue_begin:
+            break;
+         default:
+            // DW_LNS_set_column, DW_LNS_set_isa and unknown standard opcodes.
+            for (uint8_t i = 0; i < standard_opcode_lengths[opcode]; i++)
+               reader.uleb ();
+            break;
+         }
+      }
+   }
+
+   /// Adds a file to the string table; returns its index.
+   uint32_t add_file (const std::string& name, const std::string& directory)
+   {
+      if (name.empty () || name[0] == '/' || directory.empty ())
+         file_names.push_back (name);
+      else
+         file_names.push_back (directory + "/" + name);
+
+      return (uint32_t)(file_names.size () - 1);
+   }
+
+   ///
+   /// Reads a directory or file table of DWARF 5.
+   /// Returns the path and directory index of each entry.
+   ///
+   static std::vector<std::pair<std::string, uint64_t>> ReadEntryTable (SectionReader& reader, bool dwarf64, const ELF_SECTIONS& sections)
+   {
+      std::vector<std::pair<uint64_t, uint64_t>> formats (reader.read<uint8_t> ());    // content type, form
+      for (auto& format : formats)
+      {
+         format.first = reader.uleb ();
+         format.second = reader.uleb ();
+      }
+
+      std::vector<std::pair<std::string, uint64_t>> entries (reader.uleb ());
+      for (auto& entry : entries)
+      {
+         entry.second = 0;
+         for (const auto& format : formats)
+         {
+            std::string text;
+            uint64_t value = 0;
+            switch (format.second)
+            {
+            case DW_FORM_string:    text = reader.cstr (); break;
+            case DW_FORM_line_strp: text = GetString (sections.debug_line_str, dwarf64 ? reader.read<uint64_t> () : reader.read<uint32_t> ()); break;
+            case DW_FORM_strp:      text = GetString (sections.debug_str, dwarf64 ? reader.read<uint64_t> () : reader.read<uint32_t> ()); break;
+            case DW_FORM_udata:     value = reader.uleb (); break;
+            case DW_FORM_sdata:     value = (uint64_t)reader.sleb (); break;
+            case DW_FORM_data1:     value = reader.read<uint8_t> (); break;
+            case DW_FORM_data2:     value = reader.read<uint16_t> (); break;
+            case DW_FORM_data4:     value = reader.read<uint32_t> (); break;
+            case DW_FORM_data8:     value = reader.read<uint64_t> (); break;
+            case DW_FORM_data16:    reader.skip (16); break;
+            case DW_FORM_block:     reader.skip (reader.uleb ()); break;
+            case DW_FORM_block1:    reader.skip (reader.read<uint8_t> ()); break;
+            case DW_FORM_block2:    reader.skip (reader.read<uint16_t> ()); break;
+            case DW_FORM_block4:    reader.skip (reader.read<uint32_t> ()); break;
+            default:
+               // Forms that need the string offsets of a compilation unit (DW_FORM_strx).
+               reader.seek (SIZE_MAX);
+               return {};
+            }
+
+            if (format.first == DW_LNCT_path)
+               entry.first = text;
+            else if (format.first == DW_LNCT_directory_index)
+               entry.second = value;
+         }
+      }
+
+      return entries;
+   }
+
+   static std::string GetString (SectionReader strings, uint64_t offset)
+   {
+      strings.seek ((size_t)offset);
+      return strings.cstr ();
+   }
+
+   /// Returns the ELF header of a mapped file, or nullptr if the file is not supported.
+   static const Elf64_Ehdr* GetHeader (const MappedFile& file)
+   {
+      const Elf64_Ehdr* header = (const Elf64_Ehdr*)file.data ();
+      if (file.size () < sizeof (Elf64_Ehdr) ||
+         memcmp (header->e_ident, ELFMAG, SELFMAG) != 0 ||
+         header->e_ident[EI_CLASS] != ELFCLASS64 ||
+         header->e_ident[EI_DATA] != ELFDATA2LSB ||
+         header->e_phoff + (uint64_t)header->e_phnum * sizeof (Elf64_Phdr) > file.size () ||
+         header->e_shoff + (uint64_t)header->e_shnum * sizeof (Elf64_Shdr) > file.size () ||
+         (header->e_phnum && header->e_phentsize != sizeof (Elf64_Phdr)) ||
+         (header->e_shnum && header->e_shentsize != sizeof (Elf64_Shdr)))
+      {
+         return nullptr;
+      }
+
+      return header;
+   }
+
+   /// Returns the sections used by the symbolizer; missing sections are empty.
+   static ELF_SECTIONS GetSections (const MappedFile& file, const Elf64_Ehdr& header)
+   {
+      const SectionReader empty (nullptr, 0);
+      ELF_SECTIONS sections = { empty, empty, empty, empty, empty, empty, empty, empty };
+      if (header.e_shnum == 0 || header.e_shstrndx >= header.e_shnum)
+         return sections;
+
+      const Elf64_Shdr* headers = (const Elf64_Shdr*)(file.data () + header.e_shoff);
+      auto section = [&] (unsigned int index) -> SectionReader
+      {
+         if (index >= header.e_shnum)
+            return empty;
+
+         const Elf64_Shdr& shdr = headers[index];
+         if (shdr.sh_type == SHT_NOBITS || (shdr.sh_flags & SHF_COMPRESSED) != 0 ||
+            shdr.sh_offset > file.size () || shdr.sh_size > file.size () - shdr.sh_offset)
+         {
+            return empty;
+         }
+
+         return SectionReader (file.data () + shdr.sh_offset, (size_t)shdr.sh_size);
+      };
+
+      const SectionReader names = section (header.e_shstrndx);
+      for (unsigned int i = 0; i < header.e_shnum; i++)
+      {
+         const std::string name = GetString (names, headers[i].sh_name);
+         if (name == ".symtab")
+         {
+            sections.symtab = section (i);
+            sections.symtab_strings = section (headers[i].sh_link);
+         }
+         else if (name == ".dynsym")
+         {
+            sections.dynsym = section (i);
+            sections.dynsym_strings = section (headers[i].sh_link);
+         }
+         else if (name == ".debug_line")
+            sections.debug_line = section (i);
+         else if (name == ".debug_line_str")
+            sections.debug_line_str = section (i);
+         else if (name == ".debug_str")
+            sections.debug_str = section (i);
+         else if (name == ".gnu_debuglink")
+            sections.debuglink = section (i);
+      }
+
+      return sections;
+   }
+
+   /// Reads the GNU build id of a note segment.
+   static std::vector<uint8_t> ReadBuildId (SectionReader notes)
+   {
+      while (!notes.eof ())
+      {
+         const Elf64_Nhdr note = notes.read<Elf64_Nhdr> ();
+         const size_t name = notes.offset ();
+         notes.skip ((note.n_namesz + 3) & ~3);
+         const size_t descriptor = notes.offset ();
+         notes.skip ((note.n_descsz + 3) & ~3);
+         if (notes.failed ())
+            break;
+
+         SectionReader text = notes;
+         text.seek (name);
+         if (note.n_type == NT_GNU_BUILD_ID && note.n_namesz == 4 && strcmp (text.cstr (), "GNU") == 0)
+         {
+            std::vector<uint8_t> id (note.n_descsz);
+            text.seek (descriptor);
+            for (auto& byte : id)
+               byte = text.read<uint8_t> ();
+
+            return id;
+         }
+      }
+
+      return {};
+   }
+
+   /// Returns the paths the separate debug file of a stripped binary is searched at.
+   std::vector<std::string> GetDebugFileCandidates (const std::string& path, const std::string& debuglink) const
+   {
+      std::vector<std::string> candidates;
+      if (build_id.size () > 1)
+      {
+         static const char* digits = "0123456789abcdef";
+         std::string hex;
+         for (uint8_t byte : build_id)
+         {
+            hex += digits[byte >> 4];
+            hex += digits[byte & 0xf];
+         }
+
+         candidates.push_back ("/usr/lib/debug/.build-id/" + hex.substr (0, 2) + "/" + hex.substr (2) + ".debug");
+      }
+
+      if (!debuglink.empty ())
+      {
+         const std::string directory = std::filesystem::path (path).parent_path ().string ();
+         candidates.push_back (directory + "/" + debuglink);
+         candidates.push_back (directory + "/.debug/" + debuglink);
+         candidates.push_back ("/usr/lib/debug" + directory + "/" + debuglink);
+      }
+
+      return candidates;
+   }
+
+   static std::string Demangle (const char* name)
+   {
+      int status = 0;
+      char* demangled = abi::__cxa_demangle (name, nullptr, nullptr, &status);
+      if (demangled == nullptr)
+         return name;
+
+      std::string result (demangled);
+      free (demangled);
+      return result;
+   }
+};
+
+ElfSymbols::ElfSymbols ()
+   : mPrivate (new Private ())
+{
+}
+
+ElfSymbols::~ElfSymbols ()
+{
+   delete mPrivate;
+   mPrivate = nullptr;
+}
+
+bool ElfSymbols::open (const std::string& path)
+{
+   return mPrivate->open (path);
+}
+
+const std::vector<uint8_t>& ElfSymbols::build_id () const
+{
+   return mPrivate->build_id;
+}
+
+bool ElfSymbols::resolve (uint64_t offset, libLeak::SYMBOL_ENTRY& entry) const
+{
+   return mPrivate->resolve (offset, entry);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "libLeak.h"
+
+#include <string>
+#include <vector>
+
+///
+/// ElfSymbols
+/// Symbols and line table of an ELF binary (64 bit, little endian), used to resolve
+/// the frames of sessions with deferred symbols on Linux.
+///
+/// The file is mapped and two tables sorted by address are built once:
+/// - functions of .symtab and .dynsym
+/// - rows of the .debug_line programs (DWARF 2 to 5)
+/// Each frame is then resolved with a binary search in both tables.
+///
+/// If the binary is stripped, the separate debug file is searched by its build id
+/// (/usr/lib/debug/.build-id/xx/yyyy.debug) and by its .gnu_debuglink.
+/// Compressed debug sections are not supported.
+///
+class ElfSymbols
+{
+public:
+   ElfSymbols ();
+   ~ElfSymbols ();
+
+   ElfSymbols (const ElfSymbols&) = delete;
+   ElfSymbols& operator = (const ElfSymbols&) = delete;
+
+   /// Maps the given binary and builds the tables.
+   /// Returns false if the file is not a supported ELF file.
+   bool open (const std::string& path);
+
+   /// Returns the GNU build id of the binary; empty if it has none.
+   const std::vector<uint8_t>& build_id () const;
+
+   ///
+   /// Resolves a return address, given as offset to the load address of the module
+   /// (the start of its first mapping minus the file offset).
+   /// Fills the demangled function name, the source file and line if available.
+   /// Returns false if no function contains the address.
+   ///
+   bool resolve (uint64_t offset, libLeak::SYMBOL_ENTRY& entry) const;
+
+private:
+   class Private;
+   Private* mPrivate;
+};
@@ -5,10 +5,14 @@
 #include <iterator>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
 
 #include "libLeak.h"
 #include "LeakObject.h"
-#include "LeakFileStream.h"
+#include "LeakFileView.h"
+#include "LeakFileBlockReader.h"
+#include "OfflineSymbolizer.h"
 
 typedef std::vector<std::string> CSVRow;
 
@@ -17,38 +21,49 @@ std::filesystem::path GetDirectoryFromInputFile (const std::string& input);
 
 class CSVFile
 {
-   std::fstream& fs;
+   std::ostream& fs;
+   uint64_t sampling_interval;
+   std::map<uint64_t, libLeak::LeakObjectSnapshotEntry> previous_snapshot;   // stacktrace id -> entry
 
 public:
-   CSVFile (std::fstream& file)
+   CSVFile (std::ostream& file)
       : fs(file)
+      , sampling_interval(0)
    {
    }
 
    ~CSVFile ()
    {
-      if (fs.is_open ())
-      {
-         fs.flush ();
-         fs.close ();
-      }
+      fs.flush ();
    }
 
    inline CSVFile& this_ref () { return *this; }
 
+   /// Sets the sampling interval of the session, used to weight allocations.
+   void SetSamplingInterval (uint64_t interval) { sampling_interval = interval; }
+
    void WriteHeader (libLeak::LeakObjectType type)
    {
       switch (type)
       {
       case libLeak::LeakObjectType::Allocation:
-         this_ref() << CSVRow { "Timestamp", "StacktraceID", "Pointer", "Size" };
+         this_ref() << CSVRow { "Timestamp", "StacktraceID", "Pointer", "Size", "Weight" };
          break;
       case libLeak::LeakObjectType::Deallocation:
          this_ref () << CSVRow { "Timestamp", "Pointer" };
          break;
+      case libLeak::LeakObjectType::Reallocation:
+         this_ref () << CSVRow { "Timestamp", "StacktraceID", "PreviousPointer", "Pointer", "Size", "Weight" };
+         break;
       case libLeak::LeakObjectType::Stacktrace:
          this_ref () << CSVRow { "Timestamp", "StackTraceID", "Stacktrace" };
          break;
+      case libLeak::LeakObjectType::Aggregate:
+         this_ref () << CSVRow { "Timestamp", "StackTraceID", "Allocations", "Deallocations", "LiveBytes", "PeakBytes" };
+         break;
+      case libLeak::LeakObjectType::Snapshot:
+         this_ref () << CSVRow { "Timestamp", "SnapshotID", "StackTraceID", "Count", "Bytes", "CountDelta", "BytesDelta" };
+         break;
       default:
          break;
       }
@@ -59,14 +74,16 @@ public:
       return std::to_string (ts);
    }
 
-   std::string FormatPointer (intptr_t ptr)
+   std::string FormatPointer (uint64_t ptr)
    {
       std::stringstream ss;
-      ss << "0x" << std::setfill ('0') << std::setw (sizeof (intptr_t) * 2) << std::hex << ptr;
+      ss << "0x" << std::setfill ('0') << std::setw (sizeof (uint64_t) * 2) << std::hex << ptr;
       return ss.str ();
    }
 
-   std::string FormatStacktrace (const std::vector<libLeak::SYMBOL_ENTRY>& stacktrace)
+   /// Formats resolved symbols (SYMBOL_ENTRY) or the frames of the file (FRAME_VIEW).
+   template <typename Frame>
+   std::string FormatStacktrace (const std::vector<Frame>& stacktrace)
    {
       std::vector<std::string> lines;
       for (const auto& entry : stacktrace)
@@ -91,7 +108,23 @@ public:
 
    CSVFile& operator << (const libLeak::LeakObjectAllocation& object)
    {
-      return this_ref () << CSVRow { FormatTimestamp(object.Timestamp), std::to_string(object.StacktraceId), FormatPointer(object.Pointer), std::to_string(object.ObjectSize) };
+      return this_ref () << CSVRow { 
+         FormatTimestamp(object.Timestamp), 
+         std::to_string(object.StacktraceId), 
+         FormatPointer(object.Pointer), 
+         std::to_string(object.PointerSize),
+         std::to_string(libLeak::GetSamplingWeight (object.PointerSize, sampling_interval)) };
+   }
+
+   CSVFile& operator << (const libLeak::LeakObjectReallocation& object)
+   {
+      return this_ref () << CSVRow { 
+         FormatTimestamp(object.Timestamp), 
+         std::to_string(object.StacktraceId), 
+         FormatPointer(object.PreviousPointer), 
+         FormatPointer(object.Pointer), 
+         std::to_string(object.PointerSize),
+         std::to_string(libLeak::GetSamplingWeight (object.PointerSize, sampling_interval)) };
    }
 
    CSVFile& operator << (const libLeak::LeakObjectDeallocation& object)
@@ -99,14 +132,71 @@ public:
       return this_ref () << CSVRow { FormatTimestamp(object.Timestamp), FormatPointer(object.Pointer) };
    }
 
-   CSVFile& operator << (const std::pair<const libLeak::LeakObjectStacktrace&, const std::vector<libLeak::SYMBOL_ENTRY>&> objectPair)
+   template <typename Frame>
+   CSVFile& operator << (const std::pair<const libLeak::LeakObjectStacktrace&, const std::vector<Frame>&> objectPair)
    {
       return this_ref () << CSVRow { FormatTimestamp (objectPair.first.Timestamp), std::to_string (objectPair.first.StacktraceId), FormatStacktrace (objectPair.second) };
    }
 
+   CSVFile& operator << (const libLeak::LeakObjectAggregate& object)
+   {
+      return this_ref () << CSVRow { 
+         FormatTimestamp (object.Timestamp), 
+         std::to_string (object.StacktraceId), 
+         std::to_string (object.Allocations), 
+         std::to_string (object.Deallocations), 
+         std::to_string (object.LiveBytes), 
+         std::to_string (object.PeakBytes) };
+   }
+
+   /// Writes the entries of a snapshot including the difference to the previous snapshot.
+   /// Stacktraces without outstanding allocations anymore are written with a count of zero.
+   CSVFile& operator << (const std::pair<const libLeak::LeakObjectSnapshot&, const libLeak::LeakObjectSnapshotEntry*> objectPair)
+   {
+      const libLeak::LeakObjectSnapshot& snapshot = objectPair.first;
+
+      std::map<uint64_t, libLeak::LeakObjectSnapshotEntry> current;
+      for (uint64_t i = 0; i < snapshot.NumEntries; i++)
+         current[objectPair.second[i].StacktraceId] = objectPair.second[i];
+
+      for (const auto& entry : current)
+      {
+         libLeak::LeakObjectSnapshotEntry previous{ entry.first, 0, 0 };
+         auto it = previous_snapshot.find (entry.first);
+         if (it != previous_snapshot.end ())
+            previous = it->second;
+
+         WriteSnapshotRow (snapshot, entry.second, previous);
+      }
+
+      for (const auto& entry : previous_snapshot)
+      {
+         if (current.find (entry.first) == current.end ())
+            WriteSnapshotRow (snapshot, { entry.first, 0, 0 }, entry.second);
+      }
+
+      previous_snapshot.swap (current);
+      return *this;
+   }
+
+   void WriteSnapshotRow (
+      const libLeak::LeakObjectSnapshot& snapshot,
+      const libLeak::LeakObjectSnapshotEntry& entry,
+      const libLeak::LeakObjectSnapshotEntry& previous)
+   {
+      this_ref () << CSVRow {
+         FormatTimestamp (snapshot.Timestamp),
+         std::to_string (snapshot.SnapshotId),
+         std::to_string (entry.StacktraceId),
+         std::to_string (entry.Count),
+         std::to_string (entry.Bytes),
+         std::to_string ((int64_t)entry.Count - (int64_t)previous.Count),
+         std::to_string ((int64_t)entry.Bytes - (int64_t)previous.Bytes) };
+   }
+
    CSVFile& operator << (const CSVRow& row)
    {
-      if (!fs.is_open ())
+      if (!fs)
          return *this;
 
       std::vector<std::string> quoted_strings;
@@ -122,7 +212,55 @@ public:
    }
 };
 
-void GenerateCSVFile (const std::string& input)
+/// Rows of the events of a block, formatted on a worker thread, and the other objects
+/// of the block, which are written in order by the calling thread.
+class CSVBlock
+{
+public:
+   std::stringstream allocationRows;
+   std::stringstream deallocationRows;
+   std::stringstream reallocationRows;
+   std::stringstream aggregateRows;
+
+   CSVFile allocations;
+   CSVFile deallocations;
+   CSVFile reallocations;
+   CSVFile aggregates;
+
+   std::vector<uint8_t> objects;                                  // Records of the objects, one after another
+
+   CSVBlock (uint64_t sampling_interval)
+      : allocations (allocationRows)
+      , deallocations (deallocationRows)
+      , reallocations (reallocationRows)
+      , aggregates (aggregateRows)
+   {
+      allocations.SetSamplingInterval (sampling_interval);
+      reallocations.SetSamplingInterval (sampling_interval);
+   }
+
+   /// Appends the rows to the file and clears them.
+   static void MoveRows (std::stringstream& rows, std::ostream& file)
+   {
+      const std::string text = rows.str ();
+      file.write (text.data (), (std::streamsize)text.size ());
+      rows.str (std::string ());
+   }
+};
+
+/// Returns the sampling interval of the session, the first object of the file.
+uint64_t ReadSamplingInterval (const std::string& input)
+{
+   libLeak::LeakFileView view;
+   libLeak::LeakObjectHeader header;
+   if (!view.Open (input) || !view.ParseHeader (header) || view.ReadObject () == nullptr)
+      return 0;
+
+   const libLeak::LeakObjectSession* session = view.GetSession ();
+   return session ? session->SamplingInterval : 0;
+}
+
+void GenerateCSVFile (const std::string& input, const OfflineSymbolizer& symbolizer, size_t threads)
 {
    std::filesystem::path base_dir = GetDirectoryFromInputFile (input);
    
@@ -141,6 +279,13 @@ void GenerateCSVFile (const std::string& input)
       return;
    }
 
+   std::fstream fileReallocations (base_dir / ("reallocations.csv"), std::fstream::out | std::fstream::trunc);
+   if (!fileReallocations.is_open ())
+   {
+      std::cerr << "Could not open output file reallocations.csv.." << std::endl;
+      return;
+   }
+
    std::fstream fileStacktraces (base_dir / ("stacktrace.csv"), std::fstream::out | std::fstream::trunc);
    if (!fileStacktraces.is_open ())
    {
@@ -148,9 +293,22 @@ void GenerateCSVFile (const std::string& input)
       return;
    }
 
-   FILE* fp = NULL;
-   fopen_s (&fp, input.c_str (), "rb");
-   if (fp == NULL)
+   std::fstream fileSnapshots (base_dir / ("snapshots.csv"), std::fstream::out | std::fstream::trunc);
+   if (!fileSnapshots.is_open ())
+   {
+      std::cerr << "Could not open output file snapshots.csv.." << std::endl;
+      return;
+   }
+
+   std::fstream fileAggregates (base_dir / ("aggregates.csv"), std::fstream::out | std::fstream::trunc);
+   if (!fileAggregates.is_open ())
+   {
+      std::cerr << "Could not open output file aggregates.csv.." << std::endl;
+      return;
+   }
+
+   libLeak::LeakFileView view;
+   if (!view.Open (input))
    {
       std::cerr << "Could not open input file " << input << std::endl;
       return;
@@ -162,61 +320,139 @@ void GenerateCSVFile (const std::string& input)
    CSVFile csvDeallocations (fileDeallocations);
    csvDeallocations.WriteHeader (libLeak::LeakObjectType::Deallocation);
 
+   CSVFile csvReallocations (fileReallocations);
+   csvReallocations.WriteHeader (libLeak::LeakObjectType::Reallocation);
+
    CSVFile csvStacktrace (fileStacktraces);
    csvStacktrace.WriteHeader (libLeak::LeakObjectType::Stacktrace);
 
-   libLeak::LeakObject nextObject;
-   libLeak::LeakFileStream stream (fp);
-   
+   CSVFile csvSnapshots (fileSnapshots);
+   csvSnapshots.WriteHeader (libLeak::LeakObjectType::Snapshot);
+
+   CSVFile csvAggregates (fileAggregates);
+   csvAggregates.WriteHeader (libLeak::LeakObjectType::Aggregate);
+
    libLeak::LeakObjectHeader header;
-   if (!stream.ParseHeader (header) || libLeak::LeakObjectHeader::GetArchitecture() != header.Architecture)
+   if (!view.ParseHeader (header))
    {
-      std::cerr << "Could not parse input file. Invalid architecture." << std::endl;
+      std::cerr << "Could not parse input file. Unsupported version or architecture." << std::endl;
       return;
    }
 
-   while (stream.ParseObject (nextObject))
+   // The rows of the events of each block are formatted on a worker thread.
+   libLeak::LeakFileBlockReader reader (view, threads);
+   const uint64_t sampling_interval = ReadSamplingInterval (input);
+
+   std::vector<std::unique_ptr<CSVBlock>> blocks;
+   for (size_t i = 0; i < reader.GetSlotCount (); i++)
+      blocks.push_back (std::make_unique<CSVBlock> (sampling_interval));
+
+   auto decode = [&] (const libLeak::LeakFileView& block, const libLeak::LeakObject& object, size_t slot)
    {
-      switch (nextObject.ObjectType)
+      CSVBlock& rows = *blocks[slot];
+      switch (object.ObjectType)
       {
-      
-      // Serialize Allocations
       case (int)libLeak::LeakObjectType::Allocation:
       {
-         libLeak::LeakObjectAllocation obj;
-         if (stream.ParseAllocation (obj))
-            csvAllocations << obj;
+         if (const libLeak::LeakObjectAllocation* obj = block.GetAllocation ())
+            rows.allocations << *obj;
          break;
       }
 
-      // Serialize Deallocations
       case (int)libLeak::LeakObjectType::Deallocation:
       {
-         libLeak::LeakObjectDeallocation obj;
-         if (stream.ParseDeallocation (obj))
-            csvDeallocations << obj;
+         if (const libLeak::LeakObjectDeallocation* obj = block.GetDeallocation ())
+            rows.deallocations << *obj;
          break;
       }
 
-      // Serialize Stacktrace
-      case (int)libLeak::LeakObjectType::Stacktrace:
+      case (int)libLeak::LeakObjectType::Reallocation:
       {
-         libLeak::LeakObjectStacktrace obj;
-         std::vector<libLeak::SYMBOL_ENTRY> symbols;
-         if (stream.ParseStacktrace (obj, symbols))
-            csvStacktrace << std::pair<libLeak::LeakObjectStacktrace, std::vector<libLeak::SYMBOL_ENTRY>> (obj, symbols);
+         if (const libLeak::LeakObjectReallocation* obj = block.GetReallocation ())
+            rows.reallocations << *obj;
          break;
       }
 
-      case (int)libLeak::LeakObjectType::Header:
-      case (int)libLeak::LeakObjectType::Session:
+      case (int)libLeak::LeakObjectType::Aggregate:
+      {
+         if (const libLeak::LeakObjectAggregate* obj = block.GetAggregate ())
+            rows.aggregates << *obj;
+         break;
+      }
+
+      // Stacktraces and snapshots depend on the objects before them; they are written by the calling thread.
       default:
-         if (!stream.SkipObject (nextObject))
+         rows.objects.insert (rows.objects.end (), (const uint8_t*)&object, (const uint8_t*)&object + object.ObjectSize);
+         break;
+      }
+   };
+
+   // Reused for all stacktraces.
+   std::vector<libLeak::FRAME_VIEW> frames;
+
+   auto merge = [&] (size_t slot)
+   {
+      CSVBlock& rows = *blocks[slot];
+      CSVBlock::MoveRows (rows.allocationRows, fileAllocations);
+      CSVBlock::MoveRows (rows.deallocationRows, fileDeallocations);
+      CSVBlock::MoveRows (rows.reallocationRows, fileReallocations);
+      CSVBlock::MoveRows (rows.aggregateRows, fileAggregates);
+
+      for (size_t offset = 0; offset < rows.objects.size (); )
+      {
+         const libLeak::LeakObject& object = *(const libLeak::LeakObject*)(rows.objects.data () + offset);
+         offset += (size_t)object.ObjectSize;
+
+         const libLeak::LeakObject* nextObject = view.ApplyObject (object);
+         if (nextObject == nullptr)
+            continue;
+
+         switch (nextObject->ObjectType)
+         {
+
+         // Serialize Stacktrace
+         case (int)libLeak::LeakObjectType::Stacktrace:
          {
-            std::cerr << "Skipping object pointed to invalid position in file.\n";
-            return;
+            if (const libLeak::LeakObjectStacktrace* obj = view.GetStacktrace (frames))
+               csvStacktrace << std::pair<const libLeak::LeakObjectStacktrace&, const std::vector<libLeak::FRAME_VIEW>&> (*obj, frames);
+            break;
+         }
+
+         // Serialize raw Stacktraces (deferred symbols)
+         case (int)libLeak::LeakObjectType::RawStacktrace:
+         {
+            const uint64_t* raw_frames = nullptr;
+            if (const libLeak::LeakObjectRawStacktrace* raw = view.GetRawStacktrace (raw_frames))
+            {
+               const std::vector<libLeak::SYMBOL_ENTRY>& symbols = symbolizer.GetStacktrace (raw->StacktraceId);
+               libLeak::LeakObjectStacktrace obj{};
+               obj.Timestamp = raw->Timestamp;
+               obj.StacktraceId = raw->StacktraceId;
+               obj.NumEntries = symbols.size ();
+               csvStacktrace << std::pair<const libLeak::LeakObjectStacktrace&, const std::vector<libLeak::SYMBOL_ENTRY>&> (obj, symbols);
+            }
+            break;
+         }
+
+         // Serialize Snapshots
+         case (int)libLeak::LeakObjectType::Snapshot:
+         {
+            const libLeak::LeakObjectSnapshotEntry* entries = nullptr;
+            if (const libLeak::LeakObjectSnapshot* obj = view.GetSnapshot (entries))
+               csvSnapshots << std::pair<const libLeak::LeakObjectSnapshot&, const libLeak::LeakObjectSnapshotEntry*> (*obj, entries);
+            break;
+         }
+
+         // The session was read before; objects of other types are decoded completely.
+         case (int)libLeak::LeakObjectType::Session:
+         case (int)libLeak::LeakObjectType::Header:
+         default:
+            break;
          }
-         break;
       }
-   }
-}
\ No newline at end of file
+
+      rows.objects.clear ();
+   };
+
+   reader.Run (decode, merge);
+}
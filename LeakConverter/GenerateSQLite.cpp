@@ -8,7 +8,10 @@
 
 #include <libLeak.h>
 #include <LeakObject.h>
-#include <LeakFileStream.h>
+#include <LeakFileView.h>
+#include <LeakFileBlockReader.h>
+
+#include "OfflineSymbolizer.h"
 
 namespace statements
 {
@@ -18,9 +21,11 @@ namespace statements
 	      "StacktraceID"	         INTEGER,
          "Pointer"               INTEGER,
 	      "Size"	               INTEGER,
+         "Weight"                REAL,
 	      "AllocationTimestamp"	INTEGER,
 	      "FreeTimestamp"	      INTEGER,
          "Freed"                 INTEGER,
+         "Reallocations"         INTEGER DEFAULT 0,
 	      PRIMARY KEY("AllocationID")
       );
    )";
@@ -37,6 +42,29 @@ namespace statements
       );
    )";
 
+   const char* CreateSnapshotTable = R"(
+      CREATE TABLE "SNAPSHOT" (
+	      "SnapshotID"	         INTEGER,
+	      "Timestamp"	            INTEGER,
+	      "StacktraceID"	         INTEGER,
+	      "Count"	               INTEGER,
+	      "Bytes"	               INTEGER,
+	      PRIMARY KEY("SnapshotID", "StacktraceID")
+      );
+   )";
+
+   const char* CreateAggregateTable = R"(
+      CREATE TABLE "AGGREGATE" (
+	      "ID"	                  INTEGER PRIMARY KEY AUTOINCREMENT,
+	      "Timestamp"	            INTEGER,
+	      "StacktraceID"	         INTEGER,
+	      "Allocations"	         INTEGER,
+	      "Deallocations"	      INTEGER,
+	      "LiveBytes"	            INTEGER,
+	      "PeakBytes"	            INTEGER
+      );
+   )";
+
    const char* CreateIndexAllocationStackTraceID = R"(
       CREATE INDEX "IDX_AllocationStacktraceID" ON "ALLOCATION" (
 	      "StacktraceID"
@@ -63,15 +91,19 @@ namespace statements
 
    const char* InsertAllocation = R"(
       INSERT INTO "ALLOCATION" 
-         ("AllocationID","StacktraceID", "Pointer", "Size","AllocationTimestamp","FreeTimestamp","Freed") 
+         ("AllocationID","StacktraceID", "Pointer", "Size","Weight","AllocationTimestamp","FreeTimestamp","Freed") 
       VALUES 
-         (?, ?, ?, ?, ?, ?, ?);
+         (?, ?, ?, ?, ?, ?, ?, ?);
    )";
 
    const char* UpdateAllocationFree = R"(
       UPDATE "ALLOCATION" SET "Freed"=1, "FreeTimestamp"=? WHERE "AllocationID" = ?;
    )";
 
+   const char* UpdateAllocationRealloc = R"(
+      UPDATE "ALLOCATION" SET "Pointer"=?, "Size"=?, "Weight"=?, "Reallocations"="Reallocations"+1 WHERE "AllocationID" = ?;
+   )";
+
    const char* InsertStackEntry = R"(
       INSERT INTO "STACKENTRY"
          ("StackTraceID","StackTraceIndex","ModuleBaseAddress","FileName","SymbolName","LineNumber") 
@@ -79,6 +111,20 @@ namespace statements
          (?, ?, ?, ?, ?, ?);
    )";
 
+   const char* InsertSnapshot = R"(
+      INSERT INTO "SNAPSHOT"
+         ("SnapshotID","Timestamp","StacktraceID","Count","Bytes") 
+      VALUES 
+         (?, ?, ?, ?, ?);
+   )";
+
+   const char* InsertAggregate = R"(
+      INSERT INTO "AGGREGATE"
+         ("Timestamp","StacktraceID","Allocations","Deallocations","LiveBytes","PeakBytes") 
+      VALUES 
+         (?, ?, ?, ?, ?, ?);
+   )";
+
    const char* SelectAllocation = R"(
       SELECT AllocationID from ALLOCATION WHERE Pointer = ? AND Freed = 0 ORDER BY AllocationID ASC LIMIT 0, 1
    )";
@@ -90,8 +136,12 @@ class Sqlite
    std::filesystem::path base_dir;
    sqlite3_stmt* stmt_insert_allocation;
    sqlite3_stmt* stmt_update_allocation;
+   sqlite3_stmt* stmt_update_reallocation;
    sqlite3_stmt* stmt_insert_stackentry;
    sqlite3_stmt* stmt_select_allocation;
+   sqlite3_stmt* stmt_insert_snapshot;
+   sqlite3_stmt* stmt_insert_aggregate;
+   uint64_t sampling_interval;
 
 public:
    Sqlite (const std::filesystem::path& directory)
@@ -99,8 +149,12 @@ public:
       , base_dir(directory)
       , stmt_insert_allocation(nullptr)
       , stmt_update_allocation(nullptr)
+      , stmt_update_reallocation(nullptr)
       , stmt_insert_stackentry(nullptr)
       , stmt_select_allocation(nullptr)
+      , stmt_insert_snapshot(nullptr)
+      , stmt_insert_aggregate(nullptr)
+      , sampling_interval(0)
    {
    }
 
@@ -118,6 +172,12 @@ public:
          stmt_update_allocation = nullptr;
       }
 
+      if (stmt_update_reallocation)
+      {
+         sqlite3_finalize (stmt_update_reallocation);
+         stmt_update_reallocation = nullptr;
+      }
+
       if (stmt_insert_stackentry)
       {
          sqlite3_finalize (stmt_insert_stackentry);
@@ -130,6 +190,18 @@ public:
          stmt_select_allocation = nullptr;
       }
 
+      if (stmt_insert_snapshot)
+      {
+         sqlite3_finalize (stmt_insert_snapshot);
+         stmt_insert_snapshot = nullptr;
+      }
+
+      if (stmt_insert_aggregate)
+      {
+         sqlite3_finalize (stmt_insert_aggregate);
+         stmt_insert_aggregate = nullptr;
+      }
+
       if (db)
       {
          sqlite3_close (db);
@@ -137,6 +209,12 @@ public:
       }
    }
 
+   /// Sets the sampling interval of the session, used to weight allocations.
+   void SetSamplingInterval (uint64_t interval)
+   {
+      sampling_interval = interval;
+   }
+
    std::filesystem::path GetNextDatabaseFileName (const std::string& name_template)
    {
       int index = 1;
@@ -234,6 +312,12 @@ public:
       rc = sqlite3_exec (db, statements::CreateStackEntryTable, NULL, NULL, &error);
       if (rc) goto Cleanup;
 
+      rc = sqlite3_exec (db, statements::CreateSnapshotTable, NULL, NULL, &error);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_exec (db, statements::CreateAggregateTable, NULL, NULL, &error);
+      if (rc) goto Cleanup;
+
       rc = end_transaction ();
       if (rc) goto Cleanup;
 
@@ -244,12 +328,21 @@ public:
       rc = sqlite3_prepare_v2 (db, statements::UpdateAllocationFree, -1, &stmt_update_allocation, 0);
       if (rc) goto Cleanup;
 
+      rc = sqlite3_prepare_v2 (db, statements::UpdateAllocationRealloc, -1, &stmt_update_reallocation, 0);
+      if (rc) goto Cleanup;
+
       rc = sqlite3_prepare_v2 (db, statements::InsertStackEntry, -1, &stmt_insert_stackentry, 0);
       if (rc) goto Cleanup;
 
       rc = sqlite3_prepare_v2 (db, statements::SelectAllocation, -1, &stmt_select_allocation, 0);
       if (rc) goto Cleanup;
 
+      rc = sqlite3_prepare_v2 (db, statements::InsertSnapshot, -1, &stmt_insert_snapshot, 0);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_prepare_v2 (db, statements::InsertAggregate, -1, &stmt_insert_aggregate, 0);
+      if (rc) goto Cleanup;
+
    Cleanup:
       if (rc)
       {
@@ -271,27 +364,25 @@ public:
       rc = sqlite3_bind_int64 (stmt, 1, allocationId++);
       if (rc) goto Cleanup;
    
-      rc = sqlite3_bind_int64 (stmt, 2, object.StacktraceId);
+      rc = sqlite3_bind_int64 (stmt, 2, (sqlite3_int64)object.StacktraceId);
       if (rc) goto Cleanup;
 
-#ifdef _WIN64
-      rc = sqlite3_bind_int64 (stmt, 3, object.Pointer);
+      rc = sqlite3_bind_int64 (stmt, 3, (sqlite3_int64)object.Pointer);
       if (rc) goto Cleanup;
-#else
-      rc = sqlite3_bind_int (stmt, 3, object.Pointer);
-      if (rc) goto Cleanup;
-#endif
 
       rc = sqlite3_bind_int64 (stmt, 4, object.PointerSize);
       if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_double (stmt, 5, libLeak::GetSamplingWeight (object.PointerSize, sampling_interval));
+      if (rc) goto Cleanup;
    
-      rc = sqlite3_bind_int64 (stmt, 5, object.Timestamp);
+      rc = sqlite3_bind_int64 (stmt, 6, object.Timestamp);
       if (rc) goto Cleanup;
    
-      rc = sqlite3_bind_int64 (stmt, 6, 0); // Free Timestamp;
+      rc = sqlite3_bind_int64 (stmt, 7, 0); // Free Timestamp;
       if (rc) goto Cleanup;
    
-      rc = sqlite3_bind_int64 (stmt, 7, 0); // Freed;
+      rc = sqlite3_bind_int64 (stmt, 8, 0); // Freed;
       if (rc) goto Cleanup;
 
       rc = sqlite3_step (stmt);
@@ -308,18 +399,13 @@ public:
       return *this;
    }
 
-   uint64_t GetAllocationIdentifierByPointer (intptr_t pointer)
+   uint64_t GetAllocationIdentifierByPointer (uint64_t pointer)
    {
       int rc;
       sqlite3_stmt* stmt = stmt_select_allocation;
 
-#ifdef _WIN64
-      rc = sqlite3_bind_int64 (stmt, 1, pointer);
-      if (rc) goto Cleanup;
-#else
-      rc = sqlite3_bind_int (stmt, 1, pointer);
+      rc = sqlite3_bind_int64 (stmt, 1, (sqlite3_int64)pointer);
       if (rc) goto Cleanup;
-#endif
 
       rc = sqlite3_step (stmt);
       if (rc == SQLITE_ROW)
@@ -368,21 +454,68 @@ public:
       return *this;
    }
 
+   /// A reallocation moves the outstanding allocation row to the new pointer and size;
+   /// it keeps the stacktrace and timestamp of the original allocation.
+   /// Blocks allocated before profiling started are inserted as new allocations.
+   Sqlite& operator << (const libLeak::LeakObjectReallocation& object)
+   {
+      uint64_t id = GetAllocationIdentifierByPointer (object.PreviousPointer);
+      if (id == 0)
+      {
+         libLeak::LeakObjectAllocation allocation{ 0 };
+         allocation.StacktraceId = object.StacktraceId;
+         allocation.Timestamp = object.Timestamp;
+         allocation.Pointer = object.Pointer;
+         allocation.PointerSize = object.PointerSize;
+         return *this << allocation;
+      }
+
+      int rc;
+      sqlite3_stmt* stmt = stmt_update_reallocation;
+
+      rc = sqlite3_bind_int64 (stmt, 1, (sqlite3_int64)object.Pointer);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_int64 (stmt, 2, object.PointerSize);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_double (stmt, 3, libLeak::GetSamplingWeight (object.PointerSize, sampling_interval));
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_int64 (stmt, 4, id);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_step (stmt);
+      if (rc != SQLITE_DONE) goto Cleanup;
+
+      rc = sqlite3_clear_bindings (stmt);
+      if (rc) goto Cleanup;
+   
+      rc = sqlite3_reset (stmt);
+      if (rc) goto Cleanup;
+
+   Cleanup:
+      print_err_if_any (rc);
+      return *this;
+   }
+
+   /// Inserts resolved symbols (SYMBOL_ENTRY) or the frames of the file (FRAME_VIEW).
+   template <typename Frame>
    Sqlite& operator << (
       const std::pair<const libLeak::LeakObjectStacktrace&, 
-      const std::vector<libLeak::SYMBOL_ENTRY>&> pair)
+      const std::vector<Frame>&> pair)
    {
       int rc = 0;
       sqlite3_stmt* stmt = stmt_insert_stackentry;
 
       const libLeak::LeakObjectStacktrace& object = pair.first;
-      const std::vector<libLeak::SYMBOL_ENTRY>& entries = pair.second;
+      const std::vector<Frame>& entries = pair.second;
 
       int index = 0;
       for (const auto& entry : entries)
       {
          // StackTraceID
-         rc = sqlite3_bind_int64 (stmt, 1, object.StacktraceId);
+         rc = sqlite3_bind_int64 (stmt, 1, (sqlite3_int64)object.StacktraceId);
          if (rc) goto Cleanup;
 
          // StackTraceIndex
@@ -394,11 +527,11 @@ public:
          if (rc) goto Cleanup;
 
          // FileName
-         rc = sqlite3_bind_text (stmt, 4, entry.file.c_str(), -1, NULL);
+         rc = sqlite3_bind_text (stmt, 4, entry.file.data(), (int)entry.file.size(), NULL);
          if (rc) goto Cleanup;
 
          // SymbolName
-         rc = sqlite3_bind_text (stmt, 5, entry.name.c_str(), -1, NULL);
+         rc = sqlite3_bind_text (stmt, 5, entry.name.data(), (int)entry.name.size(), NULL);
          if (rc) goto Cleanup;
 
          // LineNumber
@@ -419,6 +552,86 @@ public:
       print_err_if_any (rc);
       return *this;
    }
+
+   Sqlite& operator << (const libLeak::LeakObjectAggregate& object)
+   {
+      int rc;
+      sqlite3_stmt* stmt = stmt_insert_aggregate;
+
+      rc = sqlite3_bind_int64 (stmt, 1, object.Timestamp);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_int64 (stmt, 2, (sqlite3_int64)object.StacktraceId);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_int64 (stmt, 3, object.Allocations);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_int64 (stmt, 4, object.Deallocations);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_int64 (stmt, 5, object.LiveBytes);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_bind_int64 (stmt, 6, object.PeakBytes);
+      if (rc) goto Cleanup;
+
+      rc = sqlite3_step (stmt);
+      if (rc != SQLITE_DONE) goto Cleanup;
+
+      rc = sqlite3_clear_bindings (stmt);
+      if (rc) goto Cleanup;
+   
+      rc = sqlite3_reset (stmt);
+      if (rc) goto Cleanup;
+
+   Cleanup:
+      print_err_if_any (rc);
+      return *this;
+   }
+
+   Sqlite& operator << (
+      const std::pair<const libLeak::LeakObjectSnapshot&, 
+      const libLeak::LeakObjectSnapshotEntry*> pair)
+   {
+      int rc = 0;
+      sqlite3_stmt* stmt = stmt_insert_snapshot;
+
+      const libLeak::LeakObjectSnapshot& object = pair.first;
+
+      for (uint64_t i = 0; i < object.NumEntries; i++)
+      {
+         const libLeak::LeakObjectSnapshotEntry& entry = pair.second[i];
+
+         rc = sqlite3_bind_int64 (stmt, 1, object.SnapshotId);
+         if (rc) goto Cleanup;
+
+         rc = sqlite3_bind_int64 (stmt, 2, object.Timestamp);
+         if (rc) goto Cleanup;
+
+         rc = sqlite3_bind_int64 (stmt, 3, (sqlite3_int64)entry.StacktraceId);
+         if (rc) goto Cleanup;
+
+         rc = sqlite3_bind_int64 (stmt, 4, entry.Count);
+         if (rc) goto Cleanup;
+
+         rc = sqlite3_bind_int64 (stmt, 5, entry.Bytes);
+         if (rc) goto Cleanup;
+
+         rc = sqlite3_step (stmt);
+         if (rc != SQLITE_DONE) goto Cleanup;
+
+         rc = sqlite3_clear_bindings (stmt);
+         if (rc) goto Cleanup;
+   
+         rc = sqlite3_reset (stmt);
+         if (rc) goto Cleanup;
+      }
+
+   Cleanup:
+      print_err_if_any (rc);
+      return *this;
+   }
 };
 
 std::filesystem::path GetDirectoryFromInputFile (const std::string& input)
@@ -427,7 +640,7 @@ std::filesystem::path GetDirectoryFromInputFile (const std::string& input)
    return input_path.parent_path ();
 }
 
-void GenerateSQLite (const std::string& input)
+void GenerateSQLite (const std::string& input, const OfflineSymbolizer& symbolizer, size_t threads)
 {
    Sqlite db(GetDirectoryFromInputFile(input));
    if (!db.initialize ())
@@ -443,80 +656,150 @@ void GenerateSQLite (const std::string& input)
       return;
    }
 
-   FILE* fp = NULL;
-   fopen_s (&fp, input.c_str (), "rb");
-   if (fp == NULL)
+   libLeak::LeakFileView view;
+   if (!view.Open (input))
    {
       std::cerr << "Could not open input file " << input << std::endl;
       return;
    }
 
-   libLeak::LeakObject nextObject;
-   libLeak::LeakFileStream stream (fp);
-
    libLeak::LeakObjectHeader header{ 0 };
-   if (!stream.ParseHeader (header) || libLeak::LeakObjectHeader::GetArchitecture() != header.Architecture)
+   if (!view.ParseHeader (header))
    {
-      std::cerr << "Could not parse input file. Invalid architecture." << std::endl;
+      std::cerr << "Could not parse input file. Unsupported version or architecture." << std::endl;
       return;
    }
 
-   while (stream.ParseObject (nextObject))
+   // Objects are decoded on worker threads and written in order by the calling thread.
+   libLeak::LeakFileBlockReader reader (view, threads);
+   std::vector<std::vector<uint8_t>> blocks (reader.GetSlotCount ());
+
+   auto decode = [&] (const libLeak::LeakFileView& block, const libLeak::LeakObject& object, size_t slot)
    {
-      switch (nextObject.ObjectType)
+      blocks[slot].insert (blocks[slot].end (), (const uint8_t*)&object, (const uint8_t*)&object + object.ObjectSize);
+   };
+
+   // Reused for all stacktraces.
+   std::vector<libLeak::FRAME_VIEW> frames;
+
+   auto merge = [&] (size_t slot)
+   {
+      const std::vector<uint8_t>& objects = blocks[slot];
+      for (size_t offset = 0; offset < objects.size (); )
       {
+         const libLeak::LeakObject& object = *(const libLeak::LeakObject*)(objects.data () + offset);
+         offset += (size_t)object.ObjectSize;
+
+         const libLeak::LeakObject* nextObject = view.ApplyObject (object);
+         if (nextObject == nullptr)
+            continue;
+
+         switch (nextObject->ObjectType)
+         {
       
-      // Serialize Allocations
-      case (int)libLeak::LeakObjectType::Allocation:
-      {
-         libLeak::LeakObjectAllocation obj{ 0 };
-         if (stream.ParseAllocation (obj))
+         // Serialize Allocations
+         case (int)libLeak::LeakObjectType::Allocation:
          {
-            db << obj;
+            if (const libLeak::LeakObjectAllocation* obj = view.GetAllocation ())
+            {
+               db << *obj;
+            }
+            break;
          }
-         break;
-      }
 
-      // Serialize Deallocations
-      case (int)libLeak::LeakObjectType::Deallocation:
-      {
-         libLeak::LeakObjectDeallocation obj{ 0 };
-         if (stream.ParseDeallocation (obj))
+         // Serialize Deallocations
+         case (int)libLeak::LeakObjectType::Deallocation:
          {
-            db << obj;
+            if (const libLeak::LeakObjectDeallocation* obj = view.GetDeallocation ())
+            {
+               db << *obj;
+            }
+            break;
          }
-         break;
-      }
 
-      // Serialize Stacktrace
-      case (int)libLeak::LeakObjectType::Stacktrace:
-      {
-         libLeak::LeakObjectStacktrace obj{ 0 };
-         std::vector<libLeak::SYMBOL_ENTRY> symbols;
-         if (stream.ParseStacktrace (obj, symbols))
+         // Serialize Reallocations
+         case (int)libLeak::LeakObjectType::Reallocation:
          {
-            db << std::pair<libLeak::LeakObjectStacktrace, std::vector<libLeak::SYMBOL_ENTRY>> (obj, symbols);
+            if (const libLeak::LeakObjectReallocation* obj = view.GetReallocation ())
+            {
+               db << *obj;
+            }
+            break;
+         }
+
+         // Serialize Stacktrace
+         case (int)libLeak::LeakObjectType::Stacktrace:
+         {
+            if (const libLeak::LeakObjectStacktrace* obj = view.GetStacktrace (frames))
+            {
+               db << std::pair<const libLeak::LeakObjectStacktrace&, const std::vector<libLeak::FRAME_VIEW>&> (*obj, frames);
+            }
+            break;
+         }
+
+         // Serialize raw Stacktraces (deferred symbols)
+         case (int)libLeak::LeakObjectType::RawStacktrace:
+         {
+            const uint64_t* raw_frames = nullptr;
+            if (const libLeak::LeakObjectRawStacktrace* raw = view.GetRawStacktrace (raw_frames))
+            {
+               const std::vector<libLeak::SYMBOL_ENTRY>& symbols = symbolizer.GetStacktrace (raw->StacktraceId);
+               libLeak::LeakObjectStacktrace obj{ 0 };
+               obj.Timestamp = raw->Timestamp;
+               obj.StacktraceId = raw->StacktraceId;
+               obj.NumEntries = symbols.size ();
+               db << std::pair<const libLeak::LeakObjectStacktrace&, const std::vector<libLeak::SYMBOL_ENTRY>&> (obj, symbols);
+            }
+            break;
+         }
+
+         // Serialize Aggregates
+         case (int)libLeak::LeakObjectType::Aggregate:
+         {
+            if (const libLeak::LeakObjectAggregate* obj = view.GetAggregate ())
+            {
+               db << *obj;
+            }
+            break;
+         }
+
+         // Serialize Snapshots
+         case (int)libLeak::LeakObjectType::Snapshot:
+         {
+            const libLeak::LeakObjectSnapshotEntry* entries = nullptr;
+            if (const libLeak::LeakObjectSnapshot* obj = view.GetSnapshot (entries))
+            {
+               db << std::pair<const libLeak::LeakObjectSnapshot&, const libLeak::LeakObjectSnapshotEntry*> (*obj, entries);
+            }
+            break;
          }
-         break;
-      }
 
-      // The Header and Session is not particular interesting in a Sqlite dump.
-      // The only information of value is the starting Timestamp; however the first Allocation
-      // Timestamp should be enough for ongoing analysis.
-      //
-      case (int)libLeak::LeakObjectType::Header:
-      case (int)libLeak::LeakObjectType::Session:
-      default:
-         if (!stream.SkipObject (nextObject))
+         // The only information of the Session needed in a Sqlite dump is the sampling interval,
+         // which is used to weight the allocations.
+         case (int)libLeak::LeakObjectType::Session:
          {
-            std::cerr << "Skipping object pointed to invalid position in file.\n";
-            goto Exit;
+            if (const libLeak::LeakObjectSession* obj = view.GetSession ())
+            {
+               db.SetSamplingInterval (obj->SamplingInterval);
+            }
+            break;
+         }
+
+         // The Header is not particular interesting in a Sqlite dump.
+         // The only information of value is the starting Timestamp; however the first Allocation
+         // Timestamp should be enough for ongoing analysis.
+         //
+         case (int)libLeak::LeakObjectType::Header:
+         default:
+            break;
          }
-         break;
       }
-   }
 
-Exit:
+      blocks[slot].clear ();
+   };
+
+   reader.Run (decode, merge);
+
    rc = db.end_transaction ();
    if (rc) goto Cleanup;
 
@@ -0,0 +1,346 @@
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "libLeak.h"
+#include "LeakObject.h"
+#include "LeakFileView.h"
+#include "LeakFileBlockReader.h"
+
+// Borrowed from GenerateCSV.cpp
+uint64_t ReadSamplingInterval (const std::string& input);
+
+///
+/// Totals of the recorded events of a time window.
+/// The counts and bytes are estimates weighted by the sampling interval of the session.
+///
+struct SUMMARY
+{
+   double allocations = 0;
+   double allocated_bytes = 0;
+   double reallocations = 0;
+   double reallocated_bytes = 0;
+   double deallocations = 0;
+   uint64_t first_timestamp = UINT64_MAX;
+   uint64_t last_timestamp = 0;
+
+   void AddTimestamp (uint64_t ts)
+   {
+      if (ts < first_timestamp)
+         first_timestamp = ts;
+      if (ts > last_timestamp)
+         last_timestamp = ts;
+   }
+
+   void Add (const SUMMARY& other)
+   {
+      allocations += other.allocations;
+      allocated_bytes += other.allocated_bytes;
+      reallocations += other.reallocations;
+      reallocated_bytes += other.reallocated_bytes;
+      deallocations += other.deallocations;
+      if (other.first_timestamp <= other.last_timestamp)
+      {
+         AddTimestamp (other.first_timestamp);
+         AddTimestamp (other.last_timestamp);
+      }
+   }
+};
+
+///
+/// Pointers of a block of a sampled session, in the order of the events.
+/// A deallocation is weighted with the size of the sampled allocation it frees, which may be
+/// in an earlier block, so the logs are replayed in the order of the blocks (SampledPointers).
+///
+struct POINTER_LOG
+{
+   enum : uint8_t
+   {
+      Free = 0,                                 // Deallocation outside of the time window
+      Allocate = 1,
+      CountedFree = 2,                          // Deallocation within the time window
+   };
+
+   std::vector<uint8_t> types;
+   std::vector<uint64_t> pointers;
+   std::vector<uint64_t> sizes;                 // 0 for deallocations
+
+   void push_back (uint8_t type, uint64_t pointer, uint64_t size)
+   {
+      types.push_back (type);
+      pointers.push_back (pointer);
+      sizes.push_back (size);
+   }
+
+   void clear ()
+   {
+      types.clear ();
+      pointers.clear ();
+      sizes.clear ();
+   }
+};
+
+///
+/// Sizes of the outstanding sampled allocations, used to weight their deallocations.
+///
+class SampledPointers
+{
+   uint64_t sampling_interval;
+   std::unordered_map<uint64_t, uint64_t> sizes;
+
+public:
+   SampledPointers (uint64_t interval)
+      : sampling_interval(interval)
+   {
+   }
+
+   /// Replays the pointers of a block and adds the weighted deallocations to the summary.
+   void Replay (const POINTER_LOG& log, SUMMARY& summary)
+   {
+      for (size_t i = 0; i < log.types.size (); i++)
+      {
+         if (log.types[i] == POINTER_LOG::Allocate)
+         {
+            sizes[log.pointers[i]] = log.sizes[i];
+            continue;
+         }
+
+         // Allocations before the file started are unknown; they are counted once.
+         uint64_t size = 0;
+         auto it = sizes.find (log.pointers[i]);
+         if (it != sizes.end ())
+         {
+            size = it->second;
+            sizes.erase (it);
+         }
+
+         if (log.types[i] == POINTER_LOG::CountedFree)
+            summary.deallocations += libLeak::GetSamplingWeight (size, sampling_interval);
+      }
+   }
+};
+
+///
+/// Adds the events of a columnar chunk within [from, to] to the summary.
+/// The loop takes no branch per event; it is vectorized by the compiler and scans the
+/// columns as fast as they are read from memory.
+///
+static void AddColumns (const libLeak::EVENT_COLUMNS& events, uint64_t from, uint64_t to, SUMMARY& summary)
+{
+   const size_t count = events.size ();
+   const uint8_t* allocations = events.allocations.data ();
+   const uint64_t* timestamps = events.timestamps.data ();
+   const uint64_t* sizes = events.sizes.data ();
+
+   uint64_t inside_count = 0;
+   uint64_t allocation_count = 0;
+   uint64_t bytes = 0;
+   uint64_t first = summary.first_timestamp;
+   uint64_t last = summary.last_timestamp;
+   for (size_t i = 0; i < count; i++)
+   {
+      const uint64_t ts = timestamps[i];
+      const uint64_t inside = (uint64_t)(ts >= from) & (uint64_t)(ts <= to);
+      const uint64_t allocation = inside & allocations[i];
+      inside_count += inside;
+      allocation_count += allocation;
+      bytes += sizes[i] & (0 - allocation);
+      first = (inside && ts < first) ? ts : first;
+      last = (inside && ts > last) ? ts : last;
+   }
+
+   summary.allocations += (double)allocation_count;
+   summary.allocated_bytes += (double)bytes;
+   summary.deallocations += (double)(inside_count - allocation_count);
+   summary.first_timestamp = first;
+   summary.last_timestamp = last;
+}
+
+///
+/// Adds the allocations of a columnar chunk of a sampled session within [from, to] to the
+/// summary, each multiplied by its weight, and appends the pointers of all events to the log.
+/// The deallocations are counted when the log is replayed.
+///
+static void AddSampledColumns (const libLeak::EVENT_COLUMNS& events, uint64_t from, uint64_t to,
+   uint64_t sampling_interval, SUMMARY& summary, POINTER_LOG& log)
+{
+   const size_t count = events.size ();
+   const uint8_t* allocations = events.allocations.data ();
+   const uint64_t* timestamps = events.timestamps.data ();
+   const uint64_t* sizes = events.sizes.data ();
+
+   const size_t offset = log.types.size ();
+   log.types.resize (offset + count);
+   log.pointers.insert (log.pointers.end (), events.pointers.begin (), events.pointers.end ());
+   log.sizes.insert (log.sizes.end (), events.sizes.begin (), events.sizes.end ());
+   uint8_t* types = log.types.data () + offset;
+
+   double allocation_count = 0;
+   double bytes = 0;
+   uint64_t first = summary.first_timestamp;
+   uint64_t last = summary.last_timestamp;
+   for (size_t i = 0; i < count; i++)
+   {
+      const uint64_t ts = timestamps[i];
+      const uint8_t inside = (uint8_t)(ts >= from) & (uint8_t)(ts <= to);
+      const uint8_t allocation = allocations[i];
+
+      // Deallocations have no size; their weight is 1 and masked out.
+      const double weight = libLeak::GetSamplingWeight (sizes[i], sampling_interval) * (double)(inside & allocation);
+      allocation_count += weight;
+      bytes += weight * (double)sizes[i];
+      types[i] = (uint8_t)(allocation | ((inside & (allocation ^ 1)) << 1));
+      first = (inside && ts < first) ? ts : first;
+      last = (inside && ts > last) ? ts : last;
+   }
+
+   summary.allocations += allocation_count;
+   summary.allocated_bytes += bytes;
+   summary.first_timestamp = first;
+   summary.last_timestamp = last;
+}
+
+///
+/// Prints the number of allocations, reallocations and deallocations recorded between the
+/// epoch timestamps 'from' and 'to', and the bytes that were allocated.
+/// Events of a sampled session are weighted like the Weight column of the other reports.
+///
+void GenerateSummary (const std::string& input, uint64_t from, uint64_t to, size_t threads)
+{
+   libLeak::LeakFileView view;
+   if (!view.Open (input))
+   {
+      std::cerr << "Could not open input file " << input << std::endl;
+      return;
+   }
+
+   libLeak::LeakObjectHeader header;
+   if (!view.ParseHeader (header))
+   {
+      std::cerr << "Could not parse input file. Unsupported version or architecture." << std::endl;
+      return;
+   }
+
+   const uint64_t sampling_interval = ReadSamplingInterval (input);
+   const bool sampled = sampling_interval != 0;
+
+   // Chunks of events are summed up column by column; blocks outside the window are skipped.
+   // In a sampled session the blocks before the window are read for the sizes of the
+   // allocations freed within it.
+   view.SetEventColumns (true);
+   libLeak::LeakFileBlockReader reader (view, threads);
+   reader.SetBlockFilter ([from, to, sampled] (const libLeak::LeakObjectBlock& block)
+   {
+      // The last block of a file that was not closed has no time range.
+      const bool unknown = block.FirstTimestamp == 0 && block.LastTimestamp == 0;
+      return unknown || ((sampled || block.LastTimestamp >= from) && block.FirstTimestamp <= to);
+   });
+
+   std::vector<SUMMARY> blocks (reader.GetSlotCount ());
+   std::vector<POINTER_LOG> logs (sampled ? reader.GetSlotCount () : 0);
+   SampledPointers pointers (sampling_interval);
+   SUMMARY total;
+
+   auto decode = [&] (const libLeak::LeakFileView& block, const libLeak::LeakObject& object, size_t slot)
+   {
+      SUMMARY& summary = blocks[slot];
+      switch (object.ObjectType)
+      {
+      case (int)libLeak::LeakObjectType::Events:
+      {
+         if (const libLeak::EVENT_COLUMNS* events = block.GetEventColumns ())
+         {
+            if (sampled)
+               AddSampledColumns (*events, from, to, sampling_interval, summary, logs[slot]);
+            else
+               AddColumns (*events, from, to, summary);
+         }
+         break;
+      }
+
+      case (int)libLeak::LeakObjectType::Allocation:
+      {
+         const libLeak::LeakObjectAllocation* obj = block.GetAllocation ();
+         if (!obj)
+            break;
+
+         if (sampled)
+            logs[slot].push_back (POINTER_LOG::Allocate, obj->Pointer, obj->PointerSize);
+
+         if (obj->Timestamp >= from && obj->Timestamp <= to)
+         {
+            const double weight = libLeak::GetSamplingWeight (obj->PointerSize, sampling_interval);
+            summary.allocations += weight;
+            summary.allocated_bytes += weight * (double)obj->PointerSize;
+            summary.AddTimestamp (obj->Timestamp);
+         }
+         break;
+      }
+
+      case (int)libLeak::LeakObjectType::Reallocation:
+      {
+         const libLeak::LeakObjectReallocation* obj = block.GetReallocation ();
+         if (!obj)
+            break;
+
+         // The sampled block moves; its deallocation is weighted with the new size.
+         if (sampled)
+         {
+            logs[slot].push_back (POINTER_LOG::Free, obj->PreviousPointer, 0);
+            logs[slot].push_back (POINTER_LOG::Allocate, obj->Pointer, obj->PointerSize);
+         }
+
+         if (obj->Timestamp >= from && obj->Timestamp <= to)
+         {
+            const double weight = libLeak::GetSamplingWeight (obj->PointerSize, sampling_interval);
+            summary.reallocations += weight;
+            summary.reallocated_bytes += weight * (double)obj->PointerSize;
+            summary.AddTimestamp (obj->Timestamp);
+         }
+         break;
+      }
+
+      case (int)libLeak::LeakObjectType::Deallocation:
+      {
+         const libLeak::LeakObjectDeallocation* obj = block.GetDeallocation ();
+         if (!obj)
+            break;
+
+         const bool inside = obj->Timestamp >= from && obj->Timestamp <= to;
+         if (sampled)
+            logs[slot].push_back (inside ? POINTER_LOG::CountedFree : POINTER_LOG::Free, obj->Pointer, 0);
+         else if (inside)
+            summary.deallocations++;
+
+         if (inside)
+            summary.AddTimestamp (obj->Timestamp);
+         break;
+      }
+      }
+   };
+
+   auto merge = [&] (size_t slot)
+   {
+      if (sampled)
+      {
+         pointers.Replay (logs[slot], blocks[slot]);
+         logs[slot].clear ();
+      }
+
+      total.Add (blocks[slot]);
+      blocks[slot] = SUMMARY ();
+   };
+
+   reader.Run (decode, merge);
+
+   std::cout << std::fixed << std::setprecision (0);
+   std::cout << "Allocations:   " << total.allocations << " (" << total.allocated_bytes << " bytes)" << std::endl;
+   std::cout << "Reallocations: " << total.reallocations << " (" << total.reallocated_bytes << " bytes)" << std::endl;
+   std::cout << "Deallocations: " << total.deallocations << std::endl;
+   if (total.first_timestamp <= total.last_timestamp)
+      std::cout << "Timestamps:    " << total.first_timestamp << " - " << total.last_timestamp << std::endl;
+   if (sampled)
+      std::cout << "Sampling:      " << sampling_interval << " bytes; counts and bytes are estimates" << std::endl;
+}
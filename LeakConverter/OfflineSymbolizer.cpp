@@ -0,0 +1,371 @@
+#include "OfflineSymbolizer.h"
+
+#include "LeakObject.h"
+#include "LeakFileView.h"
+
+#include <map>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <DbgHelp.h>
+
+#pragma comment(lib, "DbgHelp.lib")
+#else
+#include "ElfSymbols.h"
+
+#include <memory>
+#endif
+
+/// Utility: Returns the file name of a module path written on Windows or Linux.
+static std::string GetFileNameOfPath (const std::string& path)
+{
+   const size_t separator = path.find_last_of ("\\/");
+   return separator == std::string::npos ? path : path.substr (separator + 1);
+}
+
+/// Utility: Frames of the instrumentation (detoured or interposed functions).
+static bool IsInstrumentationModule (const std::string& path)
+{
+   const std::string name = GetFileNameOfPath (path);
+   return name.compare (0, 10, "LeakDetect") == 0 || name.compare (0, 13, "libLeakDetect") == 0;
+}
+
+/// Utility: Names a frame "module+0xoffset", the same way as the live symbols on Linux.
+static libLeak::SYMBOL_ENTRY GetModuleOffsetSymbol (const libLeak::MODULE_ENTRY& module, uint64_t offset)
+{
+   char text[32];
+   snprintf (text, sizeof (text), "+0x%llx", (unsigned long long)offset);
+   return { GetFileNameOfPath (module.path) + text, std::string (), 0 };
+}
+
+#ifdef _WIN32
+
+///
+/// ModuleResolver
+/// Resolves the frames of a single module at a time with DbgHelp.
+/// The module is loaded at its original base address, so the symbols of modules
+/// loaded at the same address during the session do not collide.
+///
+class ModuleResolver
+{
+   HANDLE session;
+   bool initialized;
+   DWORD64 loaded;
+   std::vector<char> symbol_buffer;
+
+public:
+   ModuleResolver ()
+      : session ((HANDLE)this)
+      , initialized (false)
+      , loaded (0)
+      , symbol_buffer (sizeof (SYMBOL_INFO) + MAX_SYM_NAME * sizeof (char))
+   {
+      SymSetOptions (SYMOPT_UNDNAME | SYMOPT_LOAD_LINES);
+      initialized = SymInitialize (session, NULL, FALSE) == TRUE;
+   }
+
+   ~ModuleResolver ()
+   {
+      unload ();
+      if (initialized)
+         SymCleanup (session);
+   }
+
+   /// Loads the symbols of a module. Returns false if the symbols are not available
+   /// or do not match the identity recorded during the session.
+   bool load (const libLeak::MODULE_ENTRY& module)
+   {
+      if (!initialized)
+         return false;
+
+      loaded = SymLoadModuleEx (session, NULL, module.path.c_str (), NULL, module.base, (DWORD)module.size, NULL, 0);
+      if (loaded == 0)
+         return false;
+
+      IMAGEHLP_MODULE64 info{ 0 };
+      info.SizeOfStruct = sizeof (info);
+      if (module.identity.size () == sizeof (GUID) &&
+         SymGetModuleInfo64 (session, loaded, &info) &&
+         (memcmp (&info.PdbSig70, module.identity.data (), sizeof (GUID)) != 0 || info.PdbAge != module.age))
+      {
+         std::cerr << "Symbols of " << module.path << " do not match the session." << std::endl;
+         unload ();
+         return false;
+      }
+
+      return true;
+   }
+
+   void unload ()
+   {
+      if (loaded)
+         SymUnloadModule64 (session, loaded);
+
+      loaded = 0;
+   }
+
+   /// Resolves the symbol of a frame; returns false if the frame is not reported.
+   bool resolve (const libLeak::MODULE_ENTRY& module, uint64_t offset, libLeak::SYMBOL_ENTRY& entry)
+   {
+      DWORD64 displacement = 0;
+      PSYMBOL_INFO symbol = (PSYMBOL_INFO)symbol_buffer.data ();
+      memset (symbol, 0, sizeof (SYMBOL_INFO));
+      symbol->SizeOfStruct = sizeof (SYMBOL_INFO);
+      symbol->MaxNameLen = MAX_SYM_NAME;
+
+      const DWORD64 address = module.base + offset;
+      if (!SymFromAddr (session, address, &displacement, symbol) || symbol->NameLen == 0)
+      {
+         entry = GetModuleOffsetSymbol (module, offset);
+         return true;
+      }
+
+      // Frames of the detoured functions (uberHeapAlloc, uberLocalFree, ...).
+      entry.name = std::string (symbol->Name, symbol->NameLen);
+      if (entry.name.compare (0, 4, "uber") == 0)
+         return false;
+
+      DWORD line_displacement = 0;
+      IMAGEHLP_LINE64 line{ 0 };
+      line.SizeOfStruct = sizeof (line);
+      if (SymGetLineFromAddr64 (session, address, &line_displacement, &line))
+      {
+         entry.file = line.FileName;
+         entry.line = line.LineNumber;
+      }
+      else
+      {
+         entry.file.clear ();
+         entry.line = 0;
+      }
+
+      return true;
+   }
+};
+
+#else
+
+///
+/// ModuleResolver
+/// Resolves the frames of a single module at a time from its ELF symbols and line table.
+/// Frames without a symbol are named "module+0xoffset", like the live symbols.
+///
+class ModuleResolver
+{
+   std::unique_ptr<ElfSymbols> symbols;
+
+public:
+   /// Loads the symbols of a module. Returns false if the binary is not available
+   /// or does not match the build id recorded during the session.
+   bool load (const libLeak::MODULE_ENTRY& module)
+   {
+      symbols = std::make_unique<ElfSymbols> ();
+      if (!symbols->open (module.path))
+      {
+         symbols.reset ();
+         return false;
+      }
+
+      if (!module.identity.empty () && symbols->build_id () != module.identity)
+      {
+         std::cerr << "Symbols of " << module.path << " do not match the session." << std::endl;
+         symbols.reset ();
+         return false;
+      }
+
+      return true;
+   }
+
+   void unload ()
+   {
+      symbols.reset ();
+   }
+
+   bool resolve (const libLeak::MODULE_ENTRY& module, uint64_t offset, libLeak::SYMBOL_ENTRY& entry)
+   {
+      if (!symbols || !symbols->resolve (offset, entry))
+         entry = GetModuleOffsetSymbol (module, offset);
+
+      return true;
+   }
+};
+
+#endif
+
+class OfflineSymbolizer::Private
+{
+   friend class ::OfflineSymbolizer;
+
+   /// A frame of a raw stacktrace, relative to the module it was part of.
+   typedef struct FRAME_ {
+      size_t module;
+      uint64_t offset;
+   } FRAME;
+
+   std::vector<libLeak::MODULE_ENTRY> modules;
+   std::unordered_map<uint64_t, std::vector<FRAME>> raw_stacktraces;        // stacktrace id -> frames
+   std::unordered_map<uint64_t, std::vector<libLeak::SYMBOL_ENTRY>> stacktraces;
+   const std::vector<libLeak::SYMBOL_ENTRY> empty;
+
+   bool Load (const std::string& input)
+   {
+      libLeak::LeakFileView view;
+      if (!view.Open (input))
+      {
+         std::cerr << "Could not open input file " << input << std::endl;
+         return false;
+      }
+
+      libLeak::LeakObjectHeader header{ 0 };
+      if (!view.ParseHeader (header))
+      {
+         std::cerr << "Could not parse input file. Unsupported version or architecture." << std::endl;
+         return false;
+      }
+
+      // Modules loaded at the current position of the file.
+      std::map<uint64_t, size_t> loaded;    // base address -> module
+
+      while (const libLeak::LeakObject* nextObject = view.ReadObject ())
+      {
+         switch (nextObject->ObjectType)
+         {
+         case (int)libLeak::LeakObjectType::Module:
+         {
+            std::string_view path;
+            if (const libLeak::LeakObjectModule* module = view.GetModule (path))
+            {
+               const libLeak::LeakObjectModule& obj = *module;
+
+               // Modules unloaded before this one was loaded.
+               auto overlapping = loaded.lower_bound (obj.BaseAddress);
+               if (overlapping != loaded.begin () &&
+                  modules[std::prev (overlapping)->second].base + modules[std::prev (overlapping)->second].size > obj.BaseAddress)
+               {
+                  --overlapping;
+               }
+
+               while (overlapping != loaded.end () && overlapping->first < obj.BaseAddress + obj.Size)
+                  overlapping = loaded.erase (overlapping);
+
+               loaded[obj.BaseAddress] = modules.size ();
+               modules.push_back ({
+                  obj.BaseAddress,
+                  obj.Size,
+                  std::string (path),
+                  std::vector<uint8_t> (obj.Identity, obj.Identity + obj.IdentitySize),
+                  obj.Age,
+                  obj.TimeDateStamp });
+            }
+            break;
+         }
+
+         case (int)libLeak::LeakObjectType::RawStacktrace:
+         {
+            const uint64_t* frames = nullptr;
+            if (const libLeak::LeakObjectRawStacktrace* obj = view.GetRawStacktrace (frames))
+            {
+               // Frames outside of any module are not reported (e.g. generated code).
+               std::vector<FRAME>& resolved = raw_stacktraces[obj->StacktraceId];
+               for (uint64_t i = 0; i < obj->NumFrames; i++)
+               {
+                  const uint64_t address = frames[i];
+                  auto module = loaded.upper_bound (address);
+                  if (module == loaded.begin ())
+                     continue;
+
+                  --module;
+                  const libLeak::MODULE_ENTRY& entry = modules[module->second];
+                  if (address < entry.base + entry.size)
+                     resolved.push_back ({ module->second, address - entry.base });
+               }
+            }
+            break;
+         }
+
+         default:
+            break;
+         }
+      }
+
+      Resolve ();
+      return true;
+   }
+
+   ///
+   /// Resolves each unique frame once, module by module, and assembles the stacktraces.
+   ///
+   void Resolve ()
+   {
+      if (raw_stacktraces.empty ())
+         return;
+
+      // Unique frames per module.
+      std::vector<std::map<uint64_t, std::optional<libLeak::SYMBOL_ENTRY>>> frames (modules.size ());
+      for (const auto& stacktrace : raw_stacktraces)
+      {
+         for (const FRAME& frame : stacktrace.second)
+            frames[frame.module][frame.offset];
+      }
+
+      ModuleResolver resolver;
+      size_t resolved = 0;
+      for (size_t i = 0; i < modules.size (); i++)
+      {
+         if (frames[i].empty () || IsInstrumentationModule (modules[i].path))
+            continue;
+
+         // Frames of modules without matching symbols keep their offset.
+         const bool loaded = resolver.load (modules[i]);
+         for (auto& frame : frames[i])
+         {
+            libLeak::SYMBOL_ENTRY entry;
+            if (!loaded)
+               frame.second = GetModuleOffsetSymbol (modules[i], frame.first);
+            else if (resolver.resolve (modules[i], frame.first, entry))
+               frame.second = entry;
+         }
+
+         resolver.unload ();
+         resolved += frames[i].size ();
+      }
+
+      for (const auto& stacktrace : raw_stacktraces)
+      {
+         std::vector<libLeak::SYMBOL_ENTRY>& symbols = stacktraces[stacktrace.first];
+         for (const FRAME& frame : stacktrace.second)
+         {
+            const auto& symbol = frames[frame.module][frame.offset];
+            if (symbol.has_value ())
+               symbols.push_back (symbol.value ());
+         }
+      }
+
+      std::cout << "Resolved " << resolved << " unique frames of " << raw_stacktraces.size () << " stacktraces." << std::endl;
+   }
+};
+
+OfflineSymbolizer::OfflineSymbolizer ()
+   : mPrivate (new Private ())
+{
+}
+
+OfflineSymbolizer::~OfflineSymbolizer ()
+{
+   delete mPrivate;
+   mPrivate = nullptr;
+}
+
+bool OfflineSymbolizer::Load (const std::string& input)
+{
+   return mPrivate->Load (input);
+}
+
+const std::vector<libLeak::SYMBOL_ENTRY>& OfflineSymbolizer::GetStacktrace (uint64_t id) const
+{
+   auto stacktrace = mPrivate->stacktraces.find (id);
+   return stacktrace != mPrivate->stacktraces.end () ? stacktrace->second : mPrivate->empty;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "libLeak.h"
+
+#include <string>
+#include <vector>
+
+///
+/// OfflineSymbolizer
+/// Resolves the raw stacktraces of a session recorded with deferred symbols
+/// (LeakMonitor --symbols deferred).
+///
+/// The frames of all raw stacktraces are mapped to the module that was loaded at the
+/// time the stacktrace was written, then every unique frame is resolved once, module
+/// by module. Sessions with resolved symbols contain no raw stacktraces; loading them
+/// only costs a pass over the file.
+///
+class OfflineSymbolizer
+{
+public:
+   OfflineSymbolizer ();
+   ~OfflineSymbolizer ();
+
+   OfflineSymbolizer (const OfflineSymbolizer&) = delete;
+   OfflineSymbolizer& operator = (const OfflineSymbolizer&) = delete;
+
+   /// Reads the modules and raw stacktraces of the given file and resolves their frames.
+   /// Returns false if the file could not be read.
+   bool Load (const std::string& input);
+
+   /// Returns the symbols of a raw stacktrace; empty if the stacktrace is unknown.
+   const std::vector<libLeak::SYMBOL_ENTRY>& GetStacktrace (uint64_t id) const;
+
+private:
+   class Private;
+   Private* mPrivate;
+};
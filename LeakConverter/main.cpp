@@ -1,18 +1,18 @@
-#include <Windows.h>
-
 #include <iostream>
 
 #include "libLeak.h"
 #include "LeakObject.h"
 #include "LeakFileStream.h"
+#include "OfflineSymbolizer.h"
 
 #include <optional>
 #include <filesystem>
 #include <unordered_set>
 #include <unordered_map>
 
-void GenerateSQLite (const std::string& input);    // GenerateSQLite.cpp
-void GenerateCSVFile (const std::string& input);   // GenerateCSV.cpp
+void GenerateSQLite (const std::string& input, const OfflineSymbolizer& symbolizer, size_t threads);    // GenerateSQLite.cpp
+void GenerateCSVFile (const std::string& input, const OfflineSymbolizer& symbolizer, size_t threads);   // GenerateCSV.cpp
+void GenerateSummary (const std::string& input, uint64_t from, uint64_t to, size_t threads);            // GenerateSummary.cpp
 
 ///
 /// Application class
@@ -23,7 +23,11 @@ class Application
    std::optional<std::string> optInputFile;
    std::optional<bool> optGenerateCSV;
    std::optional<bool> optGenerateSQLite;
+   std::optional<bool> optGenerateSummary;
+   std::optional<uint64_t> optFrom;
+   std::optional<uint64_t> optTo;
    std::optional<bool> optPrintHelp;
+   std::optional<size_t> optThreads;
 
 public:
    Application (int argc, char** argv)
@@ -58,6 +62,22 @@ private:
          {
             optGenerateSQLite = true;
          }
+         else if (strcmp (argument, "--summary") == 0)
+         {
+            optGenerateSummary = true;
+         }
+         else if (strcmp (argument, "--from") == 0 && (i + 1) < argc)
+         {
+            optFrom = (uint64_t)strtoull (argv[i + 1], nullptr, 10);
+         }
+         else if (strcmp (argument, "--to") == 0 && (i + 1) < argc)
+         {
+            optTo = (uint64_t)strtoull (argv[i + 1], nullptr, 10);
+         }
+         else if (strcmp (argument, "--threads") == 0 && (i + 1) < argc)
+         {
+            optThreads = (size_t)strtoul (argv[i + 1], nullptr, 10);
+         }
          else if (strcmp (argument, "--help") == 0)
          {
             optPrintHelp = true;
@@ -72,7 +92,7 @@ private:
    {
       // Determines if a valid option is set.
       bool has_valid_option = 
-         optGenerateCSV.has_value () || optGenerateSQLite.has_value ();
+         optGenerateCSV.has_value () || optGenerateSQLite.has_value () || optGenerateSummary.has_value ();
 
       // Print help if no option is selected or --help was requested.
       if (!has_valid_option || (optPrintHelp.has_value() && optPrintHelp.value ()))
@@ -88,16 +108,29 @@ private:
          return 1;
       }
 
+      // The summary only scans the events; it does not need the symbols.
+      if (optGenerateSummary.has_value () && optGenerateSummary.value ())
+      {
+         GenerateSummary (optInputFile.value (), optFrom.value_or (0), optTo.value_or (UINT64_MAX), optThreads.value_or (0));
+         if (!optGenerateCSV.has_value () && !optGenerateSQLite.has_value ())
+            return 0;
+      }
+
+      // Resolve the raw stacktraces of a session with deferred symbols once for all outputs.
+      OfflineSymbolizer symbolizer;
+      if (!symbolizer.Load (optInputFile.value ()))
+         return 1;
+
       // Convert Leak.db to CSV if required.
       if (optGenerateCSV.has_value () && optGenerateCSV.value ())
       {
-         GenerateCSVFile (optInputFile.value ());
+         GenerateCSVFile (optInputFile.value (), symbolizer, optThreads.value_or (0));
       }
 
       // Convert native dat to SQLite if required.
       if (optGenerateSQLite.has_value () && optGenerateSQLite.value ())
       {
-         GenerateSQLite (optInputFile.value ());
+         GenerateSQLite (optInputFile.value (), symbolizer, optThreads.value_or (0));
       }
 
       return 0;
@@ -121,6 +154,10 @@ private:
       PrintOption ("--help", "Prints this help text.");
       PrintOption ("--csv", "Convert the input file to multiple CSV files.");
       PrintOption ("--sql", "Convert the input file to a Sqlite3 compatible .sql file.");
+      PrintOption ("--summary", "Print the number of events and allocated bytes.");
+      PrintOption ("--from", "Only summarize events at or after this epoch timestamp (seconds).");
+      PrintOption ("--to", "Only summarize events at or before this epoch timestamp (seconds).");
+      PrintOption ("--threads", "Number of threads decoding the input file (default: one per core).");
    }
 };
 
@@ -0,0 +1,973 @@
+//
+// LD_PRELOAD interposer; the Linux counterpart of dllmain.cpp.
+//
+//    LD_PRELOAD=/path/to/libLeakDetect.so ./application
+//
+// The allocator functions of the C library and the C++ runtime are replaced by the
+// functions of this file, which forward to the real implementation (dlsym RTLD_NEXT)
+// and publish each event to the ring transport (LeakSharedMemory.h).
+//
+// By default a writer thread inside the process drains the ring, resolves the frames
+// with dladdr and writes the same Leak.dat as the LeakMonitor on Windows.
+// With LEAKDETECT_MONITOR=1, the LeakMonitor reads the ring from outside the process instead
+// (see the Linux rendezvous in LeakSharedMemory.h). The process does not wait for it; a
+// controller thread enables the instrumentation once the monitor is attached, so earlier
+// allocations are not reported.
+//
+// Environment
+// ---------------------------------------------------------------------------
+// LEAKDETECT_MONITOR               "1" to let the LeakMonitor write Leak.dat once it is attached.
+// LEAKDETECT_OUTPUT                File to write, default "Logs/PID - YYYY-MM-DD.HH-MM/leak.dat".
+// LEAKDETECT_RING_CAPACITY         Number of slots in the ring (rounded to a power of two).
+// LEAKDETECT_STACK_TABLE_CAPACITY  Number of distinct stacktraces (rounded to a power of two).
+// LEAKDETECT_OVERFLOW              "block" (default) or "drop" if the ring is full.
+// LEAKDETECT_EVENTS                "rows" (default) or "columns" to write columnar chunks of events.
+// The capacities and the overflow policy are published by the LeakMonitor if it is used.
+//
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <cxxabi.h>
+#include <time.h>
+#include <errno.h>
+
+#include <new>
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <filesystem>
+
+#include "libLeak.h"
+#include "LeakSharedMemory.h"
+#include "LeakFileStream.h"
+#include "StacktraceIds.h"
+
+#define LEAKDETECT_EXPORT extern "C" __attribute__((visibility("default")))
+#define LEAKDETECT_EXPORT_CXX __attribute__((visibility("default")))
+
+//
+// Real allocator functions, resolved with dlsym (RTLD_NEXT).
+//
+static void* (*Real_malloc)(size_t size) = nullptr;
+static void* (*Real_calloc)(size_t count, size_t size) = nullptr;
+static void* (*Real_realloc)(void* ptr, size_t size) = nullptr;
+static void (*Real_free)(void* ptr) = nullptr;
+static int (*Real_posix_memalign)(void** memptr, size_t alignment, size_t size) = nullptr;
+static void* (*Real_aligned_alloc)(size_t alignment, size_t size) = nullptr;
+
+static volatile LONG ProfilingEnabled = FALSE;       // Indicates wether the allocations are reported or not.
+static volatile LONG ActiveInstrumentations = 0;     // Number of threads currently reporting an event.
+static volatile LONG Resolving = FALSE;              // The real functions are being resolved.
+static volatile LONG WriterStopRequested = FALSE;    // Signals the writer thread to drain the ring and exit.
+static volatile LONG ControllerStopRequested = FALSE;   // Signals the controller thread to exit.
+static libLeak::PLEAK_SHARED_CONTROL SharedControl = nullptr;  // Control block, ring and stack table.
+static libLeak::PLEAK_SHARED_RENDEZVOUS Rendezvous = nullptr;  // Shared with the LeakMonitor, if attached.
+static pthread_t hThreadWriter;                      // Thread which drains the ring into Leak.dat.
+static pthread_t hThreadController;                  // Thread which waits for the LeakMonitor.
+static bool WriterStarted = false;
+static bool ControllerStarted = false;
+
+/// Reentrancy guard; set while the thread reports an event and for the whole writer thread.
+/// initial-exec TLS never allocates on first access.
+static thread_local int tInstrumenting __attribute__((tls_model("initial-exec"))) = 0;
+
+/// Cached kernel thread id of the current thread; zero if not queried yet.
+static thread_local DWORD tThreadId __attribute__((tls_model("initial-exec"))) = 0;
+
+//
+// Bootstrap allocator.
+// dlsym allocates memory itself, before the real functions are known. These requests are
+// served from a static buffer; its blocks are never released.
+//
+const size_t BootstrapHeapSize = 64 * 1024;
+const size_t BootstrapAlignment = 16;
+
+alignas(16) static char BootstrapHeap[BootstrapHeapSize];
+static volatile LONG64 BootstrapOffset = 0;
+
+/// Returns true if the pointer was handed out by the bootstrap allocator.
+__forceinline bool IsBootstrapPointer (void* ptr)
+{
+   return (char*)ptr >= BootstrapHeap && (char*)ptr < BootstrapHeap + BootstrapHeapSize;
+}
+
+/// Returns zero-initialized memory of the bootstrap buffer, or nullptr if it is exhausted.
+/// Each block is preceded by its size, so it can be reallocated.
+static void* BootstrapAlloc (size_t size)
+{
+   const size_t total = BootstrapAlignment + ((size + BootstrapAlignment - 1) & ~(BootstrapAlignment - 1));
+   const LONG64 offset = InterlockedAdd64 (&BootstrapOffset, (LONG64)total) - (LONG64)total;
+   if (total < size || (size_t)offset + total > BootstrapHeapSize)
+      return nullptr;
+
+   char* block = BootstrapHeap + offset;
+   *(size_t*)block = size;
+   return block + BootstrapAlignment;
+}
+
+/// Returns the size of a block handed out by the bootstrap allocator.
+__forceinline size_t GetBootstrapSize (void* ptr)
+{
+   return *(size_t*)((char*)ptr - BootstrapAlignment);
+}
+
+/// Resolves the real allocator functions.
+/// Returns false if called recursively by dlsym; the caller must use the bootstrap allocator.
+static bool ResolveRealFunctions ()
+{
+   if (Real_malloc != nullptr)
+      return true;
+
+   if (InterlockedExchange (&Resolving, TRUE) == TRUE)
+      return false;
+
+   Real_calloc = (void* (*)(size_t, size_t))dlsym (RTLD_NEXT, "calloc");
+   Real_realloc = (void* (*)(void*, size_t))dlsym (RTLD_NEXT, "realloc");
+   Real_free = (void (*)(void*))dlsym (RTLD_NEXT, "free");
+   Real_posix_memalign = (int (*)(void**, size_t, size_t))dlsym (RTLD_NEXT, "posix_memalign");
+   Real_aligned_alloc = (void* (*)(size_t, size_t))dlsym (RTLD_NEXT, "aligned_alloc");
+
+   // Real_malloc is the indicator that all functions are resolved.
+   void* (*real_malloc)(size_t) = (void* (*)(size_t))dlsym (RTLD_NEXT, "malloc");
+   __atomic_store_n (&Real_malloc, real_malloc, __ATOMIC_RELEASE);
+
+   InterlockedExchange (&Resolving, FALSE);
+   return Real_malloc != nullptr;
+}
+
+// Forward to Stacktrace.cpp
+void CaptureStackFrames (ULONG skip, libLeak::PSTACKTRACE StackTrace);
+
+/// Returns the current time as FILETIME (100ns intervals since 1601-01-01),
+/// the unit of LEAK_EVENT_RECORD::Timestamp.
+__forceinline uint64_t GetTimestamp ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_REALTIME, &ts);
+   return (uint64_t)ts.tv_sec * 10000000ULL + (uint64_t)ts.tv_nsec / 100 + 116444736000000000ULL;
+}
+
+/// Returns the kernel thread id of the calling thread.
+__forceinline DWORD GetCurrentThreadId ()
+{
+   if (tThreadId == 0)
+      tThreadId = (DWORD)syscall (SYS_gettid);
+
+   return tThreadId;
+}
+
+/// Appends a record to the ring.
+/// The writer thread polls the ring; the LeakMonitor is woken up if the ring fills up.
+__forceinline void PushRecord (const libLeak::LEAK_EVENT_RECORD& record)
+{
+   bool signal = false;
+   while (!libLeak::RingTryPush (SharedControl, record, signal))
+   {
+      if (SharedControl->Overflow == (DWORD)libLeak::OverflowPolicy::Drop)
+      {
+         InterlockedIncrement64 (&SharedControl->LostEvents);
+         return;
+      }
+
+      // Ring is full. Wake up the monitor and wait until some slots were released.
+      if (Rendezvous)
+         libLeak::SignalMonitor (Rendezvous);
+
+      Sleep (1);
+   }
+
+   // Wake up the monitor early if the ring is filling up.
+   if (signal && Rendezvous)
+      libLeak::SignalMonitor (Rendezvous);
+}
+
+///
+/// Appends an event to the ring and returns without waiting for the writer thread.
+/// 'previous' is the block released by a reallocation, nullptr otherwise.
+/// Inlined to make sure to not grow the callstack by our interposed functions.
+__forceinline void InstrumentAllocation (
+   libLeak::InstrumentType type,
+   void* ptr,
+   size_t size,
+   void* previous)
+{
+   libLeak::LEAK_EVENT_RECORD record;
+   record.Type = (DWORD)type;
+   record.ThreadId = GetCurrentThreadId ();
+   record.Size = size;
+   record.Pointer = (intptr_t)ptr;
+   record.PreviousPointer = (intptr_t)previous;
+   record.Timestamp = GetTimestamp ();
+
+   // Skip the frame of the interposed function itself.
+   // Each distinct stacktrace is published once in the stack table.
+   record.StackId = 0;
+   if (type != libLeak::InstrumentType::Deallocation)
+   {
+      libLeak::STACKTRACE stacktrace;
+      CaptureStackFrames (1, &stacktrace);
+
+      record.StackId = libLeak::StackTableInsert (SharedControl, stacktrace);
+      if (record.StackId == 0)
+         InterlockedIncrement64 (&SharedControl->LostStacks);
+   }
+
+   PushRecord (record);
+}
+
+/// Enters the instrumentation of the calling thread.
+/// Returns false if the thread is already reporting an event (e.g. the stack walk
+/// allocated memory) or profiling was stopped in the meantime.
+__forceinline bool EnterInstrumentation ()
+{
+   if (tInstrumenting)
+      return false;
+
+   tInstrumenting = 1;
+
+   // Announce the event before checking the flag again; StopInstrumentation
+   // clears the flag and then waits for all announced events.
+   InterlockedIncrement (&ActiveInstrumentations);
+   if (ProfilingEnabled)
+      return true;
+
+   InterlockedDecrement (&ActiveInstrumentations);
+   tInstrumenting = 0;
+   return false;
+}
+
+/// Leaves the instrumentation of the calling thread.
+__forceinline void LeaveInstrumentation ()
+{
+   InterlockedDecrement (&ActiveInstrumentations);
+   tInstrumenting = 0;
+}
+
+/// Reports an allocation of an interposed function.
+__forceinline void ReportAllocation (void* ptr, size_t size)
+{
+   if (ProfilingEnabled && ptr && EnterInstrumentation ())
+   {
+      InstrumentAllocation (libLeak::InstrumentType::Allocation, ptr, size, nullptr);
+      LeaveInstrumentation ();
+   }
+}
+
+/// Reports a reallocation of an interposed function.
+__forceinline void ReportReallocation (void* previous, void* ptr, size_t size)
+{
+   if (ProfilingEnabled && ptr && EnterInstrumentation ())
+   {
+      InstrumentAllocation (libLeak::InstrumentType::Reallocation, ptr, size, previous);
+      LeaveInstrumentation ();
+   }
+}
+
+/// Reports a deallocation of an interposed function.
+/// The deallocation is reported before the memory is released. Otherwise another thread
+/// could receive the same address and report its allocation before this deallocation.
+__forceinline void ReportDeallocation (void* ptr)
+{
+   if (ProfilingEnabled && ptr && EnterInstrumentation ())
+   {
+      InstrumentAllocation (libLeak::InstrumentType::Deallocation, ptr, 0, nullptr);
+      LeaveInstrumentation ();
+   }
+}
+
+//
+// Interposed C library functions.
+//
+
+LEAKDETECT_EXPORT void* malloc (size_t size)
+{
+   if (!ResolveRealFunctions ())
+      return BootstrapAlloc (size);
+
+   void* rv = Real_malloc (size);
+   ReportAllocation (rv, size);
+   return rv;
+}
+
+LEAKDETECT_EXPORT void* calloc (size_t count, size_t size)
+{
+   if (!ResolveRealFunctions ())
+   {
+      // The bootstrap buffer is static storage and never reused, thus zeroed.
+      if (size != 0 && count > SIZE_MAX / size)
+         return nullptr;
+
+      return BootstrapAlloc (count * size);
+   }
+
+   void* rv = Real_calloc (count, size);
+   ReportAllocation (rv, count * size);
+   return rv;
+}
+
+/// A failed reallocation leaves the previous block untouched and is not reported.
+/// The reallocation is reported after the previous block was released; another thread may
+/// report an allocation at the same address first (see ReportDeallocation).
+LEAKDETECT_EXPORT void* realloc (void* ptr, size_t size)
+{
+   if (ptr == nullptr)
+      return malloc (size);
+
+   if (IsBootstrapPointer (ptr))
+   {
+      // Move the block to the real heap; the bootstrap block is never released.
+      void* rv = malloc (size);
+      if (rv)
+      {
+         const size_t previous_size = GetBootstrapSize (ptr);
+         memcpy (rv, ptr, previous_size < size ? previous_size : size);
+      }
+
+      return rv;
+   }
+
+   if (!ResolveRealFunctions ())
+      return nullptr;
+
+   // glibc releases the block and returns nullptr.
+   if (size == 0)
+      ReportDeallocation (ptr);
+
+   void* rv = Real_realloc (ptr, size);
+   if (size == 0)
+      ReportAllocation (rv, size);
+   else
+      ReportReallocation (ptr, rv, size);
+
+   return rv;
+}
+
+LEAKDETECT_EXPORT void free (void* ptr)
+{
+   if (ptr == nullptr || IsBootstrapPointer (ptr) || !ResolveRealFunctions ())
+      return;
+
+   ReportDeallocation (ptr);
+   Real_free (ptr);
+}
+
+LEAKDETECT_EXPORT int posix_memalign (void** memptr, size_t alignment, size_t size)
+{
+   if (!ResolveRealFunctions ())
+      return ENOMEM;
+
+   const int rv = Real_posix_memalign (memptr, alignment, size);
+   if (rv == 0)
+      ReportAllocation (*memptr, size);
+
+   return rv;
+}
+
+LEAKDETECT_EXPORT void* aligned_alloc (size_t alignment, size_t size)
+{
+   if (!ResolveRealFunctions ())
+      return nullptr;
+
+   void* rv = Real_aligned_alloc (alignment, size);
+   ReportAllocation (rv, size);
+   return rv;
+}
+
+//
+// Interposed C++ runtime functions.
+// Calling the real allocator directly keeps operator new out of the stacktraces.
+//
+
+/// Allocates memory for operator new; calls the new handler until it succeeds.
+/// Returns nullptr instead of throwing if 'nothrow' is set.
+static void* AllocateNew (size_t size, size_t alignment, bool nothrow)
+{
+   if (size == 0)
+      size = 1;
+
+   for (;;)
+   {
+      void* rv = nullptr;
+      if (!ResolveRealFunctions ())
+         rv = BootstrapAlloc (size);
+      else if (alignment <= alignof (std::max_align_t))
+         rv = Real_malloc (size);
+      else if (Real_posix_memalign (&rv, alignment, size) != 0)
+         rv = nullptr;
+
+      if (rv)
+      {
+         ReportAllocation (rv, size);
+         return rv;
+      }
+
+      std::new_handler handler = std::get_new_handler ();
+      if (handler == nullptr)
+      {
+         if (nothrow)
+            return nullptr;
+
+         throw std::bad_alloc ();
+      }
+
+      if (!nothrow)
+      {
+         handler ();
+         continue;
+      }
+
+      try
+      {
+         handler ();
+      }
+      catch (...)
+      {
+         return nullptr;
+      }
+   }
+}
+
+LEAKDETECT_EXPORT_CXX void* operator new (size_t size)
+{
+   return AllocateNew (size, 0, false);
+}
+
+LEAKDETECT_EXPORT_CXX void* operator new[] (size_t size)
+{
+   return AllocateNew (size, 0, false);
+}
+
+LEAKDETECT_EXPORT_CXX void* operator new (size_t size, const std::nothrow_t&) noexcept
+{
+   return AllocateNew (size, 0, true);
+}
+
+LEAKDETECT_EXPORT_CXX void* operator new[] (size_t size, const std::nothrow_t&) noexcept
+{
+   return AllocateNew (size, 0, true);
+}
+
+LEAKDETECT_EXPORT_CXX void* operator new (size_t size, std::align_val_t alignment)
+{
+   return AllocateNew (size, (size_t)alignment, false);
+}
+
+LEAKDETECT_EXPORT_CXX void* operator new[] (size_t size, std::align_val_t alignment)
+{
+   return AllocateNew (size, (size_t)alignment, false);
+}
+
+LEAKDETECT_EXPORT_CXX void* operator new (size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+   return AllocateNew (size, (size_t)alignment, true);
+}
+
+LEAKDETECT_EXPORT_CXX void* operator new[] (size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+   return AllocateNew (size, (size_t)alignment, true);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete (void* ptr) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete[] (void* ptr) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete (void* ptr, size_t) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete[] (void* ptr, size_t) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete (void* ptr, const std::nothrow_t&) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete[] (void* ptr, const std::nothrow_t&) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete (void* ptr, std::align_val_t) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete[] (void* ptr, std::align_val_t) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete (void* ptr, size_t, std::align_val_t) noexcept
+{
+   free (ptr);
+}
+
+LEAKDETECT_EXPORT_CXX void operator delete[] (void* ptr, size_t, std::align_val_t) noexcept
+{
+   free (ptr);
+}
+
+///
+/// SessionWriter class
+/// Drains the ring and writes the events to Leak.dat, the same way
+/// QueuedFilesystemBackend does for the LeakMonitor on Windows.
+///
+class SessionWriter
+{
+   std::shared_ptr<libLeak::LeakFileStream> writer;
+   libLeak::StacktraceIds stacktrace_ids;
+   std::vector<libLeak::LEAK_EVENT_RECORD> drain_buffer;
+   uintptr_t module_base;                                  // Base address of this library
+
+public:
+   SessionWriter ()
+      : drain_buffer (4096)
+      , module_base (0)
+   {
+      Dl_info info;
+      if (dladdr ((void*)&ResolveRealFunctions, &info))
+         module_base = (uintptr_t)info.dli_fbase;
+   }
+
+   /// Opens the output file and writes the file header and session.
+   bool open (const std::filesystem::path& path, pid_t pid)
+   {
+      std::error_code error;
+      if (path.has_parent_path ())
+         std::filesystem::create_directories (path.parent_path (), error);
+
+      FILE* fp = fopen (path.string ().c_str (), "wb");
+      if (fp == nullptr)
+         return false;
+
+      writer = std::make_shared<libLeak::LeakFileStream> (fp);
+      writer->SetEventColumns (getenv ("LEAKDETECT_EVENTS") && strcmp (getenv ("LEAKDETECT_EVENTS"), "columns") == 0);
+      writer->WriteHeader ();
+      writer->WriteSession (pid, libLeak::FileTimeToEpochSeconds (GetTimestamp ()));
+      return true;
+   }
+
+   /// Drains all published records and writes them.
+   /// Returns the number of drained records.
+   size_t drain ()
+   {
+      size_t total = 0;
+      for (;;)
+      {
+         const size_t count = libLeak::RingDrain (SharedControl, drain_buffer.data (), drain_buffer.size ());
+         for (size_t i = 0; i < count; i++)
+            write (drain_buffer[i]);
+
+         total += count;
+         if (count < drain_buffer.size ())
+            break;
+      }
+
+      return total;
+   }
+
+   /// Writes the buffered objects to Leak.dat.
+   void flush ()
+   {
+      if (writer)
+         writer->Flush ();
+   }
+
+   /// Writes a summary of the events and stacktraces that were dropped.
+   void report_lost_events ()
+   {
+      const uint64_t lost_events = (uint64_t)SharedControl->LostEvents;
+      if (lost_events)
+         std::cerr << "LeakDetect: " << lost_events << " events were dropped since the ring was full." << std::endl;
+
+      const uint64_t lost_stacks = (uint64_t)SharedControl->LostStacks;
+      if (lost_stacks)
+         std::cerr << "LeakDetect: " << lost_stacks << " stacktraces were dropped since the stack table was full." << std::endl;
+   }
+
+private:
+   void write (const libLeak::LEAK_EVENT_RECORD& record)
+   {
+      if (!writer)
+         return;
+
+      const uint64_t ts = libLeak::FileTimeToEpochSeconds (record.Timestamp);
+      if (record.Type == (DWORD)libLeak::InstrumentType::Deallocation)
+      {
+         libLeak::DELLOCATION_EVENT event{ record.Pointer, ts };
+         writer->WriteDeallocation (&event);
+         return;
+      }
+
+      libLeak::ALLOCATION_EVENT event;
+      memset (&event, 0, sizeof (libLeak::ALLOCATION_EVENT));
+      event.Size = record.Size;
+      event.Pointer = record.Pointer;
+      event.PreviousPointer = record.PreviousPointer;
+      event.TimestampEpochSeconds = ts;
+      event.StackId = record.StackId;
+
+      const uint64_t stacktrace_id = WriteStacktraceOnce (record.StackId, ts);
+      if (record.Type == (DWORD)libLeak::InstrumentType::Reallocation)
+         writer->WriteReallocation (stacktrace_id, &event);
+      else
+         writer->WriteAllocation (stacktrace_id, &event);
+   }
+
+   /// Returns the stacktrace id of the given stack id and writes the stacktrace if it is new.
+   /// Each stacktrace is symbolized once.
+   uint64_t WriteStacktraceOnce (DWORD stack_id, uint64_t ts)
+   {
+      static const libLeak::STACKTRACE empty{};
+      libLeak::PLEAK_STACK_ENTRY entry = libLeak::GetStackEntry (SharedControl, stack_id);
+      const libLeak::STACKTRACE& stacktrace = entry ? entry->Stacktrace : empty;
+
+      bool added = false;
+      const uint64_t stacktrace_id = stacktrace_ids.get (stack_id, stacktrace, added);
+
+      // Write unique stacktraces once..
+      if (added)
+         writer->WriteStacktrace (stacktrace_id, Symbolize (stacktrace), ts);
+
+      return stacktrace_id;
+   }
+
+   /// Resolves the frames with the dynamic symbol tables of the loaded objects.
+   /// Frames without a dynamic symbol are named "module+0xoffset".
+   std::vector<libLeak::SYMBOL_ENTRY> Symbolize (const libLeak::STACKTRACE& stacktrace)
+   {
+      std::vector<libLeak::SYMBOL_ENTRY> symbols;
+      for (UINT i = 0; i < stacktrace.FrameCount; i++)
+      {
+         const uintptr_t address = (uintptr_t)stacktrace.Frames[i];
+
+         Dl_info info;
+         if (!dladdr ((void*)address, &info))
+            continue;
+
+         // Frames of the interposer itself.
+         if ((uintptr_t)info.dli_fbase == module_base)
+            continue;
+
+         std::string name;
+         if (info.dli_sname)
+         {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle (info.dli_sname, nullptr, nullptr, &status);
+            name = demangled && status == 0 ? demangled : info.dli_sname;
+            ::free (demangled);
+         }
+         else
+         {
+            const std::string module = info.dli_fname ? std::filesystem::path (info.dli_fname).filename ().string () : "?";
+            char offset[32];
+            snprintf (offset, sizeof (offset), "+0x%zx", (size_t)(address - (uintptr_t)info.dli_fbase));
+            name = module + offset;
+         }
+
+         symbols.push_back ({ name, std::string (), 0 });
+      }
+
+      return symbols;
+   }
+};
+
+/// Returns the output file of this session.
+static std::filesystem::path GetSessionFileName (pid_t pid)
+{
+   const char* output = getenv ("LEAKDETECT_OUTPUT");
+   if (output && *output)
+      return std::filesystem::path (output);
+
+   // Get current date/time, format is YYYY-MM-DD.HH-MM
+   time_t now = time (0);
+   struct tm tstruct;
+   char buf[80];
+   localtime_r (&now, &tstruct);
+   strftime (buf, sizeof (buf), "%Y-%m-%d.%H-%M", &tstruct);
+
+   return std::filesystem::path ("Logs") / (std::to_string (pid) + " - " + buf) / "leak.dat";
+}
+
+/// Returns the numeric value of the given environment variable, or 'fallback'.
+static DWORD GetEnvironmentNumber (const char* name, DWORD fallback)
+{
+   const char* value = getenv (name);
+   return value && *value ? (DWORD)strtoul (value, nullptr, 10) : fallback;
+}
+
+/// Drains the ring into Leak.dat until profiling stops.
+/// Allocations of this thread are never reported.
+static void* WriterThread (void* parameter)
+{
+   SessionWriter* writer = (SessionWriter*)parameter;
+   tInstrumenting = 1;
+
+   const DWORD drain_interval = 10;
+   while (!WriterStopRequested)
+   {
+      // Leak.dat is written in large blocks while events arrive, and brought up to date once the ring is empty.
+      if (writer->drain () == 0)
+      {
+         writer->flush ();
+         Sleep (drain_interval);
+      }
+   }
+
+   // Pick up everything that was published before profiling stopped.
+   writer->drain ();
+   writer->report_lost_events ();
+
+   delete writer;
+   return nullptr;
+}
+
+/// Allocates the control block, the ring and the stack table in private memory.
+/// Returns true on success.
+static bool CreateSharedControl (libLeak::OverflowPolicy overflow, DWORD ringCapacity, DWORD stackTableCapacity)
+{
+   const SIZE_T size = libLeak::GetSharedControlSize (ringCapacity, stackTableCapacity);
+   void* mapping = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (mapping == MAP_FAILED)
+      return false;
+
+   libLeak::InitializeSharedControl (
+      (libLeak::PLEAK_SHARED_CONTROL)mapping,
+      libLeak::TransportMode::Ring,
+      overflow,
+      libLeak::StackCaptureMode::Local,
+      ringCapacity,
+      stackTableCapacity,
+      0,
+      0);
+
+   SharedControl = (libLeak::PLEAK_SHARED_CONTROL)mapping;
+   return true;
+}
+
+/// Opens the rendezvous block of the LeakMonitor.
+/// Returns nullptr if the LeakMonitor has not requested the start (yet).
+static libLeak::PLEAK_SHARED_RENDEZVOUS OpenRendezvous ()
+{
+   const std::string name = libLeak::ReplaceEventName (libLeak::VL_MEMORY_SHARED_CONTROL, getpid ());
+   const int fd = shm_open (name.c_str (), O_RDWR, 0);
+   if (fd < 0)
+      return nullptr;
+
+   void* mapping = mmap (nullptr, sizeof (libLeak::LEAK_SHARED_RENDEZVOUS), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close (fd);
+   if (mapping == MAP_FAILED)
+      return nullptr;
+
+   // The monitor publishes the magic once the settings are valid.
+   libLeak::PLEAK_SHARED_RENDEZVOUS rendezvous = (libLeak::PLEAK_SHARED_RENDEZVOUS)mapping;
+   if (__atomic_load_n (&rendezvous->Magic, __ATOMIC_ACQUIRE) != libLeak::SharedRendezvousMagic ||
+      rendezvous->Version != libLeak::SharedRendezvousVersion ||
+      rendezvous->State != (LONG)libLeak::RendezvousState::StartRequested)
+   {
+      munmap (mapping, sizeof (libLeak::LEAK_SHARED_RENDEZVOUS));
+      return nullptr;
+   }
+
+   return rendezvous;
+}
+
+/// Enables Instrumentation once the LeakMonitor requested the start.
+static void StartInstrumentation (libLeak::PLEAK_SHARED_RENDEZVOUS rendezvous)
+{
+   // The monitor reads the ring with process_vm_readv; allow it even if it is not our parent.
+   prctl (PR_SET_PTRACER, (unsigned long)rendezvous->MonitorProcessId, 0, 0, 0);
+
+   if (!CreateSharedControl (
+      (libLeak::OverflowPolicy)rendezvous->Overflow,
+      libLeak::GetRingCapacity (rendezvous->RingCapacity),
+      libLeak::GetRingCapacity (rendezvous->StackTableCapacity)))
+   {
+      return;
+   }
+
+   rendezvous->ControlAddress = (uint64_t)(uintptr_t)SharedControl;
+   rendezvous->ControlSize = libLeak::GetSharedControlSize (SharedControl->RingCapacity, SharedControl->StackTableCapacity);
+   Rendezvous = rendezvous;
+
+   InterlockedExchange (&ProfilingEnabled, TRUE);
+   libLeak::SetRendezvousState (rendezvous, libLeak::RendezvousState::Started);
+}
+
+/// Disables Instrumentation.
+/// Events that were already announced are still published before the stop is confirmed,
+/// so the monitor keeps draining the ring until then.
+static void StopInstrumentation (libLeak::PLEAK_SHARED_RENDEZVOUS rendezvous)
+{
+   InterlockedExchange (&ProfilingEnabled, FALSE);
+
+   while (ActiveInstrumentations != 0)
+      Sleep (1);
+
+   libLeak::SetRendezvousState (rendezvous, libLeak::RendezvousState::Stopped);
+}
+
+/// Waits for the LeakMonitor to request the start and later the stop of the profiling.
+/// Allocations of this thread are never reported.
+static void* ControllerThread (void* parameter)
+{
+   UNREFERENCED_PARAMETER (parameter);
+   tInstrumenting = 1;
+
+   // May take some time if the monitor is not started yet.
+   libLeak::PLEAK_SHARED_RENDEZVOUS rendezvous = nullptr;
+   while (!ControllerStopRequested && (rendezvous = OpenRendezvous ()) == nullptr)
+      Sleep (100);
+
+   if (rendezvous == nullptr)
+      return nullptr;
+
+   StartInstrumentation (rendezvous);
+
+   while (!ControllerStopRequested)
+   {
+      const LONG state = rendezvous->State;
+      if (state == (LONG)libLeak::RendezvousState::StopRequested)
+      {
+         StopInstrumentation (rendezvous);
+         break;
+      }
+
+      libLeak::FutexWait (&rendezvous->State, state, 100);
+   }
+
+   return nullptr;
+}
+
+/// Returns true if the LeakMonitor writes Leak.dat instead of this process.
+static bool IsMonitorMode ()
+{
+   const char* value = getenv ("LEAKDETECT_MONITOR");
+   return value && *value && strcmp (value, "0") != 0;
+}
+
+/// The writer and controller threads do not exist in a forked child; the ring would never be drained.
+static void ChildAfterFork ()
+{
+   InterlockedExchange (&ProfilingEnabled, FALSE);
+   WriterStarted = false;
+   ControllerStarted = false;
+   Rendezvous = nullptr;
+}
+
+/// Sets up the ring and the writer thread and enables the instrumentation.
+/// In monitor mode, only the controller thread is started; it enables the instrumentation
+/// once the LeakMonitor is attached.
+__attribute__((constructor)) static void ProcessAttach ()
+{
+   if (!ResolveRealFunctions ())
+      return;
+
+   // Allocations of the setup are not reported.
+   tInstrumenting = 1;
+
+   if (IsMonitorMode ())
+   {
+      ControllerStarted = pthread_create (&hThreadController, nullptr, ControllerThread, nullptr) == 0;
+      if (ControllerStarted)
+         pthread_atfork (nullptr, nullptr, ChildAfterFork);
+
+      tInstrumenting = 0;
+      return;
+   }
+
+   const libLeak::OverflowPolicy overflow = getenv ("LEAKDETECT_OVERFLOW") && strcmp (getenv ("LEAKDETECT_OVERFLOW"), "drop") == 0
+      ? libLeak::OverflowPolicy::Drop
+      : libLeak::OverflowPolicy::Block;
+   const DWORD ring_capacity = libLeak::GetRingCapacity (
+      GetEnvironmentNumber ("LEAKDETECT_RING_CAPACITY", libLeak::DefaultRingCapacity));
+   const DWORD stack_table_capacity = libLeak::GetRingCapacity (
+      GetEnvironmentNumber ("LEAKDETECT_STACK_TABLE_CAPACITY", libLeak::DefaultStackTableCapacity));
+
+   if (!CreateSharedControl (overflow, ring_capacity, stack_table_capacity))
+   {
+      tInstrumenting = 0;
+      return;
+   }
+
+   const pid_t pid = getpid ();
+   const std::filesystem::path path = GetSessionFileName (pid);
+
+   SessionWriter* writer = new SessionWriter ();
+   if (!writer->open (path, pid))
+   {
+      std::cerr << "LeakDetect: Could not open target file " << path.string () << std::endl;
+      delete writer;
+      tInstrumenting = 0;
+      return;
+   }
+
+   if (pthread_create (&hThreadWriter, nullptr, WriterThread, writer) != 0)
+   {
+      delete writer;
+      tInstrumenting = 0;
+      return;
+   }
+
+   WriterStarted = true;
+   pthread_atfork (nullptr, nullptr, ChildAfterFork);
+
+   InterlockedExchange (&ProfilingEnabled, TRUE);
+   tInstrumenting = 0;
+}
+
+/// Disables the instrumentation and waits until all events were written.
+/// Events that were already announced are still published before the ring is drained.
+/// The LeakMonitor cannot read the ring once the process has exited; it is given
+/// some time to drain the remaining events.
+__attribute__((destructor)) static void ProcessDetach ()
+{
+   InterlockedExchange (&ProfilingEnabled, FALSE);
+
+   while (ActiveInstrumentations != 0)
+      Sleep (1);
+
+   if (ControllerStarted)
+   {
+      InterlockedExchange (&ControllerStopRequested, TRUE);
+      pthread_join (hThreadController, nullptr);
+      ControllerStarted = false;
+
+      if (Rendezvous && Rendezvous->State == (LONG)libLeak::RendezvousState::Started)
+      {
+         const DWORD drain_timeout = 10000;
+         for (DWORD waited = 0; waited < drain_timeout && SharedControl->ReadIndex != SharedControl->WriteIndex; waited++)
+         {
+            libLeak::SignalMonitor (Rendezvous);
+            Sleep (1);
+         }
+
+         libLeak::SetRendezvousState (Rendezvous, libLeak::RendezvousState::Stopped);
+      }
+   }
+
+   if (!WriterStarted)
+      return;
+
+   InterlockedExchange (&WriterStopRequested, TRUE);
+   pthread_join (hThreadWriter, nullptr);
+   WriterStarted = false;
+
+   // The mapping is kept; threads that are still running may read the flag only.
+}
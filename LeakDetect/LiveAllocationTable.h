@@ -0,0 +1,123 @@
+#pragma once
+
+#include <windows.h>
+
+#include "TableStorage.h"
+
+///
+/// LiveAllocationTable
+/// Lock-free open-addressing map of outstanding allocations to their stack id and size.
+/// Used by the aggregate transport to attribute a deallocation to the counters
+/// of the stacktrace that allocated the pointer.
+///
+/// The pointer of each entry doubles as its state:
+/// Empty / Removed     - free entry
+/// Reserved            - a thread is writing or reading the entry
+/// Pointer             - outstanding allocation
+///
+/// The storage and the hash are shared with the other tables (see TableStorage.h).
+///
+class LiveAllocationTable
+{
+   static constexpr intptr_t Empty = 0;
+   static constexpr intptr_t Removed = -1;
+   static constexpr intptr_t Reserved = -2;
+   static constexpr DWORD MaximumProbes = 64;
+
+   typedef struct ENTRY_ {
+      PVOID volatile Pointer;
+      DWORD StackId;
+      SIZE_T Size;
+   } ENTRY;
+
+   ENTRY* mEntries = nullptr;
+   DWORD mCapacity = 0;
+
+public:
+   /// Reserves storage for 'capacity' allocations (power of two).
+   /// Returns true if the table is usable.
+   bool initialize (DWORD capacity)
+   {
+      if (mEntries != nullptr)
+         return true;
+
+      mEntries = AllocateTableStorage<ENTRY> (capacity);
+      if (mEntries == nullptr)
+         return false;
+
+      mCapacity = capacity;
+      return true;
+   }
+
+   /// Releases the storage.
+   void release ()
+   {
+      if (mEntries)
+      {
+         ReleaseTableStorage (mEntries);
+         mEntries = nullptr;
+         mCapacity = 0;
+      }
+   }
+
+   /// Adds an allocation. Returns false if the table is not initialized or
+   /// no free entry was found within the probe limit.
+   __forceinline bool insert (intptr_t pointer, DWORD stackId, SIZE_T size)
+   {
+      if (mEntries == nullptr)
+         return false;
+
+      const DWORD start = HashTablePointer (pointer);
+      for (DWORD probe = 0; probe < MaximumProbes; probe++)
+      {
+         ENTRY* entry = &mEntries[(start + probe) & (mCapacity - 1)];
+         PVOID current = entry->Pointer;
+         while (current == (PVOID)Empty || current == (PVOID)Removed)
+         {
+            PVOID previous = InterlockedCompareExchangePointer (&entry->Pointer, (PVOID)Reserved, current);
+            if (previous == current)
+            {
+               entry->StackId = stackId;
+               entry->Size = size;
+               InterlockedExchangePointer (&entry->Pointer, (PVOID)pointer);
+               return true;
+            }
+
+            current = previous;
+         }
+      }
+
+      return false;
+   }
+
+   /// Removes an allocation and returns its stack id and size.
+   /// Returns false if the pointer is not part of the table.
+   __forceinline bool remove (intptr_t pointer, DWORD& stackId, SIZE_T& size)
+   {
+      if (mEntries == nullptr)
+         return false;
+
+      const DWORD start = HashTablePointer (pointer);
+      for (DWORD probe = 0; probe < MaximumProbes; probe++)
+      {
+         ENTRY* entry = &mEntries[(start + probe) & (mCapacity - 1)];
+         PVOID current = entry->Pointer;
+         if (current == (PVOID)pointer)
+         {
+            // Claim the entry before reading it; it may be reused right after.
+            if (InterlockedCompareExchangePointer (&entry->Pointer, (PVOID)Reserved, current) != current)
+               return false;
+
+            stackId = entry->StackId;
+            size = entry->Size;
+            InterlockedExchangePointer (&entry->Pointer, (PVOID)Removed);
+            return true;
+         }
+
+         if (current == (PVOID)Empty)
+            return false;
+      }
+
+      return false;
+   }
+};
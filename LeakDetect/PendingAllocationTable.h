@@ -0,0 +1,255 @@
+#pragma once
+
+#include <windows.h>
+
+#include "LeakSharedMemory.h"
+#include "TableStorage.h"
+
+///
+/// PendingAllocationTable
+/// Lock-free open-addressing table of allocations that have not been published yet.
+/// Allocations are held back until they survived a minimum lifetime; allocations
+/// released before are removed again and never reach the monitoring process.
+///
+/// The pointer of each entry doubles as its state:
+/// Empty / Removed     - free entry; lookups stop at an empty entry only
+/// Reserved            - a producer is writing the record
+/// Reclaiming          - the sweeper turns a removed entry into an empty one
+/// Pointer             - pending allocation
+/// Pointer | Emitting  - the sweeper is publishing the allocation
+///
+/// The sweeper turns removed entries back into empty ones unless a pending allocation was
+/// inserted past them, so lookups of pointers that are not in the table stop after a few
+/// probes. A producer that finds a reclaimed entry in front of its own gives up and
+/// publishes the allocation at once.
+///
+/// The storage and the hash are shared with the other tables (see TableStorage.h).
+///
+class PendingAllocationTable
+{
+   static constexpr intptr_t Empty = 0;
+   static constexpr intptr_t Removed = -1;
+   static constexpr intptr_t Reserved = -2;
+   static constexpr intptr_t Reclaiming = -3;
+   static constexpr intptr_t Emitting = 1;
+   static constexpr DWORD MaximumProbes = 64;
+
+   typedef struct ENTRY_ {
+      PVOID volatile Pointer;
+      libLeak::LEAK_EVENT_RECORD Record;
+   } ENTRY;
+
+   ENTRY* mEntries = nullptr;
+   DWORD mCapacity = 0;
+   volatile LONG mPending = 0;                  // Entries holding an allocation
+   volatile LONG mRemoved = 0;                  // Removed entries not reclaimed yet
+
+public:
+   /// Reserves storage for 'capacity' allocations (power of two).
+   /// Returns true if the table is usable.
+   bool initialize (DWORD capacity)
+   {
+      if (mEntries != nullptr)
+         return true;
+
+      mEntries = AllocateTableStorage<ENTRY> (capacity);
+      if (mEntries == nullptr)
+         return false;
+
+      mCapacity = capacity;
+      return true;
+   }
+
+   /// Releases the storage.
+   void release ()
+   {
+      if (mEntries)
+      {
+         ReleaseTableStorage (mEntries);
+         mEntries = nullptr;
+         mCapacity = 0;
+      }
+   }
+
+   /// Holds back the given allocation record. Returns false if the table is not
+   /// initialized or no free entry was found within the probe limit.
+   __forceinline bool insert (const libLeak::LEAK_EVENT_RECORD& record)
+   {
+      if (mEntries == nullptr)
+         return false;
+
+      const DWORD start = HashTablePointer (record.Pointer);
+      for (DWORD probe = 0; probe < MaximumProbes; probe++)
+      {
+         ENTRY* entry = &mEntries[(start + probe) & (mCapacity - 1)];
+         PVOID current = entry->Pointer;
+         while (current == (PVOID)Empty || current == (PVOID)Removed)
+         {
+            PVOID previous = InterlockedCompareExchangePointer (&entry->Pointer, (PVOID)Reserved, current);
+            if (previous == current)
+            {
+               if (current == (PVOID)Removed)
+                  InterlockedDecrement (&mRemoved);
+
+               // Lookups would stop at an entry the sweeper reclaimed in front of this one.
+               if (!IsReachable (start, probe))
+               {
+                  InterlockedIncrement (&mRemoved);
+                  InterlockedExchangePointer (&entry->Pointer, (PVOID)Removed);
+                  return false;
+               }
+
+               entry->Record = record;
+               InterlockedIncrement (&mPending);
+               InterlockedExchangePointer (&entry->Pointer, (PVOID)record.Pointer);
+               return true;
+            }
+
+            current = previous;
+         }
+      }
+
+      return false;
+   }
+
+   /// Removes the given pointer if its allocation was not published yet.
+   /// Returns true if the allocation was removed; neither the allocation nor the
+   /// deallocation must be reported in that case.
+   /// If the sweeper is publishing the allocation right now, waits until it is published.
+   __forceinline bool remove (intptr_t pointer)
+   {
+      libLeak::LEAK_EVENT_RECORD record;
+      return remove (pointer, record);
+   }
+
+   /// Removes the given pointer like above and returns the record of its allocation,
+   /// so it can be inserted again if the memory was not released after all.
+   __forceinline bool remove (intptr_t pointer, libLeak::LEAK_EVENT_RECORD& record)
+   {
+      if (mEntries == nullptr)
+         return false;
+
+      const DWORD start = HashTablePointer (pointer);
+      for (DWORD probe = 0; probe < MaximumProbes; probe++)
+      {
+         ENTRY* entry = &mEntries[(start + probe) & (mCapacity - 1)];
+         PVOID current = entry->Pointer;
+         if (current == (PVOID)pointer)
+         {
+            // The record does not change while the entry holds the pointer.
+            record = entry->Record;
+            PVOID previous = InterlockedCompareExchangePointer (&entry->Pointer, (PVOID)Removed, current);
+            if (previous == current)
+            {
+               InterlockedDecrement (&mPending);
+               InterlockedIncrement (&mRemoved);
+               return true;
+            }
+
+            current = previous;
+         }
+
+         if (current == (PVOID)(pointer | Emitting))
+         {
+            // The deallocation must be published after the allocation.
+            while (entry->Pointer == (PVOID)(pointer | Emitting))
+               YieldProcessor ();
+
+            return false;
+         }
+
+         if (current == (PVOID)Empty)
+            return false;
+      }
+
+      return false;
+   }
+
+   /// Publishes all allocations that were allocated before 'timestamp' (FILETIME)
+   /// using the given callback and reclaims removed entries. Must only be called by a
+   /// single thread.
+   template<typename Callback>
+   void sweep (uint64_t timestamp, Callback publish)
+   {
+      if (mEntries == nullptr || (mPending == 0 && mRemoved == 0))
+         return;
+
+      // Backwards, so the entries behind a removed entry were reclaimed already.
+      for (DWORD i = mCapacity; i-- > 0;)
+      {
+         ENTRY* entry = &mEntries[i];
+         PVOID current = entry->Pointer;
+         if (IsPending (current) && entry->Record.Timestamp <= timestamp)
+         {
+            // Claim the entry; the record does not change while it is claimed.
+            PVOID claimed = (PVOID)((intptr_t)current | Emitting);
+            if (InterlockedCompareExchangePointer (&entry->Pointer, claimed, current) == current)
+            {
+               publish (entry->Record);
+               InterlockedDecrement (&mPending);
+               InterlockedIncrement (&mRemoved);
+               InterlockedExchangePointer (&entry->Pointer, (PVOID)Removed);
+               current = (PVOID)Removed;
+            }
+         }
+
+         if (current == (PVOID)Removed)
+            reclaim (i);
+      }
+   }
+
+private:
+   /// Turns the removed entry 'index' into an empty one unless an entry behind it was
+   /// inserted past it; no lookup has to probe past the entry then.
+   __forceinline void reclaim (DWORD index)
+   {
+      ENTRY* entry = &mEntries[index];
+      if (InterlockedCompareExchangePointer (&entry->Pointer, (PVOID)Reclaiming, (PVOID)Removed) != (PVOID)Removed)
+         return;
+
+      // Entries are less than MaximumProbes behind their hash. A producer that takes one
+      // of them from now on sees this entry reclaiming and gives up.
+      for (DWORD distance = 1; distance < MaximumProbes; distance++)
+      {
+         const DWORD position = (index + distance) & (mCapacity - 1);
+         const intptr_t current = (intptr_t)mEntries[position].Pointer;
+         if (current == Empty)
+            break;
+
+         if (current == Removed)
+            continue;
+
+         if (current == Reserved || ((position - HashTablePointer (current & ~Emitting)) & (mCapacity - 1)) >= distance)
+         {
+            InterlockedExchangePointer (&entry->Pointer, (PVOID)Removed);
+            return;
+         }
+      }
+
+      InterlockedDecrement (&mRemoved);
+      InterlockedExchangePointer (&entry->Pointer, (PVOID)Empty);
+   }
+
+   /// Returns true if none of the first 'probes' entries from 'start' is empty or reclaiming.
+   __forceinline bool IsReachable (DWORD start, DWORD probes) const
+   {
+      for (DWORD probe = 0; probe < probes; probe++)
+      {
+         PVOID current = mEntries[(start + probe) & (mCapacity - 1)].Pointer;
+         if (current == (PVOID)Empty || current == (PVOID)Reclaiming)
+            return false;
+      }
+
+      return true;
+   }
+
+   static __forceinline bool IsPending (PVOID current)
+   {
+      const intptr_t value = (intptr_t)current;
+      return value != Empty
+         && value != Removed
+         && value != Reserved
+         && value != Reclaiming
+         && (value & Emitting) == 0;
+   }
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <windows.h>
+
+#include "TableStorage.h"
+
+///
+/// PointerTable
+/// Lock-free open-addressing set of pointers used by the detoured functions
+/// (see TableStorage.h).
+///
+class PointerTable
+{
+   static constexpr intptr_t Empty = 0;
+   static constexpr intptr_t Removed = -1;
+   static constexpr DWORD MaximumProbes = 64;
+
+   PVOID volatile* mEntries = nullptr;
+   DWORD mMask = 0;
+
+public:
+   /// Reserves storage for 'capacity' pointers (power of two).
+   /// Returns true if the table is usable.
+   bool initialize (DWORD capacity)
+   {
+      if (mEntries != nullptr)
+         return true;
+
+      mEntries = AllocateTableStorage<PVOID volatile> (capacity);
+      if (mEntries == nullptr)
+         return false;
+
+      mMask = capacity - 1;
+      return true;
+   }
+
+   /// Releases the storage.
+   void release ()
+   {
+      if (mEntries)
+      {
+         ReleaseTableStorage (mEntries);
+         mEntries = nullptr;
+      }
+   }
+
+   /// Adds a pointer. Returns false if the table is not initialized or
+   /// no free slot was found within the probe limit.
+   __forceinline bool insert (intptr_t pointer)
+   {
+      if (mEntries == nullptr)
+         return false;
+
+      const DWORD start = HashTablePointer (pointer);
+      for (DWORD probe = 0; probe < MaximumProbes; probe++)
+      {
+         PVOID volatile* slot = &mEntries[(start + probe) & mMask];
+         PVOID current = *slot;
+         while (current == (PVOID)Empty || current == (PVOID)Removed)
+         {
+            PVOID previous = InterlockedCompareExchangePointer (slot, (PVOID)pointer, current);
+            if (previous == current)
+               return true;
+
+            current = previous;
+         }
+      }
+
+      return false;
+   }
+
+   /// Removes a pointer. Returns true if the pointer was part of the table.
+   __forceinline bool remove (intptr_t pointer)
+   {
+      if (mEntries == nullptr)
+         return false;
+
+      const DWORD start = HashTablePointer (pointer);
+      for (DWORD probe = 0; probe < MaximumProbes; probe++)
+      {
+         PVOID volatile* slot = &mEntries[(start + probe) & mMask];
+         PVOID current = *slot;
+         if (current == (PVOID)pointer)
+            return InterlockedCompareExchangePointer (slot, (PVOID)Removed, current) == current;
+
+         if (current == (PVOID)Empty)
+            return false;
+      }
+
+      return false;
+   }
+};
@@ -0,0 +1,149 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unwind.h>
+#endif
+
+#include "libLeak.h"
+
+#ifndef _WIN32
+/// State of a stack walk with _Unwind_Backtrace.
+struct UNWIND_STATE {
+   ULONG skip;
+   libLeak::PSTACKTRACE StackTrace;
+};
+
+/// Called by _Unwind_Backtrace for each frame, starting with the frame of CaptureStackFrames.
+static _Unwind_Reason_Code UnwindFrame (struct _Unwind_Context* context, void* argument)
+{
+   UNWIND_STATE* state = (UNWIND_STATE*)argument;
+   if (state->StackTrace->FrameCount >= libLeak::MaximumStackTraceFrames)
+      return _URC_END_OF_STACK;
+
+   const uintptr_t address = _Unwind_GetIP (context);
+   if (address == 0)
+      return _URC_END_OF_STACK;
+
+   if (state->skip > 0)
+      state->skip--;
+   else
+      state->StackTrace->Frames[state->StackTrace->FrameCount++] = (intptr_t)address;
+
+   return _URC_NO_REASON;
+}
+#endif
+
+///
+/// Captures the return addresses of the calling thread without any help
+/// of the monitoring process.
+///
+/// x64 walks the unwind tables of the loaded images (RtlLookupFunctionEntry / RtlVirtualUnwind).
+/// x86 walks the frame pointer chain; frames compiled without frame pointers end the walk.
+/// Linux walks the unwind tables (.eh_frame) using the unwinder of libgcc.
+///
+/// 'skip' is the number of frames to skip above the caller of this function,
+/// e.g. 1 to skip the detoured API function itself.
+/// Must not allocate memory since it is called from within the detoured functions.
+///
+#ifdef _WIN32
+__declspec(noinline) void CaptureStackFrames (ULONG skip, libLeak::PSTACKTRACE StackTrace)
+{
+   // The walk must never leave the stack of the current thread.
+   NT_TIB* tib = (NT_TIB*)NtCurrentTeb ();
+   const ULONG_PTR low = (ULONG_PTR)tib->StackLimit;
+   const ULONG_PTR high = (ULONG_PTR)tib->StackBase;
+
+   StackTrace->FrameCount = 0;
+
+#ifdef _WIN64
+   CONTEXT context;
+   RtlCaptureContext (&context);
+
+   UNWIND_HISTORY_TABLE history;
+   memset (&history, 0, sizeof (UNWIND_HISTORY_TABLE));
+
+   while (StackTrace->FrameCount < libLeak::MaximumStackTraceFrames)
+   {
+      DWORD64 imageBase = 0;
+      PRUNTIME_FUNCTION function = RtlLookupFunctionEntry (context.Rip, &imageBase, &history);
+      if (function == NULL)
+      {
+         // Leaf function without unwind information;
+         // the return address is stored on top of the stack.
+         if (context.Rsp < low || context.Rsp + sizeof (DWORD64) > high)
+            break;
+
+         context.Rip = *(DWORD64*)context.Rsp;
+         context.Rsp += sizeof (DWORD64);
+      }
+      else
+      {
+         PVOID handlerData = NULL;
+         DWORD64 establisherFrame = 0;
+         RtlVirtualUnwind (
+            UNW_FLAG_NHANDLER,
+            imageBase,
+            context.Rip,
+            function,
+            &context,
+            &handlerData,
+            &establisherFrame,
+            NULL);
+      }
+
+      //
+      // Base reached.
+      //
+      if (context.Rip == 0 || context.Rsp < low || context.Rsp >= high)
+         break;
+
+      if (skip > 0)
+      {
+         skip--;
+         continue;
+      }
+
+      StackTrace->Frames[StackTrace->FrameCount++] = (intptr_t)context.Rip;
+   }
+#else
+   ULONG_PTR* frame = NULL;
+   __asm mov frame, ebp
+
+   while (StackTrace->FrameCount < libLeak::MaximumStackTraceFrames)
+   {
+      // Each frame stores [previous frame pointer][return address].
+      if ((ULONG_PTR)frame < low ||
+         (ULONG_PTR)frame + 2 * sizeof (ULONG_PTR) > high ||
+         ((ULONG_PTR)frame & (sizeof (ULONG_PTR) - 1)) != 0)
+      {
+         break;
+      }
+
+      ULONG_PTR address = frame[1];
+      if (address == 0)
+         break;
+
+      if (skip > 0)
+         skip--;
+      else
+         StackTrace->Frames[StackTrace->FrameCount++] = (intptr_t)address;
+
+      // The stack grows downwards; the caller frame must be located above.
+      ULONG_PTR* next = (ULONG_PTR*)frame[0];
+      if (next <= frame)
+         break;
+
+      frame = next;
+   }
+#endif
+}
+#else
+__attribute__((noinline)) void CaptureStackFrames (ULONG skip, libLeak::PSTACKTRACE StackTrace)
+{
+   StackTrace->FrameCount = 0;
+
+   // The first frame reported by the unwinder is this function.
+   UNWIND_STATE state{ skip + 1, StackTrace };
+   _Unwind_Backtrace (UnwindFrame, &state);
+}
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <windows.h>
+
+///
+/// TableStorage
+/// Storage and hashing shared by the lock-free tables of the detoured functions
+/// (PointerTable, PendingAllocationTable, LiveAllocationTable).
+///
+/// The storage is reserved with VirtualAlloc, so using a table never
+/// recurses into the detoured heap functions.
+///
+
+/// Reserves zero-initialized storage for 'count' entries.
+/// Returns nullptr on failure.
+template <typename T>
+T* AllocateTableStorage (DWORD count)
+{
+   return (T*)VirtualAlloc (NULL, (SIZE_T)count * sizeof (T), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+/// Releases storage reserved by AllocateTableStorage.
+inline void ReleaseTableStorage (const volatile void* entries)
+{
+   VirtualFree ((LPVOID)entries, 0, MEM_RELEASE);
+}
+
+/// Returns the hash of a pointer; the caller masks it with the capacity of its table.
+__forceinline DWORD HashTablePointer (intptr_t pointer)
+{
+   // Heap blocks are at least 8 byte aligned; mix the remaining bits.
+   uint64_t value = (uint64_t)pointer >> 3;
+   value *= 0x9E3779B97F4A7C15ULL;
+   return (DWORD)(value >> 32);
+}
@@ -2,6 +2,8 @@
 #include <codecvt>
 
 #include <windows.h>
+#include <intrin.h>
+#include <cmath>
 
 #pragma comment(lib, "detours.lib")
 #pragma comment(lib, "syelog.lib")
@@ -10,6 +12,10 @@
 #include <syelog.h>
 
 #include "libLeak.h"
+#include "LeakSharedMemory.h"
+#include "PointerTable.h"
+#include "PendingAllocationTable.h"
+#include "LiveAllocationTable.h"
 
 static LONG gTlsIndent = -1;
 static LONG gTlsThread = -1;
@@ -25,20 +31,57 @@ HANDLE hEventStartConfirm = NULL;
 HANDLE hEventStopConfirm = NULL;
 HANDLE hThreadControllerStart  = NULL;        // Handle to controller thread which listens to start signal.
 HANDLE hThreadControllerStop   = NULL;        // Handle to controller thread which listens to stop signal.
-volatile BOOL ProfilingEnabled = FALSE;       // Indicates wether the profiling interrupts are active or not.
-CRITICAL_SECTION SyncSection;                 // Synchronize allocation / release access.
+HANDLE hThreadSweeper = NULL;                 // Handle to thread which publishes held back allocations.
+HANDLE hEventSweeperStop = NULL;              // Signals the sweeper thread to flush and exit.
+volatile LONG ProfilingEnabled = FALSE;       // Indicates wether the profiling interrupts are active or not.
+volatile LONG ActiveInstrumentations = 0;     // Number of threads currently reporting an event.
+CRITICAL_SECTION SyncSection;                 // Serializes the publication of the rendezvous Metadata.
+HANDLE hSharedControl = NULL;                 // Handle to the shared control block created by the monitor.
+libLeak::PLEAK_SHARED_CONTROL SharedControl = NULL; // Mapped shared control block; NULL if not available.
+DWORD SamplingInterval = 0;                   // Mean sampling interval in bytes; 0 reports every allocation.
+PointerTable SampledPointers;                 // Sampled allocations whose deallocation must be reported.
+DWORD MinimumLifetime = 0;                    // Allocations freed within this many milliseconds are not reported.
+PendingAllocationTable PendingAllocations;    // Allocations held back until they survived MinimumLifetime.
+LiveAllocationTable LiveAllocations;          // Outstanding allocations of the aggregate transport.
+
+/// Number of outstanding sampled allocations that can be tracked.
+const DWORD SampledPointersCapacity = 1 << 20;
+
+/// Number of outstanding allocations the aggregate transport can attribute to their stacktrace.
+const DWORD LiveAllocationsCapacity = 1 << 20;
+
+/// Number of allocations that can be held back at once.
+/// Allocations that do not fit are published immediately.
+const DWORD PendingAllocationsCapacity = 1 << 16;
+
+/// Per-thread state of the allocation sampler.
+struct SAMPLER_STATE {
+   int64_t BytesUntilSample;
+   uint64_t Seed;
+   bool Initialized;
+};
+
+static thread_local SAMPLER_STATE tSampler;
 
 __declspec(dllexport) libLeak::ANALYZER_METADATA Metadata;
 
 //
 // Detoured API Functions
 //
-#ifdef _WIN64
 LPVOID (WINAPI *Real_HeapAlloc)(HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes) = HeapAlloc;
-#else
-LPVOID (WINAPI *Real_HeapAlloc)(HANDLE hHeap, DWORD dwFlags, DWORD dwBytes) = HeapAlloc;
-#endif
 BOOL (WINAPI *Real_HeapFree)(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem) = HeapFree;
+LPVOID (WINAPI *Real_HeapReAlloc)(HANDLE hHeap, DWORD dwFlags, LPVOID lpMem, SIZE_T dwBytes) = HeapReAlloc;
+HLOCAL (WINAPI *Real_LocalAlloc)(UINT uFlags, SIZE_T uBytes) = LocalAlloc;
+HLOCAL (WINAPI *Real_LocalReAlloc)(HLOCAL hMem, SIZE_T uBytes, UINT uFlags) = LocalReAlloc;
+HLOCAL (WINAPI *Real_LocalFree)(HLOCAL hMem) = LocalFree;
+HGLOBAL (WINAPI *Real_GlobalAlloc)(UINT uFlags, SIZE_T dwBytes) = GlobalAlloc;
+HGLOBAL (WINAPI *Real_GlobalReAlloc)(HGLOBAL hMem, SIZE_T dwBytes, UINT uFlags) = GlobalReAlloc;
+HGLOBAL (WINAPI *Real_GlobalFree)(HGLOBAL hMem) = GlobalFree;
+LPVOID (WINAPI *Real_VirtualAlloc)(LPVOID lpAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect) = VirtualAlloc;
+BOOL (WINAPI *Real_VirtualFree)(LPVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType) = VirtualFree;
+
+// Forward to Stacktrace.cpp
+void CaptureStackFrames (ULONG skip, libLeak::PSTACKTRACE StackTrace);
 
 /// Inlined function to ensure that IPC communication is alive.
 /// This method may deadlock the instrumented process if it constantly fails.
@@ -56,18 +99,205 @@ __forceinline void EnsureIPC ()
    }
 }
 
+/// Returns true if stacktraces are captured by this process
+/// instead of being walked by the monitor.
+__forceinline bool IsLocalStackCapture ()
+{
+   return SharedControl != NULL
+      && SharedControl->StackCapture == (DWORD)libLeak::StackCaptureMode::Local;
+}
+
+/// Returns true if events are published to the shared ring
+/// instead of interrupting the process for each event.
+__forceinline bool IsRingTransport ()
+{
+   return SharedControl != NULL 
+      && SharedControl->Transport == (DWORD)libLeak::TransportMode::Ring;
+}
+
+/// Returns true if only counters per stacktrace are maintained.
+__forceinline bool IsAggregateTransport ()
+{
+   return SharedControl != NULL 
+      && SharedControl->Transport == (DWORD)libLeak::TransportMode::Aggregate;
+}
+
+///
+/// Counts an allocation in the stack table entry of the current stacktrace.
+/// Nothing is sent to the monitor; it reads the counters periodically.
+__forceinline void AggregateAllocation (LPVOID ptr, SIZE_T size)
+{
+   // Skip the frame of the detoured function itself.
+   libLeak::STACKTRACE stacktrace;
+   CaptureStackFrames (1, &stacktrace);
+
+   const DWORD stackId = libLeak::StackTableInsert (SharedControl, stacktrace);
+   if (stackId == 0)
+   {
+      InterlockedIncrement64 (&SharedControl->LostStacks);
+      return;
+   }
+
+   // Allocations whose deallocation cannot be attributed are not counted at all;
+   // they would look like a leak otherwise.
+   if (!LiveAllocations.insert ((intptr_t)ptr, stackId, size))
+   {
+      InterlockedIncrement64 (&SharedControl->LostEvents);
+      return;
+   }
+
+   libLeak::StackEntryAddAllocation (libLeak::GetStackEntry (SharedControl, stackId), size);
+}
+
+/// Reserves a slot of the shared ring for a record committed by RingCommit.
+/// Returns -1 if the record is dropped. 'signal' is set if the watcher process should
+/// be woken up once the record was committed.
+__forceinline LONG64 ReserveRecord (bool& signal)
+{
+   LONG64 position;
+   signal = false;
+   while (!libLeak::RingTryReserve (SharedControl, position, signal))
+   {
+      if (SharedControl->Overflow == (DWORD)libLeak::OverflowPolicy::Drop)
+      {
+         InterlockedIncrement64 (&SharedControl->LostEvents);
+         return -1;
+      }
+
+      // Ring is full. Wake up the watcher process and wait until it released some slots.
+      SetEvent (hEventInterrupt);
+      Sleep (1);
+   }
+
+   return position;
+}
+
+/// Commits a record into a slot reserved by ReserveRecord.
+__forceinline void CommitRecord (LONG64 position, bool signal, const libLeak::LEAK_EVENT_RECORD& record)
+{
+   if (position < 0)
+      return;
+
+   libLeak::RingCommit (SharedControl, position, record);
+
+   // Wake up the watcher process early if the ring is filling up.
+   if (signal)
+      SetEvent (hEventInterrupt);
+}
+
+/// Appends a record to the shared ring.
+__forceinline void PushRecord (const libLeak::LEAK_EVENT_RECORD& record)
+{
+   bool signal;
+   const LONG64 position = ReserveRecord (signal);
+   CommitRecord (position, signal, record);
+}
+
+///
+/// Fills the record of an event of the calling thread.
+/// Inlined to make sure to not grow the callstack by our detoured functions.
+__forceinline void CreateRecord (
+   libLeak::InstrumentType type,
+   LPVOID ptr,
+   SIZE_T size,
+   LPVOID previous,
+   libLeak::LEAK_EVENT_RECORD& record)
+{
+   record.Type = (DWORD)type;
+   record.ThreadId = GetCurrentThreadId ();
+   record.Size = size;
+   record.Pointer = (intptr_t)ptr;
+   record.PreviousPointer = (intptr_t)previous;
+
+   FILETIME ft;
+   GetSystemTimeAsFileTime (&ft);
+   record.Timestamp = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+   // The monitor cannot walk our stack once we have returned,
+   // so the stacktrace of allocations is captured right here.
+   // Skip the frame of the detoured function itself.
+   // Each distinct stacktrace is published once in the stack table.
+   record.StackId = 0;
+   if (type == libLeak::InstrumentType::Allocation || type == libLeak::InstrumentType::Reallocation)
+   {
+      libLeak::STACKTRACE stacktrace;
+      CaptureStackFrames (1, &stacktrace);
+
+      record.StackId = libLeak::StackTableInsert (SharedControl, stacktrace);
+      if (record.StackId == 0)
+         InterlockedIncrement64 (&SharedControl->LostStacks);
+   }
+}
+
+///
+/// Appends an event to the shared ring and returns without waiting for the monitor.
+/// Allocations are held back if the lifetime filter is enabled.
+/// Inlined to make sure to not grow the callstack by our detoured functions.
+__forceinline void PublishRecord (
+   libLeak::InstrumentType type,
+   LPVOID ptr,
+   SIZE_T size,
+   LPVOID previous)
+{
+   libLeak::LEAK_EVENT_RECORD record;
+   CreateRecord (type, ptr, size, previous, record);
+
+   // Published by the sweeper thread once it survived the minimum lifetime.
+   if (type == libLeak::InstrumentType::Allocation &&
+      MinimumLifetime != 0 && 
+      PendingAllocations.insert (record))
+   {
+      return;
+   }
+
+   PushRecord (record);
+}
+
 ///
 /// Instrumentation function.
+/// 'previous' is the block released by a reallocation, NULL for plain allocations.
 /// Inlined to make sure to not grow the callstack by our detoured functions.
 __forceinline void InstrumentAllocation (
    libLeak::InstrumentType type, 
    LPVOID ptr, 
-   DWORD size)
+   SIZE_T size,
+   LPVOID previous = NULL)
 {
+   if (IsRingTransport ())
+   {
+      PublishRecord (type, ptr, size, previous);
+      return;
+   }
+
+   if (IsAggregateTransport ())
+   {
+      AggregateAllocation (ptr, size);
+      return;
+   }
+
+   // There is a single Metadata instance shared with the watcher process.
+   EnterCriticalSection (&SyncSection);
+
+   // Ensure IPC communication is alive.
+   // That may cause a deadlock if the watcher process is not alive.
+   EnsureIPC ();
+
    // Prepare metadata for the watcher process.
-   RtlCaptureContext (&Metadata.Context);
+   if (IsLocalStackCapture ())
+   {
+      // Ship the raw frames; the watcher process does not need to walk our stack.
+      Metadata.StackCapture = (DWORD)libLeak::StackCaptureMode::Local;
+      CaptureStackFrames (1, &Metadata.Stacktrace);
+   }
+   else
+   {
+      Metadata.StackCapture = (DWORD)libLeak::StackCaptureMode::Remote;
+      RtlCaptureContext (&Metadata.Context);
+   }
+
    Metadata.Type = (DWORD)type;
    Metadata.Pointer = (intptr_t)ptr;
+   Metadata.PreviousPointer = (intptr_t)previous;
    Metadata.Size = size;
 
    // Notify the watcher process.
@@ -75,6 +305,8 @@ __forceinline void InstrumentAllocation (
 
    // Wait for resume signal.
    WaitForSingleObject (hEventInterruptContinue, INFINITE);
+
+   LeaveCriticalSection (&SyncSection);
 }
 
 ///
@@ -84,10 +316,26 @@ __forceinline void InstrumentDeallocation (
    libLeak::InstrumentType type,
    LPVOID ptr)
 {
+   if (IsRingTransport ())
+   {
+      PublishRecord (type, ptr, 0, NULL);
+      return;
+   }
+
+   // There is a single Metadata instance shared with the watcher process.
+   EnterCriticalSection (&SyncSection);
+
+   // Ensure IPC communication is alive.
+   // That may cause a deadlock if the watcher process is not alive.
+   EnsureIPC ();
+
    // Prepare metadata for the watcher process.
-   RtlCaptureContext (&Metadata.Context);
+   // The watcher process does not walk the stack of deallocations.
+   Metadata.StackCapture = (DWORD)libLeak::StackCaptureMode::Local;
+   Metadata.Stacktrace.FrameCount = 0;
    Metadata.Type = (DWORD)type;
    Metadata.Pointer = (intptr_t)ptr;
+   Metadata.PreviousPointer = 0;
    Metadata.Size = 0;
 
    // Notify the watcher process.
@@ -95,86 +343,725 @@ __forceinline void InstrumentDeallocation (
 
    // Wait for resume signal.
    WaitForSingleObject (hEventInterruptContinue, INFINITE);
+
+   LeaveCriticalSection (&SyncSection);
 }
 
-/// Detoured HeapAlloc API function.
-#ifdef _WIN64
-LPVOID WINAPI uberHeapAlloc (HANDLE hHeap, DWORD dwFlags, DWORD dwBytes)
-#else
-LPVOID WINAPI uberHeapAlloc (HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes)
-#endif
+/// Returns the number of bytes until the next sample.
+/// The intervals are exponentially distributed with mean 'SamplingInterval', so each
+/// byte is sampled with equal probability (Poisson process over allocated bytes).
+__forceinline int64_t NextSampleInterval (SAMPLER_STATE& sampler)
+{
+   // xorshift64*
+   sampler.Seed ^= sampler.Seed >> 12;
+   sampler.Seed ^= sampler.Seed << 25;
+   sampler.Seed ^= sampler.Seed >> 27;
+   const uint64_t random = sampler.Seed * 0x2545F4914F6CDD1DULL;
+
+   // Uniform value in (0, 1].
+   const double uniform = (double)((random >> 11) + 1) * (1.0 / 9007199254740992.0);
+   return (int64_t)(-log (uniform) * (double)SamplingInterval) + 1;
+}
+
+/// Decides whether the given allocation is reported. An allocation of 'size' bytes
+/// is sampled with probability 1 - exp(-size / SamplingInterval).
+__forceinline bool SampleAllocation (SIZE_T size)
+{
+   SAMPLER_STATE& sampler = tSampler;
+   if (!sampler.Initialized)
+   {
+      sampler.Seed = (__rdtsc () ^ ((uint64_t)GetCurrentThreadId () << 32)) | 1;
+      sampler.BytesUntilSample = NextSampleInterval (sampler);
+      sampler.Initialized = true;
+   }
+
+   sampler.BytesUntilSample -= (int64_t)size;
+   if (sampler.BytesUntilSample > 0)
+      return false;
+
+   sampler.BytesUntilSample = NextSampleInterval (sampler);
+   return true;
+}
+
+/// Returns true if the given allocation must be reported.
+/// Sampled pointers are remembered, so the matching deallocation is reported as well.
+__forceinline bool IsReportedAllocation (LPVOID ptr, SIZE_T size)
+{
+   if (SamplingInterval == 0)
+      return true;
+
+   return SampleAllocation (size) && SampledPointers.insert ((intptr_t)ptr);
+}
+
+/// Returns true if the given deallocation must be reported.
+__forceinline bool IsReportedDeallocation (LPVOID ptr)
+{
+   if (SamplingInterval == 0)
+      return true;
+
+   return SampledPointers.remove ((intptr_t)ptr);
+}
+
+/// Reports an allocation of a detoured function.
+/// Must be called within EnterInstrumentation / LeaveInstrumentation.
+__forceinline void ReportAllocation (LPVOID ptr, SIZE_T size)
+{
+   if (IsReportedAllocation (ptr, size))
+      InstrumentAllocation (libLeak::InstrumentType::Allocation, ptr, size);
+}
+
+/// Reallocation of a detoured function. The previous block is claimed before the real
+/// function releases it, so no other thread can report an allocation at the same address
+/// before this reallocation.
+typedef struct REALLOCATION_ {
+   bool Reported;                                 // The previous block was sampled (always without sampling)
+   bool HeldBack;                                 // The previous block was not published yet (lifetime filter)
+   bool Counted;                                  // The previous block was counted (aggregate transport)
+   bool Synchronized;                             // SyncSection is held (rendezvous transport)
+   bool Signal;                                   // Wake up the watcher process after the commit
+   LONG64 Slot;                                   // Reserved slot of the ring, -1 if none
+   DWORD StackId;                                 // Stack entry of the counted previous block
+   SIZE_T Size;                                   // Size of the counted previous block
+   libLeak::LEAK_EVENT_RECORD Allocation;         // Record of the held back previous block
+} REALLOCATION;
+
+/// Claims the previous block of a reallocation before the real function is called.
+/// Must be called within EnterInstrumentation / LeaveInstrumentation and followed by
+/// ReportReallocation or RestoreReallocation.
+__forceinline void ClaimReallocation (LPVOID previous, REALLOCATION& reallocation)
 {
-   LPVOID rv = 0;
+   reallocation.HeldBack = false;
+   reallocation.Counted = false;
+   reallocation.Synchronized = false;
+   reallocation.Signal = false;
+   reallocation.Slot = -1;
+   reallocation.Reported = previous != NULL && IsReportedDeallocation (previous);
+   if (!reallocation.Reported)
+      return;
+
+   if (IsRingTransport ())
+   {
+      // The previous block was never published; the monitor only sees the new one.
+      if (MinimumLifetime != 0 && PendingAllocations.remove ((intptr_t)previous, reallocation.Allocation))
+         reallocation.HeldBack = true;
+      else
+         reallocation.Slot = ReserveRecord (reallocation.Signal);
+
+      return;
+   }
+
+   if (IsAggregateTransport ())
+   {
+      reallocation.Counted = LiveAllocations.remove ((intptr_t)previous, reallocation.StackId, reallocation.Size);
+      return;
+   }
 
+   // The watcher process is not notified before the reallocation is reported.
    EnterCriticalSection (&SyncSection);
-   
-   // Ensure IPC communication is alive.
-   // That may cause a deadlock if the watcher process is not alive.
-   EnsureIPC ();
+   reallocation.Synchronized = true;
+}
 
-   __try {
-      rv = Real_HeapAlloc (hHeap, dwFlags, dwBytes);
-      if (ProfilingEnabled && rv)
-      {
-         // Do analysis if enabled.
-         InstrumentAllocation (libLeak::InstrumentType::Allocation, rv, (SIZE_T)dwBytes);
-      }
+/// Reports a successful reallocation claimed by ClaimReallocation.
+/// Reallocations of sampled blocks are reported as such; otherwise the new block
+/// is sampled like any other allocation and reported as a plain allocation.
+/// Must be called within EnterInstrumentation / LeaveInstrumentation.
+__forceinline void ReportReallocation (LPVOID previous, LPVOID ptr, SIZE_T size, const REALLOCATION& reallocation)
+{
+   if (!reallocation.Reported)
+   {
+      ReportAllocation (ptr, size);
+      return;
    }
-   __finally {
 
+   // If the table is full, the deallocation of the new block is not reported.
+   if (SamplingInterval != 0)
+      SampledPointers.insert ((intptr_t)ptr);
+
+   if (reallocation.HeldBack)
+   {
+      InstrumentAllocation (libLeak::InstrumentType::Allocation, ptr, size);
+   }
+   else if (IsRingTransport ())
+   {
+      libLeak::LEAK_EVENT_RECORD record;
+      CreateRecord (libLeak::InstrumentType::Reallocation, ptr, size, previous, record);
+      CommitRecord (reallocation.Slot, reallocation.Signal, record);
+   }
+   else if (IsAggregateTransport ())
+   {
+      // The counters of a reallocation move from the previous block to the new one.
+      if (reallocation.Counted)
+         libLeak::StackEntryAddDeallocation (libLeak::GetStackEntry (SharedControl, reallocation.StackId), reallocation.Size);
+
+      AggregateAllocation (ptr, size);
+   }
+   else
+   {
+      InstrumentAllocation (libLeak::InstrumentType::Reallocation, ptr, size, previous);
+   }
+
+   if (reallocation.Synchronized)
       LeaveCriticalSection (&SyncSection);
+}
+
+/// Releases the claim of a failed reallocation; the previous block is still allocated.
+/// Must be called within EnterInstrumentation / LeaveInstrumentation.
+__forceinline void RestoreReallocation (LPVOID previous, const REALLOCATION& reallocation)
+{
+   if (!reallocation.Reported)
+      return;
+
+   // The consumer must not wait for the reserved slot; it skips an invalid record.
+   if (reallocation.Slot >= 0)
+   {
+      libLeak::LEAK_EVENT_RECORD record = {};
+      record.Type = (DWORD)libLeak::InstrumentType::Invalid;
+      CommitRecord (reallocation.Slot, reallocation.Signal, record);
+   }
+
+   if (reallocation.HeldBack)
+   {
+      // An allocation that does not fit into the table anymore is published at once.
+      if (!PendingAllocations.insert (reallocation.Allocation))
+         PushRecord (reallocation.Allocation);
+   }
+   else if (reallocation.Counted && 
+      !LiveAllocations.insert ((intptr_t)previous, reallocation.StackId, reallocation.Size))
+   {
+      // The deallocation could not be attributed anymore; the block is not counted at all.
+      libLeak::StackEntryAddDeallocation (libLeak::GetStackEntry (SharedControl, reallocation.StackId), reallocation.Size);
+      InterlockedIncrement64 (&SharedControl->LostEvents);
+   }
+
+   if (SamplingInterval != 0)
+      SampledPointers.insert ((intptr_t)previous);
+
+   if (reallocation.Synchronized)
+      LeaveCriticalSection (&SyncSection);
+}
+
+/// Deallocation of a detoured function, reported before the memory is released.
+typedef struct DEALLOCATION_ {
+   bool Reported;                                 // The pointer was sampled (always without sampling)
+   bool HeldBack;                                 // The allocation was not published yet (lifetime filter)
+   bool Counted;                                  // The allocation was counted (aggregate transport)
+   DWORD StackId;                                 // Stack entry of the counted allocation
+   SIZE_T Size;                                   // Size of the counted allocation
+   libLeak::LEAK_EVENT_RECORD Allocation;         // Record of the held back allocation
+} DEALLOCATION;
+
+/// Reports a deallocation of a detoured function before the real function releases the
+/// memory. Otherwise another thread could receive the same address and report its
+/// allocation before this deallocation.
+/// Must be called within EnterInstrumentation / LeaveInstrumentation.
+__forceinline void ReportDeallocation (LPVOID ptr, DEALLOCATION& deallocation)
+{
+   deallocation.HeldBack = false;
+   deallocation.Counted = false;
+   deallocation.Reported = IsReportedDeallocation (ptr);
+   if (!deallocation.Reported)
+      return;
+
+   // Short-lived allocation; neither the allocation nor this deallocation is reported.
+   if (IsRingTransport () && 
+      MinimumLifetime != 0 && 
+      PendingAllocations.remove ((intptr_t)ptr, deallocation.Allocation))
+   {
+      deallocation.HeldBack = true;
+      return;
+   }
+
+   if (IsAggregateTransport ())
+   {
+      deallocation.Counted = LiveAllocations.remove ((intptr_t)ptr, deallocation.StackId, deallocation.Size);
+      if (deallocation.Counted)
+         libLeak::StackEntryAddDeallocation (libLeak::GetStackEntry (SharedControl, deallocation.StackId), deallocation.Size);
+
+      return;
+   }
+
+   InstrumentDeallocation (libLeak::InstrumentType::Deallocation, ptr);
+}
+
+/// Returns the size of the region reserved at 'ptr' by VirtualAlloc, 0 if there is none.
+static SIZE_T GetRegionSize (LPVOID ptr)
+{
+   MEMORY_BASIC_INFORMATION info;
+   if (VirtualQuery (ptr, &info, sizeof (info)) == 0 || info.AllocationBase != ptr || info.State == MEM_FREE)
+      return 0;
+
+   return info.RegionSize;
+}
+
+/// Reverts a reported deallocation if the real function did not release the memory.
+/// 'size' is the size of the block that is still allocated, 0 if the pointer is no block;
+/// a published deallocation is compensated by an allocation with the stacktrace of this call.
+/// Must be called within EnterInstrumentation / LeaveInstrumentation.
+__forceinline void RestoreDeallocation (LPVOID ptr, const DEALLOCATION& deallocation, SIZE_T size)
+{
+   if (!deallocation.Reported)
+      return;
+
+   if (deallocation.HeldBack)
+   {
+      // An allocation that does not fit into the table anymore is published at once.
+      if (!PendingAllocations.insert (deallocation.Allocation))
+         PushRecord (deallocation.Allocation);
+   }
+   else if (deallocation.Counted)
+   {
+      libLeak::StackEntryAddAllocation (libLeak::GetStackEntry (SharedControl, deallocation.StackId), deallocation.Size);
+      if (!LiveAllocations.insert ((intptr_t)ptr, deallocation.StackId, deallocation.Size))
+         InterlockedIncrement64 (&SharedControl->LostEvents);
+   }
+   else if (size != 0 && !IsAggregateTransport ())
+   {
+      InstrumentAllocation (libLeak::InstrumentType::Allocation, ptr, size);
+   }
+   else
+   {
+      return;
+   }
+
+   if (SamplingInterval != 0)
+      SampledPointers.insert ((intptr_t)ptr);
+}
+
+/// Enters the instrumentation of the calling thread.
+/// Returns false if the thread is already reporting an event (e.g. the stack walk
+/// allocated memory) or profiling was stopped in the meantime.
+__forceinline bool EnterInstrumentation ()
+{
+   if (TlsGetValue (gTlsIndent) != NULL)
+      return false;
+
+   TlsSetValue (gTlsIndent, (PVOID)1);
+
+   // Announce the event before checking the flag again; StopInstrumentation
+   // clears the flag and then waits for all announced events.
+   InterlockedIncrement (&ActiveInstrumentations);
+   if (ProfilingEnabled)
+      return true;
+
+   InterlockedDecrement (&ActiveInstrumentations);
+   TlsSetValue (gTlsIndent, (PVOID)0);
+   return false;
+}
+
+/// Leaves the instrumentation of the calling thread.
+__forceinline void LeaveInstrumentation ()
+{
+   InterlockedDecrement (&ActiveInstrumentations);
+   TlsSetValue (gTlsIndent, (PVOID)0);
+}
+
+/// Detoured HeapAlloc API function.
+/// The real allocator is called without any lock; if profiling is disabled
+/// the only overhead is a single branch.
+LPVOID WINAPI uberHeapAlloc (HANDLE hHeap, DWORD dwFlags, SIZE_T dwBytes)
+{
+   LPVOID rv = Real_HeapAlloc (hHeap, dwFlags, dwBytes);
+
+   if (ProfilingEnabled && rv && EnterInstrumentation ())
+   {
+      __try 
+      {
+         ReportAllocation (rv, dwBytes);
+      }
+      __finally 
+      {
+         LeaveInstrumentation ();
+      }
    }
+
    return rv;
 }
 
 /// Detoured HeapFree API function.
+/// The deallocation is reported before the memory is released and reverted if HeapFree
+/// failed, e.g. for a block of another heap (see RestoreDeallocation).
 BOOL WINAPI uberHeapFree (HANDLE hHeap, DWORD dwFlags, LPVOID lpMem)
 {
-   BOOL result = FALSE;
-
-   EnterCriticalSection (&SyncSection);
-
-   // Ensure IPC communication is alive.
-   // That may cause a deadlock if the watcher process is not alive.
-   EnsureIPC ();
+   if (!ProfilingEnabled || lpMem == NULL || !EnterInstrumentation ())
+      return Real_HeapFree (hHeap, dwFlags, lpMem);
 
+   BOOL rv = FALSE;
    __try 
    {
-      result = Real_HeapFree (hHeap, dwFlags, lpMem);
-      if (ProfilingEnabled && result)
+      DEALLOCATION deallocation;
+      ReportDeallocation (lpMem, deallocation);
+      rv = Real_HeapFree (hHeap, dwFlags, lpMem);
+      if (!rv)
       {
-         // Do analysis if successfull.
-         InstrumentDeallocation (libLeak::InstrumentType::Deallocation, lpMem);
+         const SIZE_T size = HeapSize (hHeap, 0, lpMem);
+         RestoreDeallocation (lpMem, deallocation, size != (SIZE_T)-1 ? size : 0);
       }
    }
    __finally 
    {
-      LeaveCriticalSection (&SyncSection);
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+//
+// The following detoured functions may be implemented on top of the detoured heap functions.
+// The real function is called within the instrumentation, so the nested heap calls are not
+// reported a second time.
+//
+
+/// Detoured HeapReAlloc API function.
+/// The previous block is claimed before it is released (see ClaimReallocation).
+/// A failed reallocation leaves the previous block untouched and is not reported.
+LPVOID WINAPI uberHeapReAlloc (HANDLE hHeap, DWORD dwFlags, LPVOID lpMem, SIZE_T dwBytes)
+{
+   if (!ProfilingEnabled || !EnterInstrumentation ())
+      return Real_HeapReAlloc (hHeap, dwFlags, lpMem, dwBytes);
+
+   LPVOID rv = NULL;
+   REALLOCATION reallocation;
+   ClaimReallocation (lpMem, reallocation);
+   __try 
+   {
+      rv = Real_HeapReAlloc (hHeap, dwFlags, lpMem, dwBytes);
+      if (rv)
+         ReportReallocation (lpMem, rv, dwBytes, reallocation);
+   }
+   __finally 
+   {
+      if (!rv)
+         RestoreReallocation (lpMem, reallocation);
+
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+/// Detoured LocalAlloc API function.
+/// Movable memory is tracked by its handle.
+HLOCAL WINAPI uberLocalAlloc (UINT uFlags, SIZE_T uBytes)
+{
+   if (!ProfilingEnabled || !EnterInstrumentation ())
+      return Real_LocalAlloc (uFlags, uBytes);
+
+   HLOCAL rv = NULL;
+   __try 
+   {
+      rv = Real_LocalAlloc (uFlags, uBytes);
+      if (rv)
+         ReportAllocation (rv, uBytes);
+   }
+   __finally 
+   {
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+/// Detoured LocalReAlloc API function.
+/// LMEM_MODIFY only changes the attributes of the block and is not reported.
+HLOCAL WINAPI uberLocalReAlloc (HLOCAL hMem, SIZE_T uBytes, UINT uFlags)
+{
+   if (!ProfilingEnabled || !EnterInstrumentation ())
+      return Real_LocalReAlloc (hMem, uBytes, uFlags);
+
+   HLOCAL rv = NULL;
+   REALLOCATION reallocation;
+   const bool modify = (uFlags & LMEM_MODIFY) != 0;
+   if (!modify)
+      ClaimReallocation (hMem, reallocation);
+
+   __try 
+   {
+      rv = Real_LocalReAlloc (hMem, uBytes, uFlags);
+      if (rv && !modify)
+         ReportReallocation (hMem, rv, uBytes, reallocation);
+   }
+   __finally 
+   {
+      if (!rv && !modify)
+         RestoreReallocation (hMem, reallocation);
+
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+/// Detoured LocalFree API function.
+HLOCAL WINAPI uberLocalFree (HLOCAL hMem)
+{
+   if (!ProfilingEnabled || hMem == NULL || !EnterInstrumentation ())
+      return Real_LocalFree (hMem);
+
+   HLOCAL rv = hMem;
+   __try 
+   {
+      DEALLOCATION deallocation;
+      ReportDeallocation (hMem, deallocation);
+      rv = Real_LocalFree (hMem);
+      if (rv != NULL)
+         RestoreDeallocation (hMem, deallocation, LocalSize (hMem));
+   }
+   __finally 
+   {
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+/// Detoured GlobalAlloc API function.
+/// Movable memory is tracked by its handle.
+HGLOBAL WINAPI uberGlobalAlloc (UINT uFlags, SIZE_T dwBytes)
+{
+   if (!ProfilingEnabled || !EnterInstrumentation ())
+      return Real_GlobalAlloc (uFlags, dwBytes);
+
+   HGLOBAL rv = NULL;
+   __try 
+   {
+      rv = Real_GlobalAlloc (uFlags, dwBytes);
+      if (rv)
+         ReportAllocation (rv, dwBytes);
+   }
+   __finally 
+   {
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+/// Detoured GlobalReAlloc API function.
+/// GMEM_MODIFY only changes the attributes of the block and is not reported.
+HGLOBAL WINAPI uberGlobalReAlloc (HGLOBAL hMem, SIZE_T dwBytes, UINT uFlags)
+{
+   if (!ProfilingEnabled || !EnterInstrumentation ())
+      return Real_GlobalReAlloc (hMem, dwBytes, uFlags);
+
+   HGLOBAL rv = NULL;
+   REALLOCATION reallocation;
+   const bool modify = (uFlags & GMEM_MODIFY) != 0;
+   if (!modify)
+      ClaimReallocation (hMem, reallocation);
+
+   __try 
+   {
+      rv = Real_GlobalReAlloc (hMem, dwBytes, uFlags);
+      if (rv && !modify)
+         ReportReallocation (hMem, rv, dwBytes, reallocation);
+   }
+   __finally 
+   {
+      if (!rv && !modify)
+         RestoreReallocation (hMem, reallocation);
+
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+/// Detoured GlobalFree API function.
+HGLOBAL WINAPI uberGlobalFree (HGLOBAL hMem)
+{
+   if (!ProfilingEnabled || hMem == NULL || !EnterInstrumentation ())
+      return Real_GlobalFree (hMem);
+
+   HGLOBAL rv = hMem;
+   __try 
+   {
+      DEALLOCATION deallocation;
+      ReportDeallocation (hMem, deallocation);
+      rv = Real_GlobalFree (hMem);
+      if (rv != NULL)
+         RestoreDeallocation (hMem, deallocation, GlobalSize (hMem));
+   }
+   __finally 
+   {
+      LeaveInstrumentation ();
    }
 
-   return result;
+   return rv;
+}
+
+/// Detoured VirtualAlloc API function.
+/// Only new regions (MEM_RESERVE) are reported, with their requested size.
+/// Committing pages of an existing reservation is not a new allocation.
+LPVOID WINAPI uberVirtualAlloc (LPVOID lpAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect)
+{
+   if (!ProfilingEnabled || (flAllocationType & MEM_RESERVE) == 0 || !EnterInstrumentation ())
+      return Real_VirtualAlloc (lpAddress, dwSize, flAllocationType, flProtect);
+
+   LPVOID rv = NULL;
+   __try 
+   {
+      rv = Real_VirtualAlloc (lpAddress, dwSize, flAllocationType, flProtect);
+      if (rv)
+         ReportAllocation (rv, dwSize);
+   }
+   __finally 
+   {
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+/// Detoured VirtualFree API function.
+/// Only the release of a whole region (MEM_RELEASE) is reported; decommitted pages
+/// remain part of the region.
+BOOL WINAPI uberVirtualFree (LPVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType)
+{
+   if (!ProfilingEnabled || (dwFreeType & MEM_RELEASE) == 0 || lpAddress == NULL || !EnterInstrumentation ())
+      return Real_VirtualFree (lpAddress, dwSize, dwFreeType);
+
+   BOOL rv = FALSE;
+   __try 
+   {
+      DEALLOCATION deallocation;
+      ReportDeallocation (lpAddress, deallocation);
+      rv = Real_VirtualFree (lpAddress, dwSize, dwFreeType);
+      if (!rv)
+         RestoreDeallocation (lpAddress, deallocation, GetRegionSize (lpAddress));
+   }
+   __finally 
+   {
+      LeaveInstrumentation ();
+   }
+
+   return rv;
+}
+
+/// Publishes held back allocations once they survived the minimum lifetime.
+/// Everything that is still held back when profiling stops is published as well.
+DWORD WINAPI SweeperThread (LPVOID lpParameter)
+{
+   UNREFERENCED_PARAMETER (lpParameter);
+
+   const uint64_t lifetime = (uint64_t)MinimumLifetime * 10000;   // FILETIME intervals
+   const DWORD interval = MinimumLifetime > 2 ? MinimumLifetime / 2 : 1;
+
+   while (WaitForSingleObject (hEventSweeperStop, interval) == WAIT_TIMEOUT)
+   {
+      FILETIME ft;
+      GetSystemTimeAsFileTime (&ft);
+      const uint64_t now = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+      PendingAllocations.sweep (now - lifetime, PushRecord);
+   }
+
+   PendingAllocations.sweep (UINT64_MAX, PushRecord);
+   return 0;
+}
+
+/// Enables the lifetime filter if requested by the monitoring process.
+void StartSweeper ()
+{
+   if (!IsRingTransport () || 
+      SharedControl->MinimumLifetime == 0 ||
+      !PendingAllocations.initialize (PendingAllocationsCapacity))
+   {
+      return;
+   }
+
+   if (hEventSweeperStop == NULL)
+      hEventSweeperStop = CreateEventA (NULL, FALSE, FALSE, NULL);
+
+   if (hEventSweeperStop == NULL)
+      return;
+
+   MinimumLifetime = SharedControl->MinimumLifetime;
+   hThreadSweeper = CreateThread (NULL, NULL, SweeperThread, NULL, 0, NULL);
+   if (hThreadSweeper == NULL)
+      MinimumLifetime = 0;
+}
+
+/// Publishes all held back allocations and stops the sweeper thread.
+/// Must be called once no detoured function is instrumenting anymore.
+void StopSweeper ()
+{
+   if (hThreadSweeper == NULL)
+      return;
+
+   SetEvent (hEventSweeperStop);
+   WaitForSingleObject (hThreadSweeper, INFINITE);
+   CloseHandle (hThreadSweeper);
+   hThreadSweeper = NULL;
+   MinimumLifetime = 0;
+}
+
+/// Opens the shared control block created by the monitoring process.
+/// Monitors that do not provide one are served by the rendezvous transport.
+void OpenSharedControl ()
+{
+   if (SharedControl != NULL)
+      return;
+
+   std::string name = libLeak::ReplaceEventName (libLeak::VL_MEMORY_SHARED_CONTROL, gProcessId);
+   hSharedControl = OpenFileMappingA (FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+   if (hSharedControl == NULL)
+      return;
+
+   libLeak::PLEAK_SHARED_CONTROL control = (libLeak::PLEAK_SHARED_CONTROL)MapViewOfFile (
+      hSharedControl, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+   if (control == NULL ||
+      control->Magic != libLeak::SharedControlMagic ||
+      control->Version != libLeak::SharedControlVersion)
+   {
+      if (control)
+         UnmapViewOfFile (control);
+
+      CloseHandle (hSharedControl);
+      hSharedControl = NULL;
+      return;
+   }
+
+   SharedControl = control;
 }
 
 /// Enables Instrumentation.
 void StartInstrumentation ()
 {
-   EnterCriticalSection (&SyncSection);
+   // Must happen before enabling the profiling; mapping the view
+   // may allocate memory.
+   OpenSharedControl ();
+
+   if (SharedControl != NULL && 
+      SharedControl->SamplingInterval != 0 &&
+      SampledPointers.initialize (SampledPointersCapacity))
    {
-      ProfilingEnabled = TRUE;
-      SetEvent (hEventStartConfirm);
+      SamplingInterval = SharedControl->SamplingInterval;
    }
-   LeaveCriticalSection (&SyncSection);
+
+   StartSweeper ();
+
+   // Without the table every allocation is counted as lost by the aggregate transport.
+   if (IsAggregateTransport ())
+      LiveAllocations.initialize (LiveAllocationsCapacity);
+
+   InterlockedExchange (&ProfilingEnabled, TRUE);
+   SetEvent (hEventStartConfirm);
 }
 
 /// Disables Instrumentation.
+/// Events that were already announced are still published before the stop is confirmed,
+/// so the watcher process keeps serving them until then.
 void StopInstrumentation ()
 {
-   EnterCriticalSection (&SyncSection);
-   {
-      ProfilingEnabled = FALSE;
-      SetEvent (hEventStopConfirm);
-   }
-   LeaveCriticalSection (&SyncSection);
+   InterlockedExchange (&ProfilingEnabled, FALSE);
+
+   while (ActiveInstrumentations != 0)
+      Sleep (1);
+
+   StopSweeper ();
+
+   SetEvent (hEventStopConfirm);
 }
 
 /// Process remote events.
@@ -245,6 +1132,15 @@ LONG AttachDetours (VOID)
 
    DetourAttach (&(PVOID&)Real_HeapAlloc, uberHeapAlloc);
    DetourAttach (&(PVOID&)Real_HeapFree, uberHeapFree);
+   DetourAttach (&(PVOID&)Real_HeapReAlloc, uberHeapReAlloc);
+   DetourAttach (&(PVOID&)Real_LocalAlloc, uberLocalAlloc);
+   DetourAttach (&(PVOID&)Real_LocalReAlloc, uberLocalReAlloc);
+   DetourAttach (&(PVOID&)Real_LocalFree, uberLocalFree);
+   DetourAttach (&(PVOID&)Real_GlobalAlloc, uberGlobalAlloc);
+   DetourAttach (&(PVOID&)Real_GlobalReAlloc, uberGlobalReAlloc);
+   DetourAttach (&(PVOID&)Real_GlobalFree, uberGlobalFree);
+   DetourAttach (&(PVOID&)Real_VirtualAlloc, uberVirtualAlloc);
+   DetourAttach (&(PVOID&)Real_VirtualFree, uberVirtualFree);
 
    return DetourTransactionCommit ();
 }
@@ -257,6 +1153,15 @@ LONG DetachDetours (VOID)
 
    DetourDetach (&(PVOID&)Real_HeapAlloc, uberHeapAlloc);
    DetourDetach (&(PVOID&)Real_HeapFree, uberHeapFree);
+   DetourDetach (&(PVOID&)Real_HeapReAlloc, uberHeapReAlloc);
+   DetourDetach (&(PVOID&)Real_LocalAlloc, uberLocalAlloc);
+   DetourDetach (&(PVOID&)Real_LocalReAlloc, uberLocalReAlloc);
+   DetourDetach (&(PVOID&)Real_LocalFree, uberLocalFree);
+   DetourDetach (&(PVOID&)Real_GlobalAlloc, uberGlobalAlloc);
+   DetourDetach (&(PVOID&)Real_GlobalReAlloc, uberGlobalReAlloc);
+   DetourDetach (&(PVOID&)Real_GlobalFree, uberGlobalFree);
+   DetourDetach (&(PVOID&)Real_VirtualAlloc, uberVirtualAlloc);
+   DetourDetach (&(PVOID&)Real_VirtualFree, uberVirtualFree);
 
    return DetourTransactionCommit ();
 }
@@ -344,6 +1249,10 @@ BOOL ProcessAttach (HMODULE hDll)
    gTlsIndent = TlsAlloc();
    gTlsThread = TlsAlloc();
 
+   // The detoured functions rely on the reentrancy guard.
+   if (gTlsIndent == (LONG)TLS_OUT_OF_INDEXES)
+      return FALSE;
+
    // Initialize critical section.
    InitializeCriticalSection (&SyncSection);
 
@@ -393,6 +1302,28 @@ BOOL ProcessDetach (HMODULE hDll)
 
    DeleteCriticalSection (&SyncSection);
 
+   SampledPointers.release ();
+   PendingAllocations.release ();
+   LiveAllocations.release ();
+
+   if (hEventSweeperStop)
+   {
+      CloseHandle (hEventSweeperStop);
+      hEventSweeperStop = NULL;
+   }
+
+   if (SharedControl)
+   {
+      UnmapViewOfFile (SharedControl);
+      SharedControl = NULL;
+   }
+
+   if (hSharedControl)
+   {
+      CloseHandle (hSharedControl);
+      hSharedControl = NULL;
+   }
+
    if (gTlsIndent >= 0) 
    {
       TlsFree(gTlsIndent);
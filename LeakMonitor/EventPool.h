@@ -0,0 +1,75 @@
+#pragma once
+#include "libLeak.h"
+
+#include <mutex>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+///
+/// EventPool
+/// Recycles the event objects passed from the client to the queued backend.
+///
+/// Objects are allocated in slabs and never freed before the pool; the memory of the
+/// pool is bounded by the largest number of events queued at a time. The client thread
+/// acquires objects, the queue thread releases them once they were written. Both sides
+/// work on their own list and only exchange them under the lock, once per slab or batch.
+///
+/// Only for plain structures; acquired objects are zeroed.
+///
+template <typename T>
+class EventPool
+{
+   static constexpr size_t SlabSize = 1024;
+
+   std::vector<std::unique_ptr<T[]>> mSlabs;               // Acquiring thread only
+   std::vector<T*> mAvailable;                             // Acquiring thread only
+
+   std::mutex mLock;
+   std::vector<T*> mReleased;
+
+public:
+   EventPool () = default;
+
+   EventPool (const EventPool&) = delete;
+   EventPool& operator = (const EventPool&) = delete;
+
+   /// Returns a zeroed object. Must always be called by the same thread.
+   T* acquire ()
+   {
+      if (mAvailable.empty ())
+      {
+         {
+            const std::lock_guard<std::mutex> lock (mLock);
+            mAvailable.swap (mReleased);
+         }
+
+         if (mAvailable.empty ())
+         {
+            mSlabs.emplace_back (new T[SlabSize]);
+            for (size_t i = SlabSize; i > 0; i--)
+               mAvailable.push_back (&mSlabs.back ()[i - 1]);
+         }
+      }
+
+      T* object = mAvailable.back ();
+      mAvailable.pop_back ();
+      memset (object, 0, sizeof (T));
+      return object;
+   }
+
+   /// Returns a batch of objects to the pool; clears the batch.
+   void release (std::vector<T*>& objects)
+   {
+      if (objects.empty ())
+         return;
+
+      const std::lock_guard<std::mutex> lock (mLock);
+      if (mReleased.empty ())
+         mReleased.swap (objects);
+      else
+         mReleased.insert (mReleased.end (), objects.begin (), objects.end ());
+
+      objects.clear ();
+   }
+};
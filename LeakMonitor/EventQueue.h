@@ -0,0 +1,125 @@
+#pragma once
+#include "libLeak.h"
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+///
+/// EventQueue
+/// Bounded lock-free queue of events, for many producers and a single consumer.
+///
+/// The queue is a ring of slots; each slot carries a sequence number that tells
+/// whether it is free for the producer of a position or filled for the consumer.
+/// Producers reserve a position with a compare-exchange of the enqueue index, the
+/// consumer owns the dequeue index. Neither side takes a lock.
+///
+/// The capacity is rounded up to the next power of two.
+///
+template <typename T>
+class EventQueue
+{
+   typedef struct SLOT_ {
+      std::atomic<size_t> sequence;
+      T value;
+   } SLOT;
+
+   std::unique_ptr<SLOT[]> mSlots;
+   size_t mMask;
+
+   alignas(64) std::atomic<size_t> mEnqueueIndex{ 0 };
+   alignas(64) std::atomic<size_t> mDequeueIndex{ 0 };
+   alignas(64) std::atomic<size_t> mHighWater{ 0 };
+
+public:
+   explicit EventQueue (size_t capacity)
+   {
+      size_t slots = 2;
+      while (slots < capacity)
+         slots <<= 1;
+
+      mSlots.reset (new SLOT[slots]);
+      mMask = slots - 1;
+      for (size_t i = 0; i < slots; i++)
+         mSlots[i].sequence.store (i, std::memory_order_relaxed);
+   }
+
+   EventQueue (const EventQueue&) = delete;
+   EventQueue& operator = (const EventQueue&) = delete;
+
+   /// Appends an event; the event is moved only on success.
+   /// Returns false if the queue is full.
+   bool try_push (T& value)
+   {
+      size_t position = mEnqueueIndex.load (std::memory_order_relaxed);
+      SLOT* slot = nullptr;
+      for (;;)
+      {
+         slot = &mSlots[position & mMask];
+         const size_t sequence = slot->sequence.load (std::memory_order_acquire);
+         const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+         if (difference == 0)
+         {
+            if (mEnqueueIndex.compare_exchange_weak (position, position + 1, std::memory_order_relaxed))
+               break;
+         }
+         else if (difference < 0)
+         {
+            // The consumer did not free the slot of the previous round yet.
+            return false;
+         }
+         else
+         {
+            position = mEnqueueIndex.load (std::memory_order_relaxed);
+         }
+      }
+
+      slot->value = std::move (value);
+      slot->sequence.store (position + 1, std::memory_order_release);
+
+      const size_t depth = position + 1 - mDequeueIndex.load (std::memory_order_relaxed);
+      size_t high_water = mHighWater.load (std::memory_order_relaxed);
+      while (depth > high_water && !mHighWater.compare_exchange_weak (high_water, depth, std::memory_order_relaxed))
+         ;
+
+      return true;
+   }
+
+   /// Removes the oldest event. Must always be called by the same thread.
+   /// Returns false if the queue is empty.
+   bool try_pop (T& value)
+   {
+      const size_t position = mDequeueIndex.load (std::memory_order_relaxed);
+      SLOT& slot = mSlots[position & mMask];
+      if (slot.sequence.load (std::memory_order_acquire) != position + 1)
+         return false;
+
+      // The dequeue index is published with the slot, so a producer that reuses the slot
+      // never computes a depth beyond the capacity.
+      value = std::move (slot.value);
+      mDequeueIndex.store (position + 1, std::memory_order_relaxed);
+      slot.sequence.store (position + mMask + 1, std::memory_order_release);
+      return true;
+   }
+
+   /// Returns true if the consumer would not find an event.
+   bool empty () const
+   {
+      const size_t position = mDequeueIndex.load (std::memory_order_relaxed);
+      return mSlots[position & mMask].sequence.load (std::memory_order_acquire) != position + 1;
+   }
+
+   /// Number of slots.
+   size_t capacity () const { return mMask + 1; }
+
+   /// Number of queued events; approximate while producers or the consumer are active.
+   size_t depth () const
+   {
+      const size_t dequeued = mDequeueIndex.load (std::memory_order_relaxed);
+      const size_t enqueued = mEnqueueIndex.load (std::memory_order_relaxed);
+      return enqueued > dequeued ? enqueued - dequeued : 0;
+   }
+
+   /// Largest number of queued events observed by a producer.
+   size_t high_water () const { return mHighWater.load (std::memory_order_relaxed); }
+};
@@ -14,6 +14,12 @@ public:
    /// Called as soon as the program is initialized.
    virtual void initialize (DWORD pid) = 0;
 
+   /// Returns a zeroed event to be passed to push. The backend owns the events
+   /// and recycles them once they were processed; they must not be deleted.
+   virtual libLeak::PALLOCATION_EVENT create_allocation () = 0;
+   virtual libLeak::PDELLOCATION_EVENT create_deallocation () = 0;
+   virtual libLeak::PAGGREGATE_EVENT create_aggregate () = 0;
+
    /// Called synchronously for each allocation event.
    /// Make sure to not do any heavy operation in this routine.
    virtual void push (_In_ libLeak::PALLOCATION_EVENT event) = 0;
@@ -22,6 +28,10 @@ public:
    /// Make sure to not do any heavy operation in this routine.
    virtual void push (_In_ libLeak::PDELLOCATION_EVENT event) = 0;
 
+   /// Called periodically with the counters of a stacktrace (aggregate transport).
+   /// Make sure to not do any heavy operation in this routine.
+   virtual void push (_In_ libLeak::PAGGREGATE_EVENT event) = 0;
+
    /// Called synchronously for each signal timeout.
    /// Happens when the remote process is IDLE and is not doing
    /// any allocation / deallocation.
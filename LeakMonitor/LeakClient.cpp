@@ -1,6 +1,8 @@
 #include "LeakClient.h"
 
 #include <string>
+#include <vector>
+#include <chrono>
 #include <iostream>
 
 #include "libLeak.h"
@@ -98,6 +100,79 @@ private:
    HANDLE mHandle;
 };
 
+///
+/// SharedControl class
+/// This class wraps the shared control block and event ring (CreateFileMapping)
+///
+class SharedControl {
+public:
+   SharedControl (const std::string& name)
+      : mName (name)
+      , mHandle (NULL)
+      , mControl (nullptr)
+   {
+   }
+
+   ~SharedControl ()
+   {
+      if (mControl)
+      {
+         UnmapViewOfFile (mControl);
+      }
+
+      if (mHandle)
+      {
+         CloseHandle (mHandle);
+      }
+   }
+
+   bool create (
+      libLeak::TransportMode transport, 
+      libLeak::OverflowPolicy overflow, 
+      libLeak::StackCaptureMode stackCapture, 
+      DWORD ringCapacity,
+      DWORD stackTableCapacity,
+      DWORD samplingInterval,
+      DWORD minimumLifetime)
+   {
+      const uint64_t size = (uint64_t)libLeak::GetSharedControlSize (ringCapacity, stackTableCapacity);
+      mHandle = CreateFileMappingA (
+         INVALID_HANDLE_VALUE, 
+         NULL, 
+         PAGE_READWRITE, 
+         (DWORD)(size >> 32), 
+         (DWORD)(size & 0xFFFFFFFF), 
+         mName.c_str());
+
+      if (mHandle == NULL)
+         return false;
+
+      mControl = (libLeak::PLEAK_SHARED_CONTROL)MapViewOfFile (mHandle, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+      if (mControl == nullptr)
+         return false;
+
+      libLeak::InitializeSharedControl (
+         mControl, 
+         transport, 
+         overflow, 
+         stackCapture, 
+         ringCapacity, 
+         stackTableCapacity, 
+         samplingInterval,
+         minimumLifetime);
+      return true;
+   }
+
+   libLeak::PLEAK_SHARED_CONTROL get () const { return mControl; }
+
+   const std::string& GetName () const { return mName; }
+
+private:
+   std::string mName;
+   HANDLE mHandle;
+   libLeak::PLEAK_SHARED_CONTROL mControl;
+};
+
 // Forwarded from Inject.cpp
 DWORD Inject (HANDLE hProcess, const std::string& dll, LPVOID& memory);
 
@@ -153,10 +228,19 @@ class LeakClient::Private
    std::shared_ptr<ReadEvent> ipcEventInterrupt;
    std::shared_ptr<ReadEvent> ipcEventStartConfirm;
    std::shared_ptr<ReadEvent> ipcEventStopConfirm;
+   std::shared_ptr<SharedControl> ipcSharedControl;
+   std::vector<libLeak::LEAK_EVENT_RECORD> drain_buffer;
+   std::vector<std::pair<uint64_t, uint64_t>> flushed_counters;   // stack table index -> allocations, deallocations
+   DWORD aggregate_interval;
+   uint64_t reported_lost_events;
+   uint64_t reported_lost_stacks;
 
    Private (LeakClient* q)
       : qptr(q)
       , pid(0)
+      , aggregate_interval(0)
+      , reported_lost_events(0)
+      , reported_lost_stacks(0)
    {
    }
 
@@ -174,6 +258,7 @@ class LeakClient::Private
       ipcEventInterrupt = std::make_shared<ReadEvent> (libLeak::ReplaceEventName(libLeak::VL_MEMORY_EVENT_INTERRUPT, pid));
       ipcEventStartConfirm = std::make_shared<ReadEvent> (libLeak::ReplaceEventName(libLeak::VL_MEMORY_EVENT_START_CONFIRM, pid));
       ipcEventStopConfirm = std::make_shared<ReadEvent> (libLeak::ReplaceEventName(libLeak::VL_MEMORY_EVENT_STOP_CONFIRM, pid));
+      ipcSharedControl = std::make_shared<SharedControl> (libLeak::ReplaceEventName(libLeak::VL_MEMORY_SHARED_CONTROL, pid));
 
       if (!ipcEventInterruptConfirm->create ())
       {
@@ -205,6 +290,38 @@ class LeakClient::Private
          qptr->OnEventCreated (ipcEventStop->GetName ());
       }
 
+      // The shared control block publishes the transport settings to the remote process.
+      // It must exist before the start signal is sent.
+      if (!ipcSharedControl->create (
+         settings.transport, 
+         settings.overflow, 
+         settings.stack_capture, 
+         libLeak::GetRingCapacity (
+            settings.transport == libLeak::TransportMode::Ring ? settings.ring_capacity : 0),
+         settings.transport != libLeak::TransportMode::Rendezvous 
+            ? libLeak::GetRingCapacity (settings.stack_table_capacity) 
+            : 0,
+         settings.sampling_interval,
+         settings.minimum_lifetime))
+      {
+         qptr->OnEventCreateError (ipcSharedControl->GetName ());
+         return false;
+      }
+      else
+      {
+         qptr->OnEventCreated (ipcSharedControl->GetName ());
+      }
+
+      if (settings.transport == libLeak::TransportMode::Ring)
+      {
+         drain_buffer.resize (4096);
+      }
+      else if (settings.transport == libLeak::TransportMode::Aggregate)
+      {
+         flushed_counters.resize (ipcSharedControl->get ()->StackTableCapacity);
+         aggregate_interval = settings.aggregate_interval ? settings.aggregate_interval : 1;
+      }
+
       // Test if --inject PID is set where PID is a numeric value 
       // which stands for the remote process id.
       if (settings.inject.has_value () && settings.inject.value())
@@ -261,8 +378,34 @@ class LeakClient::Private
       return false;
    }
 
+   bool IsRingTransport () const
+   {
+      return ipcSharedControl 
+         && ipcSharedControl->get () 
+         && ipcSharedControl->get ()->Transport == (DWORD)libLeak::TransportMode::Ring;
+   }
+
+   bool IsAggregateTransport () const
+   {
+      return ipcSharedControl 
+         && ipcSharedControl->get () 
+         && ipcSharedControl->get ()->Transport == (DWORD)libLeak::TransportMode::Aggregate;
+   }
+
    void mainloop (bool& bExitApplication)
    {
+      if (IsRingTransport ())
+      {
+         mainloop_ring (bExitApplication);
+         return;
+      }
+
+      if (IsAggregateTransport ())
+      {
+         mainloop_aggregate (bExitApplication);
+         return;
+      }
+
       bool remote_process_alive = true;
 
       const DWORD timeout = 250;
@@ -311,7 +454,196 @@ class LeakClient::Private
       qptr->OnProfilingStopped ();
    }
 
+   ///
+   /// Main loop of the ring transport.
+   /// The remote process is never interrupted. Published records are drained in batches
+   /// once the remote process signals a half-full ring or the drain interval elapsed.
+   ///
+   void mainloop_ring (bool& bExitApplication)
+   {
+      bool remote_process_alive = true;
+
+      const DWORD timeout = 250;
+      const DWORD drain_interval = 10;
+      DWORD idle = 0;
+
+      for (;;)
+      {
+         ipcEventInterrupt->wait_for_signal_timeout (drain_interval);
+
+         if (drain_ring () > 0)
+         {
+            idle = 0;
+         }
+         else if ((idle += drain_interval) >= timeout)
+         {
+            idle = 0;
+            report_lost_events ();
+            qptr->OnTimeout (timeout);
+
+            remote_process_alive = IsProcessAlive (pid);
+            if (!remote_process_alive)
+               bExitApplication = true;
+         }
+
+         if (bExitApplication)
+            break;
+      }
+
+      // Trigger the signal to stop profiling.
+      if (remote_process_alive)
+      {
+         ipcEventStop->signal ();
+
+         // Threads of the remote process may be blocked on a full ring.
+         // Keep draining until the stop is confirmed.
+         for (DWORD waited = 0; waited < 10000; waited += drain_interval)
+         {
+            drain_ring ();
+            if (ipcEventStopConfirm->wait_for_signal_timeout (drain_interval))
+               break;
+         }
+      }
+
+      // Pick up everything that was published before profiling stopped.
+      drain_ring ();
+      report_lost_events ();
+
+      qptr->OnProfilingStopped ();
+   }
+
+   ///
+   /// Main loop of the aggregate transport.
+   /// The remote process maintains counters per stacktrace in the stack table;
+   /// they are read and forwarded every aggregate interval.
+   ///
+   void mainloop_aggregate (bool& bExitApplication)
+   {
+      bool remote_process_alive = true;
+
+      const DWORD timeout = 250;
+      DWORD elapsed = 0;
+
+      for (;;)
+      {
+         Sleep (timeout);
+         qptr->OnTimeout (timeout);
+
+         if ((elapsed += timeout) >= aggregate_interval * 1000)
+         {
+            elapsed = 0;
+            flush_aggregates ();
+            report_lost_events ();
+         }
+
+         remote_process_alive = IsProcessAlive (pid);
+         if (!remote_process_alive)
+            bExitApplication = true;
+
+         if (bExitApplication)
+            break;
+      }
+
+      // Trigger the signal to stop profiling.
+      if (remote_process_alive)
+      {
+         ipcEventStop->signal ();
+         ipcEventStopConfirm->wait_for_signal_timeout (10000);
+      }
+
+      // The counters remain readable after the remote process has exited.
+      flush_aggregates ();
+      report_lost_events ();
+
+      qptr->OnProfilingStopped ();
+   }
+
 private:
+   /// Forwards the counters of all stacktraces that changed since the last flush.
+   void flush_aggregates ()
+   {
+      libLeak::PLEAK_SHARED_CONTROL control = ipcSharedControl->get ();
+      const uint64_t timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(
+         std::chrono::system_clock::now ().time_since_epoch ()).count ();
+
+      std::vector<libLeak::AGGREGATE_EVENT> events;
+      for (DWORD index = 0; index < (DWORD)flushed_counters.size (); index++)
+      {
+         libLeak::PLEAK_STACK_ENTRY entry = libLeak::GetStackEntry (control, index + 1);
+         if (entry == NULL)
+            continue;
+
+         const uint64_t allocations = (uint64_t)entry->Allocations;
+         const uint64_t deallocations = (uint64_t)entry->Deallocations;
+         if (flushed_counters[index].first == allocations && flushed_counters[index].second == deallocations)
+            continue;
+
+         flushed_counters[index] = { allocations, deallocations };
+
+         libLeak::AGGREGATE_EVENT event;
+         event.StackId = index + 1;
+         event.Stacktrace = entry->Stacktrace;
+         event.Allocations = allocations;
+         event.Deallocations = deallocations;
+         event.LiveBytes = (uint64_t)entry->LiveBytes;
+         event.PeakBytes = (uint64_t)entry->PeakBytes;
+         event.TimestampEpochSeconds = timestamp;
+         events.push_back (event);
+      }
+
+      if (events.size ())
+         qptr->OnAggregates (pid, events.data (), events.size ());
+   }
+
+   /// Drains all published records and forwards them in batches.
+   /// Returns the number of drained records.
+   SIZE_T drain_ring ()
+   {
+      SIZE_T total = 0;
+      for (;;)
+      {
+         SIZE_T count = libLeak::RingDrain (ipcSharedControl->get (), drain_buffer.data (), drain_buffer.size ());
+         if (count == 0)
+            break;
+
+         qptr->OnRecords (pid, drain_buffer.data (), count);
+         total += count;
+
+         if (count < drain_buffer.size ())
+            break;
+      }
+
+      return total;
+   }
+
+   /// Notifies about events and stacktraces that were dropped by the remote process.
+   void report_lost_events ()
+   {
+      uint64_t lost = (uint64_t)ipcSharedControl->get ()->LostEvents;
+      if (lost != reported_lost_events)
+      {
+         reported_lost_events = lost;
+         qptr->OnEventsLost (lost);
+      }
+
+      lost = (uint64_t)ipcSharedControl->get ()->LostStacks;
+      if (lost != reported_lost_stacks)
+      {
+         reported_lost_stacks = lost;
+         qptr->OnStacksLost (lost);
+      }
+   }
+
+   /// Returns the published stacktrace of the given stack id.
+   const libLeak::STACKTRACE* GetStacktrace (DWORD stackId) const
+   {
+      if (!ipcSharedControl || !ipcSharedControl->get ())
+         return nullptr;
+
+      libLeak::PLEAK_STACK_ENTRY entry = libLeak::GetStackEntry (ipcSharedControl->get (), stackId);
+      return entry ? &entry->Stacktrace : nullptr;
+   }
+
    /// Returns the file name of the LeakDetect.dll.
    /// The file name is different depending on the current platform.
    std::string GetLeakDetectFileName ()
@@ -354,3 +686,8 @@ std::string LeakClient::GetLeakDetectFileName () const
 {
    return mPrivate->GetLeakDetectFileName ();
 }
+
+const libLeak::STACKTRACE* LeakClient::GetStacktrace (DWORD stackId) const
+{
+   return mPrivate->GetStacktrace (stackId);
+}
@@ -1,10 +1,11 @@
 #pragma once
 
-#include <Windows.h>
-
 #include <string>
 #include <optional>
 
+#include "libLeak.h"
+#include "LeakSharedMemory.h"
+
 ///
 /// LeakClient settings.
 ///
@@ -13,6 +14,27 @@ typedef struct LEAKCLIENT_SETTINGS_
    DWORD pid = 0;                            /// Remote Process ID
    std::optional<bool> inject;               /// Indicates whether the Leak.X86.dll / Leak.X64.dll
                                              /// should be injected to a remote process or not.
+   libLeak::TransportMode transport = libLeak::TransportMode::Rendezvous;
+                                             /// IPC transport used by the remote process.
+   DWORD ring_capacity = libLeak::DefaultRingCapacity;
+                                             /// Number of slots in the shared ring (power of two).
+   libLeak::OverflowPolicy overflow = libLeak::OverflowPolicy::Block;
+                                             /// Behaviour of the remote process if the ring is full.
+   libLeak::StackCaptureMode stack_capture = libLeak::StackCaptureMode::Remote;
+                                             /// Where stacktraces are captured (rendezvous transport).
+   DWORD stack_table_capacity = libLeak::DefaultStackTableCapacity;
+                                             /// Number of distinct stacktraces shared by the remote process.
+   DWORD sampling_interval = 0;              /// Mean sampling interval in bytes, 0 reports every allocation.
+   DWORD minimum_lifetime = 0;               /// Allocations freed within this many milliseconds are not reported.
+                                             /// Requires the ring transport.
+   DWORD snapshot_interval = 0;              /// Seconds between snapshots of outstanding allocations, 0 writes every event.
+   DWORD aggregate_interval = 60;            /// Seconds between flushes of the counters (aggregate transport).
+   DWORD symbolizer_threads = 0;             /// Threads resolving symbols in parallel to the writer.
+   bool deferred_symbols = false;            /// Write raw frames and modules; LeakConverter resolves the symbols.
+   bool event_columns = false;               /// Write allocations and deallocations in columnar chunks.
+   DWORD queue_capacity = 0;                 /// Number of events queued for the writer, 0 uses the default.
+   bool queue_spill = false;                 /// Spill events to an unbounded buffer instead of waiting
+                                             /// for the writer if the queue is full.
 } LEAKCLIENT_SETTINGS;
 
 ///
@@ -41,6 +63,10 @@ public:
    /// Returns the Leak.dll name.
    std::string GetLeakDetectFileName () const;
 
+   /// Returns the stacktrace published by the remote process for the given stack id,
+   /// or nullptr if the stack id is unknown.
+   const libLeak::STACKTRACE* GetStacktrace (DWORD stackId) const;
+
 protected:
    virtual void OnEventCreated (const std::string& eventName) { };
    virtual void OnEventCreateError (const std::string& eventName) { };
@@ -54,6 +80,10 @@ protected:
    virtual void OnProfilingStopped () { };
 
    virtual void OnSignal (DWORD pid) { };
+   virtual void OnRecords (DWORD pid, const libLeak::LEAK_EVENT_RECORD* records, SIZE_T count) { };
+   virtual void OnAggregates (DWORD pid, const libLeak::AGGREGATE_EVENT* events, SIZE_T count) { };
+   virtual void OnEventsLost (uint64_t count) { };
+   virtual void OnStacksLost (uint64_t count) { };
    virtual void OnTimeout (DWORD timeoutMs) {};
 
 private:
@@ -0,0 +1,535 @@
+#include "LeakClient.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cerrno>
+#include <cstddef>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "libLeak.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+
+// Forward to Stacktrace.cpp
+void RefreshModuleMappings (_In_ HANDLE RemoteProcess);
+
+///
+/// SharedRendezvous class
+/// This class wraps the rendezvous block shared with the instrumented process (shm_open).
+/// It replaces the named events of the Windows implementation.
+///
+class SharedRendezvous {
+public:
+   SharedRendezvous (const std::string& name)
+      : mName (name)
+      , mRendezvous (nullptr)
+      , mLastSignal (0)
+   {
+   }
+
+   ~SharedRendezvous ()
+   {
+      if (mRendezvous)
+      {
+         munmap (mRendezvous, sizeof (libLeak::LEAK_SHARED_RENDEZVOUS));
+         shm_unlink (mName.c_str ());
+      }
+   }
+
+   /// Creates the block, publishes the settings and requests the start of the profiling.
+   bool create (
+      libLeak::OverflowPolicy overflow,
+      DWORD ringCapacity,
+      DWORD stackTableCapacity)
+   {
+      // A block of a previous monitor that did not exit gracefully.
+      shm_unlink (mName.c_str ());
+
+      const int fd = shm_open (mName.c_str (), O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (fd < 0)
+         return false;
+
+      void* mapping = MAP_FAILED;
+      if (ftruncate (fd, sizeof (libLeak::LEAK_SHARED_RENDEZVOUS)) == 0)
+         mapping = mmap (nullptr, sizeof (libLeak::LEAK_SHARED_RENDEZVOUS), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+      close (fd);
+      if (mapping == MAP_FAILED)
+      {
+         shm_unlink (mName.c_str ());
+         return false;
+      }
+
+      mRendezvous = (libLeak::PLEAK_SHARED_RENDEZVOUS)mapping;
+      memset (mRendezvous, 0, sizeof (libLeak::LEAK_SHARED_RENDEZVOUS));
+      mRendezvous->Version = libLeak::SharedRendezvousVersion;
+      mRendezvous->MonitorProcessId = (DWORD)getpid ();
+      mRendezvous->Overflow = (DWORD)overflow;
+      mRendezvous->RingCapacity = ringCapacity;
+      mRendezvous->StackTableCapacity = stackTableCapacity;
+      mRendezvous->State = (LONG)libLeak::RendezvousState::StartRequested;
+
+      // The instrumented process only accepts the block once the magic is published.
+      __atomic_store_n (&mRendezvous->Magic, libLeak::SharedRendezvousMagic, __ATOMIC_RELEASE);
+      return true;
+   }
+
+   /// Waits until the instrumented process has entered the given state.
+   bool wait_for_state_timeout (libLeak::RendezvousState state, DWORD timeout)
+   {
+      const LONG current = mRendezvous->State;
+      if (current == (LONG)state)
+         return true;
+
+      libLeak::FutexWait (&mRendezvous->State, current, timeout);
+      return mRendezvous->State == (LONG)state;
+   }
+
+   /// Waits until a producer signals the ring is filling up, or the timeout elapsed.
+   void wait_for_signal_timeout (DWORD timeout)
+   {
+      InterlockedExchange (&mRendezvous->MonitorWaiting, TRUE);
+
+      // Signals that were raised before we started waiting are not lost.
+      const LONG signal = mRendezvous->Signal;
+      if (signal == mLastSignal)
+         libLeak::FutexWait (&mRendezvous->Signal, signal, timeout);
+
+      mLastSignal = mRendezvous->Signal;
+      InterlockedExchange (&mRendezvous->MonitorWaiting, FALSE);
+   }
+
+   void set_state (libLeak::RendezvousState state)
+   {
+      libLeak::SetRendezvousState (mRendezvous, state);
+   }
+
+   libLeak::PLEAK_SHARED_RENDEZVOUS get () const { return mRendezvous; }
+
+   const std::string& GetName () const { return mName; }
+
+private:
+   std::string mName;
+   libLeak::PLEAK_SHARED_RENDEZVOUS mRendezvous;
+   LONG mLastSignal;
+};
+
+///
+/// RemoteRing class
+/// This class reads the control block, the ring and the stack table from the private
+/// memory of the instrumented process (process_vm_readv). Each drain reads all published
+/// slots with a single call; the slots are released by writing the read index back.
+///
+class RemoteRing {
+public:
+   RemoteRing ()
+      : mPid (0)
+      , mAddress (0)
+      , mReadIndex (0)
+   {
+      memset (&mControl, 0, sizeof (mControl));
+   }
+
+   /// Reads the control block at the given address of the instrumented process.
+   /// Fails if the monitor is not allowed to read the memory of the process.
+   bool open (pid_t pid, uint64_t address)
+   {
+      mPid = pid;
+      mAddress = address;
+
+      if (!read_control () ||
+         mControl.Magic != libLeak::SharedControlMagic ||
+         mControl.Version != libLeak::SharedControlVersion)
+      {
+         return false;
+      }
+
+      mReadIndex = mControl.ReadIndex;
+      mSlots.resize (mControl.RingCapacity);
+      return true;
+   }
+
+   /// Drains up to 'maximum' published records into 'records'.
+   /// Returns the number of drained records.
+   SIZE_T drain (libLeak::PLEAK_EVENT_RECORD records, SIZE_T maximum)
+   {
+      if (!read_control ())
+         return 0;
+
+      const LONG64 capacity = (LONG64)mControl.RingCapacity;
+      const LONG64 available = std::min<LONG64> (mControl.WriteIndex - mReadIndex, (LONG64)maximum);
+      if (available <= 0)
+         return 0;
+
+      // The reserved slots are read in one call, split in two ranges if the ring wraps around.
+      const LONG64 first = mReadIndex & (capacity - 1);
+      const LONG64 first_count = std::min<LONG64> (available, capacity - first);
+      const uint64_t slots = mAddress + sizeof (libLeak::LEAK_SHARED_CONTROL);
+
+      struct iovec local = { mSlots.data (), (size_t)available * sizeof (libLeak::LEAK_RING_SLOT) };
+      struct iovec remote[2] = {
+         { (void*)(uintptr_t)(slots + first * sizeof (libLeak::LEAK_RING_SLOT)), (size_t)first_count * sizeof (libLeak::LEAK_RING_SLOT) },
+         { (void*)(uintptr_t)slots, (size_t)(available - first_count) * sizeof (libLeak::LEAK_RING_SLOT) },
+      };
+
+      const ssize_t expected = (ssize_t)local.iov_len;
+      if (process_vm_readv (mPid, &local, 1, remote, available > first_count ? 2 : 1, 0) != expected)
+         return 0;
+
+      // Stop at the first slot which is reserved but not yet published.
+      SIZE_T count = 0;
+      for (LONG64 position = mReadIndex; count < (SIZE_T)available; position++)
+      {
+         const libLeak::LEAK_RING_SLOT& slot = mSlots[count];
+         if (slot.Sequence != position + 1)
+            break;
+
+         records[count++] = slot.Record;
+      }
+
+      if (count == 0)
+         return 0;
+
+      // Hand the slots back to the producers for the next lap.
+      // If that fails, the slots are drained again by the next call; the records of a
+      // process that has exited are consumed anyway.
+      if (!write_read_index (mReadIndex + (LONG64)count) && errno != ESRCH)
+         return 0;
+
+      mReadIndex += (LONG64)count;
+      return count;
+   }
+
+   /// Reads the stacktraces of the given records that are not known yet;
+   /// one call per batch of IOV_MAX stack table entries.
+   /// Only published entries are stored; the others are read again for later records.
+   /// Returns the number of stacktraces that were read.
+   SIZE_T fetch_stacktraces (const libLeak::LEAK_EVENT_RECORD* records, SIZE_T count)
+   {
+      std::vector<DWORD> unknown;
+      std::unordered_set<DWORD> requested;
+      for (SIZE_T i = 0; i < count; i++)
+      {
+         const DWORD stackId = records[i].StackId;
+         if (stackId != 0 &&
+            stackId <= mControl.StackTableCapacity &&
+            mStacktraces.find (stackId) == mStacktraces.end () &&
+            requested.insert (stackId).second)
+         {
+            unknown.push_back (stackId);
+         }
+      }
+
+      const uint64_t table = mAddress
+         + sizeof (libLeak::LEAK_SHARED_CONTROL)
+         + (uint64_t)mControl.RingCapacity * sizeof (libLeak::LEAK_RING_SLOT);
+
+      SIZE_T fetched = 0;
+      const size_t batch = IOV_MAX;
+      for (size_t offset = 0; offset < unknown.size (); offset += batch)
+      {
+         const size_t entries = std::min (batch, unknown.size () - offset);
+         std::vector<libLeak::LEAK_STACK_ENTRY> buffer (entries);
+         std::vector<struct iovec> local (entries);
+         std::vector<struct iovec> remote (entries);
+         for (size_t i = 0; i < entries; i++)
+         {
+            local[i] = { &buffer[i], sizeof (libLeak::LEAK_STACK_ENTRY) };
+            remote[i] = { (void*)(uintptr_t)(table + (uint64_t)(unknown[offset + i] - 1) * sizeof (libLeak::LEAK_STACK_ENTRY)), sizeof (libLeak::LEAK_STACK_ENTRY) };
+         }
+
+         const ssize_t expected = (ssize_t)(entries * sizeof (libLeak::LEAK_STACK_ENTRY));
+         if (process_vm_readv (mPid, local.data (), entries, remote.data (), entries, 0) != expected)
+            continue;
+
+         // Entries are published before the records referencing them.
+         for (size_t i = 0; i < entries; i++)
+         {
+            if (buffer[i].State == (LONG)libLeak::StackEntryState::Published)
+            {
+               mStacktraces[unknown[offset + i]] = std::make_unique<libLeak::STACKTRACE> (buffer[i].Stacktrace);
+               fetched++;
+            }
+         }
+      }
+
+      return fetched;
+   }
+
+   /// Returns the stacktrace of the given stack id, or nullptr if it was not read.
+   const libLeak::STACKTRACE* GetStacktrace (DWORD stackId) const
+   {
+      auto entry = mStacktraces.find (stackId);
+      return entry != mStacktraces.end () ? entry->second.get () : nullptr;
+   }
+
+   uint64_t GetLostEvents () const { return (uint64_t)mControl.LostEvents; }
+   uint64_t GetLostStacks () const { return (uint64_t)mControl.LostStacks; }
+
+private:
+   bool read_control ()
+   {
+      struct iovec local = { &mControl, sizeof (mControl) };
+      struct iovec remote = { (void*)(uintptr_t)mAddress, sizeof (mControl) };
+      return process_vm_readv (mPid, &local, 1, &remote, 1, 0) == (ssize_t)sizeof (mControl);
+   }
+
+   bool write_read_index (LONG64 value)
+   {
+      struct iovec local = { &value, sizeof (value) };
+      struct iovec remote = { (void*)(uintptr_t)(mAddress + offsetof (libLeak::LEAK_SHARED_CONTROL, ReadIndex)), sizeof (value) };
+      return process_vm_writev (mPid, &local, 1, &remote, 1, 0) == (ssize_t)sizeof (value);
+   }
+
+   pid_t mPid;
+   uint64_t mAddress;
+   LONG64 mReadIndex;
+   libLeak::LEAK_SHARED_CONTROL mControl;    // Copy of the remote control block
+   std::vector<libLeak::LEAK_RING_SLOT> mSlots;
+   std::unordered_map<DWORD, std::unique_ptr<libLeak::STACKTRACE>> mStacktraces;
+};
+
+///
+/// LeakClient::Private
+///
+class LeakClient::Private
+{
+   friend class ::LeakClient;
+   ::LeakClient* qptr;
+   DWORD pid;
+   std::shared_ptr<SharedRendezvous> ipcRendezvous;
+   std::shared_ptr<RemoteRing> ipcRing;
+   std::vector<libLeak::LEAK_EVENT_RECORD> drain_buffer;
+   uint64_t reported_lost_events;
+   uint64_t reported_lost_stacks;
+
+   Private (LeakClient* q)
+      : qptr(q)
+      , pid(0)
+      , reported_lost_events(0)
+      , reported_lost_stacks(0)
+   {
+   }
+
+   ~Private ()
+   {
+      qptr = nullptr;
+   }
+
+   bool bootstrap (const LEAKCLIENT_SETTINGS& settings)
+   {
+      pid = settings.pid;
+
+      // The library is preloaded by the target process (LD_PRELOAD).
+      if (settings.inject.has_value () && settings.inject.value())
+      {
+         qptr->OnInjectLibraryError (settings.pid);
+         return false;
+      }
+
+      // Events are always published to the ring.
+      if (settings.transport == libLeak::TransportMode::Aggregate)
+      {
+         std::cerr << "The aggregate transport is not supported on Linux." << std::endl;
+         return false;
+      }
+
+      ipcRendezvous = std::make_shared<SharedRendezvous> (libLeak::ReplaceEventName (libLeak::VL_MEMORY_SHARED_CONTROL, pid));
+      ipcRing = std::make_shared<RemoteRing> ();
+
+      if (!ipcRendezvous->create (
+         settings.overflow,
+         libLeak::GetRingCapacity (settings.ring_capacity),
+         libLeak::GetRingCapacity (settings.stack_table_capacity)))
+      {
+         qptr->OnEventCreateError (ipcRendezvous->GetName ());
+         return false;
+      }
+      else
+      {
+         qptr->OnEventCreated (ipcRendezvous->GetName ());
+      }
+
+      // The target process polls for the rendezvous block and confirms the start
+      // once the ring is set up.
+      while (!ipcRendezvous->wait_for_state_timeout (libLeak::RendezvousState::Started, 250))
+      {
+         if (!IsProcessAlive (pid))
+            return false;
+      }
+
+      qptr->OnEventOpened (ipcRendezvous->GetName ());
+
+      if (!ipcRing->open ((pid_t)pid, ipcRendezvous->get ()->ControlAddress))
+      {
+         std::cerr << "Could not read the memory of process " << pid << ": " << strerror (errno) << std::endl;
+         ipcRendezvous->set_state (libLeak::RendezvousState::StopRequested);
+         return false;
+      }
+
+      drain_buffer.resize (4096);
+      qptr->OnProfilingStarted ();
+      return true;
+   }
+
+   bool IsProcessAlive (DWORD pid)
+   {
+      return kill ((pid_t)pid, 0) == 0 || errno == EPERM;
+   }
+
+   ///
+   /// Main loop of the ring transport.
+   /// The remote process is never interrupted. Published records are drained in batches
+   /// once the remote process signals a half-full ring or the drain interval elapsed.
+   ///
+   void mainloop (bool& bExitApplication)
+   {
+      bool remote_process_alive = true;
+
+      const DWORD timeout = 250;
+      const DWORD drain_interval = 10;
+      DWORD idle = 0;
+
+      for (;;)
+      {
+         ipcRendezvous->wait_for_signal_timeout (drain_interval);
+
+         if (drain_ring () > 0)
+         {
+            idle = 0;
+         }
+         else if ((idle += drain_interval) >= timeout)
+         {
+            idle = 0;
+            report_lost_events ();
+            qptr->OnTimeout (timeout);
+
+            remote_process_alive = IsProcessAlive (pid);
+            if (!remote_process_alive)
+               bExitApplication = true;
+         }
+
+         if (bExitApplication)
+            break;
+      }
+
+      // Trigger the signal to stop profiling.
+      if (remote_process_alive)
+      {
+         ipcRendezvous->set_state (libLeak::RendezvousState::StopRequested);
+
+         // Threads of the remote process may be blocked on a full ring.
+         // Keep draining until the stop is confirmed.
+         for (DWORD waited = 0; waited < 10000; waited += drain_interval)
+         {
+            drain_ring ();
+            if (ipcRendezvous->wait_for_state_timeout (libLeak::RendezvousState::Stopped, drain_interval))
+               break;
+         }
+      }
+
+      // Pick up everything that was published before profiling stopped.
+      drain_ring ();
+      report_lost_events ();
+
+      qptr->OnProfilingStopped ();
+   }
+
+private:
+   /// Drains all published records and forwards them in batches.
+   /// Returns the number of drained records.
+   SIZE_T drain_ring ()
+   {
+      SIZE_T total = 0;
+      for (;;)
+      {
+         SIZE_T count = ipcRing->drain (drain_buffer.data (), drain_buffer.size ());
+         if (count == 0)
+            break;
+
+         // The frames are resolved later; the modules they refer to must be known
+         // even if the process has exited by then.
+         if (ipcRing->fetch_stacktraces (drain_buffer.data (), count))
+            RefreshModuleMappings ((HANDLE)(intptr_t)pid);
+
+         qptr->OnRecords (pid, drain_buffer.data (), count);
+         total += count;
+
+         if (count < drain_buffer.size ())
+            break;
+      }
+
+      return total;
+   }
+
+   /// Notifies about events and stacktraces that were dropped by the remote process.
+   void report_lost_events ()
+   {
+      uint64_t lost = ipcRing->GetLostEvents ();
+      if (lost != reported_lost_events)
+      {
+         reported_lost_events = lost;
+         qptr->OnEventsLost (lost);
+      }
+
+      lost = ipcRing->GetLostStacks ();
+      if (lost != reported_lost_stacks)
+      {
+         reported_lost_stacks = lost;
+         qptr->OnStacksLost (lost);
+      }
+   }
+
+   /// Returns the stacktrace published by the remote process for the given stack id.
+   const libLeak::STACKTRACE* GetStacktrace (DWORD stackId) const
+   {
+      return ipcRing ? ipcRing->GetStacktrace (stackId) : nullptr;
+   }
+
+   /// Returns the file name of the preloaded LeakDetect library.
+   std::string GetLeakDetectFileName ()
+   {
+      return "libLeakDetect.so";
+   }
+};
+
+///
+/// LeakClient
+///
+LeakClient::LeakClient ()
+   : mPrivate (new Private(this))
+{
+}
+
+LeakClient::~LeakClient ()
+{
+   delete mPrivate;
+   mPrivate = nullptr;
+}
+
+bool LeakClient::bootstrap (const LEAKCLIENT_SETTINGS& settings)
+{
+   return mPrivate->bootstrap (settings);
+}
+
+void LeakClient::run_mainloop (bool& bExitApplication)
+{
+   mPrivate->mainloop (bExitApplication);
+}
+
+std::string LeakClient::GetLeakDetectFileName () const
+{
+   return mPrivate->GetLeakDetectFileName ();
+}
+
+const libLeak::STACKTRACE* LeakClient::GetStacktrace (DWORD stackId) const
+{
+   return mPrivate->GetStacktrace (stackId);
+}
@@ -2,148 +2,146 @@
 
 // Forward to Stacktrace.cpp
 HRESULT CaptureStackTraceWithSymbols (
-   __in HANDLE RemoteProcess,
-   __in CONST libLeak::PSTACKTRACE StackTrace,
+   _In_ HANDLE RemoteProcess,
+   _In_ const libLeak::PSTACKTRACE StackTrace,
    std::vector<libLeak::SYMBOL_ENTRY>& SymbolStackTrace);
 
-DWORD WINAPI QueuedBackendThread (LPVOID lpParameter)
-{
-   return static_cast<QueuedBackend*>(lpParameter)->QueuedBackendThread ();
-}
-
 QueuedBackend::QueuedBackend ()
 {
-   InitializeCriticalSection (&csThreading);
 }
 
 QueuedBackend::~QueuedBackend ()
 {
-   DeleteCriticalSection (&csThreading);
 }
 
 void QueuedBackend::join ()
 {
-   if (hThread == NULL)
+   if (!thread.joinable ())
       return;
 
-   // Interrupt the thread.
-   if (hThreadInterruptEvent)
+   // Hand the spilled events over to the thread.
+   while (!flush_spill_queue ())
    {
-      // Synchronize all pending events to the thread.
-      while (synchronize_queue (true))
-      {
-         // Notify the thread.
-         interrupt_thread ();
-      }
-
-      // Now make sure the thread picked up all elements.
-      while (true)
-      {
-         EnterCriticalSection (&csThreading);
-         bool empty = event_queue_thread.size() == 0;
-         LeaveCriticalSection (&csThreading);
-
-         if (empty) 
-            break;
-         else
-         {
-            Sleep (100);
-            continue;
-         }
-      }
+      interrupt_thread ();
+      std::this_thread::yield ();
+   }
 
-      // Now; all elements were picked up by the thread.
-      // Signal the thread to finish work and exit.
-      EnterCriticalSection (&csThreading);
+   // Now; all events are queued.
+   // Signal the thread to finish work and exit; it drains the queue first.
+   {
+      const std::lock_guard<std::mutex> lock (csThreading);
       bThreadExitRequested = true;
-      LeaveCriticalSection (&csThreading);
+   }
 
-      // Perform interrupt.
-      SetEvent (hThreadInterruptEvent);
+   // Perform interrupt.
+   interrupt_thread ();
 
-      // Wait for the thread to exit.
-      // That should be the case the thread is signalled. An internal error most likely
-      // means that the thread is exited already.
-      WaitForSingleObject (hThread, INFINITE);
+   // Wait for the thread to exit.
+   thread.join ();
 
-      // Close interrupt event handle.
-      CloseHandle (hThreadInterruptEvent);
-      hThreadInterruptEvent = NULL;
-   }
-   else
+   // All batches were processed by now.
    {
-      // For some reason our interrupt event is corrupt.
-      // Make sure to terminate the thread by now.
-      TerminateThread (hThread, 0);
+      const std::lock_guard<std::mutex> lock (csSymbolizer);
+      bSymbolizerExitRequested = true;
    }
-      
-   // Close thread handle.
-   CloseHandle (hThread);
-   hThread = NULL;
+
+   cvSymbolizerBatch.notify_all ();
+   for (auto& symbolizer : symbolizer_threads)
+      symbolizer.join ();
+
+   symbolizer_threads.clear ();
 }
 
-void QueuedBackend::initialize (DWORD pid)
+void QueuedBackend::SetSymbolizerThreads (DWORD count)
 {
-   last_queue_push = std::chrono::steady_clock::now ();
+   symbolizer_count = count;
+}
 
-   // We must confirm that the thread is running and available
-   // when leaving this function.
-   while (hThreadStartedEvent == NULL || hThreadInterruptEvent == NULL)
-   {
-      if (hThreadStartedEvent == NULL)
-      {
-         hThreadStartedEvent = CreateEvent (NULL, FALSE, FALSE, NULL);
-         if (hThreadStartedEvent == NULL) 
-            Sleep (100);
-      }
-      
-      if (hThreadInterruptEvent == NULL)
-      {
-         hThreadInterruptEvent = CreateEvent (NULL, FALSE, FALSE, NULL);
-         if (hThreadInterruptEvent == NULL) 
-            Sleep (100);
-      }
-   }
+void QueuedBackend::SetDeferredSymbols (bool deferred)
+{
+   bDeferredSymbols = deferred;
+}
+
+void QueuedBackend::SetQueueCapacity (DWORD capacity, bool spill)
+{
+   queue_capacity = capacity;
+   bQueueSpill = spill;
+}
 
-   // Thread creation must succeed.
-   while (hThread == NULL)
+QUEUE_STATISTICS QueuedBackend::GetQueueStatistics () const
+{
+   QUEUE_STATISTICS statistics{ 0 };
+   if (event_queue)
    {
-      hThread = CreateThread (NULL, 0, ::QueuedBackendThread, (LPVOID)this, 0, NULL);
-      if (hThread == NULL) Sleep (100);
+      statistics.Capacity = event_queue->capacity ();
+      statistics.Depth = event_queue->depth ();
+      statistics.HighWater = event_queue->high_water ();
    }
 
-   // Wait for the thread to signal us.
-   while (WAIT_OBJECT_0 != WaitForSingleObject (hThreadStartedEvent, INFINITE))
-      Sleep (100);
+   statistics.Spilled = queue_spilled.load (std::memory_order_relaxed);
+   statistics.Blocked = queue_blocked.load (std::memory_order_relaxed);
+   return statistics;
+}
+
+void QueuedBackend::initialize (DWORD pid)
+{
+   event_queue = std::make_unique<EventQueue<LEAKEVENT>> (queue_capacity);
 
-   // Close the handle.
-   CloseHandle (hThreadStartedEvent);
-   hThreadStartedEvent = NULL;
+   for (DWORD i = 0; i < symbolizer_count && !bDeferredSymbols; i++)
+      symbolizer_threads.emplace_back (&QueuedBackend::SymbolizerThread, this);
+
+   // Interrupts are remembered until the thread waits for them;
+   // no need to wait for the thread to be started.
+   thread = std::thread (&QueuedBackend::QueuedBackendThread, this);
 
    OnInitialized (pid);
 }
 
+libLeak::PALLOCATION_EVENT QueuedBackend::create_allocation ()
+{
+   return allocation_pool.acquire ();
+}
+
+libLeak::PDELLOCATION_EVENT QueuedBackend::create_deallocation ()
+{
+   return deallocation_pool.acquire ();
+}
+
+libLeak::PAGGREGATE_EVENT QueuedBackend::create_aggregate ()
+{
+   return aggregate_pool.acquire ();
+}
+
 /// Called synchronously for each allocation event.
 /// Make sure to not do any heavy operation in this routine.
 void QueuedBackend::push (_In_ libLeak::PALLOCATION_EVENT event)
 {
-   event_queue.push_back ({event, NULL});
-   update_queue ();
+   enqueue ({event, NULL});
 }
 
 /// Called synchronously for each deallocation event.
 /// Make sure to not do any heavy operation in this routine.
 void QueuedBackend::push (_In_ libLeak::PDELLOCATION_EVENT event)
 {
-   event_queue.push_back ({NULL, event});
-   update_queue ();
+   enqueue ({NULL, event});
+}
+
+/// Called periodically with the counters of a stacktrace (aggregate transport).
+/// Make sure to not do any heavy operation in this routine.
+void QueuedBackend::push (_In_ libLeak::PAGGREGATE_EVENT event)
+{
+   enqueue ({NULL, NULL, event});
 }
 
 /// Called synchronously for each timeout event.
 /// The remote process is in IDLE state at this point.
 void QueuedBackend::signal_timeout ()
 {
-   update_queue (true);
+   if (!spill_queue.empty ())
+   {
+      flush_spill_queue ();
+      wake_thread ();
+   }
 }
 
 void QueuedBackend::SetRemoteProcessHandle (HANDLE handle) 
@@ -152,88 +150,231 @@ void QueuedBackend::SetRemoteProcessHandle (HANDLE handle)
 }
 
 
-DWORD QueuedBackend::QueuedBackendThread ()
+void QueuedBackend::QueuedBackendThread ()
 {
-   // Notify the main thread that we are ready.
-   SetEvent (hThreadStartedEvent);
-
+   // Keeps its capacity between the batches.
+   std::vector<LEAKEVENT> events;
    for (;;)
    {
-      // Wait for interrupt.
-      if (WaitForSingleObject (hThreadInterruptEvent, INFINITE) != WAIT_OBJECT_0)
+      // Wait for events or an interrupt.
+      bool finished = false;
       {
-         // If waiting infinite is not possible, break out of this thread function
-         // to avoid processing infinite for nothing.
-         break;
-      }
+         std::unique_lock<std::mutex> lock (csThreading);
 
-      std::vector<LEAKEVENT> events;
-      EnterCriticalSection (&csThreading);
-      {
-         event_queue_thread.swap (events);
+         // Pairs with the fence in wake_thread; either the client sees the flag
+         // or this thread sees the event.
+         bThreadWaiting.store (true, std::memory_order_relaxed);
+         std::atomic_thread_fence (std::memory_order_seq_cst);
+
+         cvThreadInterrupt.wait_for (lock, std::chrono::milliseconds (100), [this] { return bThreadInterrupted || !event_queue->empty (); });
+         bThreadWaiting.store (false, std::memory_order_relaxed);
+         bThreadInterrupted = false;
+
+         // The exit is requested once all events were queued.
+         finished = bThreadExitRequested;
       }
-      LeaveCriticalSection (&csThreading);
+
+      // Take all events queued so far.
+      LEAKEVENT event;
+      while (event_queue->try_pop (event))
+         events.push_back (std::move (event));
 
       // Process the events..
-      for (auto& event : events)
-         OnProcessEventInternal (event);
+      ProcessEvents (events);
+      ReleaseEvents (events);
+      events.clear ();
 
-      if (bThreadExitRequested &&
-         event_queue_thread.size () == 0 &&
-         event_queue.size () == 0)
-      {
+      OnQueueProcessed (finished);
+
+      if (finished)
          break;
+   }
+}
+
+void QueuedBackend::SymbolizerThread ()
+{
+   std::shared_ptr<SYMBOLIZE_BATCH> processed;
+   for (;;)
+   {
+      // Wait for the next batch.
+      std::shared_ptr<SYMBOLIZE_BATCH> batch;
+      {
+         std::unique_lock<std::mutex> lock (csSymbolizer);
+         cvSymbolizerBatch.wait (lock, [&] { return bSymbolizerExitRequested || symbolize_batch != processed; });
+         if (bSymbolizerExitRequested)
+            break;
+
+         batch = symbolize_batch;
       }
+
+      while (SymbolizeNext (*batch))
+         ;
+
+      processed = batch;
    }
-   return 0;
 }
 
-void QueuedBackend::OnProcessEventInternal (LEAKEVENT& event)
+/// Grab symbolic information for allocations..
+/// Stacks shared by the remote process are symbolized once per stack id,
+/// other stacks once per hash of their frames.
+bool QueuedBackend::RequiresSymbols (const LEAKEVENT& event)
 {
-   // Grab symbolic information for allocations..
+   if (bDeferredSymbols)
+      return false;
+
    if (event.allocation)
+      return event.allocation->StackId == 0
+         ? symbolized_stacktraces.insert (libLeak::CreateUniqueId (event.allocation->Stacktrace)).second
+         : symbolized_stack_ids.insert (event.allocation->StackId).second;
+
+   if (event.aggregate)
+      return symbolized_stack_ids.insert (event.aggregate->StackId).second;
+
+   return false;
+}
+
+/// Resolves the symbols of the next unclaimed event of the batch.
+/// Returns false if all events of the batch were claimed.
+bool QueuedBackend::SymbolizeNext (SYMBOLIZE_BATCH& batch)
+{
+   const size_t index = batch.next.fetch_add (1);
+   if (index >= batch.pending.size ())
+      return false;
+
+   LEAKEVENT& event = *batch.pending[index];
+   CaptureStackTraceWithSymbols (
+      hRemoteProcess, 
+      event.allocation ? &event.allocation->Stacktrace : &event.aggregate->Stacktrace, 
+      event.symbols);
+
+   batch.resolved[index].store (true, std::memory_order_release);
+   cvSymbolizerResolved.notify_all ();
+   return true;
+}
+
+///
+/// Resolves the symbols of the events with the symbolizer threads and passes the events
+/// to OnProcessEvent in their original order.
+/// The queue thread resolves symbols as well while it waits for the next event in order.
+///
+void QueuedBackend::ProcessEvents (std::vector<LEAKEVENT>& events)
+{
+   // Decide which events carry the symbols; the first event of a stack id in order.
+   auto batch = std::make_shared<SYMBOLIZE_BATCH> ();
+   std::vector<size_t> pending_index (events.size (), SIZE_MAX);
+   for (size_t i = 0; i < events.size (); i++)
+   {
+      if (RequiresSymbols (events[i]))
+      {
+         pending_index[i] = batch->pending.size ();
+         batch->pending.push_back (&events[i]);
+      }
+   }
+
+   batch->resolved.reset (new std::atomic<bool>[batch->pending.size ()]);
+   for (size_t i = 0; i < batch->pending.size (); i++)
+      batch->resolved[i] = false;
+
+   if (batch->pending.size () > 1 && symbolizer_threads.size ())
    {
-      CaptureStackTraceWithSymbols (
-         hRemoteProcess, 
-         &event.allocation->Stacktrace, 
-         event.symbols);
+      const std::lock_guard<std::mutex> lock (csSymbolizer);
+      symbolize_batch = batch;
+      cvSymbolizerBatch.notify_all ();
+   }
+
+   for (size_t i = 0; i < events.size (); i++)
+   {
+      const size_t index = pending_index[i];
+      while (index != SIZE_MAX && !batch->resolved[index].load (std::memory_order_acquire))
+      {
+         // Help the symbolizer threads instead of waiting.
+         if (SymbolizeNext (*batch))
+            continue;
+
+         // The event is resolved by a symbolizer thread right now.
+         std::unique_lock<std::mutex> lock (csSymbolizer);
+         cvSymbolizerResolved.wait_for (lock, std::chrono::milliseconds (1));
+      }
+
+      OnProcessEvent (events[i]);
    }
-   OnProcessEvent (event);
 }
 
-void QueuedBackend::update_queue (bool force)
+/// Returns the events of a processed batch to the pools.
+void QueuedBackend::ReleaseEvents (const std::vector<LEAKEVENT>& events)
 {
-   if (synchronize_queue (force))
+   for (const LEAKEVENT& event : events)
    {
-      interrupt_thread ();
+      if (event.allocation)
+         released_allocations.push_back (event.allocation);
+      else if (event.deallocation)
+         released_deallocations.push_back (event.deallocation);
+      else if (event.aggregate)
+         released_aggregates.push_back (event.aggregate);
    }
+
+   allocation_pool.release (released_allocations);
+   deallocation_pool.release (released_deallocations);
+   aggregate_pool.release (released_aggregates);
 }
 
-bool QueuedBackend::synchronize_queue (bool force)
+///
+/// Hands an event over to the queue thread.
+/// If the queue is full, the client waits for the queue thread or spills the event.
+/// Spilled events are queued before any later event, so the order is preserved.
+///
+void QueuedBackend::enqueue (LEAKEVENT&& event)
 {
-   if (event_queue.size () == 0)
-      return false;
+   if (!flush_spill_queue ())
+   {
+      spill_queue.push_back (std::move (event));
+      queue_spilled.fetch_add (1, std::memory_order_relaxed);
+      return;
+   }
 
-   auto now = std::chrono::steady_clock::now ();
-   if (force || std::chrono::duration_cast<std::chrono::milliseconds> (now - last_queue_push).count () >= 5000)
+   if (!event_queue->try_push (event))
    {
-      EnterCriticalSection (&csThreading);
+      if (bQueueSpill)
+      {
+         spill_queue.push_back (std::move (event));
+         queue_spilled.fetch_add (1, std::memory_order_relaxed);
+         interrupt_thread ();
+         return;
+      }
 
-      for (const auto& entry : event_queue)
-         event_queue_thread.push_back (entry);
+      // Backpressure; with the ring transport the remote process waits for the ring in turn.
+      queue_blocked.fetch_add (1, std::memory_order_relaxed);
+      interrupt_thread ();
+      while (!event_queue->try_push (event))
+         std::this_thread::yield ();
+   }
 
-      event_queue.clear ();
-      event_queue.shrink_to_fit ();
-      last_queue_push = std::chrono::steady_clock::now ();
+   wake_thread ();
+}
 
-      LeaveCriticalSection (&csThreading);
-      return true;
-   }
+/// Moves the spilled events to the queue; returns false if some are left.
+bool QueuedBackend::flush_spill_queue ()
+{
+   while (!spill_queue.empty () && event_queue->try_push (spill_queue.front ()))
+      spill_queue.pop_front ();
 
-   return false;
+   return spill_queue.empty ();
+}
+
+/// Interrupts the queue thread if it waits for events.
+void QueuedBackend::wake_thread ()
+{
+   std::atomic_thread_fence (std::memory_order_seq_cst);
+   if (bThreadWaiting.load (std::memory_order_relaxed))
+      interrupt_thread ();
 }
 
 void QueuedBackend::interrupt_thread ()
 {
-   SetEvent (hThreadInterruptEvent);
+   {
+      const std::lock_guard<std::mutex> lock (csThreading);
+      bThreadInterrupted = true;
+   }
+
+   cvThreadInterrupt.notify_one ();
 }
@@ -1,27 +1,81 @@
 #pragma once
 #include "libLeak.h"
 #include "LeakBackend.h"
+#include "EventPool.h"
+#include "EventQueue.h"
 
+#include <mutex>
+#include <atomic>
 #include <chrono>
+#include <memory>
+#include <thread>
+#include <deque>
 #include <vector>
+#include <condition_variable>
+#include <unordered_set>
 
+/// A queued event.
+/// 'symbols' is only resolved for the first allocation or aggregate of a known stack id,
+/// subsequent events with the same stack id leave it empty. It is always empty
+/// if symbols are deferred.
 typedef struct LEAKEVENT_ {
    libLeak::PALLOCATION_EVENT allocation;
    libLeak::PDELLOCATION_EVENT deallocation;
+   libLeak::PAGGREGATE_EVENT aggregate;
    std::vector<libLeak::SYMBOL_ENTRY> symbols;
 } LEAKEVENT, *PLEAKEVENT;
 
+/// Counters of the queue between the client and the queue thread.
+typedef struct QUEUE_STATISTICS_ {
+   uint64_t Capacity;                     // Number of slots
+   uint64_t Depth;                        // Events in the queue
+   uint64_t HighWater;                    // Largest number of events in the queue
+   uint64_t Spilled;                      // Events stored in the spill buffer since the queue was full
+   uint64_t Blocked;                      // Events the client waited for since the queue was full
+} QUEUE_STATISTICS, *PQUEUE_STATISTICS;
+
+/// Events of a processed batch whose symbols are resolved by the symbolizer threads.
+typedef struct SYMBOLIZE_BATCH_ {
+   std::vector<PLEAKEVENT> pending;                      // Events that require symbols
+   std::unique_ptr<std::atomic<bool>[]> resolved;        // Per pending event
+   std::atomic<size_t> next{0};                          // Next pending event to be claimed
+} SYMBOLIZE_BATCH, *PSYMBOLIZE_BATCH;
+
 class QueuedBackend : public LeakBackend
 {
+public:
+   static constexpr DWORD DefaultQueueCapacity = 65536;
+
+private:
    HANDLE hRemoteProcess = NULL;
-   HANDLE hThread = NULL;
-   HANDLE hThreadStartedEvent = NULL;
-   HANDLE hThreadInterruptEvent = NULL;
-   CRITICAL_SECTION csThreading;
+   std::thread thread;
+   std::mutex csThreading;
+   std::condition_variable cvThreadInterrupt;
+   bool bThreadInterrupted = false;
    bool bThreadExitRequested = false;
-   std::vector<LEAKEVENT> event_queue;
-   std::vector<LEAKEVENT> event_queue_thread;
-   std::chrono::steady_clock::time_point last_queue_push;
+   std::atomic<bool> bThreadWaiting{ false };           // The queue thread waits for an interrupt
+   std::unique_ptr<EventQueue<LEAKEVENT>> event_queue;
+   std::deque<LEAKEVENT> spill_queue;                   // Client thread only
+   DWORD queue_capacity = DefaultQueueCapacity;
+   bool bQueueSpill = false;
+   std::atomic<uint64_t> queue_spilled{ 0 };
+   std::atomic<uint64_t> queue_blocked{ 0 };
+   std::unordered_set<uint32_t> symbolized_stack_ids;
+   std::unordered_set<uint64_t> symbolized_stacktraces;    // Frame hashes of events without stack id
+   DWORD symbolizer_count = 0;
+   std::vector<std::thread> symbolizer_threads;
+   std::mutex csSymbolizer;
+   std::condition_variable cvSymbolizerBatch;           // A batch was published or the exit is requested
+   std::condition_variable cvSymbolizerResolved;        // An event of the current batch was resolved
+   std::shared_ptr<SYMBOLIZE_BATCH> symbolize_batch;
+   bool bSymbolizerExitRequested = false;
+   bool bDeferredSymbols = false;
+   EventPool<libLeak::ALLOCATION_EVENT> allocation_pool;
+   EventPool<libLeak::DELLOCATION_EVENT> deallocation_pool;
+   EventPool<libLeak::AGGREGATE_EVENT> aggregate_pool;
+   std::vector<libLeak::PALLOCATION_EVENT> released_allocations;      // Queue thread only
+   std::vector<libLeak::PDELLOCATION_EVENT> released_deallocations;   // Queue thread only
+   std::vector<libLeak::PAGGREGATE_EVENT> released_aggregates;        // Queue thread only
 
 public:
    QueuedBackend ();
@@ -33,6 +87,12 @@ public:
    /// Called as soon as the program is initialized.
    virtual void initialize (DWORD pid) override;
 
+   /// Returns a zeroed event of the pools; recycled once the event was processed.
+   /// Must be called by the thread that pushes the events.
+   virtual libLeak::PALLOCATION_EVENT create_allocation () override;
+   virtual libLeak::PDELLOCATION_EVENT create_deallocation () override;
+   virtual libLeak::PAGGREGATE_EVENT create_aggregate () override;
+
    /// Called synchronously for each allocation event.
    /// Make sure to not do any heavy operation in this routine.
    virtual void push (_In_ libLeak::PALLOCATION_EVENT event) override;
@@ -41,6 +101,10 @@ public:
    /// Make sure to not do any heavy operation in this routine.
    virtual void push (_In_ libLeak::PDELLOCATION_EVENT event) override;
 
+   /// Called periodically with the counters of a stacktrace (aggregate transport).
+   /// Make sure to not do any heavy operation in this routine.
+   virtual void push (_In_ libLeak::PAGGREGATE_EVENT event) override;
+
    /// Called synchronously for each timeout event.
    /// The remote process is in IDLE state at this point.
    virtual void signal_timeout () override;
@@ -48,18 +112,51 @@ public:
    /// Updates the current remote process handle to the symbol backend engine.
    virtual void SetRemoteProcessHandle (HANDLE handle) override;
 
+   /// Sets the number of threads that resolve symbols in parallel to the queue thread.
+   /// The queue thread still writes the events in order. Must be called before initialize.
+   void SetSymbolizerThreads (DWORD count);
+
+   /// Leaves the symbols of all events unresolved; the raw frames are resolved
+   /// after the session (LeakConverter). Must be called before initialize.
+   void SetDeferredSymbols (bool deferred);
+
+   /// Sets the number of events the queue holds. If the queue is full, the client
+   /// waits for the queue thread, unless spilling is enabled: the events are kept in
+   /// an unbounded buffer then. Must be called before initialize.
+   void SetQueueCapacity (DWORD capacity, bool spill);
+
+   /// Returns the counters of the queue.
+   QUEUE_STATISTICS GetQueueStatistics () const;
+
    /// Threaded queue.
-   DWORD QueuedBackendThread ();
+   void QueuedBackendThread ();
+
+   /// Symbolizer thread.
+   void SymbolizerThread ();
 
 protected:
    virtual void OnInitialized (DWORD pid) = 0;
    virtual void OnProcessEvent (const LEAKEVENT& event) = 0;
 
+   /// Called by the queue thread after each processed batch of events.
+   /// 'finished' is set for the last call before the thread exits.
+   virtual void OnQueueProcessed (bool finished) { (void)finished; }
+
+   /// Wakes up the queue thread, even if no events are pending.
+   void interrupt_thread ();
+
+   bool IsDeferredSymbols () const { return bDeferredSymbols; }
+
+   HANDLE GetRemoteProcessHandle () const { return hRemoteProcess; }
+
 private:
-   void OnProcessEventInternal (LEAKEVENT& event);
+   void ProcessEvents (std::vector<LEAKEVENT>& events);
+   bool RequiresSymbols (const LEAKEVENT& event);
+   bool SymbolizeNext (SYMBOLIZE_BATCH& batch);
+   void ReleaseEvents (const std::vector<LEAKEVENT>& events);
 
 private:
-   void update_queue (bool force = false);
-   bool synchronize_queue (bool force = false);
-   void interrupt_thread ();
+   void enqueue (LEAKEVENT&& event);
+   bool flush_spill_queue ();
+   void wake_thread ();
 };
@@ -1,21 +1,62 @@
 #include "QueuedFilesystemBackend.h"
 #include "LeakFileStream.h"
+#include "StacktraceIds.h"
 
+#include <map>
+#include <cmath>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <iterator>
 #include <filesystem>
-#include <unordered_set>
+#include <unordered_map>
 
 /// Assuming this is declared somewhere.
 extern void LogMessage (const std::string& message);
 
+// Forward to Stacktrace.cpp
+HRESULT CaptureStackTraceWithSymbols (
+   _In_ HANDLE RemoteProcess,
+   _In_ const libLeak::PSTACKTRACE StackTrace,
+   std::vector<libLeak::SYMBOL_ENTRY>& SymbolStackTrace);
+
+// Forward to Stacktrace.cpp
+HRESULT EnumerateModules (
+   _In_ HANDLE RemoteProcess,
+   std::vector<libLeak::MODULE_ENTRY>& Modules);
+
 class QueuedFilesystemBackend::Private
 {
    friend class ::QueuedFilesystemBackend;
    
-   std::unordered_set<uint32_t> known_stacktraces;
+   libLeak::StacktraceIds stacktrace_ids;
    std::shared_ptr<libLeak::LeakFileStream> writer;
+   uint64_t sampling_interval;
+   bool deferred_symbols;
+   bool event_columns;
+   std::map<uint64_t, libLeak::MODULE_ENTRY> written_modules;        // base address -> module
+
+   /// Outstanding allocation in snapshot mode.
+   struct LIVE_ALLOCATION {
+      uint64_t stacktrace_id;
+      size_t size;
+   };
+
+   std::unordered_map<intptr_t, LIVE_ALLOCATION> live_allocations;    // pointer -> allocation
+   std::chrono::steady_clock::time_point last_snapshot;
+   std::atomic<bool> snapshot_requested;
+   uint32_t snapshot_interval;                                       // seconds, 0 if disabled
+   uint32_t snapshot_id;
+   bool snapshot_dirty;
 
    Private ()
+      : sampling_interval(0)
+      , deferred_symbols(false)
+      , event_columns(false)
+      , snapshot_requested(false)
+      , snapshot_interval(0)
+      , snapshot_id(0)
+      , snapshot_dirty(false)
    {
    }
 
@@ -40,6 +81,7 @@ class QueuedFilesystemBackend::Private
       if (0 == fopen_s (&fp, p.string().c_str (), "wb"))
       {
          writer = std::make_shared<libLeak::LeakFileStream> (fp);
+         writer->SetEventColumns (event_columns);
       }
       else
       {
@@ -56,29 +98,203 @@ class QueuedFilesystemBackend::Private
       writer->WriteSession (
          pid, 
          std::chrono::duration_cast<std::chrono::seconds>(
-            std::chrono::system_clock::now ().time_since_epoch ()).count ());
+            std::chrono::system_clock::now ().time_since_epoch ()).count (),
+         sampling_interval);
    }
 
-   void WriteEvent (const LEAKEVENT& event)
+   void WriteEvent (const LEAKEVENT& event, HANDLE process)
    {
       if (event.allocation != NULL)
       {
-         // Write unique stacktraces once..
-         uint32_t stacktrace_id = libLeak::CreateUniqueId (event.symbols);
-         if (known_stacktraces.find (stacktrace_id) == known_stacktraces.end ())
+         const uint64_t stacktrace_id = WriteStacktraceOnce (
+            process,
+            event.allocation->StackId, 
+            event.allocation->Stacktrace, 
+            event.symbols, 
+            event.allocation->TimestampEpochSeconds);
+
+         if (IsSnapshotMode ())
+         {
+            // Only remember the allocation; it is written with the next snapshot.
+            // A reallocated block is attributed to the stacktrace that resized it.
+            if (event.allocation->PreviousPointer != 0)
+               live_allocations.erase (event.allocation->PreviousPointer);
+
+            live_allocations[event.allocation->Pointer] = { stacktrace_id, event.allocation->Size };
+            snapshot_dirty = true;
+         }
+         else if (event.allocation->PreviousPointer != 0)
+         {
+            // Serialize the reallocation..
+            writer->WriteReallocation (stacktrace_id, event.allocation);
+         }
+         else
          {
-            writer->WriteStacktrace (stacktrace_id, event.symbols, event.allocation->TimestampEpochSeconds);
-            known_stacktraces.insert (stacktrace_id);
+            // Serialize the allocation..
+            writer->WriteAllocation (stacktrace_id, event.allocation);
          }
+      }
+      else if (event.aggregate != NULL)
+      {
+         const uint64_t stacktrace_id = WriteStacktraceOnce (
+            process,
+            event.aggregate->StackId, 
+            event.aggregate->Stacktrace, 
+            event.symbols, 
+            event.aggregate->TimestampEpochSeconds);
 
-         // Serialize the allocation..
-         writer->WriteAllocation (stacktrace_id, event.allocation);
+         // Serialize the counters..
+         writer->WriteAggregate (stacktrace_id, event.aggregate);
       }
       else if (event.deallocation != NULL)
       {
-         // Serialize the deallocation..
-         writer->WriteDeallocation (event.deallocation);
+         if (IsSnapshotMode ())
+         {
+            snapshot_dirty |= live_allocations.erase (event.deallocation->Pointer) != 0;
+         }
+         else
+         {
+            // Serialize the deallocation..
+            writer->WriteDeallocation (event.deallocation);
+         }
+      }
+   }
+
+   /// Returns the stacktrace id of the given raw frames and writes the stacktrace if it is new;
+   /// with its symbols, or preceded by the modules of its frames if symbols are deferred.
+   uint64_t WriteStacktraceOnce (
+      HANDLE process, 
+      uint32_t stack_id, 
+      const libLeak::STACKTRACE& stacktrace, 
+      const std::vector<libLeak::SYMBOL_ENTRY>& symbols, 
+      uint64_t ts)
+   {
+      bool added = false;
+      const uint64_t collisions = stacktrace_ids.collisions ();
+      const uint64_t stacktrace_id = stacktrace_ids.get (stack_id, stacktrace, added);
+      if (!added)
+         return stacktrace_id;
+
+      if (stacktrace_ids.collisions () != collisions)
+         LogMessage ("Stacktrace id collision, rehashed to " + std::to_string (stacktrace_id));
+
+      // Write unique stacktraces once..
+      if (deferred_symbols)
+      {
+         WriteModulesOnce (process, stacktrace, ts);
+         writer->WriteRawStacktrace (stacktrace_id, stacktrace, ts);
       }
+      else if (symbols.empty ())
+      {
+         // Only resolved for the first event of a frame hash; it collided.
+         std::vector<libLeak::SYMBOL_ENTRY> resolved;
+         CaptureStackTraceWithSymbols (process, const_cast<libLeak::PSTACKTRACE> (&stacktrace), resolved);
+         writer->WriteStacktrace (stacktrace_id, resolved, ts);
+      }
+      else
+      {
+         writer->WriteStacktrace (stacktrace_id, symbols, ts);
+      }
+
+      return stacktrace_id;
+   }
+
+   /// Writes the modules of the remote process if a frame is not part of a written module.
+   /// A module loaded at the base address of a written module replaces it.
+   void WriteModulesOnce (HANDLE process, const libLeak::STACKTRACE& stacktrace, uint64_t ts)
+   {
+      bool complete = true;
+      for (UINT i = 0; i < stacktrace.FrameCount && i < (UINT)libLeak::MaximumStackTraceFrames && complete; i++)
+      {
+         const uint64_t address = (uint64_t)stacktrace.Frames[i];
+         if (address == 0)
+            break;
+
+         auto module = written_modules.upper_bound (address);
+         if (module == written_modules.begin ())
+            complete = false;
+         else
+            complete = address < std::prev (module)->second.base + std::prev (module)->second.size;
+      }
+
+      if (complete)
+         return;
+
+      std::vector<libLeak::MODULE_ENTRY> modules;
+      EnumerateModules (process, modules);
+      for (const auto& module : modules)
+      {
+         auto written = written_modules.find (module.base);
+         if (written != written_modules.end () && 
+            written->second.path == module.path && 
+            written->second.size == module.size)
+         {
+            continue;
+         }
+
+         // Modules unloaded since they were written.
+         auto overlapping = written_modules.lower_bound (module.base);
+         if (overlapping != written_modules.begin () && 
+            std::prev (overlapping)->second.base + std::prev (overlapping)->second.size > module.base)
+         {
+            --overlapping;
+         }
+
+         while (overlapping != written_modules.end () && overlapping->second.base < module.base + module.size)
+            overlapping = written_modules.erase (overlapping);
+
+         writer->WriteModule (module, ts);
+         written_modules[module.base] = module;
+      }
+   }
+
+   bool IsSnapshotMode () const
+   {
+      return snapshot_interval != 0;
+   }
+
+   /// Writes a snapshot if it was requested, the interval elapsed or the session ends.
+   /// Snapshots are only written on elapsed intervals if the outstanding allocations changed.
+   void UpdateSnapshot (bool finished)
+   {
+      if (!writer || !IsSnapshotMode ())
+         return;
+
+      const auto now = std::chrono::steady_clock::now ();
+      const bool requested = snapshot_requested.exchange (false);
+      const bool elapsed = snapshot_dirty && 
+         std::chrono::duration_cast<std::chrono::seconds> (now - last_snapshot).count () >= snapshot_interval;
+
+      if (!requested && !elapsed && !finished)
+         return;
+
+      // Aggregate the outstanding allocations per stacktrace. Sampled allocations are
+      // weighted, so the snapshot estimates all outstanding allocations.
+      std::map<uint64_t, std::pair<double, double>> aggregated;                 // stacktrace id -> (count, bytes)
+      for (const auto& allocation : live_allocations)
+      {
+         const double weight = libLeak::GetSamplingWeight (allocation.second.size, sampling_interval);
+         auto& entry = aggregated[allocation.second.stacktrace_id];
+         entry.first += weight;
+         entry.second += weight * (double)allocation.second.size;
+      }
+
+      std::vector<libLeak::LeakObjectSnapshotEntry> entries;
+      entries.reserve (aggregated.size ());
+      for (const auto& entry : aggregated)
+         entries.push_back ({ entry.first, (uint64_t)llround (entry.second.first), (uint64_t)llround (entry.second.second) });
+
+      writer->WriteSnapshot (
+         ++snapshot_id, 
+         entries, 
+         std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now ().time_since_epoch ()).count ());
+
+      last_snapshot = now;
+      snapshot_dirty = false;
+      LogMessage ("Snapshot " + std::to_string (snapshot_id) + ": " + 
+         std::to_string (live_allocations.size ()) + " outstanding allocations of " +
+         std::to_string (entries.size ()) + " stacktraces");
    }
 
    // Get current date/time, format is YYYY-MM-DD.HH:mm
@@ -94,12 +310,17 @@ class QueuedFilesystemBackend::Private
 
    static std::filesystem::path GetSessionDirectory (DWORD pid)
    {
+#ifdef _WIN32
       wchar_t path[MAX_PATH];
       memset (path, 0, sizeof (path));
       GetModuleFileName (NULL, path, MAX_PATH);
 
       std::wstring m (path);
       m = m.erase (m.find_last_of (L"\\") + 1);
+#else
+      std::error_code error;
+      std::filesystem::path m = std::filesystem::read_symlink ("/proc/self/exe", error).parent_path ();
+#endif
 
       return std::filesystem::path (m) / "Logs" / (std::to_string (pid) + " - " + time_str ());
    }
@@ -119,19 +340,54 @@ QueuedFilesystemBackend::~QueuedFilesystemBackend ()
 void QueuedFilesystemBackend::initialize (DWORD pid)
 {
    // Initialize session writer..
+   mPrivate->deferred_symbols = IsDeferredSymbols ();
    mPrivate->initialize (pid);
 
    // Initialize base class..
-   __super::initialize (pid);
+   QueuedBackend::initialize (pid);
+}
+
+void QueuedFilesystemBackend::SetSamplingInterval (uint64_t bytes)
+{
+   mPrivate->sampling_interval = bytes;
+}
+
+void QueuedFilesystemBackend::SetSnapshotInterval (uint32_t seconds)
+{
+   mPrivate->snapshot_interval = seconds;
+}
+
+void QueuedFilesystemBackend::SetEventColumns (bool enabled)
+{
+   mPrivate->event_columns = enabled;
+}
+
+void QueuedFilesystemBackend::RequestSnapshot ()
+{
+   if (!mPrivate->IsSnapshotMode ())
+      return;
+
+   mPrivate->snapshot_requested = true;
+   interrupt_thread ();
 }
 
 void QueuedFilesystemBackend::OnInitialized (DWORD pid)
 {
    LogMessage ("Initialized QueuedFilesystemBackend for PID " + std::to_string (pid));
    mPrivate->WriteFileHeaderAndSession (pid);
+   mPrivate->last_snapshot = std::chrono::steady_clock::now ();
 }
 
 void QueuedFilesystemBackend::OnProcessEvent (const LEAKEVENT& event)
 {
-   mPrivate->WriteEvent (event);
+   mPrivate->WriteEvent (event, GetRemoteProcessHandle ());
+}
+
+void QueuedFilesystemBackend::OnQueueProcessed (bool finished)
+{
+   mPrivate->UpdateSnapshot (finished);
+
+   // One write per processed batch keeps Leak.dat up to date while the session runs.
+   if (mPrivate->writer)
+      mPrivate->writer->Flush ();
 }
\ No newline at end of file
@@ -10,9 +10,26 @@ public:
 
    virtual void initialize (DWORD pid) override;
 
+   /// Sets the sampling interval written to the session. Must be called before initialize.
+   void SetSamplingInterval (uint64_t bytes);
+
+   /// Enables the snapshot mode. Must be called before initialize.
+   /// Instead of every allocation and deallocation, only the outstanding allocations
+   /// are written every 'seconds' seconds, on request and when the session ends.
+   void SetSnapshotInterval (uint32_t seconds);
+
+   /// Writes allocations and deallocations in columnar chunks (LeakObjectEvents).
+   /// Must be called before initialize.
+   void SetEventColumns (bool enabled);
+
+   /// Requests a snapshot of the outstanding allocations.
+   /// Thread-safe; ignored if the snapshot mode is disabled.
+   void RequestSnapshot ();
+
 protected:
    virtual void OnInitialized (DWORD pid) override;
    virtual void OnProcessEvent (const LEAKEVENT& event) override;
+   virtual void OnQueueProcessed (bool finished) override;
 
 private:
    class Private;
@@ -1,11 +1,20 @@
 #include "libLeak.h"
 
+#include "SymbolCache.h"
+
+#include <mutex>
 #include <vector>
 
+#ifdef _WIN32
 #include <DbgHelp.h>
+#include <Psapi.h>
 
 #pragma comment(lib, "DbgHelp.lib")
 
+/// All DbgHelp functions are single threaded; stacks are walked by the main thread
+/// while the symbolizer threads resolve symbols.
+std::mutex DbgHelpLock;
+
 /// Utility: Get a symbol from a given address..
 bool GetSymbolFromFrameAddress (HANDLE hProcess, PSYMBOL_INFO symbol, intptr_t address)
 {
@@ -47,6 +56,8 @@ HRESULT CaptureStackTrace (
    if (Context == NULL)
       return S_FALSE;
 
+   const std::lock_guard<std::mutex> lock (DbgHelpLock);
+
    //
    // Set up stack frame.
    //
@@ -109,10 +120,9 @@ HRESULT CaptureStackTrace (
    return S_OK;
 }
 
-HRESULT CaptureStackTraceWithSymbols (
-   __in HANDLE RemoteProcess,
-   __in CONST libLeak::PSTACKTRACE StackTrace,
-   std::vector<libLeak::SYMBOL_ENTRY>& SymbolStackTrace)
+/// Initializes the symbol engine once. DbgHelpLock must be held.
+/// Returns false if the symbols of the remote process are not available.
+static bool InitializeSymbols (HANDLE RemoteProcess)
 {
    static bool initialized = false;
    static bool initialized_success = false;
@@ -124,55 +134,409 @@ HRESULT CaptureStackTraceWithSymbols (
 
       SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS | SYMOPT_LOAD_LINES);
       if (SymInitialize (RemoteProcess, NULL, TRUE) == FALSE)
-         return S_FALSE;
+         return false;
 
       initialized_success = true;
    }
 
-   if (!initialized_success)
-      return S_FALSE;
+   return initialized_success;
+}
+
+static bool PrepareSymbols (HANDLE RemoteProcess)
+{
+   const std::lock_guard<std::mutex> lock (DbgHelpLock);
+   return InitializeSymbols (RemoteProcess);
+}
 
+/// Resolves the symbol of a single frame.
+/// Returns false if the frame is not reported.
+static bool ResolveFrameSymbol (HANDLE RemoteProcess, intptr_t address, libLeak::SYMBOL_ENTRY& entry)
+{
    // Manually created SYMBOL_INFO structure since the
    // maximum symbol length is dynamic.
-   std::vector<char> symbol_buffer (sizeof (SYMBOL_INFO) + MAX_SYM_NAME * sizeof (char));
+   static thread_local std::vector<char> symbol_buffer (sizeof (SYMBOL_INFO) + MAX_SYM_NAME * sizeof (char));
 
-   // Loop through all stackframes.
-   for (unsigned int i = 0; i < StackTrace->FrameCount; i++)
+   const std::lock_guard<std::mutex> lock (DbgHelpLock);
+
+   PSYMBOL_INFO symbol = (PSYMBOL_INFO)symbol_buffer.data();
+   if (!GetSymbolFromFrameAddress (RemoteProcess, symbol, address))
+      return false;
+
+   // Symbol name.
+   // Most likely a function name (if valid).
+   entry.name = std::string (symbol->Name, symbol->NameLen);
+
+   // We are not interested in allocations without any symbol name.
+   // Either an allocation has a symbolic reference to our code or some APIs but 'unknown'
+   // symbols are not interesting for our use-case.
+   if (entry.name.empty ())
+      return false;
+
+   // Frames of the detoured functions (uberHeapAlloc, uberLocalFree, ...).
+   if (entry.name.compare (0, 4, "uber") == 0)
+      return false;
+
+   // Now optionally get the source code file and line number.
+   // Empty if source code information is not available.
+   std::pair<std::string, DWORD> source = GetSymbolSourceFile (RemoteProcess, address);
+   entry.file = source.first;
+   entry.line = source.first.size () ? source.second : 0;
+   return true;
+}
+
+/// CodeView debug information of an image (PDB 7.0).
+typedef struct CV_INFO_PDB70_ {
+   DWORD CvSignature;                        // 'RSDS'
+   GUID Signature;
+   DWORD Age;
+} CV_INFO_PDB70;
+
+///
+/// Enumerates the modules of the remote process (deferred symbols).
+/// The identity of the PDB is read from the CodeView record of the mapped image.
+///
+HRESULT EnumerateModules (
+   _In_ HANDLE RemoteProcess,
+   std::vector<libLeak::MODULE_ENTRY>& Modules)
+{
+   std::vector<HMODULE> handles (256);
+   DWORD needed = 0;
+   while (EnumProcessModulesEx (RemoteProcess, handles.data (), (DWORD)(handles.size () * sizeof (HMODULE)), &needed, LIST_MODULES_ALL))
    {
-      intptr_t address = StackTrace->Frames[i];
-      if (address == 0)
+      if (needed <= handles.size () * sizeof (HMODULE))
+      {
+         handles.resize (needed / sizeof (HMODULE));
          break;
+      }
 
-      PSYMBOL_INFO symbol = (PSYMBOL_INFO)symbol_buffer.data();
-      if (!GetSymbolFromFrameAddress (RemoteProcess, symbol, address))
+      handles.resize (needed / sizeof (HMODULE));
+   }
+
+   if (needed == 0)
+      return S_FALSE;
+
+   for (HMODULE handle : handles)
+   {
+      MODULEINFO info{ 0 };
+      char path[MAX_PATH] = { 0 };
+      if (!GetModuleInformation (RemoteProcess, handle, &info, sizeof (info)) ||
+         !GetModuleFileNameExA (RemoteProcess, handle, path, MAX_PATH))
+      {
          continue;
+      }
 
-      // Symbol name.
-      // Most likely a function name (if valid).
-      std::string name = std::string (symbol->Name, symbol->NameLen);
+      libLeak::MODULE_ENTRY module{ (uint64_t)info.lpBaseOfDll, (uint64_t)info.SizeOfImage, path, {}, 0, 0 };
+      const uint8_t* base = (const uint8_t*)info.lpBaseOfDll;
 
-      // We are not interested in allocations without any symbol name.
-      // Either an allocation has a symbolic reference to our code or some APIs but 'unknown'
-      // symbols are not interesting for our use-case.
-      if (name.empty ())
+      IMAGE_DOS_HEADER dos;
+      IMAGE_NT_HEADERS nt;
+      if (ReadProcessMemory (RemoteProcess, base, &dos, sizeof (dos), NULL) &&
+         dos.e_magic == IMAGE_DOS_SIGNATURE &&
+         ReadProcessMemory (RemoteProcess, base + dos.e_lfanew, &nt, sizeof (nt), NULL) &&
+         nt.Signature == IMAGE_NT_SIGNATURE)
+      {
+         module.timestamp = nt.FileHeader.TimeDateStamp;
+
+         const IMAGE_DATA_DIRECTORY& directory = nt.OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_DEBUG];
+         std::vector<IMAGE_DEBUG_DIRECTORY> entries (directory.Size / sizeof (IMAGE_DEBUG_DIRECTORY));
+         if (entries.size () &&
+            ReadProcessMemory (RemoteProcess, base + directory.VirtualAddress, entries.data (), entries.size () * sizeof (IMAGE_DEBUG_DIRECTORY), NULL))
+         {
+            for (const auto& entry : entries)
+            {
+               CV_INFO_PDB70 codeview;
+               if (entry.Type == IMAGE_DEBUG_TYPE_CODEVIEW &&
+                  entry.SizeOfData >= sizeof (codeview) &&
+                  ReadProcessMemory (RemoteProcess, base + entry.AddressOfRawData, &codeview, sizeof (codeview), NULL) &&
+                  codeview.CvSignature == 'SDSR')
+               {
+                  module.identity.assign ((const uint8_t*)&codeview.Signature, (const uint8_t*)&codeview.Signature + sizeof (GUID));
+                  module.age = codeview.Age;
+                  break;
+               }
+            }
+         }
+      }
+
+      Modules.push_back (module);
+   }
+
+   return S_OK;
+}
+
+#else
+
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include <elf.h>
+
+///
+/// A file mapping of the remote process (/proc/PID/maps).
+///
+typedef struct MODULE_MAPPING_ {
+   uintptr_t Start;
+   uintptr_t End;
+   uintptr_t Base;                           // Load address of the module
+   std::string Name;                         // File name without the directory
+   std::string Path;
+} MODULE_MAPPING;
+
+/// Utility: Reads the file mappings of the given process.
+std::vector<MODULE_MAPPING> ReadModuleMappings (pid_t pid)
+{
+   std::vector<MODULE_MAPPING> mappings;
+   std::unordered_map<std::string, uintptr_t> bases;    // path -> load address
+   std::ifstream maps ("/proc/" + std::to_string (pid) + "/maps");
+
+   std::string line;
+   while (std::getline (maps, line))
+   {
+      // start-end perms offset dev inode path
+      std::istringstream fields (line);
+      std::string range, perms, offset, dev, inode, path;
+      fields >> range >> perms >> offset >> dev >> inode;
+      std::getline (fields >> std::ws, path);
+
+      const size_t separator = range.find ('-');
+      if (separator == std::string::npos || path.empty () || path[0] != '/')
          continue;
 
-      if (name == "uberHeapAlloc" || name == "uberHeapFree")
+      MODULE_MAPPING mapping;
+      mapping.Start = (uintptr_t)std::stoull (range.substr (0, separator), nullptr, 16);
+      mapping.End = (uintptr_t)std::stoull (range.substr (separator + 1), nullptr, 16);
+
+      // The first mapping of a module maps the start of the file.
+      const uintptr_t file_offset = (uintptr_t)std::stoull (offset, nullptr, 16);
+      auto base = bases.emplace (path, mapping.Start - file_offset).first;
+      mapping.Base = base->second;
+      mapping.Name = std::filesystem::path (path).filename ().string ();
+      mapping.Path = path;
+      mappings.push_back (mapping);
+   }
+
+   return mappings;
+}
+
+/// Utility: Get the file mapping of a given address..
+const MODULE_MAPPING* FindModuleMapping (const std::vector<MODULE_MAPPING>& mappings, intptr_t address)
+{
+   for (const auto& mapping : mappings)
+   {
+      if ((uintptr_t)address >= mapping.Start && (uintptr_t)address < mapping.End)
+         return &mapping;
+   }
+
+   return nullptr;
+}
+
+/// File mappings of the remote process; replaced as a whole, so readers never lock while resolving.
+static std::shared_ptr<const std::vector<MODULE_MAPPING>> ModuleMappings;
+static pid_t ModuleMappingsPid = 0;
+static std::shared_mutex ModuleMappingsLock;
+
+/// Returns the last file mappings read from the given process, or nullptr.
+static std::shared_ptr<const std::vector<MODULE_MAPPING>> GetModuleMappings (pid_t pid)
+{
+   std::shared_lock<std::shared_mutex> lock (ModuleMappingsLock);
+   return ModuleMappingsPid == pid ? ModuleMappings : nullptr;
+}
+
+/// Reads the file mappings of the remote process again; the last mappings
+/// are kept once the process has exited.
+static std::shared_ptr<const std::vector<MODULE_MAPPING>> UpdateModuleMappings (_In_ HANDLE RemoteProcess)
+{
+   const pid_t pid = (pid_t)(intptr_t)RemoteProcess;
+   auto mappings = std::make_shared<const std::vector<MODULE_MAPPING>> (ReadModuleMappings (pid));
+   if (mappings->empty ())
+      return GetModuleMappings (pid);
+
+   std::unique_lock<std::shared_mutex> lock (ModuleMappingsLock);
+   ModuleMappings = mappings;
+   ModuleMappingsPid = pid;
+   return mappings;
+}
+
+///
+/// Called by the client whenever new stacktraces were published. Symbols are resolved
+/// later and the process may have exited in the meantime.
+///
+void RefreshModuleMappings (_In_ HANDLE RemoteProcess)
+{
+   UpdateModuleMappings (RemoteProcess);
+}
+
+/// On Linux, the remote process handle is the process id.
+static bool PrepareSymbols (HANDLE RemoteProcess)
+{
+   const pid_t pid = (pid_t)(intptr_t)RemoteProcess;
+   return pid != 0 && (GetModuleMappings (pid) || UpdateModuleMappings (RemoteProcess));
+}
+
+///
+/// Resolves the symbol of a single frame; returns false if the frame is not reported.
+/// Frames are named "module+0xoffset" where offset is relative to the load address
+/// of the module, the same way as the in-process writer of the interposer.
+///
+static bool ResolveFrameSymbol (HANDLE RemoteProcess, intptr_t address, libLeak::SYMBOL_ENTRY& entry)
+{
+   const pid_t pid = (pid_t)(intptr_t)RemoteProcess;
+   std::shared_ptr<const std::vector<MODULE_MAPPING>> current = GetModuleMappings (pid);
+   if (!current)
+      return false;
+
+   // Modules may have been loaded since the mappings were read.
+   const MODULE_MAPPING* mapping = FindModuleMapping (*current, address);
+   if (mapping == nullptr)
+   {
+      if (auto mappings = UpdateModuleMappings (RemoteProcess))
+         current = mappings;
+
+      mapping = FindModuleMapping (*current, address);
+   }
+
+   // Not interested in frames outside of any module (e.g. generated code).
+   if (mapping == nullptr)
+      return false;
+
+   // Frames of the interposed functions (malloc, operator new, ...).
+   if (mapping->Name.compare (0, 13, "libLeakDetect") == 0)
+      return false;
+
+   char offset[32];
+   snprintf (offset, sizeof (offset), "+0x%zx", (size_t)((uintptr_t)address - mapping->Base));
+   entry = { mapping->Name + offset, std::string (), 0 };
+   return true;
+}
+
+/// Utility: Reads the GNU build id from the notes of an ELF file.
+static std::vector<uint8_t> ReadBuildId (const std::string& path)
+{
+   std::ifstream file (path, std::ios::binary);
+   Elf64_Ehdr header;
+   if (!file.read ((char*)&header, sizeof (header)) ||
+      memcmp (header.e_ident, ELFMAG, SELFMAG) != 0 ||
+      header.e_ident[EI_CLASS] != ELFCLASS64 ||
+      header.e_phentsize != sizeof (Elf64_Phdr))
+   {
+      return {};
+   }
+
+   for (unsigned int i = 0; i < header.e_phnum; i++)
+   {
+      Elf64_Phdr segment;
+      file.seekg (header.e_phoff + i * sizeof (Elf64_Phdr));
+      if (!file.read ((char*)&segment, sizeof (segment)))
+         break;
+
+      if (segment.p_type != PT_NOTE || segment.p_filesz > 0x10000)
          continue;
 
-      // Now optionally get the source code file and line number.
-      std::pair<std::string, DWORD> source = GetSymbolSourceFile (RemoteProcess, address);
-      if (source.first.size ())
+      std::vector<uint8_t> notes (segment.p_filesz);
+      file.seekg (segment.p_offset);
+      if (!file.read ((char*)notes.data (), notes.size ()))
+         break;
+
+      // [Elf64_Nhdr][name, 4 byte aligned][descriptor, 4 byte aligned]
+      for (size_t offset = 0; offset + sizeof (Elf64_Nhdr) <= notes.size (); )
+      {
+         const Elf64_Nhdr* note = (const Elf64_Nhdr*)(notes.data () + offset);
+         const size_t name = offset + sizeof (Elf64_Nhdr);
+         const size_t descriptor = name + ((note->n_namesz + 3) & ~3);
+         if (descriptor + note->n_descsz > notes.size ())
+            break;
+
+         if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp (notes.data () + name, "GNU", 4) == 0)
+            return std::vector<uint8_t> (notes.data () + descriptor, notes.data () + descriptor + note->n_descsz);
+
+         offset = descriptor + ((note->n_descsz + 3) & ~3);
+      }
+   }
+
+   return {};
+}
+
+///
+/// Enumerates the modules of the remote process (deferred symbols).
+/// Uses the last mappings read from the process, so the modules are still known
+/// once the process has exited.
+///
+HRESULT EnumerateModules (
+   _In_ HANDLE RemoteProcess,
+   std::vector<libLeak::MODULE_ENTRY>& Modules)
+{
+   std::shared_ptr<const std::vector<MODULE_MAPPING>> current = UpdateModuleMappings (RemoteProcess);
+   if (!current)
+      return S_FALSE;
+
+   std::unordered_map<std::string, size_t> modules;    // path -> index
+   for (const auto& mapping : *current)
+   {
+      auto known = modules.emplace (mapping.Path, Modules.size ());
+      if (known.second)
       {
-         // Source Code information is available.
-         SymbolStackTrace.push_back ({ name, source.first, source.second });
+         Modules.push_back ({ mapping.Base, mapping.End - mapping.Base, mapping.Path, ReadBuildId (mapping.Path), 0, 0 });
       }
       else
       {
-         // Source Code information is not available.
-         SymbolStackTrace.push_back ({ name, std::string(), 0 });
+         libLeak::MODULE_ENTRY& module = Modules[known.first->second];
+         module.size = std::max<uint64_t> (module.size, mapping.End - module.base);
+      }
+   }
+
+   return S_OK;
+}
+
+#endif
+
+/// Resolved frames and stacktraces of the remote process.
+static SymbolCache Symbols;
+
+SYMBOL_CACHE_STATISTICS GetSymbolCacheStatistics ()
+{
+   return Symbols.statistics ();
+}
+
+///
+/// Resolves the symbols of a stacktrace of the remote process.
+/// Thread-safe; called by all symbolizer threads. Frames are resolved by the symbol
+/// engine only once, a recurring stacktrace is resolved with a single lookup.
+///
+HRESULT CaptureStackTraceWithSymbols (
+   _In_ HANDLE RemoteProcess,
+   _In_ const libLeak::PSTACKTRACE StackTrace,
+   std::vector<libLeak::SYMBOL_ENTRY>& SymbolStackTrace)
+{
+   const uint64_t hash = libLeak::CreateUniqueId (*StackTrace);
+   if (Symbols.find_stack (*StackTrace, hash, SymbolStackTrace))
+      return S_OK;
+
+   if (!PrepareSymbols (RemoteProcess))
+      return S_FALSE;
+
+   // Loop through all stackframes.
+   std::vector<SymbolCache::FRAME_SYMBOL> frames;
+   for (unsigned int i = 0; i < StackTrace->FrameCount; i++)
+   {
+      intptr_t address = StackTrace->Frames[i];
+      if (address == 0)
+         break;
+
+      SymbolCache::FRAME_SYMBOL symbol;
+      if (!Symbols.find_frame (address, symbol))
+      {
+         libLeak::SYMBOL_ENTRY entry;
+         symbol = Symbols.insert_frame (address, ResolveFrameSymbol (RemoteProcess, address, entry) ? &entry : nullptr);
       }
+
+      if (symbol.name)
+         frames.push_back (symbol);
    }
 
+   Symbols.insert_stack (*StackTrace, hash, frames);
+   SymbolCache::expand (frames, SymbolStackTrace);
    return S_OK;
-}
\ No newline at end of file
+}
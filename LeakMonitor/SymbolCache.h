@@ -0,0 +1,189 @@
+#pragma once
+#include "libLeak.h"
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+/// Hit and miss counters of the symbol cache.
+typedef struct SYMBOL_CACHE_STATISTICS_ {
+   uint64_t FrameHits;                    // Frame addresses found in the cache
+   uint64_t FrameMisses;                  // Frame addresses resolved by the symbol engine
+   uint64_t StackHits;                    // Stacktraces found in the cache
+   uint64_t StackMisses;                  // Stacktraces resolved frame by frame
+   uint64_t Strings;                      // Interned names and files
+} SYMBOL_CACHE_STATISTICS, *PSYMBOL_CACHE_STATISTICS;
+
+///
+/// SymbolCache
+/// Caches the resolved symbols of the remote process, shared by all symbolizer threads.
+///
+/// Frame cache  - frame address to its symbol; frames that are not reported
+///                (no symbol, frames of LeakDetect) are cached as well
+/// Stack cache  - raw frames to the resolved stacktrace, so a recurring stacktrace
+///                costs one lookup; keyed by the stacktrace id (libLeak::CreateUniqueId)
+///
+/// Both caches are split in shards with their own lock. Names and files are interned;
+/// cached entries only refer to them. Entries are never evicted, the number of distinct
+/// frames and stacktraces of a process is bounded.
+///
+class SymbolCache
+{
+public:
+   /// Resolved symbol of a frame. 'name' is nullptr if the frame is not reported.
+   typedef struct FRAME_SYMBOL_ {
+      const std::string* name;
+      const std::string* file;
+      DWORD line;
+   } FRAME_SYMBOL;
+
+private:
+   static constexpr size_t ShardCount = 16;
+
+   typedef struct STACK_ENTRY_ {
+      libLeak::STACKTRACE frames;
+      std::vector<FRAME_SYMBOL> symbols;
+   } STACK_ENTRY;
+
+   struct FrameShard {
+      std::mutex lock;
+      std::unordered_map<intptr_t, FRAME_SYMBOL> frames;
+   };
+
+   struct StackShard {
+      std::mutex lock;
+      std::unordered_multimap<uint64_t, STACK_ENTRY> stacks;
+   };
+
+   FrameShard mFrameShards[ShardCount];
+   StackShard mStackShards[ShardCount];
+
+   std::mutex mStringsLock;
+   std::unordered_set<std::string> mStrings;
+
+   std::atomic<uint64_t> mFrameHits{ 0 };
+   std::atomic<uint64_t> mFrameMisses{ 0 };
+   std::atomic<uint64_t> mStackHits{ 0 };
+   std::atomic<uint64_t> mStackMisses{ 0 };
+
+public:
+   /// Looks up the symbol of a frame address.
+   /// Returns false on a miss; the caller resolves the frame and inserts it.
+   bool find_frame (intptr_t address, FRAME_SYMBOL& symbol)
+   {
+      FrameShard& shard = mFrameShards[shard_of ((uint64_t)address >> 4)];
+      {
+         const std::lock_guard<std::mutex> lock (shard.lock);
+         auto it = shard.frames.find (address);
+         if (it != shard.frames.end ())
+         {
+            symbol = it->second;
+            mFrameHits.fetch_add (1, std::memory_order_relaxed);
+            return true;
+         }
+      }
+
+      mFrameMisses.fetch_add (1, std::memory_order_relaxed);
+      return false;
+   }
+
+   /// Inserts the resolved symbol of a frame address; 'entry' is nullptr if the frame
+   /// is not reported. Returns the cached symbol.
+   FRAME_SYMBOL insert_frame (intptr_t address, const libLeak::SYMBOL_ENTRY* entry)
+   {
+      FRAME_SYMBOL symbol = { nullptr, nullptr, 0 };
+      if (entry)
+         symbol = { intern (entry->name), intern (entry->file), entry->line };
+
+      // Another thread may have resolved the same address meanwhile; both results are equal.
+      FrameShard& shard = mFrameShards[shard_of ((uint64_t)address >> 4)];
+      const std::lock_guard<std::mutex> lock (shard.lock);
+      shard.frames.emplace (address, symbol);
+      return symbol;
+   }
+
+   /// Looks up the resolved stacktrace of the given raw frames.
+   /// Returns true on a hit and appends the symbols of the reported frames.
+   bool find_stack (const libLeak::STACKTRACE& stacktrace, uint64_t hash, std::vector<libLeak::SYMBOL_ENTRY>& symbols)
+   {
+      StackShard& shard = mStackShards[shard_of (hash)];
+      {
+         const std::lock_guard<std::mutex> lock (shard.lock);
+         auto range = shard.stacks.equal_range (hash);
+         for (auto it = range.first; it != range.second; ++it)
+         {
+            if (!equal (it->second.frames, stacktrace))
+               continue;
+
+            expand (it->second.symbols, symbols);
+            mStackHits.fetch_add (1, std::memory_order_relaxed);
+            return true;
+         }
+      }
+
+      mStackMisses.fetch_add (1, std::memory_order_relaxed);
+      return false;
+   }
+
+   /// Inserts the symbols of the reported frames of a resolved stacktrace.
+   void insert_stack (const libLeak::STACKTRACE& stacktrace, uint64_t hash, const std::vector<FRAME_SYMBOL>& symbols)
+   {
+      StackShard& shard = mStackShards[shard_of (hash)];
+      const std::lock_guard<std::mutex> lock (shard.lock);
+
+      auto range = shard.stacks.equal_range (hash);
+      for (auto it = range.first; it != range.second; ++it)
+      {
+         if (equal (it->second.frames, stacktrace))
+            return;
+      }
+
+      shard.stacks.emplace (hash, STACK_ENTRY{ stacktrace, symbols });
+   }
+
+   /// Appends the symbols of cached frames as symbol entries.
+   static void expand (const std::vector<FRAME_SYMBOL>& frames, std::vector<libLeak::SYMBOL_ENTRY>& symbols)
+   {
+      symbols.reserve (symbols.size () + frames.size ());
+      for (const FRAME_SYMBOL& frame : frames)
+         symbols.push_back ({ *frame.name, *frame.file, frame.line });
+   }
+
+   SYMBOL_CACHE_STATISTICS statistics ()
+   {
+      SYMBOL_CACHE_STATISTICS statistics;
+      statistics.FrameHits = mFrameHits.load (std::memory_order_relaxed);
+      statistics.FrameMisses = mFrameMisses.load (std::memory_order_relaxed);
+      statistics.StackHits = mStackHits.load (std::memory_order_relaxed);
+      statistics.StackMisses = mStackMisses.load (std::memory_order_relaxed);
+
+      const std::lock_guard<std::mutex> lock (mStringsLock);
+      statistics.Strings = mStrings.size ();
+      return statistics;
+   }
+
+private:
+   /// Returns the interned copy of a string; stable for the lifetime of the cache.
+   const std::string* intern (const std::string& value)
+   {
+      const std::lock_guard<std::mutex> lock (mStringsLock);
+      return &*mStrings.insert (value).first;
+   }
+
+   static size_t shard_of (uint64_t value)
+   {
+      return (size_t)((value ^ (value >> 17)) & (ShardCount - 1));
+   }
+
+   static bool equal (const libLeak::STACKTRACE& a, const libLeak::STACKTRACE& b)
+   {
+      return a.FrameCount == b.FrameCount &&
+         memcmp (a.Frames, b.Frames, a.FrameCount * sizeof (intptr_t)) == 0;
+   }
+};
+
+/// Returns the counters of the symbol cache of CaptureStackTraceWithSymbols.
+SYMBOL_CACHE_STATISTICS GetSymbolCacheStatistics ();
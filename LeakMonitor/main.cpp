@@ -4,18 +4,28 @@
 #include <string>
 #include <chrono>
 #include <mutex>
-
-#include <codecvt>
+#include <thread>
 
 #include "libLeak.h"
 #include "LeakClient.h"
 #include "QueuedFilesystemBackend.h"
+#include "SymbolCache.h"
+
+#ifdef _WIN32
+#include <codecvt>
+
 #include "RemoteProcessAPI.h"
 
 #include <TlHelp32.h>
+#else
+#include <csignal>
+#include <fstream>
+#include <filesystem>
+#endif
 
 /// Global variables
 bool bExitApplication = false;
+QueuedFilesystemBackend* pBackend = nullptr;   // Serializer; used to request snapshots on CTRL+BREAK.
 
 // Get current date/time, format is YYYY-MM-DD.HH:mm:ss
 const std::string time_str() 
@@ -56,10 +66,12 @@ public:
 
    virtual ~ConsoleLeakClient () override
    {
+#ifdef _WIN32
       if (hRemoteProcessHandle)
       {
          CloseHandle (hRemoteProcessHandle);
       }
+#endif
    }
 
    void OnEventCreated (const std::string& eventName) override
@@ -97,23 +109,43 @@ public:
       LogMessage ("Profiling stopped.");
    }
 
+   void OnEventsLost (uint64_t count) override
+   {
+      LogMessage (std::to_string (count) + " events were dropped since the ring was full.");
+   }
+
+   void OnStacksLost (uint64_t count) override
+   {
+      LogMessage (std::to_string (count) + " stacktraces were dropped since the stack table was full.");
+   }
+
+#ifdef _WIN32
    void InstrumentAllocation (libLeak::PANALYZER_METADATA metadata)
    {
-      libLeak::ALLOCATION_EVENT* event = new libLeak::ALLOCATION_EVENT ();
-      memset (event, 0, sizeof (libLeak::ALLOCATION_EVENT));
-      
-      if (S_OK != CaptureStackTrace (
-         &metadata->Context, 
-         hRemoteProcessHandle, 
-         &event->Stacktrace))
+      // The remote process has captured the frames already.
+      const libLeak::STACKTRACE* stacktrace = &metadata->Stacktrace;
+
+      // Captured before the event is taken from the pool; single-threaded like the metadata.
+      static libLeak::STACKTRACE captured;
+      if (metadata->StackCapture != (DWORD)libLeak::StackCaptureMode::Local)
       {
-         // Could not grab the stacktrace.
-         delete event;
-         event = nullptr;
-         return;
+         memset (&captured, 0, sizeof (libLeak::STACKTRACE));
+         if (S_OK != CaptureStackTrace (
+            &metadata->Context, 
+            hRemoteProcessHandle, 
+            &captured))
+         {
+            // Could not grab the stacktrace.
+            return;
+         }
+
+         stacktrace = &captured;
       }
 
+      libLeak::ALLOCATION_EVENT* event = backend->create_allocation ();
+      event->Stacktrace = *stacktrace;
       event->Pointer = metadata->Pointer;
+      event->PreviousPointer = metadata->PreviousPointer;
       event->Size = metadata->Size;
       event->TimestampEpochSeconds = now ();
       backend->push (event);
@@ -121,9 +153,7 @@ public:
 
    void InstrumentDeallocation (libLeak::PANALYZER_METADATA metadata)
    {
-      libLeak::DELLOCATION_EVENT* event = new libLeak::DELLOCATION_EVENT ();
-      memset (event, 0, sizeof (libLeak::DELLOCATION_EVENT));
-      
+      libLeak::DELLOCATION_EVENT* event = backend->create_deallocation ();
       event->Pointer = metadata->Pointer;
       event->TimestampEpochSeconds = now ();
       backend->push (event);
@@ -151,6 +181,7 @@ public:
       switch (metadata.Type)
       {
       case (int)libLeak::InstrumentType::Allocation:
+      case (int)libLeak::InstrumentType::Reallocation:
          InstrumentAllocation (&metadata);
          break;
       case (int)libLeak::InstrumentType::Deallocation:
@@ -160,6 +191,77 @@ public:
          break;
       }
    }
+#endif
+
+   ///
+   /// Called with a batch of records drained from the shared ring.
+   /// The remote process is not waiting for this function; stacktraces
+   /// were captured by the remote process already.
+   ///
+   void OnRecords (DWORD pid, const libLeak::LEAK_EVENT_RECORD* records, SIZE_T count) override
+   {
+      // The backend requires the remote process handle to resolve symbols.
+      if (!OpenRemoteProcess (pid)) return;
+
+      for (SIZE_T i = 0; i < count; i++)
+      {
+         const libLeak::LEAK_EVENT_RECORD& record = records[i];
+         switch (record.Type)
+         {
+         case (int)libLeak::InstrumentType::Allocation:
+         case (int)libLeak::InstrumentType::Reallocation:
+         {
+            libLeak::ALLOCATION_EVENT* event = backend->create_allocation ();
+            event->Pointer = record.Pointer;
+            event->PreviousPointer = record.PreviousPointer;
+            event->Size = record.Size;
+            event->TimestampEpochSeconds = libLeak::FileTimeToEpochSeconds (record.Timestamp);
+
+            // The frames are read from the shared stack table; no remote memory access required.
+            const libLeak::STACKTRACE* stacktrace = GetStacktrace (record.StackId);
+            if (stacktrace)
+            {
+               event->StackId = record.StackId;
+               event->Stacktrace = *stacktrace;
+            }
+
+            backend->push (event);
+            break;
+         }
+         case (int)libLeak::InstrumentType::Deallocation:
+         {
+            libLeak::DELLOCATION_EVENT* event = backend->create_deallocation ();
+            event->Pointer = record.Pointer;
+            event->TimestampEpochSeconds = libLeak::FileTimeToEpochSeconds (record.Timestamp);
+            backend->push (event);
+            break;
+         }
+         default:
+            break;
+         }
+      }
+   }
+
+   ///
+   /// Called periodically with the counters of all stacktraces that changed
+   /// since the last call (aggregate transport).
+   ///
+   void OnAggregates (DWORD pid, const libLeak::AGGREGATE_EVENT* events, SIZE_T count) override
+   {
+      // The backend requires the remote process handle to resolve symbols.
+      // Symbols of modules that are unloaded in the meantime cannot be resolved.
+      OpenRemoteProcess (pid);
+
+      for (SIZE_T i = 0; i < count; i++)
+      {
+         libLeak::AGGREGATE_EVENT* event = backend->create_aggregate ();
+         *event = events[i];
+         backend->push (event);
+      }
+
+      // Counters are flushed rarely; hand spilled events over right away.
+      backend->signal_timeout ();
+   }
 
    void OnTimeout (DWORD timeoutMs) override
    {
@@ -170,15 +272,20 @@ public:
 
 private:
    ///
-   /// Reads the exported metadata structure from the remote process.
-   /// This requires a couple of pre-requirements:
-   /// - Opened handle with PROCESS_VM_READ rights
-   /// - LeakDetect.dll loaded to the target process.
-   /// - The exported symbol 'Metadata'.
+   /// Opens the remote process handle on first usage.
+   /// On Linux, the remote process handle is the process id.
    ///
-   BOOL ReadMetadata (libLeak::PANALYZER_METADATA metadata, DWORD pid)
+   BOOL OpenRemoteProcess (DWORD pid)
    {
-      // Open the handle on first usage.
+#ifndef _WIN32
+      if (hRemoteProcessHandle == NULL)
+      {
+         hRemoteProcessHandle = (HANDLE)(intptr_t)pid;
+         backend->SetRemoteProcessHandle (hRemoteProcessHandle);
+      }
+
+      return TRUE;
+#else
       if (hRemoteProcessHandle == NULL)
       {
          // Technically do not require PROCESS_ALL_ACCESS.
@@ -191,6 +298,24 @@ private:
          backend->SetRemoteProcessHandle (hRemoteProcessHandle);
       }
 
+      return TRUE;
+#endif
+   }
+
+#ifdef _WIN32
+   ///
+   /// Reads the exported metadata structure from the remote process.
+   /// This requires a couple of pre-requirements:
+   /// - Opened handle with PROCESS_VM_READ rights
+   /// - LeakDetect.dll loaded to the target process.
+   /// - The exported symbol 'Metadata'.
+   ///
+   BOOL ReadMetadata (libLeak::PANALYZER_METADATA metadata, DWORD pid)
+   {
+      // Open the handle on first usage.
+      if (!OpenRemoteProcess (pid))
+         return FALSE;
+
       // Get the exported symbol address.
       if (hRemoteSymbol == NULL)
       {
@@ -211,16 +336,49 @@ private:
          (LPVOID)metadata, 
          sizeof (libLeak::ANALYZER_METADATA), NULL);
    }
+#endif
 };
 
+#ifdef _WIN32
+
 /// Custom Control Handler to gracefully shutdown.
 BOOL WINAPI ConsoleBreakRoutine (DWORD dwControlType)
 {
-   UNREFERENCED_PARAMETER (dwControlType);
+   // CTRL+BREAK writes a snapshot of the outstanding allocations in snapshot mode.
+   if (dwControlType == CTRL_BREAK_EVENT && pBackend != nullptr)
+   {
+      pBackend->RequestSnapshot ();
+      return TRUE;
+   }
+
    bExitApplication = true;
    return TRUE;
 }
 
+#else
+/// Custom signal thread to gracefully shutdown.
+/// Signals are not handled asynchronously; like the console control handler on Windows,
+/// they are served by a dedicated thread.
+void ConsoleBreakThread (sigset_t signals)
+{
+   for (;;)
+   {
+      int signal = 0;
+      if (sigwait (&signals, &signal) != 0)
+         continue;
+
+      // CTRL+\ (SIGQUIT) writes a snapshot of the outstanding allocations in snapshot mode.
+      if (signal == SIGQUIT && pBackend != nullptr)
+      {
+         pBackend->RequestSnapshot ();
+         continue;
+      }
+
+      bExitApplication = true;
+   }
+}
+#endif
+
 /// Case-insensitive string comparison
 bool iequals(const std::string& a, const std::string& b)
 {
@@ -236,6 +394,7 @@ DWORD lookup_process (const char* process)
       return pid;
    }
 
+#ifdef _WIN32
    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
 
    // Most likely a process name was passed.
@@ -256,6 +415,22 @@ DWORD lookup_process (const char* process)
       }
       CloseHandle(processesSnapshot);
    }
+#else
+   // Most likely a process name was passed.
+   const std::string given_process = std::string (process);
+   std::error_code error;
+   for (const auto& entry : std::filesystem::directory_iterator ("/proc", error))
+   {
+      const std::string name = entry.path ().filename ().string ();
+      if (name.find_first_not_of ("0123456789") != std::string::npos)
+         continue;
+
+      std::string comm;
+      std::ifstream (entry.path () / "comm") >> comm;
+      if (iequals (comm, given_process))
+         return (DWORD)atoi (name.c_str ());
+   }
+#endif
 
    return 0;
 }
@@ -272,6 +447,49 @@ DWORD lookup_process (const char* process)
 ///  LeakMonitor.X86.exe
 ///
 /// [1] >> the remote process must have loaded the LeakDetect.X86.dll already.
+///
+/// Linux
+/// ---------------------------------------------------------------------------
+///  LEAKDETECT_MONITOR=1 LD_PRELOAD=libLeakDetect.so ./application
+///  LeakMonitor --pid PID
+///
+/// The events are always published to the ring; --inject and --aggregate are
+/// not supported. CTRL+\ requests a snapshot instead of CTRL+BREAK.
+///
+/// Options
+/// ---------------------------------------------------------------------------
+/// --ring                  Publish events to a shared ring buffer instead of
+///                         interrupting the remote process for each event.
+/// --ring-capacity N       Number of slots in the ring (rounded to a power of two).
+/// --overflow block|drop   Block the remote thread if the ring is full (default)
+///                         or drop the event and count it as lost.
+/// --stack-table-capacity N
+///                         Number of distinct stacktraces shared by the remote process
+///                         with the ring transport (rounded to a power of two).
+/// --aggregate SECONDS     Only maintain counters per stacktrace in the remote process
+///                         (allocations, deallocations, live and peak bytes) and write
+///                         them every SECONDS seconds.
+/// --sample BYTES          Report allocations with a probability proportional to their
+///                         size, on average one sample per BYTES allocated bytes.
+///                         Not supported with --aggregate.
+/// --min-lifetime MS       Do not report allocations that are freed within MS milliseconds.
+///                         Requires the ring transport.
+/// --snapshot SECONDS      Only write the outstanding allocations, aggregated per stacktrace,
+///                         every SECONDS seconds, on CTRL+BREAK and when the session ends.
+/// --symbolizers N         Number of threads resolving symbols in parallel to the writer,
+///                         default is one less than the number of cores.
+/// --symbols live|deferred Resolve symbols while the session runs (default) or write the
+///                         raw frames and the loaded modules, resolved by LeakConverter.
+/// --events rows|columns   Write each allocation and deallocation as an object of its own
+///                         (default) or collect them in columnar chunks for fast scans.
+/// --queue-capacity N      Number of events queued for the writer (rounded to a power of two),
+///                         default is 65536.
+/// --queue-overflow block|spill
+///                         Wait for the writer if the queue is full (default) or keep the
+///                         events in an unbounded buffer.
+/// --stack remote|local    Walk the stack of the interrupted remote process (default)
+///                         or let the remote process capture its own frames.
+///                         The ring transport always captures locally.
 /// 
 /// Note
 /// ---------------------------------------------------------------------------
@@ -282,7 +500,10 @@ DWORD lookup_process (const char* process)
 int main(int argc, char** argv)
 {
    LEAKCLIENT_SETTINGS settings;
-   memset (&settings, 0, sizeof (LEAKCLIENT_SETTINGS));
+
+   // The writer resolves symbols as well while it waits.
+   const DWORD cores = std::thread::hardware_concurrency ();
+   settings.symbolizer_threads = cores > 1 ? cores - 1 : 0;
 
    // Process command line arguments.
    for (int i = 0; i < argc; i++)
@@ -297,16 +518,105 @@ int main(int argc, char** argv)
       {
          settings.pid = lookup_process ((argv[i + 1]));
       }
+      else if (strcmp (argument, "--ring") == 0)
+      {
+         settings.transport = libLeak::TransportMode::Ring;
+      }
+      else if (strcmp (argument, "--aggregate") == 0 && (i + 1) < argc)
+      {
+         settings.transport = libLeak::TransportMode::Aggregate;
+         settings.aggregate_interval = (DWORD)strtoul (argv[i + 1], NULL, 10);
+      }
+      else if (strcmp (argument, "--ring-capacity") == 0 && (i + 1) < argc)
+      {
+         settings.ring_capacity = (DWORD)strtoul (argv[i + 1], NULL, 10);
+      }
+      else if (strcmp (argument, "--stack-table-capacity") == 0 && (i + 1) < argc)
+      {
+         settings.stack_table_capacity = (DWORD)strtoul (argv[i + 1], NULL, 10);
+      }
+      else if (strcmp (argument, "--overflow") == 0 && (i + 1) < argc)
+      {
+         settings.overflow = strcmp (argv[i + 1], "drop") == 0
+            ? libLeak::OverflowPolicy::Drop
+            : libLeak::OverflowPolicy::Block;
+      }
+      else if (strcmp (argument, "--sample") == 0 && (i + 1) < argc)
+      {
+         settings.sampling_interval = (DWORD)strtoul (argv[i + 1], NULL, 10);
+      }
+      else if (strcmp (argument, "--min-lifetime") == 0 && (i + 1) < argc)
+      {
+         settings.minimum_lifetime = (DWORD)strtoul (argv[i + 1], NULL, 10);
+      }
+      else if (strcmp (argument, "--snapshot") == 0 && (i + 1) < argc)
+      {
+         settings.snapshot_interval = (DWORD)strtoul (argv[i + 1], NULL, 10);
+      }
+      else if (strcmp (argument, "--symbolizers") == 0 && (i + 1) < argc)
+      {
+         settings.symbolizer_threads = (DWORD)strtoul (argv[i + 1], NULL, 10);
+      }
+      else if (strcmp (argument, "--symbols") == 0 && (i + 1) < argc)
+      {
+         settings.deferred_symbols = strcmp (argv[i + 1], "deferred") == 0;
+      }
+      else if (strcmp (argument, "--events") == 0 && (i + 1) < argc)
+      {
+         settings.event_columns = strcmp (argv[i + 1], "columns") == 0;
+      }
+      else if (strcmp (argument, "--queue-capacity") == 0 && (i + 1) < argc)
+      {
+         settings.queue_capacity = (DWORD)strtoul (argv[i + 1], NULL, 10);
+      }
+      else if (strcmp (argument, "--queue-overflow") == 0 && (i + 1) < argc)
+      {
+         settings.queue_spill = strcmp (argv[i + 1], "spill") == 0;
+      }
+      else if (strcmp (argument, "--stack") == 0 && (i + 1) < argc)
+      {
+         settings.stack_capture = strcmp (argv[i + 1], "local") == 0
+            ? libLeak::StackCaptureMode::Local
+            : libLeak::StackCaptureMode::Remote;
+      }
    }
 
    // Make sure the PID is not zero.
    if (settings.pid == 0)
       return 1;
 
+   // The counters of the aggregate transport are maintained by the remote process,
+   // they cannot be weighted by the sampling interval afterwards.
+   if (settings.sampling_interval != 0 && settings.transport == libLeak::TransportMode::Aggregate)
+   {
+      std::cerr << "--sample cannot be combined with --aggregate." << std::endl;
+      return 1;
+   }
+
+#ifndef _WIN32
+   // Must happen before any thread is created; all threads inherit the signal mask.
+   sigset_t signals;
+   sigemptyset (&signals);
+   sigaddset (&signals, SIGINT);
+   sigaddset (&signals, SIGTERM);
+   sigaddset (&signals, SIGQUIT);
+   pthread_sigmask (SIG_BLOCK, &signals, nullptr);
+   std::thread (ConsoleBreakThread, signals).detach ();
+#endif
+
    // Initialize the backend (serializer)
    QueuedFilesystemBackend* backend = new QueuedFilesystemBackend ();
+   backend->SetSamplingInterval (settings.sampling_interval);
+   backend->SetSnapshotInterval (settings.snapshot_interval);
+   backend->SetSymbolizerThreads (settings.symbolizer_threads);
+   backend->SetDeferredSymbols (settings.deferred_symbols);
+   backend->SetEventColumns (settings.event_columns);
+   backend->SetQueueCapacity (settings.queue_capacity ? settings.queue_capacity : QueuedBackend::DefaultQueueCapacity, settings.queue_spill);
    backend->initialize (settings.pid);
 
+   if (settings.snapshot_interval != 0)
+      pBackend = backend;
+
    ConsoleLeakClient client(backend);
    if (!client.bootstrap (settings))
    {
@@ -315,14 +625,33 @@ int main(int argc, char** argv)
    }
 
    // Setup console CTRL+c action.
+#ifdef _WIN32
    SetConsoleCtrlHandler (ConsoleBreakRoutine, TRUE);
+#endif
 
    // Run the LeakClient main loop.
    client.run_mainloop (bExitApplication);
 
    // Wait for the serializer to finish. (happens during delete)
+   pBackend = nullptr;
    backend->join ();
 
+   // Counters to size the queue.
+   const QUEUE_STATISTICS queue = backend->GetQueueStatistics ();
+   LogMessage ("Event queue: " +
+      std::to_string (queue.HighWater) + " of " + std::to_string (queue.Capacity) + " slots used at most, " +
+      std::to_string (queue.Spilled) + " events spilled, " + std::to_string (queue.Blocked) + " events waited for the writer.");
+
+   // Counters to size the symbol cache.
+   if (!settings.deferred_symbols)
+   {
+      const SYMBOL_CACHE_STATISTICS symbols = GetSymbolCacheStatistics ();
+      LogMessage ("Symbol cache: " +
+         std::to_string (symbols.StackHits) + " stack hits, " + std::to_string (symbols.StackMisses) + " stack misses, " +
+         std::to_string (symbols.FrameHits) + " frame hits, " + std::to_string (symbols.FrameMisses) + " frame misses, " +
+         std::to_string (symbols.Strings) + " strings.");
+   }
+
    delete backend;
    backend = nullptr;
 
@@ -0,0 +1,483 @@
+#include "LeakEventColumns.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LEAK_COLUMNS_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define LEAK_COLUMNS_NEON
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+   const size_t MaxVarintSize = 10;
+   const uint8_t VarintWidth = 0xFF;
+
+   void PutVarint (std::vector<uint8_t>& bytes, uint64_t value)
+   {
+      uint8_t encoded[MaxVarintSize];
+      size_t length = 0;
+      while (value >= 0x80)
+      {
+         encoded[length++] = (uint8_t)(value | 0x80);
+         value >>= 7;
+      }
+      encoded[length++] = (uint8_t)value;
+      bytes.insert (bytes.end (), encoded, encoded + length);
+   }
+
+   bool GetVarint (const uint8_t*& data, const uint8_t* end, uint64_t& value)
+   {
+      value = 0;
+      for (int shift = 0; shift < 64 && data != end; shift += 7)
+      {
+         const uint8_t byte = *data++;
+         value |= (uint64_t)(byte & 0x7F) << shift;
+         if ((byte & 0x80) == 0)
+            return true;
+      }
+
+      return false;
+   }
+
+   /// Returns the width in bytes of the largest value.
+   uint8_t GetWidth (const uint64_t* values, size_t count)
+   {
+      uint64_t bits = 0;
+      for (size_t i = 0; i < count; i++)
+         bits |= values[i];
+
+      if (bits == 0)
+         return 0;
+      if (bits <= 0xFF)
+         return 1;
+      if (bits <= 0xFFFF)
+         return 2;
+      if (bits <= 0xFFFFFFFF)
+         return 4;
+      return 8;
+   }
+
+   /// Returns the number of bytes of the varints of the values.
+   size_t GetVarintSize (const uint64_t* values, size_t count)
+   {
+      size_t size = count;
+      for (size_t i = 0; i < count; i++)
+      {
+         for (uint64_t value = values[i] >> 7; value != 0; value >>= 7)
+            size++;
+      }
+
+      return size;
+   }
+
+   void PutColumn (std::vector<uint8_t>& bytes, const uint64_t* values, size_t count)
+   {
+      const uint8_t width = GetWidth (values, count);
+
+      // A few wide values, e.g. the pointer differences between the heaps of interleaved
+      // threads, would widen all values; such a column is written as varints instead.
+      if (width >= 4)
+      {
+         const size_t size = GetVarintSize (values, count);
+         if (size < count * width)
+         {
+            bytes.push_back (VarintWidth);
+            PutVarint (bytes, size);
+            bytes.reserve (bytes.size () + size);
+            for (size_t i = 0; i < count; i++)
+               PutVarint (bytes, values[i]);
+
+            return;
+         }
+      }
+
+      bytes.push_back (width);
+
+      const size_t offset = bytes.size ();
+      bytes.resize (offset + count * width);
+
+      // The file is little endian, as are all supported platforms.
+      uint8_t* output = bytes.data () + offset;
+      for (size_t i = 0; i < count; i++, output += width)
+         memcpy (output, &values[i], width);
+   }
+
+   /// Writes the first value and the zigzag differences of each value to the value before it.
+   void PutDeltaColumn (std::vector<uint8_t>& bytes, const std::vector<uint64_t>& values, std::vector<uint64_t>& deltas)
+   {
+      deltas.resize (values.size ());
+
+      uint64_t previous = values[0];
+      for (size_t i = 0; i < values.size (); i++)
+      {
+         const int64_t delta = (int64_t)(values[i] - previous);
+         deltas[i] = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+         previous = values[i];
+      }
+
+      PutVarint (bytes, values[0]);
+      PutColumn (bytes, deltas.data (), deltas.size ());
+   }
+
+   /// Returns the bytes of a packed column of 'count' values and advances 'data' past it.
+   /// 'length' is the number of bytes of a column of varints.
+   const uint8_t* GetColumn (const uint8_t*& data, const uint8_t* end, size_t count, uint8_t& width, size_t& length)
+   {
+      if (data == end)
+         return nullptr;
+
+      width = *data++;
+      if (width == VarintWidth)
+      {
+         uint64_t size = 0;
+         if (!GetVarint (data, end, size) || size > (uint64_t)(end - data))
+            return nullptr;
+
+         const uint8_t* column = data;
+         length = (size_t)size;
+         data += length;
+         return column;
+      }
+
+      if (width != 0 && width != 1 && width != 2 && width != 4 && width != 8)
+         return nullptr;
+
+      if ((uint64_t)count * width > (uint64_t)(end - data))
+         return nullptr;
+
+      const uint8_t* column = data;
+      length = count * width;
+      data += length;
+      return column;
+   }
+
+#if defined(LEAK_COLUMNS_SSE2)
+   /// Stores four 32 bit lanes as 64 bit values.
+   inline void StoreWidened (uint64_t* output, __m128i values)
+   {
+      const __m128i zero = _mm_setzero_si128 ();
+      _mm_storeu_si128 ((__m128i*)output, _mm_unpacklo_epi32 (values, zero));
+      _mm_storeu_si128 ((__m128i*)(output + 2), _mm_unpackhi_epi32 (values, zero));
+   }
+
+   size_t Widen8 (const uint8_t* input, size_t count, uint64_t* output)
+   {
+      const __m128i zero = _mm_setzero_si128 ();
+      size_t i = 0;
+      for (; i + 16 <= count; i += 16)
+      {
+         const __m128i bytes = _mm_loadu_si128 ((const __m128i*)(input + i));
+         const __m128i low = _mm_unpacklo_epi8 (bytes, zero);
+         const __m128i high = _mm_unpackhi_epi8 (bytes, zero);
+         StoreWidened (output + i, _mm_unpacklo_epi16 (low, zero));
+         StoreWidened (output + i + 4, _mm_unpackhi_epi16 (low, zero));
+         StoreWidened (output + i + 8, _mm_unpacklo_epi16 (high, zero));
+         StoreWidened (output + i + 12, _mm_unpackhi_epi16 (high, zero));
+      }
+
+      return i;
+   }
+
+   size_t Widen16 (const uint8_t* input, size_t count, uint64_t* output)
+   {
+      const __m128i zero = _mm_setzero_si128 ();
+      size_t i = 0;
+      for (; i + 8 <= count; i += 8)
+      {
+         const __m128i words = _mm_loadu_si128 ((const __m128i*)(input + i * 2));
+         StoreWidened (output + i, _mm_unpacklo_epi16 (words, zero));
+         StoreWidened (output + i + 4, _mm_unpackhi_epi16 (words, zero));
+      }
+
+      return i;
+   }
+
+   size_t Widen32 (const uint8_t* input, size_t count, uint64_t* output)
+   {
+      size_t i = 0;
+      for (; i + 4 <= count; i += 4)
+         StoreWidened (output + i, _mm_loadu_si128 ((const __m128i*)(input + i * 4)));
+
+      return i;
+   }
+
+   /// Replaces the zigzag differences by the running sum, two values at a time.
+   size_t SumDeltas (uint64_t* values, size_t count, uint64_t& previous)
+   {
+      const __m128i zero = _mm_setzero_si128 ();
+      const __m128i one = _mm_set_epi32 (0, 1, 0, 1);
+      __m128i sum = _mm_set_epi32 ((int)(previous >> 32), (int)previous, (int)(previous >> 32), (int)previous);
+
+      size_t i = 0;
+      for (; i + 2 <= count; i += 2)
+      {
+         __m128i delta = _mm_loadu_si128 ((const __m128i*)(values + i));
+         delta = _mm_xor_si128 (_mm_srli_epi64 (delta, 1), _mm_sub_epi64 (zero, _mm_and_si128 (delta, one)));
+         delta = _mm_add_epi64 (delta, _mm_slli_si128 (delta, 8));
+         sum = _mm_add_epi64 (sum, delta);
+         _mm_storeu_si128 ((__m128i*)(values + i), sum);
+
+         // Both lanes continue from the second value.
+         sum = _mm_shuffle_epi32 (sum, _MM_SHUFFLE (3, 2, 3, 2));
+      }
+
+      if (i)
+         previous = values[i - 1];
+
+      return i;
+   }
+#elif defined(LEAK_COLUMNS_NEON)
+   /// Stores four 32 bit lanes as 64 bit values.
+   inline void StoreWidened (uint64_t* output, uint32x4_t values)
+   {
+      vst1q_u64 (output, vmovl_u32 (vget_low_u32 (values)));
+      vst1q_u64 (output + 2, vmovl_u32 (vget_high_u32 (values)));
+   }
+
+   size_t Widen8 (const uint8_t* input, size_t count, uint64_t* output)
+   {
+      size_t i = 0;
+      for (; i + 16 <= count; i += 16)
+      {
+         const uint8x16_t bytes = vld1q_u8 (input + i);
+         const uint16x8_t low = vmovl_u8 (vget_low_u8 (bytes));
+         const uint16x8_t high = vmovl_u8 (vget_high_u8 (bytes));
+         StoreWidened (output + i, vmovl_u16 (vget_low_u16 (low)));
+         StoreWidened (output + i + 4, vmovl_u16 (vget_high_u16 (low)));
+         StoreWidened (output + i + 8, vmovl_u16 (vget_low_u16 (high)));
+         StoreWidened (output + i + 12, vmovl_u16 (vget_high_u16 (high)));
+      }
+
+      return i;
+   }
+
+   size_t Widen16 (const uint8_t* input, size_t count, uint64_t* output)
+   {
+      size_t i = 0;
+      for (; i + 8 <= count; i += 8)
+      {
+         const uint16x8_t words = vreinterpretq_u16_u8 (vld1q_u8 (input + i * 2));
+         StoreWidened (output + i, vmovl_u16 (vget_low_u16 (words)));
+         StoreWidened (output + i + 4, vmovl_u16 (vget_high_u16 (words)));
+      }
+
+      return i;
+   }
+
+   size_t Widen32 (const uint8_t* input, size_t count, uint64_t* output)
+   {
+      size_t i = 0;
+      for (; i + 4 <= count; i += 4)
+         StoreWidened (output + i, vreinterpretq_u32_u8 (vld1q_u8 (input + i * 4)));
+
+      return i;
+   }
+
+   /// Replaces the zigzag differences by the running sum, two values at a time.
+   size_t SumDeltas (uint64_t* values, size_t count, uint64_t& previous)
+   {
+      const uint64x2_t zero = vdupq_n_u64 (0);
+      const uint64x2_t one = vdupq_n_u64 (1);
+      uint64x2_t sum = vdupq_n_u64 (previous);
+
+      size_t i = 0;
+      for (; i + 2 <= count; i += 2)
+      {
+         uint64x2_t delta = vld1q_u64 (values + i);
+         delta = veorq_u64 (vshrq_n_u64 (delta, 1), vsubq_u64 (zero, vandq_u64 (delta, one)));
+         delta = vaddq_u64 (delta, vextq_u64 (zero, delta, 1));
+         sum = vaddq_u64 (sum, delta);
+         vst1q_u64 (values + i, sum);
+
+         // Both lanes continue from the second value.
+         sum = vdupq_n_u64 (vgetq_lane_u64 (sum, 1));
+      }
+
+      if (i)
+         previous = values[i - 1];
+
+      return i;
+   }
+#else
+   size_t Widen8 (const uint8_t*, size_t, uint64_t*) { return 0; }
+   size_t Widen16 (const uint8_t*, size_t, uint64_t*) { return 0; }
+   size_t Widen32 (const uint8_t*, size_t, uint64_t*) { return 0; }
+   size_t SumDeltas (uint64_t*, size_t, uint64_t&) { return 0; }
+#endif
+
+   /// Widens the values of a packed column; the vector loops leave the last few values.
+   void Widen (const uint8_t* column, uint8_t width, size_t count, uint64_t* values)
+   {
+      size_t i = 0;
+      switch (width)
+      {
+      case 0:  memset (values, 0, count * sizeof (uint64_t)); return;
+      case 1:  i = Widen8 (column, count, values); break;
+      case 2:  i = Widen16 (column, count, values); break;
+      case 4:  i = Widen32 (column, count, values); break;
+      default: memcpy (values, column, count * sizeof (uint64_t)); return;
+      }
+
+      for (; i < count; i++)
+      {
+         uint64_t value = 0;
+         memcpy (&value, column + i * width, width);
+         values[i] = value;
+      }
+   }
+
+   /// Reads the values of a packed column or a column of varints and advances 'data' past it.
+   bool GetValues (const uint8_t*& data, const uint8_t* end, size_t count, uint64_t* values)
+   {
+      uint8_t width = 0;
+      size_t length = 0;
+      const uint8_t* column = GetColumn (data, end, count, width, length);
+      if (column == nullptr)
+         return false;
+
+      if (width != VarintWidth)
+      {
+         Widen (column, width, count, values);
+         return true;
+      }
+
+      const uint8_t* column_end = column + length;
+      for (size_t i = 0; i < count; i++)
+      {
+         if (!GetVarint (column, column_end, values[i]))
+            return false;
+      }
+
+      return column == column_end;
+   }
+
+   bool GetDeltaColumn (const uint8_t*& data, const uint8_t* end, std::vector<uint64_t>& values)
+   {
+      uint64_t previous = 0;
+      if (!GetVarint (data, end, previous) || !GetValues (data, end, values.size (), values.data ()))
+         return false;
+
+      for (size_t i = SumDeltas (values.data (), values.size (), previous); i < values.size (); i++)
+      {
+         const uint64_t delta = values[i];
+         previous += (delta >> 1) ^ (0 - (delta & 1));
+         values[i] = previous;
+      }
+
+      return true;
+   }
+}
+
+namespace libLeak
+{
+   void LeakEventColumns::Encode (
+      std::vector<uint8_t>& bytes,
+      const EVENT_COLUMNS& events,
+      std::unordered_map<uint64_t, uint32_t>& stacktraces,
+      uint32_t& stacktrace_count)
+   {
+      const size_t count = events.size ();
+      PutVarint (bytes, count);
+      if (count == 0)
+         return;
+
+      const size_t flags = bytes.size ();
+      bytes.resize (flags + (count + 7) / 8, 0);
+      for (size_t i = 0; i < count; i++)
+      {
+         if (events.allocations[i])
+            bytes[flags + i / 8] |= (uint8_t)(1 << (i % 8));
+      }
+
+      std::vector<uint64_t> values;
+      PutDeltaColumn (bytes, events.timestamps, values);
+      PutDeltaColumn (bytes, events.pointers, values);
+      PutColumn (bytes, events.sizes.data (), count);
+
+      // Stacktraces that are new to the block are written before the column that refers to them.
+      std::vector<uint64_t> ids;
+      for (size_t i = 0; i < count; i++)
+      {
+         values[i] = 0;
+         if (events.allocations[i])
+         {
+            auto index = stacktraces.emplace (events.stacktrace_ids[i], stacktrace_count);
+            if (index.second)
+            {
+               ids.push_back (events.stacktrace_ids[i]);
+               stacktrace_count++;
+            }
+
+            values[i] = (uint64_t)index.first->second + 1;
+         }
+      }
+
+      PutVarint (bytes, ids.size ());
+      for (const uint64_t id : ids)
+      {
+         const size_t offset = bytes.size ();
+         bytes.resize (offset + sizeof (id));
+         memcpy (bytes.data () + offset, &id, sizeof (id));
+      }
+
+      PutColumn (bytes, values.data (), count);
+   }
+
+   bool LeakEventColumns::Decode (const uint8_t* data, size_t size, EVENT_COLUMNS& events, std::vector<uint64_t>& stacktrace_ids)
+   {
+      const uint8_t* end = data + size;
+
+      // Each event takes at least one bit.
+      uint64_t count = 0;
+      if (!GetVarint (data, end, count) || (count + 7) / 8 > (uint64_t)(end - data) || count > SIZE_MAX / sizeof (uint64_t))
+         return false;
+
+      events.allocations.resize ((size_t)count);
+      events.timestamps.resize ((size_t)count);
+      events.pointers.resize ((size_t)count);
+      events.sizes.resize ((size_t)count);
+      events.stacktrace_ids.resize ((size_t)count);
+      if (count == 0)
+         return true;
+
+      for (size_t i = 0; i < count; i++)
+         events.allocations[i] = (data[i / 8] >> (i % 8)) & 1;
+
+      data += (size_t)(count + 7) / 8;
+      if (!GetDeltaColumn (data, end, events.timestamps) ||
+         !GetDeltaColumn (data, end, events.pointers))
+      {
+         return false;
+      }
+
+      if (!GetValues (data, end, (size_t)count, events.sizes.data ()))
+         return false;
+
+      uint64_t id_count = 0;
+      if (!GetVarint (data, end, id_count) || id_count > (uint64_t)(end - data) / sizeof (uint64_t))
+         return false;
+
+      for (uint64_t i = 0; i < id_count; i++, data += sizeof (uint64_t))
+      {
+         uint64_t id = 0;
+         memcpy (&id, data, sizeof (id));
+         stacktrace_ids.push_back (id);
+      }
+
+      uint64_t* ids = events.stacktrace_ids.data ();
+      if (!GetValues (data, end, (size_t)count, ids))
+         return false;
+      for (size_t i = 0; i < count; i++)
+      {
+         const uint64_t reference = ids[i];
+         if (reference > stacktrace_ids.size ())
+            return false;
+
+         ids[i] = reference ? stacktrace_ids[(size_t)reference - 1] : 0;
+      }
+
+      // Bytes after the columns are left to later versions.
+      return true;
+   }
+}
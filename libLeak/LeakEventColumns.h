@@ -0,0 +1,86 @@
+#pragma once
+
+#include "libLeak.h"
+
+#include <unordered_map>
+#include <vector>
+
+namespace libLeak
+{
+   /// Allocations and deallocations of a columnar chunk (LeakObjectEvents).
+   /// Entry i of each column belongs to event i.
+   typedef struct EVENT_COLUMNS_ {
+      std::vector<uint8_t> allocations;                           // 1 for an allocation, 0 for a deallocation
+      std::vector<uint64_t> timestamps;
+      std::vector<uint64_t> pointers;
+      std::vector<uint64_t> sizes;                                // 0 for deallocations
+      std::vector<uint64_t> stacktrace_ids;                       // 0 for deallocations
+
+      size_t size () const { return timestamps.size (); }
+
+      void push_back (bool allocation, uint64_t timestamp, uint64_t pointer, uint64_t size, uint64_t stacktrace_id)
+      {
+         allocations.push_back (allocation ? 1 : 0);
+         timestamps.push_back (timestamp);
+         pointers.push_back (pointer);
+         sizes.push_back (size);
+         stacktrace_ids.push_back (stacktrace_id);
+      }
+
+      void clear ()
+      {
+         allocations.clear ();
+         timestamps.clear ();
+         pointers.clear ();
+         sizes.clear ();
+         stacktrace_ids.clear ();
+      }
+   } EVENT_COLUMNS;
+
+   ///
+   /// Encodes the payload of a columnar chunk of events and decodes it, with SSE2 (x86, x64)
+   /// or NEON (ARM64) instructions where available.
+   ///
+   /// A chunk of N events stores each field of the events in a column of its own:
+   ///
+   /// [varint N]
+   /// [(N + 7) / 8 bytes]               bit i is set if event i is an allocation
+   /// [varint first][packed column]     timestamps; zigzag differences to the previous event
+   /// [varint first][packed column]     pointers; the same
+   /// [packed column]                   sizes
+   /// [varint M][M * 8 byte ids]        stacktraces without an index in the block yet;
+   ///                                   they are assigned the next indices
+   /// [packed column]                   stacktrace of each event; 0 for deallocations,
+   ///                                   otherwise the index of its stacktrace + 1
+   ///
+   /// The indices of the stacktraces are shared with the other objects of the block
+   /// (LeakFileStreamSerializer), so a chunk refers to a stacktrace with a few bytes.
+   ///
+   /// A packed column is [uint8_t width][N * width bytes]: all values have the width of the
+   /// largest value, 0, 1, 2, 4 or 8 bytes, little endian. Columns of one width are widened
+   /// and summed up in vector registers without a branch per value.
+   /// A column whose values would take 4 or 8 bytes is written as [uint8_t 0xFF][varint
+   /// length][N varints] if that is smaller, e.g. the pointers of interleaved threads; it is
+   /// decoded value by value.
+   ///
+   class LeakEventColumns
+   {
+      LeakEventColumns () = delete;
+      ~LeakEventColumns () = delete;
+      LeakEventColumns (const LeakEventColumns&) = delete;
+      LeakEventColumns (LeakEventColumns&&) = delete;
+      LeakEventColumns& operator= (const LeakEventColumns&) = delete;
+
+   public:
+      /// Appends the payload of a chunk of the given events to 'bytes'. 'stacktraces' maps the
+      /// ids of the block to their index; ids of the chunk that are not in it are added with
+      /// the next index, counted by 'stacktrace_count'.
+      static void Encode (std::vector<uint8_t>& bytes, const EVENT_COLUMNS& events,
+         std::unordered_map<uint64_t, uint32_t>& stacktraces, uint32_t& stacktrace_count);
+
+      /// Decodes the payload of a chunk into 'events'; the columns are reused. 'stacktrace_ids'
+      /// maps the indices of the block to their id; the ids added by the chunk are appended.
+      /// Returns true on success, otherwise false.
+      static bool Decode (const uint8_t* data, size_t size, EVENT_COLUMNS& events, std::vector<uint64_t>& stacktrace_ids);
+   };
+}
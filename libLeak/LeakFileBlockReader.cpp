@@ -0,0 +1,141 @@
+#include "LeakFileBlockReader.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace libLeak
+{
+   LeakFileBlockReader::LeakFileBlockReader (LeakFileView& view, size_t threads)
+      : view (view)
+      , threads (threads ? threads : std::max<size_t> (1, std::thread::hardware_concurrency ()))
+   {
+   }
+
+   void LeakFileBlockReader::SetBlockFilter (const FilterFunction& filter)
+   {
+      block_filter = filter;
+   }
+
+   size_t LeakFileBlockReader::GetSlotCount () const
+   {
+      // Workers go on with the next blocks while the calling thread merges.
+      return threads * 2;
+   }
+
+   void LeakFileBlockReader::Run (const DecodeFunction& decode, const MergeFunction& merge)
+   {
+      std::vector<LeakObjectBlockIndexEntry> blocks;
+      if (view.ReadBlockIndex (blocks))
+      {
+         if (block_filter)
+         {
+            blocks.erase (std::remove_if (blocks.begin (), blocks.end (),
+               [this] (const LeakObjectBlockIndexEntry& entry) { return !block_filter (entry.Block); }), blocks.end ());
+         }
+
+         RunBlocks (blocks, decode, merge);
+      }
+      else
+         RunSequential (decode, merge);
+   }
+
+   void LeakFileBlockReader::RunSequential (const DecodeFunction& decode, const MergeFunction& merge)
+   {
+      for (bool more = true; more; )
+      {
+         for (size_t count = 0; count < BlockSize; count++)
+         {
+            const LeakObject* object = view.ReadObject ();
+            if (object == nullptr)
+            {
+               more = false;
+               break;
+            }
+
+            decode (view, *object, 0);
+         }
+
+         merge (0);
+      }
+   }
+
+   void LeakFileBlockReader::RunBlocks (const std::vector<LeakObjectBlockIndexEntry>& blocks, const DecodeFunction& decode, const MergeFunction& merge)
+   {
+      const size_t slots = GetSlotCount ();
+      const size_t workers = std::min (threads, blocks.size ());
+      if (workers <= 1)
+      {
+         LeakFileView block;
+         for (const auto& entry : blocks)
+         {
+            if (block.OpenBlock (view, entry))
+            {
+               while (const LeakObject* object = block.ReadObject ())
+                  decode (block, *object, 0);
+            }
+
+            merge (0);
+         }
+
+         return;
+      }
+
+      std::mutex lock;
+      std::condition_variable changed;
+      size_t next = 0;                                            // Next block to decode
+      size_t merged = 0;                                          // Blocks merged so far
+      std::vector<bool> decoded (blocks.size (), false);
+
+      auto worker = [&] ()
+      {
+         LeakFileView block;
+         std::unique_lock<std::mutex> guard (lock);
+         for (;;)
+         {
+            // The slot of the next block is free once the block before it in the slot was merged.
+            changed.wait (guard, [&] { return next == blocks.size () || next < merged + slots; });
+            if (next == blocks.size ())
+               return;
+
+            const size_t index = next++;
+            guard.unlock ();
+
+            if (block.OpenBlock (view, blocks[index]))
+            {
+               while (const LeakObject* object = block.ReadObject ())
+                  decode (block, *object, index % slots);
+            }
+
+            guard.lock ();
+            decoded[index] = true;
+            changed.notify_all ();
+         }
+      };
+
+      std::vector<std::thread> pool;
+      for (size_t i = 0; i < workers; i++)
+         pool.emplace_back (worker);
+
+      for (size_t index = 0; index < blocks.size (); index++)
+      {
+         {
+            std::unique_lock<std::mutex> guard (lock);
+            changed.wait (guard, [&] { return decoded[index]; });
+         }
+
+         merge (index % slots);
+
+         {
+            std::lock_guard<std::mutex> guard (lock);
+            merged++;
+         }
+
+         changed.notify_all ();
+      }
+
+      for (auto& thread : pool)
+         thread.join ();
+   }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "libLeak.h"
+#include "LeakObject.h"
+#include "LeakFileView.h"
+
+#include <functional>
+
+namespace libLeak
+{
+   ///
+   /// The LeakFileBlockReader class decodes the blocks of a Leak.dat file on a pool of threads
+   /// and merges their results on the calling thread, in the order of the blocks.
+   ///
+   /// The blocks of a file of version 5 are taken from its index, or from the block headers if
+   /// the file was not closed. Each block is read by a view of its own (LeakFileView::OpenBlock);
+   /// the decode function is called for each of its objects on a worker thread. Once all blocks
+   /// before it were merged, the merge function is called for the block on the calling thread;
+   /// it applies the string and frame objects of the block to the view of the file.
+   ///
+   /// Files of older versions depend on all objects before them; they are decoded on the calling
+   /// thread in chunks of BlockSize objects, each merged after it was decoded. So are files whose
+   /// index is corrupt.
+   ///
+   /// A filter skips blocks by their header, for instance blocks outside a time window. The
+   /// strings and frames of skipped blocks are not applied; files without blocks are not filtered.
+   ///
+   /// The result of a block is kept by the caller in one of GetSlotCount () slots. A slot is reused
+   /// for a later block once the merge function has consumed it.
+   ///
+   class LeakFileBlockReader
+   {
+   public:
+      static constexpr size_t BlockSize = 1 << 16;
+
+      /// Called for each object of a block on a worker thread. Frames of stacktraces are not
+      /// known to the view of a block.
+      typedef std::function<void (const LeakFileView& block, const LeakObject& object, size_t slot)> DecodeFunction;
+
+      /// Called for each block on the calling thread, in order, once the block was decoded.
+      typedef std::function<void (size_t slot)> MergeFunction;
+
+      /// Returns false for blocks that are neither decoded nor merged.
+      typedef std::function<bool (const LeakObjectBlock& block)> FilterFunction;
+
+   private:
+      LeakFileView& view;
+      size_t threads;
+      FilterFunction block_filter;
+
+   public:
+      /// Constructs a reader of the given view; its header must be parsed.
+      /// Uses one thread per core unless 'threads' is set.
+      LeakFileBlockReader (LeakFileView& view, size_t threads = 0);
+
+      LeakFileBlockReader (const LeakFileBlockReader&) = delete;
+      LeakFileBlockReader& operator = (const LeakFileBlockReader&) = delete;
+
+      /// Sets the filter of the blocks; all blocks are read without one.
+      void SetBlockFilter (const FilterFunction& filter);
+
+      /// Returns the number of slots for the results of blocks.
+      size_t GetSlotCount () const;
+
+      /// Decodes and merges all blocks. A block is read up to its first corrupt object.
+      void Run (const DecodeFunction& decode, const MergeFunction& merge);
+
+   private:
+      /// Decodes the remaining objects of the view on the calling thread.
+      void RunSequential (const DecodeFunction& decode, const MergeFunction& merge);
+
+      /// Decodes the given blocks on the worker threads.
+      void RunBlocks (const std::vector<LeakObjectBlockIndexEntry>& blocks, const DecodeFunction& decode, const MergeFunction& merge);
+   };
+}
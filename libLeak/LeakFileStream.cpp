@@ -1,134 +1,322 @@
 #include "LeakFileStream.h"
 
 #include "LeakObject.h"
-#include "LeakFileStreamSerializer.h"
-#include "LeakFileStreamParser.h"
+
+namespace
+{
+   bool SeekFile (FILE* file, uint64_t offset, int origin)
+   {
+#ifdef _WIN32
+      return _fseeki64 (file, (__int64)offset, origin) == 0;
+#else
+      return fseeko (file, (off_t)offset, origin) == 0;
+#endif
+   }
+}
 
 namespace libLeak
 {
    LeakFileStream::LeakFileStream (FILE* fp)
       : file (fp)
+      , written (0)
+      , block_offset (0)
+      , event_columns (false)
    {
+      if (file)
+      {
+         setvbuf (file, NULL, _IONBF, 0);
+      }
+
+      // Room for the largest object that is appended to a buffer below the threshold.
+      buffer.reserve (FlushThreshold * 2);
    }
 
    LeakFileStream::~LeakFileStream ()
    {
       if (file)
       {
+         // Streams that were only read wrote nothing.
+         if (written || buffer.size ())
+         {
+            CloseBlock ();
+            LeakFileStreamSerializer::SerializeBlockIndex (buffer, blocks, written + buffer.size ());
+         }
+
+         Flush ();
          fclose (file);
       }
    }
 
+   void LeakFileStream::SetEventColumns (bool enabled)
+   {
+      event_columns = enabled;
+   }
+
+   void LeakFileStream::Flush ()
+   {
+      if (file && buffer.size ())
+      {
+         fwrite ((const void*)buffer.data (), buffer.size (), 1, file);
+      }
+
+      written += buffer.size ();
+      buffer.clear ();
+   }
+
+   void LeakFileStream::OpenBlock ()
+   {
+      if (block_offset)
+         return;
+
+      block_offset = written + buffer.size ();
+      LeakFileStreamSerializer::SerializeBlock (buffer, serializer);
+   }
+
+   void LeakFileStream::CloseBlock ()
+   {
+      if (block_offset == 0)
+         return;
+
+      WriteEvents ();
+      const uint64_t size = written + buffer.size () - block_offset - sizeof (LeakObjectBlock);
+      const LeakObjectBlock block = LeakFileStreamSerializer::FinishBlock (serializer, size);
+      if (block_offset >= written)
+      {
+         memcpy (buffer.data () + (size_t)(block_offset - written), &block, sizeof (block));
+      }
+      else if (file && SeekFile (file, block_offset, SEEK_SET))
+      {
+         // The start of the block was flushed already.
+         fwrite ((const void*)&block, sizeof (block), 1, file);
+         SeekFile (file, 0, SEEK_END);
+      }
+
+      blocks.push_back ({ block_offset, block });
+      block_offset = 0;
+   }
+
+   void LeakFileStream::Commit ()
+   {
+      const LeakObjectBlock& block = serializer.block;
+      if (block_offset && block.Objects - block.Definitions >= BlockSize)
+      {
+         CloseBlock ();
+      }
+
+      if (buffer.size () >= FlushThreshold)
+      {
+         Flush ();
+      }
+   }
+
+   void LeakFileStream::WriteEvents ()
+   {
+      // Events are only collected while a block is open.
+      if (events.size () == 0)
+         return;
+
+      LeakFileStreamSerializer::SerializeEvents (buffer, serializer, events);
+      events.clear ();
+   }
+
    void LeakFileStream::WriteHeader ()
    {
-      std::vector<uint8_t> bytes;
-      LeakFileStreamSerializer::SerializeHeader (bytes);
-      Write (bytes);
+      LeakFileStreamSerializer::SerializeHeader (buffer);
+      Commit ();
    }
 
-   void LeakFileStream::WriteSession (DWORD pid, uint64_t ts)
+   void LeakFileStream::WriteSession (DWORD pid, uint64_t ts, uint64_t samplingInterval)
    {
-      std::vector<uint8_t> bytes;
-      LeakFileStreamSerializer::SerializeSession (bytes, pid, ts);
-      Write (bytes);
+      WriteEvents ();
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeSession (buffer, serializer, pid, ts, samplingInterval);
+      Commit ();
    }
 
-   void LeakFileStream::WriteStacktrace (uint32_t id, const std::vector<libLeak::SYMBOL_ENTRY>& symbols, uint64_t ts)
+   void LeakFileStream::WriteStacktrace (uint64_t id, const std::vector<libLeak::SYMBOL_ENTRY>& symbols, uint64_t ts)
    {
-      std::vector<uint8_t> bytes;
-      LeakFileStreamSerializer::SerializeStacktrace (bytes, id, symbols, ts);
-      Write (bytes);
+      frame_ids.clear ();
+      for (const auto& symbol : symbols)
+         frame_ids.push_back (WriteFrameOnce (symbol));
+
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeStacktrace (buffer, serializer, id, frame_ids, ts);
+      Commit ();
    }
 
-   void LeakFileStream::WriteAllocation (uint32_t id, libLeak::PALLOCATION_EVENT allocation)
+   uint32_t LeakFileStream::WriteStringOnce (const std::string& text)
    {
-      std::vector<uint8_t> bytes;
-      LeakFileStreamSerializer::SerializeAllocation (bytes, allocation, id);
-      Write (bytes);
+      auto written = written_strings.find (text);
+      if (written != written_strings.end ())
+         return written->second;
+
+      const uint32_t string_id = (uint32_t)written_strings.size ();
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeString (buffer, serializer, string_id, text);
+      Commit ();
+
+      written_strings.emplace (text, string_id);
+      return string_id;
+   }
+
+   uint32_t LeakFileStream::WriteFrameOnce (const libLeak::SYMBOL_ENTRY& symbol)
+   {
+      const uint32_t name_id = WriteStringOnce (symbol.name);
+      const uint32_t file_id = WriteStringOnce (symbol.file);
+      const auto key = std::make_tuple (name_id, file_id, (uint32_t)symbol.line);
+
+      auto written = written_frames.find (key);
+      if (written != written_frames.end ())
+         return written->second;
+
+      const uint32_t frame_id = (uint32_t)written_frames.size ();
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeFrame (buffer, serializer, frame_id, name_id, file_id, (uint32_t)symbol.line);
+      Commit ();
+
+      written_frames.emplace (key, frame_id);
+      return frame_id;
+   }
+
+   void LeakFileStream::WriteRawStacktrace (uint64_t id, const libLeak::STACKTRACE& stacktrace, uint64_t ts)
+   {
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeRawStacktrace (buffer, serializer, id, stacktrace, ts);
+      Commit ();
+   }
+
+   void LeakFileStream::WriteModule (const libLeak::MODULE_ENTRY& module, uint64_t ts)
+   {
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeModule (buffer, serializer, module, ts);
+      Commit ();
+   }
+
+   void LeakFileStream::WriteAllocation (uint64_t id, libLeak::PALLOCATION_EVENT allocation)
+   {
+      OpenBlock ();
+      if (event_columns)
+      {
+         events.push_back (true, allocation->TimestampEpochSeconds, (uint64_t)(uintptr_t)allocation->Pointer, allocation->Size, id);
+         if (events.size () >= EventChunkSize)
+            WriteEvents ();
+
+         Commit ();
+         return;
+      }
+
+      LeakFileStreamSerializer::SerializeAllocation (buffer, serializer, allocation, id);
+      Commit ();
+   }
+
+   void LeakFileStream::WriteReallocation (uint64_t id, libLeak::PALLOCATION_EVENT reallocation)
+   {
+      WriteEvents ();
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeReallocation (buffer, serializer, reallocation, id);
+      Commit ();
    }
 
    void LeakFileStream::WriteDeallocation (libLeak::PDELLOCATION_EVENT deallocation)
    {
-      std::vector<uint8_t> bytes;
-      LeakFileStreamSerializer::SerializeDeallocation (bytes, deallocation);
-      Write (bytes);
+      OpenBlock ();
+      if (event_columns)
+      {
+         events.push_back (false, deallocation->TimestampEpochSeconds, (uint64_t)(uintptr_t)deallocation->Pointer, 0, 0);
+         if (events.size () >= EventChunkSize)
+            WriteEvents ();
+
+         Commit ();
+         return;
+      }
+
+      LeakFileStreamSerializer::SerializeDeallocation (buffer, serializer, deallocation);
+      Commit ();
+   }
+
+   void LeakFileStream::WriteAggregate (uint64_t id, libLeak::PAGGREGATE_EVENT aggregate)
+   {
+      WriteEvents ();
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeAggregate (buffer, serializer, aggregate, id);
+      Commit ();
+   }
+
+   void LeakFileStream::WriteSnapshot (uint32_t id, const std::vector<LeakObjectSnapshotEntry>& entries, uint64_t ts)
+   {
+      WriteEvents ();
+      OpenBlock ();
+      LeakFileStreamSerializer::SerializeSnapshot (buffer, serializer, id, entries, ts);
+      Commit ();
    }
 
    bool LeakFileStream::ParseObject (LeakObject& object)
    {
-      return LeakFileStreamParser::ParseObject (file, object);
+      if (!LeakFileStreamParser::ReadObject (file, parser, record))
+         return false;
+
+      object = *(const LeakObject*)record.data ();
+      return true;
    }
 
    bool LeakFileStream::SkipObject (const LeakObject& object)
    {
-      return LeakFileStreamParser::SkipObject (file, object);
+      // The object was read completely by ParseObject.
+      return true;
    }
 
    bool LeakFileStream::ParseHeader (LeakObjectHeader& header)
    {
-      return LeakFileStreamParser::ParseHeader (file, header);
+      if (!LeakFileStreamParser::ParseHeader (file, header) || !LeakFileStreamParser::IsSupportedHeader (header))
+         return false;
+
+      parser.version = header.Version;
+      parser.architecture = header.Architecture;
+      return true;
    }
 
    bool LeakFileStream::ParseSession (LeakObjectSession& session)
    {
-      return LeakFileStreamParser::ParseSession (file, session);
+      return LeakFileStreamParser::ParseSession (record, session);
    }
 
    bool LeakFileStream::ParseAllocation (LeakObjectAllocation& allocation)
    {
-      return LeakFileStreamParser::ParseAllocation (file, allocation);
+      return LeakFileStreamParser::ParseAllocation (record, allocation);
+   }
+
+   bool LeakFileStream::ParseReallocation (LeakObjectReallocation& reallocation)
+   {
+      return LeakFileStreamParser::ParseReallocation (record, reallocation);
    }
 
    bool LeakFileStream::ParseDeallocation (LeakObjectDeallocation& deallocation)
    {
-      return LeakFileStreamParser::ParseDeallocation (file, deallocation);
+      return LeakFileStreamParser::ParseDeallocation (record, deallocation);
    }
 
    bool LeakFileStream::ParseStacktrace (LeakObjectStacktrace& stacktrace, std::vector<libLeak::SYMBOL_ENTRY>& symbols)
    {
-      return LeakFileStreamParser::ParseStacktrace (file, stacktrace, symbols);
+      return LeakFileStreamParser::ParseStacktrace (record, stacktrace, symbols, parser.frames);
    }
 
-   void LeakFileStream::Write (const std::vector<uint8_t>& bytes)
+   bool LeakFileStream::ParseRawStacktrace (LeakObjectRawStacktrace& stacktrace, std::vector<uint64_t>& frames)
    {
-      if (bytes.size ())
-      {
-         fwrite ((const void*)bytes.data(), bytes.size(), 1, file);
-      }
+      return LeakFileStreamParser::ParseRawStacktrace (record, stacktrace, frames);
    }
 
-   void LeakFileStream::Read (std::vector<uint8_t>& bytes)
+   bool LeakFileStream::ParseModule (LeakObjectModule& module, std::string& path)
    {
-      const size_t size_hdr = sizeof (LeakObject);
-
-      // The buffer must be at least have enough memory to store the header.
-      if (bytes.size () < size_hdr)
-         bytes.resize (size_hdr);
-
-      // Read the header.
-      if (size_hdr == fread (bytes.data (), size_hdr, 1, file))
-      {
-         // Grab the total object size.
-         const size_t object_size = ((LeakObject*)bytes.data ())->ObjectSize;
+      return LeakFileStreamParser::ParseModule (record, module, path);
+   }
 
-         // Make sure this is valid.
-         if (object_size > size_hdr)
-         {
-            // Resize the buffer to the actual object size.
-            bytes.resize (object_size);
-
-            // Get the remaining size and read the remaining bytes.
-            const size_t remaining_read_size = object_size - size_hdr;
-            if (remaining_read_size == fread (bytes.data () + size_hdr, remaining_read_size, 1, file))
-            {
-               return;
-            }
-         }
-      }
+   bool LeakFileStream::ParseAggregate (LeakObjectAggregate& aggregate)
+   {
+      return LeakFileStreamParser::ParseAggregate (record, aggregate);
+   }
 
-      // Something went wrong. Revert the buffer; so the caller
-      // can simply check if the bytes are empty or not.
-      bytes.clear ();
-      bytes.shrink_to_fit ();
+   bool LeakFileStream::ParseSnapshot (LeakObjectSnapshot& snapshot, std::vector<LeakObjectSnapshotEntry>& entries)
+   {
+      return LeakFileStreamParser::ParseSnapshot (record, snapshot, entries);
    }
-}
+}
\ No newline at end of file
@@ -2,6 +2,12 @@
 
 #include "libLeak.h"
 #include "LeakObject.h"
+#include "LeakFileStreamParser.h"
+#include "LeakFileStreamSerializer.h"
+
+#include <map>
+#include <tuple>
+#include <unordered_map>
 
 namespace libLeak
 {
@@ -9,38 +15,97 @@ namespace libLeak
    /// The LeakFileStream class handles serialization of leak
    /// events such as allocations, deallocations.
    ///
+   /// Objects are serialized into one output buffer that is reused for the whole session,
+   /// and written with a single fwrite once it holds FlushThreshold bytes or Flush is called.
+   /// The FILE* is unbuffered; stdio does not copy the objects a second time.
+   ///
+   /// Objects are grouped into blocks of BlockSize events (LeakObjectBlock). The header of a
+   /// block is completed when the block is closed, in the buffer or in the file; the index of
+   /// all blocks is written when the stream is destroyed.
+   ///
+   /// With event columns, allocations and deallocations are collected and written in columnar
+   /// chunks of up to EventChunkSize events (LeakObjectEvents). A chunk is written once it is
+   /// full, before any other event, so the events keep their order, and when the block is
+   /// closed. Flush does not write a partial chunk; the destructor does.
+   ///
    class LeakFileStream
    {
+   public:
+      static constexpr size_t FlushThreshold = 1 << 20;
+      static constexpr uint32_t BlockSize = 1 << 16;
+      static constexpr size_t EventChunkSize = 1 << 12;
+
+   private:
       FILE* file;
 
+      std::vector<uint8_t> buffer;                                                 // Objects not written yet
+      uint64_t written;                                                            // Bytes written to the file
+      uint64_t block_offset;                                                       // Offset of the open block, or 0
+      std::vector<LeakObjectBlockIndexEntry> blocks;                               // Closed blocks
+      std::vector<uint32_t> frame_ids;                                             // Frames of the stacktrace being written
+      bool event_columns;                                                          // Events are written in columnar chunks
+      EVENT_COLUMNS events;                                                        // Events of the next chunk
+      SERIALIZER_STATE serializer;
+      std::unordered_map<std::string, uint32_t> written_strings;                   // string -> string id
+      std::map<std::tuple<uint32_t, uint32_t, uint32_t>, uint32_t> written_frames; // (name, file, line) -> frame id
+
+      PARSER_STATE parser;
+      std::vector<uint8_t> record;                                                 // Object returned by ParseObject
+
    public:
       /// Constructs a new LeakFileStream. The ownership of FILE* is 
       /// transferred to this instance.
       LeakFileStream (FILE* fp);
 
-      /// Destructor. Closes the opened FILE*.
+      /// Destructor. Closes the last block, writes the buffered objects and the index of
+      /// the blocks, and closes the opened FILE*.
       virtual ~LeakFileStream ();
 
       LeakFileStream (const LeakFileStream&) = delete;
       LeakFileStream (LeakFileStream&&) = delete;
       LeakFileStream& operator = (const LeakFileStream&) = delete;
 
+      /// Writes the buffered objects to the file. The open block stays open; readers of the
+      /// file read it up to the end of the file. Collected events stay in their chunk.
+      void Flush ();
+
+      /// Writes allocations and deallocations in columnar chunks instead of one object each.
+      /// Must be called before the first event.
+      void SetEventColumns (bool enabled);
+
       /// Serializes the native binary header
       void WriteHeader ();
 
-      /// Serializes session information (process identifier, epoch timestamp)
-      void WriteSession (DWORD pid, uint64_t ts);
+      /// Serializes session information (process identifier, epoch timestamp, sampling interval)
+      void WriteSession (DWORD pid, uint64_t ts, uint64_t samplingInterval = 0);
 
-      /// Serializes a stacktrace
-      void WriteStacktrace (uint32_t id, const std::vector<libLeak::SYMBOL_ENTRY>& symbols, uint64_t ts);
+      /// Serializes a stacktrace, preceded by its frames and strings not written yet
+      void WriteStacktrace (uint64_t id, const std::vector<libLeak::SYMBOL_ENTRY>& symbols, uint64_t ts);
       
       /// Serializes an allocation
-      void WriteAllocation (uint32_t id, libLeak::PALLOCATION_EVENT allocation);
+      void WriteAllocation (uint64_t id, libLeak::PALLOCATION_EVENT allocation);
+
+      /// Serializes a reallocation
+      void WriteReallocation (uint64_t id, libLeak::PALLOCATION_EVENT reallocation);
 
       /// Serializes a deallocation
       void WriteDeallocation (libLeak::PDELLOCATION_EVENT deallocation);
 
-      /// Parses the next object in the native binary stream.
+      /// Serializes the raw frames of a stacktrace
+      void WriteRawStacktrace (uint64_t id, const libLeak::STACKTRACE& stacktrace, uint64_t ts);
+
+      /// Serializes a module of the profiled process
+      void WriteModule (const libLeak::MODULE_ENTRY& module, uint64_t ts);
+
+      /// Serializes the counters of a stacktrace
+      void WriteAggregate (uint64_t id, libLeak::PAGGREGATE_EVENT aggregate);
+
+      /// Serializes a snapshot of outstanding allocations
+      void WriteSnapshot (uint32_t id, const std::vector<LeakObjectSnapshotEntry>& entries, uint64_t ts);
+
+      /// Parses the next object in the native binary stream; files of all versions and
+      /// architectures are converted to the layout of LeakObject.h. String and frame objects
+      /// are consumed; the stacktraces are returned with their symbols.
       /// Returns true on success, otherwise false.
       bool ParseObject  (LeakObject& object);
 
@@ -49,7 +114,7 @@ namespace libLeak
       bool SkipObject (const LeakObject& object);
 
       /// Parses the header object.
-      /// Returns true on success, otherwise false.
+      /// Returns true on success, otherwise false (also for files of a newer version).
       bool ParseHeader  (LeakObjectHeader& header);
       
       /// Parses the session object.
@@ -60,6 +125,10 @@ namespace libLeak
       /// Returns true on success, otherwise false.
       bool ParseAllocation (LeakObjectAllocation& allocation);
       
+      /// Parses a reallocation object.
+      /// Returns true on success, otherwise false.
+      bool ParseReallocation (LeakObjectReallocation& reallocation);
+
       /// Parses a deallocation object.
       /// Returns true on success, otherwise false.
       bool ParseDeallocation (LeakObjectDeallocation& deallocation);
@@ -68,8 +137,36 @@ namespace libLeak
       /// Returns true on success, otherwise false.
       bool ParseStacktrace (LeakObjectStacktrace& stacktrace, std::vector<libLeak::SYMBOL_ENTRY>& symbols);
 
+      /// Parses a raw stacktrace object.
+      /// Returns true on success, otherwise false.
+      bool ParseRawStacktrace (LeakObjectRawStacktrace& stacktrace, std::vector<uint64_t>& frames);
+
+      /// Parses a module object.
+      /// Returns true on success, otherwise false.
+      bool ParseModule (LeakObjectModule& module, std::string& path);
+
+      /// Parses an aggregate object.
+      /// Returns true on success, otherwise false.
+      bool ParseAggregate (LeakObjectAggregate& aggregate);
+
+      /// Parses a snapshot object.
+      /// Returns true on success, otherwise false.
+      bool ParseSnapshot (LeakObjectSnapshot& snapshot, std::vector<LeakObjectSnapshotEntry>& entries);
+
    private:
-      void Write (const std::vector<uint8_t>& bytes);
-      void Read (std::vector<uint8_t>& bytes);
+      uint32_t WriteStringOnce (const std::string& text);
+      uint32_t WriteFrameOnce (const libLeak::SYMBOL_ENTRY& symbol);
+
+      /// Starts a block unless one is open.
+      void OpenBlock ();
+
+      /// Completes the header of the open block.
+      void CloseBlock ();
+
+      /// Closes the block once it holds BlockSize events and writes the buffer once it is full.
+      void Commit ();
+
+      /// Serializes the collected events as one chunk.
+      void WriteEvents ();
    };
 }
\ No newline at end of file
@@ -1,108 +1,861 @@
 #include "LeakFileStreamParser.h"
 
-namespace libLeak
+namespace
 {
-   bool LeakFileStreamParser::ParseObject (FILE* stream, LeakObject& object)
+   /// Objects larger than this are considered corrupt.
+   const uint64_t MaximumObjectSize = 1ULL << 30;
+
+   ///
+   /// Reads the fields of an object payload in the order of LeakObject.h.
+   /// Versions 1 - 3 store fixed width fields, size_t and intptr_t with the word size of the
+   /// architecture of the file; version 4 and later store varints and deltas (LeakFileStreamSerializer).
+   /// Reading past the payload clears 'ok' and returns zeros. Text refers to the payload.
+   ///
+   class FieldReader
    {
-      if (stream == NULL)
+      const uint8_t* mData;
+      size_t mSize;
+      size_t mOffset;
+      libLeak::PARSER_STATE& mState;
+      bool mCompact;
+      bool mBlocks;
+      size_t mWordSize;
+      size_t mIdSize;
+      uint64_t mFrame;                                            // Previous frame of a raw stacktrace
+
+   public:
+      bool ok;
+
+      FieldReader (const uint8_t* payload, size_t size, libLeak::PARSER_STATE& state)
+         : mData (payload)
+         , mSize (size)
+         , mOffset (0)
+         , mState (state)
+         , mCompact (state.version >= 4)
+         , mBlocks (state.version >= 5)
+         , mWordSize (state.architecture == 32 ? 4 : 8)
+         , mIdSize (state.version < 2 ? 4 : 8)
+         , mFrame (0)
+         , ok (true)
+      {
+      }
+
+      bool compact () const { return mCompact; }
+      size_t remaining () const { return mSize - mOffset; }
+
+      /// Little endian integer of 'size' bytes.
+      uint64_t Fixed (size_t size)
+      {
+         if (remaining () < size)
+            return Fail ();
+
+         uint64_t value = 0;
+         for (size_t i = 0; i < size; i++)
+            value |= (uint64_t)mData[mOffset + i] << (i * 8);
+
+         mOffset += size;
+         return value;
+      }
+
+      uint64_t Varint ()
+      {
+         uint64_t value = 0;
+         for (int shift = 0; shift < 64; shift += 7)
+         {
+            if (remaining () == 0)
+               break;
+
+            const uint8_t byte = mData[mOffset++];
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+               return value;
+         }
+
+         return Fail ();
+      }
+
+      int64_t SignedVarint ()
+      {
+         const uint64_t value = Varint ();
+         return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+      }
+
+      const uint8_t* Bytes (uint64_t size)
+      {
+         if (remaining () < size)
+         {
+            Fail ();
+            return nullptr;
+         }
+
+         const uint8_t* bytes = mData + mOffset;
+         mOffset += (size_t)size;
+         return bytes;
+      }
+
+      std::string_view Text (uint64_t size)
+      {
+         const uint8_t* bytes = Bytes (size);
+         return bytes ? std::string_view ((const char*)bytes, (size_t)size) : std::string_view ();
+      }
+
+      uint64_t Timestamp ()
+      {
+         if (!mCompact)
+            return Fixed (8);
+
+         mState.timestamp += (uint64_t)SignedVarint ();
+         return mState.timestamp;
+      }
+
+      uint64_t Pointer ()
+      {
+         if (!mCompact)
+            return Fixed (mWordSize);
+
+         mState.pointer += (uint64_t)SignedVarint ();
+         return mState.pointer;
+      }
+
+      /// Fields that were size_t. Counts are limited by the remaining payload.
+      uint64_t Size ()
+      {
+         return mCompact ? Varint () : Fixed (mWordSize);
+      }
+
+      uint64_t Count (size_t minimum_entry_size)
+      {
+         const uint64_t count = Size ();
+         return count > remaining () / minimum_entry_size ? Fail () : count;
+      }
+
+      /// Fields that are uint64_t.
+      uint64_t Counter ()
+      {
+         return mCompact ? Varint () : Fixed (8);
+      }
+
+      /// Fields that are uint32_t or int32_t.
+      uint32_t Value ()
+      {
+         return (uint32_t)(mCompact ? Varint () : Fixed (4));
+      }
+
+      /// Id of a stacktrace defined by the object.
+      uint64_t StacktraceId ()
+      {
+         const uint64_t id = Fixed (mCompact ? 8 : mIdSize);
+         if (ok)
+            mState.stacktrace_ids.push_back (id);
+
+         return id;
+      }
+
+      /// Reference to a stacktrace.
+      uint64_t StacktraceRef ()
+      {
+         if (!mCompact)
+            return Fixed (mIdSize);
+
+         const uint64_t index = Varint ();
+         if (index == 0)
+         {
+            // Version 5 assigns an index to the first reference in a block.
+            const uint64_t id = Fixed (8);
+            if (ok && mBlocks)
+               mState.stacktrace_ids.push_back (id);
+
+            return id;
+         }
+
+         return index <= mState.stacktrace_ids.size () ? mState.stacktrace_ids[(size_t)index - 1] : Fail ();
+      }
+
+      /// Frame of a raw stacktrace; call BeginFrames before the first frame.
+      void BeginFrames () { mFrame = 0; }
+      uint64_t Frame ()
+      {
+         if (!mCompact)
+            return Fixed (8);
+
+         mFrame += (uint64_t)SignedVarint ();
+         return mFrame;
+      }
+
+   private:
+      uint64_t Fail ()
+      {
+         ok = false;
+         mOffset = mSize;
+         return 0;
+      }
+   };
+
+   /// Starts the block of the given header. The encoding of its objects does not depend on
+   /// the objects before it. Returns false at the index of the blocks.
+   bool BeginBlock (const libLeak::LeakObjectBlock& block, libLeak::PARSER_STATE& state)
+   {
+      if (block.Magic != libLeak::LeakObjectBlockMagic)
          return false;
 
-      auto previous = ftell (stream);
-      bool success = fread (&object, sizeof (LeakObject), 1, stream) == 1;
-      if (success)
+      state.timestamp = 0;
+      state.pointer = 0;
+      state.stacktrace_ids.clear ();
+
+      // The last block of a file that was not closed ends at the end of the file.
+      state.block_remaining = block.Size ? block.Size : UINT64_MAX;
+      return true;
+   }
+
+   /// Accounts an object of 'size' bytes to the current block.
+   /// Returns false if the object exceeds the block.
+   bool EndObject (libLeak::PARSER_STATE& state, uint64_t size)
+   {
+      if (state.version < 5 || state.block_remaining == UINT64_MAX)
+         return true;
+
+      if (size > state.block_remaining)
+         return false;
+
+      state.block_remaining -= size;
+      return true;
+   }
+
+   /// Reads the type and the payload of the next object.
+   bool ReadPayload (FILE* stream, libLeak::PARSER_STATE& state, uint8_t& type, std::vector<uint8_t>& payload)
+   {
+      if (state.version >= 5 && state.block_remaining == 0)
       {
-         previous = ftell (stream);
-         fseek (stream, - (long)sizeof (LeakObject), SEEK_CUR);
-         auto now = ftell (stream);
-         return previous > now;
+         libLeak::LeakObjectBlock block;
+         if (fread (&block, sizeof (block), 1, stream) != 1 || !BeginBlock (block, state))
+            return false;
       }
 
-      return false;
+      uint64_t size = 0;
+      uint64_t header_size = 0;
+      if (state.version >= 4)
+      {
+         const int first = fgetc (stream);
+         if (first == EOF)
+            return false;
+
+         type = (uint8_t)first;
+         for (int shift = 0; ; shift += 7)
+         {
+            const int byte = fgetc (stream);
+            if (byte == EOF || shift >= 64)
+               return false;
+
+            size |= (uint64_t)(byte & 0x7F) << shift;
+            header_size = 2 + shift / 7;
+            if ((byte & 0x80) == 0)
+               break;
+         }
+      }
+      else
+      {
+         // [uint8_t type][uint8_t reserved][word size]
+         const size_t word_size = state.architecture == 32 ? 4 : 8;
+         uint8_t header[2 + 8];
+         if (fread (header, 2 + word_size, 1, stream) != 1)
+            return false;
+
+         type = header[0];
+         for (size_t i = 0; i < word_size; i++)
+            size |= (uint64_t)header[2 + i] << (i * 8);
+
+         if (size < 2 + word_size)
+            return false;
+
+         size -= 2 + word_size;
+      }
+
+      if (size > MaximumObjectSize || !EndObject (state, header_size + size))
+         return false;
+
+      payload.resize ((size_t)size);
+      return size == 0 || fread (payload.data (), (size_t)size, 1, stream) == 1;
    }
 
-   bool LeakFileStreamParser::SkipObject (FILE* stream, const LeakObject& object)
+   /// Reads the type and the payload of the next object in place.
+   bool ReadPayload (const uint8_t*& data, const uint8_t* end, libLeak::PARSER_STATE& state, uint8_t& type, const uint8_t*& payload, size_t& payload_size)
    {
-      auto now = ftell (stream);
-      if (object.ObjectSize > LONG_MAX)
+      if (state.version >= 5 && state.block_remaining == 0)
+      {
+         libLeak::LeakObjectBlock block;
+         if ((size_t)(end - data) < sizeof (block))
+            return false;
+
+         memcpy (&block, data, sizeof (block));
+         if (!BeginBlock (block, state))
+            return false;
+
+         data += sizeof (block);
+      }
+
+      const uint8_t* position = data;
+      uint64_t size = 0;
+      if (state.version >= 4)
+      {
+         if (position == end)
+            return false;
+
+         type = *position++;
+         for (int shift = 0; ; shift += 7)
+         {
+            if (position == end || shift >= 64)
+               return false;
+
+            const uint8_t byte = *position++;
+            size |= (uint64_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+               break;
+         }
+      }
+      else
+      {
+         // [uint8_t type][uint8_t reserved][word size]
+         const size_t word_size = state.architecture == 32 ? 4 : 8;
+         if ((size_t)(end - position) < 2 + word_size)
+            return false;
+
+         type = position[0];
+         for (size_t i = 0; i < word_size; i++)
+            size |= (uint64_t)position[2 + i] << (i * 8);
+
+         if (size < 2 + word_size)
+            return false;
+
+         position += 2 + word_size;
+         size -= 2 + word_size;
+      }
+
+      if (size > MaximumObjectSize || size > (uint64_t)(end - position) ||
+         !EndObject (state, (uint64_t)(position - data) + size))
+      {
          return false;
+      }
 
-      fseek (stream, (long)object.ObjectSize, SEEK_CUR);
-      return ftell (stream) == now + object.ObjectSize;
+      payload = position;
+      payload_size = (size_t)size;
+      data = position + payload_size;
+      return true;
    }
-   
-   bool LeakFileStreamParser::ParseHeader (FILE* stream, LeakObjectHeader& header)
+
+   /// Strings of payloads read from a FILE* are copied; the payload is reused.
+   std::string_view KeepText (libLeak::PARSER_STATE& state, std::string_view text, bool in_place)
    {
-      return ftell(stream) == 0 && fread (&header, sizeof (LeakObjectHeader), 1, stream) == 1;
+      if (in_place)
+         return text;
+
+      state.text.emplace_back (text);
+      return state.text.back ();
    }
 
-   bool LeakFileStreamParser::ParseSession (FILE* stream, LeakObjectSession& session)
+   /// Starts a record of the given layout with 'extra' bytes of dynamic data.
+   template <typename T>
+   T* BeginRecord (std::vector<uint8_t>& record, libLeak::LeakObjectType type, size_t extra = 0)
    {
-      return fread (&session, sizeof (LeakObjectSession), 1, stream) == 1
-         && session.ObjectType == (int)LeakObjectType::Session;
+      record.assign (sizeof (T) + extra, 0);
+      T* item = (T*)record.data ();
+      item->ObjectType = (uint8_t)type;
+      item->ObjectSize = record.size ();
+      return item;
    }
 
-   bool LeakFileStreamParser::ParseAllocation (FILE* stream, LeakObjectAllocation& allocation)
+   /// Copies the layout of a record.
+   template <typename T>
+   bool CopyRecord (const std::vector<uint8_t>& record, T& object, libLeak::LeakObjectType type)
    {
-      return fread (&allocation, sizeof (LeakObjectAllocation), 1, stream) == 1
-         && allocation.ObjectType == (int)LeakObjectType::Allocation;
+      if (record.size () < sizeof (T) || ((const libLeak::LeakObject*)record.data ())->ObjectType != (uint8_t)type)
+         return false;
+
+      memcpy (&object, record.data (), sizeof (T));
+      return true;
    }
-   
-   bool LeakFileStreamParser::ParseDeallocation (FILE* stream, LeakObjectDeallocation& deallocation)
+
+   bool ReadSession (FieldReader& reader, std::vector<uint8_t>& record)
+   {
+      auto item = BeginRecord<libLeak::LeakObjectSession> (record, libLeak::LeakObjectType::Session);
+      item->ProcessId = (int32_t)reader.Value ();
+      item->Timestamp = reader.Timestamp ();
+
+      // Sessions written by older versions end after Timestamp.
+      if (reader.remaining ())
+         item->SamplingInterval = reader.Counter ();
+
+      return reader.ok;
+   }
+
+   bool ReadAllocation (FieldReader& reader, std::vector<uint8_t>& record)
+   {
+      auto item = BeginRecord<libLeak::LeakObjectAllocation> (record, libLeak::LeakObjectType::Allocation);
+      item->StacktraceId = reader.StacktraceRef ();
+      item->Timestamp = reader.Timestamp ();
+      item->Pointer = reader.Pointer ();
+      item->PointerSize = reader.Size ();
+      return reader.ok;
+   }
+
+   bool ReadReallocation (FieldReader& reader, std::vector<uint8_t>& record)
    {
-      return fread (&deallocation, sizeof (LeakObjectDeallocation), 1, stream) == 1
-         && deallocation.ObjectType == (int)LeakObjectType::Deallocation;
+      auto item = BeginRecord<libLeak::LeakObjectReallocation> (record, libLeak::LeakObjectType::Reallocation);
+      item->StacktraceId = reader.StacktraceRef ();
+      item->Timestamp = reader.Timestamp ();
+      item->PreviousPointer = reader.Pointer ();
+      item->Pointer = reader.Pointer ();
+      item->PointerSize = reader.Size ();
+      return reader.ok;
    }
 
-   bool LeakFileStreamParser::ParseStacktrace (FILE* stream, LeakObjectStacktrace& stacktrace, std::vector<libLeak::SYMBOL_ENTRY>& symbols)
+   bool ReadDeallocation (FieldReader& reader, std::vector<uint8_t>& record)
    {
-      if (fread (&stacktrace, sizeof (LeakObjectStacktrace), 1, stream) == 1)
+      auto item = BeginRecord<libLeak::LeakObjectDeallocation> (record, libLeak::LeakObjectType::Deallocation);
+      item->Timestamp = reader.Timestamp ();
+      item->Pointer = reader.Pointer ();
+      return reader.ok;
+   }
+
+   /// Stacktraces of version 3 and later refer to frames. The inline entries of older
+   /// versions are added to the frame table, so the record refers to frames as well.
+   bool ReadStacktrace (FieldReader& reader, libLeak::PARSER_STATE& state, std::vector<uint8_t>& record, bool in_place)
+   {
+      const uint64_t ts = reader.Timestamp ();
+      const uint64_t id = reader.StacktraceId ();
+      const uint64_t count = reader.Count (1);
+      if (!reader.ok)
+         return false;
+
+      auto item = BeginRecord<libLeak::LeakObjectStacktrace> (record, libLeak::LeakObjectType::Stacktrace, (size_t)count * sizeof (uint32_t));
+      item->Timestamp = ts;
+      item->StacktraceId = id;
+      item->NumEntries = count;
+
+      // The ids follow the packed structure unaligned; they are copied byte-wise.
+      uint8_t* frame_ids = record.data () + sizeof (libLeak::LeakObjectStacktrace);
+      for (uint64_t i = 0; i < count && reader.ok; i++)
       {
-         // Parsed the stacktrace header. Parse the entries now.
-         for (uint32_t i = 0; i < stacktrace.NumEntries; i++)
+         uint32_t frame_id;
+         if (state.version >= 3)
          {
-            // The layout of a single entry is stored in the following format.
-            // [size_t name_size  ]
-            // [char[name_size] name]
-            // [size_t file_line  ]
-            // [size_t file_size  ]
-            // [char[file_size] file]
-            
-            std::string name;
-            uint32_t name_size = 0;
-            if (fread (&name_size, sizeof (size_t), 1, stream) == 1)
-            {
-               // Symbol name is not empty.
-               name.resize (name_size);
-               if (fread (name.data (), name_size, 1, stream) != 1)
-               {
-                  name.clear ();
-                  name.shrink_to_fit ();
-               }
-            }
-
-            size_t file_line;
-            fread(&file_line, sizeof(size_t), 1, stream);
-
-            std::string file;
-            size_t file_size;
-            if (fread (&file_size, sizeof (size_t), 1, stream) == 1)
-            {
-               // Symbol name is not empty.
-               file.resize (file_size);
-               if (fread (file.data (), file_size, 1, stream) != 1)
-               {
-                  file.clear ();
-                  file.shrink_to_fit ();
-               }
-            }
-
-            symbols.push_back ({ name, file, (DWORD)file_line });
+            frame_id = (uint32_t)reader.Value ();
+            memcpy (frame_ids + i * sizeof (frame_id), &frame_id, sizeof (frame_id));
+            continue;
          }
 
+         // [size_t name_size][char[name_size] name][size_t file_line][size_t file_size][char[file_size] file]
+         libLeak::FRAME_VIEW entry;
+         entry.name = KeepText (state, reader.Text (reader.Size ()), in_place);
+         entry.line = (DWORD)reader.Size ();
+         entry.file = KeepText (state, reader.Text (reader.Size ()), in_place);
+
+         frame_id = (uint32_t)state.frames.size ();
+         memcpy (frame_ids + i * sizeof (frame_id), &frame_id, sizeof (frame_id));
+         state.frames.push_back (entry);
+      }
+
+      return reader.ok;
+   }
+
+   bool ReadRawStacktrace (FieldReader& reader, std::vector<uint8_t>& record)
+   {
+      const uint64_t ts = reader.Timestamp ();
+      const uint64_t id = reader.StacktraceId ();
+      const uint64_t count = reader.Count (1);
+      if (!reader.ok)
+         return false;
+
+      auto item = BeginRecord<libLeak::LeakObjectRawStacktrace> (record, libLeak::LeakObjectType::RawStacktrace, (size_t)count * sizeof (uint64_t));
+      item->Timestamp = ts;
+      item->StacktraceId = id;
+      item->NumFrames = count;
+
+      uint64_t* frames = (uint64_t*)(record.data () + sizeof (libLeak::LeakObjectRawStacktrace));
+      reader.BeginFrames ();
+      for (uint64_t i = 0; i < count; i++)
+         frames[i] = reader.Frame ();
+
+      return reader.ok;
+   }
+
+   bool ReadModule (FieldReader& reader, std::vector<uint8_t>& record)
+   {
+      libLeak::LeakObjectModule module;
+      memset (&module, 0, sizeof (module));
+      module.Timestamp = reader.Timestamp ();
+      module.BaseAddress = reader.Counter ();
+      module.Size = reader.Counter ();
+      module.TimeDateStamp = reader.Value ();
+      module.Age = reader.Value ();
+      module.IdentitySize = (uint8_t)reader.Fixed (1);
+      if (module.IdentitySize > sizeof (module.Identity))
+         return false;
+
+      // Version 4 only stores the used bytes of the identity.
+      const uint8_t* identity = reader.Bytes (reader.compact () ? module.IdentitySize : sizeof (module.Identity));
+      if (identity)
+         memcpy (module.Identity, identity, module.IdentitySize);
+
+      module.PathSize = reader.Count (1);
+      const uint8_t* path = reader.Bytes (module.PathSize);
+      if (!reader.ok)
+         return false;
+
+      auto item = BeginRecord<libLeak::LeakObjectModule> (record, libLeak::LeakObjectType::Module, (size_t)module.PathSize);
+      module.ObjectType = item->ObjectType;
+      module.ObjectSize = item->ObjectSize;
+      memcpy (item, &module, sizeof (module));
+      if (module.PathSize)
+         memcpy (record.data () + sizeof (libLeak::LeakObjectModule), path, (size_t)module.PathSize);
+
+      return true;
+   }
+
+   bool ReadSnapshot (FieldReader& reader, std::vector<uint8_t>& record)
+   {
+      const uint64_t ts = reader.Timestamp ();
+      const uint32_t snapshot_id = reader.Value ();
+      const uint64_t count = reader.Count (3);
+      if (!reader.ok)
+         return false;
+
+      auto item = BeginRecord<libLeak::LeakObjectSnapshot> (record, libLeak::LeakObjectType::Snapshot, (size_t)count * sizeof (libLeak::LeakObjectSnapshotEntry));
+      item->Timestamp = ts;
+      item->SnapshotId = snapshot_id;
+      item->NumEntries = count;
+
+      libLeak::LeakObjectSnapshotEntry* entries = (libLeak::LeakObjectSnapshotEntry*)(record.data () + sizeof (libLeak::LeakObjectSnapshot));
+      for (uint64_t i = 0; i < count; i++)
+      {
+         entries[i].StacktraceId = reader.StacktraceRef ();
+         entries[i].Count = reader.Counter ();
+         entries[i].Bytes = reader.Counter ();
+      }
+
+      return reader.ok;
+   }
+
+   bool ReadAggregate (FieldReader& reader, std::vector<uint8_t>& record)
+   {
+      auto item = BeginRecord<libLeak::LeakObjectAggregate> (record, libLeak::LeakObjectType::Aggregate);
+      item->Timestamp = reader.Timestamp ();
+      item->StacktraceId = reader.StacktraceRef ();
+      item->Allocations = reader.Counter ();
+      item->Deallocations = reader.Counter ();
+      item->LiveBytes = reader.Counter ();
+      item->PeakBytes = reader.Counter ();
+      return reader.ok;
+   }
+
+   /// Strings and frames are assigned ascending ids.
+   bool AddString (libLeak::PARSER_STATE& state, uint32_t string_id, std::string_view text, bool in_place)
+   {
+      if (string_id != state.strings.size ())
+         return false;
+
+      state.strings.push_back (KeepText (state, text, in_place));
+      return true;
+   }
+
+   bool AddFrame (libLeak::PARSER_STATE& state, uint32_t frame_id, uint32_t name_id, uint32_t file_id, uint32_t line)
+   {
+      if (frame_id != state.frames.size () ||
+         name_id >= state.strings.size () ||
+         file_id >= state.strings.size ())
+      {
+         return false;
+      }
+
+      state.frames.push_back ({ state.strings[name_id], state.strings[file_id], (DWORD)line });
+      return true;
+   }
+
+   /// Adds the string to the state, or returns it as a record if definitions are deferred.
+   bool ReadString (FieldReader& reader, libLeak::PARSER_STATE& state, std::vector<uint8_t>& record, bool in_place)
+   {
+      const uint32_t string_id = reader.Value ();
+      const std::string_view text = reader.Text (reader.Count (1));
+      if (!reader.ok)
+         return false;
+
+      if (!state.defer_definitions)
+         return AddString (state, string_id, text, in_place);
+
+      auto item = BeginRecord<libLeak::LeakObjectString> (record, libLeak::LeakObjectType::String, text.size ());
+      item->StringId = string_id;
+      item->Size = text.size ();
+      if (text.size ())
+         memcpy (record.data () + sizeof (libLeak::LeakObjectString), text.data (), text.size ());
+
+      return true;
+   }
+
+   /// Adds the frame to the state, or returns it as a record if definitions are deferred.
+   bool ReadFrame (FieldReader& reader, libLeak::PARSER_STATE& state, std::vector<uint8_t>& record)
+   {
+      const uint32_t frame_id = reader.Value ();
+      const uint32_t name_id = reader.Value ();
+      const uint32_t file_id = reader.Value ();
+      const uint32_t line = reader.Value ();
+      if (!reader.ok)
+         return false;
+
+      if (!state.defer_definitions)
+         return AddFrame (state, frame_id, name_id, file_id, line);
+
+      auto item = BeginRecord<libLeak::LeakObjectFrame> (record, libLeak::LeakObjectType::Frame);
+      item->FrameId = frame_id;
+      item->NameId = name_id;
+      item->FileId = file_id;
+      item->Line = line;
+      return true;
+   }
+
+   /// Converts the next event of the last columnar chunk to a record.
+   /// Returns false once all events were returned.
+   bool NextEvent (libLeak::PARSER_STATE& state, std::vector<uint8_t>& record)
+   {
+      const libLeak::EVENT_COLUMNS& events = state.events;
+      const size_t i = state.next_event;
+      if (i >= events.size ())
+         return false;
+
+      state.next_event++;
+      if (events.allocations[i])
+      {
+         auto item = BeginRecord<libLeak::LeakObjectAllocation> (record, libLeak::LeakObjectType::Allocation);
+         item->StacktraceId = events.stacktrace_ids[i];
+         item->Timestamp = events.timestamps[i];
+         item->Pointer = events.pointers[i];
+         item->PointerSize = events.sizes[i];
+      }
+      else
+      {
+         auto item = BeginRecord<libLeak::LeakObjectDeallocation> (record, libLeak::LeakObjectType::Deallocation);
+         item->Timestamp = events.timestamps[i];
+         item->Pointer = events.pointers[i];
+      }
+
+      return true;
+   }
+
+   /// Returns the events of a decoded columnar chunk as one record, or starts to return them by NextEvent.
+   /// Returns false if there is no record.
+   bool BeginEvents (libLeak::PARSER_STATE& state, std::vector<uint8_t>& record)
+   {
+      if (!state.event_columns)
+      {
+         state.next_event = 0;
+         return NextEvent (state, record);
+      }
+
+      state.next_event = state.events.size ();
+      auto item = BeginRecord<libLeak::LeakObjectEvents> (record, libLeak::LeakObjectType::Events);
+      item->NumEvents = state.events.size ();
+      return true;
+   }
+
+   enum class Decoded
+   {
+      Record,                                                     // The object was converted to a record
+      Consumed,                                                   // The object was added to the state
+      Failed
+   };
+
+   /// Converts the payload of an object to a record or adds it to the state.
+   /// 'in_place' is set if the payload stays valid while the state is used.
+   Decoded DecodeObject (uint8_t type, const uint8_t* payload, size_t size, libLeak::PARSER_STATE& state, std::vector<uint8_t>& record, bool in_place)
+   {
+      using libLeak::LeakObjectType;
+
+      FieldReader reader (payload, size, state);
+      bool result = false;
+      switch ((LeakObjectType)type)
+      {
+      case LeakObjectType::Session:       result = ReadSession (reader, record); break;
+      case LeakObjectType::Allocation:    result = ReadAllocation (reader, record); break;
+      case LeakObjectType::Deallocation:  result = ReadDeallocation (reader, record); break;
+      case LeakObjectType::Reallocation:  result = ReadReallocation (reader, record); break;
+      case LeakObjectType::Stacktrace:    result = ReadStacktrace (reader, state, record, in_place); break;
+      case LeakObjectType::RawStacktrace: result = ReadRawStacktrace (reader, record); break;
+      case LeakObjectType::Module:        result = ReadModule (reader, record); break;
+      case LeakObjectType::Snapshot:      result = ReadSnapshot (reader, record); break;
+      case LeakObjectType::Aggregate:     result = ReadAggregate (reader, record); break;
+
+      case LeakObjectType::String:
+         if (!ReadString (reader, state, record, in_place))
+            return Decoded::Failed;
+         return state.defer_definitions ? Decoded::Record : Decoded::Consumed;
+
+      case LeakObjectType::Frame:
+         if (!ReadFrame (reader, state, record))
+            return Decoded::Failed;
+         return state.defer_definitions ? Decoded::Record : Decoded::Consumed;
+
+      case LeakObjectType::Events:
+         if (!libLeak::LeakEventColumns::Decode (payload, size, state.events, state.stacktrace_ids))
+         {
+            state.events.clear ();
+            return Decoded::Failed;
+         }
+
+         // A chunk without events is skipped.
+         return BeginEvents (state, record) ? Decoded::Record : Decoded::Consumed;
+
+      default:
+         // Unknown object; returned as it is, callers skip it.
+         BeginRecord<libLeak::LeakObject> (record, (LeakObjectType)type, size);
+         if (size)
+            memcpy (record.data () + sizeof (libLeak::LeakObject), payload, size);
+         return Decoded::Record;
+      }
+
+      return result ? Decoded::Record : Decoded::Failed;
+   }
+}
+
+namespace libLeak
+{
+   bool LeakFileStreamParser::ParseHeader (FILE* stream, LeakObjectHeader& header)
+   {
+      return ftell(stream) == 0 && fread (&header, sizeof (LeakObjectHeader), 1, stream) == 1;
+   }
+
+   bool LeakFileStreamParser::IsSupportedHeader (const LeakObjectHeader& header)
+   {
+      return header.Version != 0 && header.Version <= LeakObjectVersion &&
+         (header.Architecture == 32 || header.Architecture == 64);
+   }
+
+   bool LeakFileStreamParser::ReadObject (FILE* stream, PARSER_STATE& state, std::vector<uint8_t>& record)
+   {
+      if (stream == NULL)
+         return false;
+
+      if (NextEvent (state, record))
+         return true;
+
+      uint8_t type = 0;
+      std::vector<uint8_t>& payload = state.payload;
+      while (ReadPayload (stream, state, type, payload))
+      {
+         const Decoded decoded = DecodeObject (type, payload.data (), payload.size (), state, record, false);
+         if (decoded != Decoded::Consumed)
+            return decoded == Decoded::Record;
+      }
+
+      return false;
+   }
+
+   bool LeakFileStreamParser::ReadObject (const uint8_t*& data, const uint8_t* end, PARSER_STATE& state, std::vector<uint8_t>& record)
+   {
+      if (NextEvent (state, record))
          return true;
+
+      uint8_t type = 0;
+      const uint8_t* payload = nullptr;
+      size_t size = 0;
+      while (ReadPayload (data, end, state, type, payload, size))
+      {
+         const Decoded decoded = DecodeObject (type, payload, size, state, record, true);
+         if (decoded != Decoded::Consumed)
+            return decoded == Decoded::Record;
       }
 
       return false;
    }
 
-}
\ No newline at end of file
+   bool LeakFileStreamParser::AddDefinition (const std::vector<uint8_t>& record, PARSER_STATE& state)
+   {
+      LeakObjectString string;
+      if (CopyRecord (record, string, LeakObjectType::String))
+      {
+         if (string.Size > record.size () - sizeof (LeakObjectString))
+            return false;
+
+         const std::string_view text ((const char*)record.data () + sizeof (LeakObjectString), (size_t)string.Size);
+         return AddString (state, string.StringId, text, false);
+      }
+
+      LeakObjectFrame frame;
+      if (CopyRecord (record, frame, LeakObjectType::Frame))
+         return AddFrame (state, frame.FrameId, frame.NameId, frame.FileId, frame.Line);
+
+      return false;
+   }
+
+   bool LeakFileStreamParser::ParseSession (const std::vector<uint8_t>& record, LeakObjectSession& session)
+   {
+      return CopyRecord (record, session, LeakObjectType::Session);
+   }
+
+   bool LeakFileStreamParser::ParseAllocation (const std::vector<uint8_t>& record, LeakObjectAllocation& allocation)
+   {
+      return CopyRecord (record, allocation, LeakObjectType::Allocation);
+   }
+
+   bool LeakFileStreamParser::ParseReallocation (const std::vector<uint8_t>& record, LeakObjectReallocation& reallocation)
+   {
+      return CopyRecord (record, reallocation, LeakObjectType::Reallocation);
+   }
+
+   bool LeakFileStreamParser::ParseDeallocation (const std::vector<uint8_t>& record, LeakObjectDeallocation& deallocation)
+   {
+      return CopyRecord (record, deallocation, LeakObjectType::Deallocation);
+   }
+
+   bool LeakFileStreamParser::ParseStacktrace (const std::vector<uint8_t>& record, LeakObjectStacktrace& stacktrace, std::vector<libLeak::SYMBOL_ENTRY>& symbols, const std::vector<FRAME_VIEW>& frames)
+   {
+      if (!CopyRecord (record, stacktrace, LeakObjectType::Stacktrace))
+         return false;
+
+      const uint8_t* frame_ids = record.data () + sizeof (LeakObjectStacktrace);
+      symbols.reserve (symbols.size () + (size_t)stacktrace.NumEntries);
+      for (uint64_t i = 0; i < stacktrace.NumEntries; i++)
+      {
+         uint32_t frame_id;
+         memcpy (&frame_id, frame_ids + i * sizeof (frame_id), sizeof (frame_id));
+         if (frame_id >= frames.size ())
+            return false;
+
+         const FRAME_VIEW& frame = frames[frame_id];
+         symbols.push_back ({ std::string (frame.name), std::string (frame.file), frame.line });
+      }
+
+      return true;
+   }
+
+   bool LeakFileStreamParser::ParseRawStacktrace (const std::vector<uint8_t>& record, LeakObjectRawStacktrace& stacktrace, std::vector<uint64_t>& frames)
+   {
+      if (!CopyRecord (record, stacktrace, LeakObjectType::RawStacktrace))
+         return false;
+
+      const uint64_t* data = (const uint64_t*)(record.data () + sizeof (LeakObjectRawStacktrace));
+      frames.assign (data, data + stacktrace.NumFrames);
+      return true;
+   }
+
+   bool LeakFileStreamParser::ParseModule (const std::vector<uint8_t>& record, LeakObjectModule& module, std::string& path)
+   {
+      if (!CopyRecord (record, module, LeakObjectType::Module))
+         return false;
+
+      path.assign ((const char*)record.data () + sizeof (LeakObjectModule), (size_t)module.PathSize);
+      return true;
+   }
+
+   bool LeakFileStreamParser::ParseSnapshot (const std::vector<uint8_t>& record, LeakObjectSnapshot& snapshot, std::vector<LeakObjectSnapshotEntry>& entries)
+   {
+      if (!CopyRecord (record, snapshot, LeakObjectType::Snapshot))
+         return false;
+
+      const LeakObjectSnapshotEntry* data = (const LeakObjectSnapshotEntry*)(record.data () + sizeof (LeakObjectSnapshot));
+      entries.assign (data, data + snapshot.NumEntries);
+      return true;
+   }
+
+   bool LeakFileStreamParser::ParseAggregate (const std::vector<uint8_t>& record, LeakObjectAggregate& aggregate)
+   {
+      return CopyRecord (record, aggregate, LeakObjectType::Aggregate);
+   }
+}
@@ -2,11 +2,49 @@
 
 #include "libLeak.h"
 #include "LeakObject.h"
+#include "LeakEventColumns.h"
+
+#include <deque>
+#include <string_view>
 
 namespace libLeak
 {
+   /// A frame of a parsed stacktrace. The strings refer to the parsed bytes
+   /// (LeakFileView) or to the strings kept by the PARSER_STATE (LeakFileStream).
+   typedef struct FRAME_VIEW_ {
+      std::string_view name;
+      std::string_view file;
+      DWORD line;
+   } FRAME_VIEW;
+
+   /// State of a parsed stream; objects refer to the objects before them.
+   typedef struct PARSER_STATE_ {
+      uint16_t version = LeakObjectVersion;                      // Version of the header
+      uint16_t architecture = LeakObjectHeader::GetArchitecture ();
+      uint64_t timestamp = 0;                                     // Timestamp of the previous object
+      uint64_t pointer = 0;                                       // Pointer of the previous object
+      std::vector<uint64_t> stacktrace_ids;                       // stacktrace index -> stacktrace id
+      uint64_t block_remaining = 0;                               // Bytes left in the current block; UINT64_MAX if unknown
+      bool defer_definitions = false;                             // Return strings and frames as records (AddDefinition)
+      bool event_columns = false;                                 // Return columnar chunks as one record (LeakObjectEvents)
+      EVENT_COLUMNS events;                                       // Events of the last columnar chunk
+      size_t next_event = 0;                                      // Next event of the chunk returned as a record
+      std::vector<std::string_view> strings;                      // string id -> string
+      std::vector<FRAME_VIEW> frames;                             // frame id -> frame
+      std::deque<std::string> text;                               // Strings read from a FILE*
+      std::vector<uint8_t> payload;                               // Encoded object read from a FILE*
+   } PARSER_STATE;
+
    /// Static helper class to encapusalte the actual methods
    /// to parse objects from the native binary file.
+   ///
+   /// ReadObject reads the next object of any version and architecture and converts it
+   /// to the layout of LeakObject.h (the 'record'); the Parse methods copy the record.
+   /// Objects are read in order, so delta encoded fields stay valid for skipped objects.
+   /// The headers of the blocks of version 5 are read between the objects; reading ends at
+   /// the index of the blocks. To read from the start of a block, set 'block_remaining' to 0.
+   /// The events of a columnar chunk are returned one by one, unless 'event_columns' is set.
+   /// Objects are read from a FILE* or decoded in place from the bytes of a mapped file.
    class LeakFileStreamParser
    {
       LeakFileStreamParser () = delete;
@@ -16,32 +54,63 @@ namespace libLeak
       LeakFileStreamParser& operator= (const LeakFileStreamParser&) = delete;
 
    public:
-      /// Parses the next object in the native binary stream.
+      /// Parses the header object.
       /// Returns true on success, otherwise false.
-      static bool ParseObject  (FILE* stream, LeakObject& object);
+      static bool ParseHeader  (FILE* stream, LeakObjectHeader& header);
 
-      /// Skips the next object in the native binary stream.
+      /// Returns true if objects of the version and architecture of the header can be read.
+      static bool IsSupportedHeader (const LeakObjectHeader& header);
+
+      /// Reads the next object in the native binary stream and converts it to a record.
+      /// String and frame objects are added to the tables of the state and not returned.
+      /// Objects of unknown types are returned as they are.
       /// Returns true on success, otherwise false.
-      static bool SkipObject (FILE* stream, const LeakObject& object);
+      static bool ReadObject (FILE* stream, PARSER_STATE& state, std::vector<uint8_t>& record);
 
-      /// Parses the header object.
+      /// Decodes the next object at 'data' in place, the same way, and advances 'data' past it.
+      /// The strings of the state refer to the bytes; they must stay valid while the state is used.
+      /// Returns true on success, otherwise false (also at 'end').
+      static bool ReadObject (const uint8_t*& data, const uint8_t* end, PARSER_STATE& state, std::vector<uint8_t>& record);
+
+      /// Adds a string or frame record, returned by a state that defers definitions (for instance
+      /// the state of a single block), to the tables of the state. Strings are copied.
+      /// Returns true on success, otherwise false (also for records of other types).
+      static bool AddDefinition (const std::vector<uint8_t>& record, PARSER_STATE& state);
+
+      /// Parses the session record.
       /// Returns true on success, otherwise false.
-      static bool ParseHeader  (FILE* stream, LeakObjectHeader& header);
+      static bool ParseSession (const std::vector<uint8_t>& record, LeakObjectSession& session);
+
+      /// Parses an allocation record.
+      /// Returns true on success, otherwise false.
+      static bool ParseAllocation (const std::vector<uint8_t>& record, LeakObjectAllocation& allocation);
+
+      /// Parses a reallocation record.
+      /// Returns true on success, otherwise false.
+      static bool ParseReallocation (const std::vector<uint8_t>& record, LeakObjectReallocation& reallocation);
+
+      /// Parses a deallocation record.
+      /// Returns true on success, otherwise false.
+      static bool ParseDeallocation (const std::vector<uint8_t>& record, LeakObjectDeallocation& deallocation);
+
+      /// Parses a stacktrace record. 'frames' are the frames parsed so far, by frame id.
+      /// Returns true on success, otherwise false.
+      static bool ParseStacktrace (const std::vector<uint8_t>& record, LeakObjectStacktrace& stacktrace, std::vector<libLeak::SYMBOL_ENTRY>& symbols, const std::vector<FRAME_VIEW>& frames);
 
-      /// Parses the session object.
+      /// Parses a raw stacktrace record.
       /// Returns true on success, otherwise false.
-      static bool ParseSession (FILE* stream, LeakObjectSession& session);
+      static bool ParseRawStacktrace (const std::vector<uint8_t>& record, LeakObjectRawStacktrace& stacktrace, std::vector<uint64_t>& frames);
 
-      /// Parses an allocation object.
+      /// Parses a module record.
       /// Returns true on success, otherwise false.
-      static bool ParseAllocation (FILE* stream, LeakObjectAllocation& allocation);
+      static bool ParseModule (const std::vector<uint8_t>& record, LeakObjectModule& module, std::string& path);
 
-      /// Parses a deallocation object.
+      /// Parses an aggregate record.
       /// Returns true on success, otherwise false.
-      static bool ParseDeallocation (FILE* stream, LeakObjectDeallocation& deallocation);
+      static bool ParseAggregate (const std::vector<uint8_t>& record, LeakObjectAggregate& aggregate);
 
-      /// Parses a stacktrace object.
+      /// Parses a snapshot record.
       /// Returns true on success, otherwise false.
-      static bool ParseStacktrace (FILE* stream, LeakObjectStacktrace& stacktrace, std::vector<libLeak::SYMBOL_ENTRY>& symbols);
+      static bool ParseSnapshot (const std::vector<uint8_t>& record, LeakObjectSnapshot& snapshot, std::vector<LeakObjectSnapshotEntry>& entries);
    };
 }
@@ -2,105 +2,419 @@
 
 #include "LeakObject.h"
 
+#include <algorithm>
+
+namespace
+{
+   const size_t MaxVarintSize = 10;
+
+   /// Unsigned LEB128; returns the number of bytes written.
+   size_t EncodeVarint (uint8_t* output, uint64_t value)
+   {
+      size_t length = 0;
+      while (value >= 0x80)
+      {
+         output[length++] = (uint8_t)(value | 0x80);
+         value >>= 7;
+      }
+      output[length++] = (uint8_t)value;
+      return length;
+   }
+
+   void PutVarint (std::vector<uint8_t>& bytes, uint64_t value)
+   {
+      if (value < 0x80)
+      {
+         bytes.push_back ((uint8_t)value);
+         return;
+      }
+
+      uint8_t encoded[MaxVarintSize];
+      bytes.insert (bytes.end (), encoded, encoded + EncodeVarint (encoded, value));
+   }
+
+   /// Zigzag encoding; small differences in both directions take few bytes.
+   void PutSignedVarint (std::vector<uint8_t>& bytes, int64_t value)
+   {
+      PutVarint (bytes, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+   }
+
+   void PutFixed64 (std::vector<uint8_t>& bytes, uint64_t value)
+   {
+      uint8_t encoded[8];
+      for (int i = 0; i < 8; i++)
+         encoded[i] = (uint8_t)(value >> (i * 8));
+
+      bytes.insert (bytes.end (), encoded, encoded + sizeof (encoded));
+   }
+
+   void PutBytes (std::vector<uint8_t>& bytes, const void* data, size_t size)
+   {
+      if (size)
+         bytes.insert (bytes.end (), (const uint8_t*)data, (const uint8_t*)data + size);
+   }
+
+   void PutTimestamp (std::vector<uint8_t>& bytes, libLeak::SERIALIZER_STATE& state, uint64_t ts)
+   {
+      PutSignedVarint (bytes, (int64_t)(ts - state.timestamp));
+      state.timestamp = ts;
+      if (ts < state.block.FirstTimestamp)
+         state.block.FirstTimestamp = ts;
+      if (ts > state.block.LastTimestamp)
+         state.block.LastTimestamp = ts;
+   }
+
+   void PutPointer (std::vector<uint8_t>& bytes, libLeak::SERIALIZER_STATE& state, intptr_t pointer)
+   {
+      const uint64_t value = (uint64_t)(uintptr_t)pointer;
+      PutSignedVarint (bytes, (int64_t)(value - state.pointer));
+      state.pointer = value;
+   }
+
+   /// Writes the reference to a stacktrace; the first reference in a block assigns its index.
+   void PutStacktraceRef (std::vector<uint8_t>& bytes, libLeak::SERIALIZER_STATE& state, uint64_t stacktrace_id)
+   {
+      auto index = state.stacktraces.find (stacktrace_id);
+      if (index != state.stacktraces.end ())
+      {
+         PutVarint (bytes, (uint64_t)index->second + 1);
+      }
+      else
+      {
+         PutVarint (bytes, 0);
+         PutFixed64 (bytes, stacktrace_id);
+         state.stacktraces.emplace (stacktrace_id, state.stacktrace_count++);
+      }
+   }
+
+   /// Writes the id of a defined stacktrace and assigns its index.
+   void PutStacktraceId (std::vector<uint8_t>& bytes, libLeak::SERIALIZER_STATE& state, uint64_t stacktrace_id)
+   {
+      PutFixed64 (bytes, stacktrace_id);
+      state.stacktraces[stacktrace_id] = state.stacktrace_count++;
+   }
+
+   /// Counts an object in the header of the current block.
+   void CountObject (libLeak::LeakObjectBlock& block, libLeak::LeakObjectType type)
+   {
+      using libLeak::LeakObjectType;
+
+      block.Objects++;
+      switch (type)
+      {
+      case LeakObjectType::Allocation:    block.Allocations++; break;
+      case LeakObjectType::Reallocation:  block.Reallocations++; break;
+      case LeakObjectType::Deallocation:  block.Deallocations++; break;
+      case LeakObjectType::String:
+      case LeakObjectType::Frame:
+      case LeakObjectType::Stacktrace:
+      case LeakObjectType::RawStacktrace:
+      case LeakObjectType::Module:        block.Definitions++; break;
+      default:                            break;
+      }
+   }
+
+   /// Starts an object at the end of 'bytes'; the payload is appended after one byte for its size.
+   /// Returns the offset of the object.
+   size_t BeginObject (std::vector<uint8_t>& bytes, libLeak::SERIALIZER_STATE& state, libLeak::LeakObjectType type)
+   {
+      CountObject (state.block, type);
+
+      const size_t offset = bytes.size ();
+      bytes.push_back ((uint8_t)type);
+      bytes.push_back (0);
+      return offset;
+   }
+
+   /// Writes the size of the payload; the payload is only moved if its size takes more than one byte.
+   void EndObject (std::vector<uint8_t>& bytes, size_t offset)
+   {
+      const size_t payload_offset = offset + 2;
+      const size_t payload_size = bytes.size () - payload_offset;
+      if (payload_size < 0x80)
+      {
+         bytes[offset + 1] = (uint8_t)payload_size;
+         return;
+      }
+
+      uint8_t size[MaxVarintSize];
+      const size_t size_length = EncodeVarint (size, payload_size);
+      bytes.resize (bytes.size () + size_length - 1);
+      memmove (bytes.data () + offset + 1 + size_length, bytes.data () + payload_offset, payload_size);
+      memcpy (bytes.data () + offset + 1, size, size_length);
+   }
+}
+
 namespace libLeak
 {
    void LeakFileStreamSerializer::SerializeHeader (std::vector<uint8_t>& bytes)
    {
-      bytes.resize (sizeof (LeakObjectHeader));
-      LeakObjectHeader* item = (LeakObjectHeader*)bytes.data ();
-      item->Architecture = LeakObjectHeader::GetArchitecture ();
-      item->Version = 1;
-      item->Magic = 'KAEL';
+      LeakObjectHeader item;
+      item.Architecture = LeakObjectHeader::GetArchitecture ();
+      item.Version = LeakObjectVersion;
+      item.Magic = 'KAEL';
+      PutBytes (bytes, &item, sizeof (item));
+   }
+
+   void LeakFileStreamSerializer::SerializeBlock (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state)
+   {
+      state.timestamp = 0;
+      state.pointer = 0;
+      state.stacktraces.clear ();
+      state.stacktrace_count = 0;
+
+      state.block = LeakObjectBlock{};
+      state.block.Magic = LeakObjectBlockMagic;
+      state.block.FirstTimestamp = UINT64_MAX;
+
+      // Size and counters stay zero until the block is finished.
+      LeakObjectBlock item{};
+      item.Magic = LeakObjectBlockMagic;
+      PutBytes (bytes, &item, sizeof (item));
+   }
+
+   LeakObjectBlock LeakFileStreamSerializer::FinishBlock (SERIALIZER_STATE& state, uint64_t size)
+   {
+      LeakObjectBlock& block = state.block;
+      block.Size = size;
+      if (block.FirstTimestamp > block.LastTimestamp)
+      {
+         block.FirstTimestamp = 0;
+         block.LastTimestamp = 0;
+      }
+
+      return block;
+   }
+
+   void LeakFileStreamSerializer::SerializeBlockIndex (
+      std::vector<uint8_t>& bytes,
+      const std::vector<LeakObjectBlockIndexEntry>& blocks,
+      uint64_t offset)
+   {
+      LeakObjectBlockIndex index;
+      index.Magic = LeakObjectBlockIndexMagic;
+      index.NumBlocks = (uint32_t)blocks.size ();
+      PutBytes (bytes, &index, sizeof (index));
+      PutBytes (bytes, blocks.data (), blocks.size () * sizeof (LeakObjectBlockIndexEntry));
+
+      LeakObjectBlockFooter footer;
+      footer.IndexOffset = offset;
+      footer.Magic = LeakObjectBlockFooterMagic;
+      PutBytes (bytes, &footer, sizeof (footer));
    }
 
    void LeakFileStreamSerializer::SerializeSession (
-      std::vector<uint8_t>& bytes, 
-      DWORD pid, 
-      uint64_t ts)
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      DWORD pid,
+      uint64_t ts,
+      uint64_t samplingInterval)
    {
-      bytes.resize (sizeof (LeakObjectSession));
-      LeakObjectSession* item = (LeakObjectSession*)bytes.data ();
-      item->ObjectSize = bytes.size ();
-      item->ObjectType = (uint8_t)LeakObjectType::Session;
-      item->ProcessId = pid;
-      item->Timestamp = ts;
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Session);
+      PutVarint (bytes, pid);
+      PutTimestamp (bytes, state, ts);
+      PutVarint (bytes, samplingInterval);
+      EndObject (bytes, offset);
    }
 
    void LeakFileStreamSerializer::SerializeAllocation (
-      std::vector<uint8_t>& bytes, 
-      libLeak::PALLOCATION_EVENT allocation, 
-      uint32_t stacktrace_id)
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      libLeak::PALLOCATION_EVENT allocation,
+      uint64_t stacktrace_id)
    {
-      bytes.resize (sizeof (LeakObjectAllocation));
-      LeakObjectAllocation* item = (LeakObjectAllocation*)bytes.data ();
-      item->ObjectSize = bytes.size ();
-      item->ObjectType = (uint8_t)LeakObjectType::Allocation;
-      item->Pointer = allocation->Pointer;
-      item->PointerSize = allocation->Size;
-      item->Timestamp = allocation->TimestampEpochSeconds;
-      item->StacktraceId = stacktrace_id;
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Allocation);
+      PutStacktraceRef (bytes, state, stacktrace_id);
+      PutTimestamp (bytes, state, allocation->TimestampEpochSeconds);
+      PutPointer (bytes, state, allocation->Pointer);
+      PutVarint (bytes, allocation->Size);
+      EndObject (bytes, offset);
+   }
+
+   void LeakFileStreamSerializer::SerializeReallocation (
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      libLeak::PALLOCATION_EVENT reallocation,
+      uint64_t stacktrace_id)
+   {
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Reallocation);
+      PutStacktraceRef (bytes, state, stacktrace_id);
+      PutTimestamp (bytes, state, reallocation->TimestampEpochSeconds);
+      PutPointer (bytes, state, reallocation->PreviousPointer);
+      PutPointer (bytes, state, reallocation->Pointer);
+      PutVarint (bytes, reallocation->Size);
+      EndObject (bytes, offset);
    }
 
    void LeakFileStreamSerializer::SerializeDeallocation (
-      std::vector<uint8_t>& bytes, 
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
       libLeak::PDELLOCATION_EVENT deallocation)
    {
-      bytes.resize (sizeof (LeakObjectDeallocation));
-      LeakObjectDeallocation* item = (LeakObjectDeallocation*)bytes.data ();
-      item->ObjectSize = bytes.size ();
-      item->ObjectType = (uint8_t)LeakObjectType::Deallocation;
-      item->Pointer = deallocation->Pointer;
-      item->Timestamp = deallocation->TimestampEpochSeconds;
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Deallocation);
+      PutTimestamp (bytes, state, deallocation->TimestampEpochSeconds);
+      PutPointer (bytes, state, deallocation->Pointer);
+      EndObject (bytes, offset);
+   }
+
+   void LeakFileStreamSerializer::SerializeEvents (
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      const EVENT_COLUMNS& events)
+   {
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Events);
+      LeakEventColumns::Encode (bytes, events, state.stacktraces, state.stacktrace_count);
+      EndObject (bytes, offset);
+
+      // The block counts the events, not the chunk.
+      LeakObjectBlock& block = state.block;
+      block.Objects += (uint32_t)events.size () - 1;
+      for (size_t i = 0; i < events.size (); i++)
+      {
+         if (events.allocations[i])
+            block.Allocations++;
+         else
+            block.Deallocations++;
+
+         const uint64_t ts = events.timestamps[i];
+         if (ts < block.FirstTimestamp)
+            block.FirstTimestamp = ts;
+         if (ts > block.LastTimestamp)
+            block.LastTimestamp = ts;
+      }
    }
 
    void LeakFileStreamSerializer::SerializeStacktrace (
-      std::vector<uint8_t>& bytes, 
-      uint32_t stacktrace_id, 
-      const std::vector<libLeak::SYMBOL_ENTRY>& symbols,
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      uint64_t stacktrace_id,
+      const std::vector<uint32_t>& frame_ids,
       uint64_t ts)
    {
-      bytes.resize (sizeof (LeakObjectStacktrace));
-      LeakObjectStacktrace* item = (LeakObjectStacktrace*)bytes.data ();
-      item->ObjectSize = bytes.size();
-      item->ObjectType = (uint8_t)LeakObjectType::Stacktrace;
-      item->StacktraceId = stacktrace_id;
-      item->NumEntries = symbols.size ();
-      item->Timestamp = ts;
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Stacktrace);
+      PutTimestamp (bytes, state, ts);
+      PutStacktraceId (bytes, state, stacktrace_id);
+      PutVarint (bytes, frame_ids.size ());
+      for (const uint32_t frame_id : frame_ids)
+         PutVarint (bytes, frame_id);
+      EndObject (bytes, offset);
+   }
 
-      // Enumerate all symbols
-      for (const auto& symbol : symbols)
+   void LeakFileStreamSerializer::SerializeString (
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      uint32_t string_id,
+      const std::string& text)
+   {
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::String);
+      PutVarint (bytes, string_id);
+      PutVarint (bytes, text.size ());
+      PutBytes (bytes, text.c_str (), text.size ());
+      EndObject (bytes, offset);
+   }
+
+   void LeakFileStreamSerializer::SerializeFrame (
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      uint32_t frame_id,
+      uint32_t name_id,
+      uint32_t file_id,
+      uint32_t line)
+   {
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Frame);
+      PutVarint (bytes, frame_id);
+      PutVarint (bytes, name_id);
+      PutVarint (bytes, file_id);
+      PutVarint (bytes, line);
+      EndObject (bytes, offset);
+   }
+
+   void LeakFileStreamSerializer::SerializeRawStacktrace (
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      uint64_t stacktrace_id,
+      const libLeak::STACKTRACE& stacktrace,
+      uint64_t ts)
+   {
+      // Frames after the first empty frame are not part of the stacktrace.
+      size_t frame_count = 0;
+      while (frame_count < stacktrace.FrameCount &&
+         frame_count < (size_t)libLeak::MaximumStackTraceFrames &&
+         stacktrace.Frames[frame_count] != 0)
       {
-         // Store symbol information to local variables..
-         const auto& name = symbol.name;
-         const size_t name_size = symbol.name.size ();
-
-         const auto& file = symbol.file;
-         const size_t file_size = symbol.file.size ();
-         const size_t file_line = symbol.line;
-
-         // store end of byte offset
-         size_t previousSize = bytes.size ();
-
-         // increase byte buffer to store symbol name
-         bytes.resize (bytes.size () + sizeof (size_t) + name_size);
-         char* offset = (char*)(bytes.data () + previousSize);
-         memcpy (offset, &name_size, sizeof (size_t));
-         if (name_size) memcpy (offset + sizeof (size_t), name.c_str (), name_size);
-
-         // store end of byte offset
-         previousSize = bytes.size ();
-
-         // increase byte buffer to store symbol file information
-         bytes.resize (bytes.size () + (sizeof (size_t) * 2) + file_size);
-         offset = (char*)(bytes.data () + previousSize);
-      
-         memcpy (offset, &file_line, sizeof (size_t));
-         memcpy (offset + sizeof(size_t), &file_size, sizeof (size_t));
-         if (file_size) memcpy (offset + (sizeof (size_t) * 2), file.c_str (), file_size);
-
-         // update item size
-         item = (LeakObjectStacktrace*)bytes.data ();
-         item->ObjectSize = bytes.size ();
+         frame_count++;
       }
+
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::RawStacktrace);
+      PutTimestamp (bytes, state, ts);
+      PutStacktraceId (bytes, state, stacktrace_id);
+      PutVarint (bytes, frame_count);
+
+      uint64_t previous = 0;
+      for (size_t i = 0; i < frame_count; i++)
+      {
+         const uint64_t frame = (uint64_t)(uintptr_t)stacktrace.Frames[i];
+         PutSignedVarint (bytes, (int64_t)(frame - previous));
+         previous = frame;
+      }
+
+      EndObject (bytes, offset);
+   }
+
+   void LeakFileStreamSerializer::SerializeModule (
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      const libLeak::MODULE_ENTRY& module,
+      uint64_t ts)
+   {
+      const uint8_t identity_size = (uint8_t)std::min (module.identity.size (), sizeof (LeakObjectModule::Identity));
+
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Module);
+      PutTimestamp (bytes, state, ts);
+      PutVarint (bytes, module.base);
+      PutVarint (bytes, module.size);
+      PutVarint (bytes, module.timestamp);
+      PutVarint (bytes, module.age);
+      bytes.push_back (identity_size);
+      PutBytes (bytes, module.identity.data (), identity_size);
+      PutVarint (bytes, module.path.size ());
+      PutBytes (bytes, module.path.c_str (), module.path.size ());
+      EndObject (bytes, offset);
+   }
+
+   void LeakFileStreamSerializer::SerializeSnapshot (
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      uint32_t snapshot_id,
+      const std::vector<LeakObjectSnapshotEntry>& entries,
+      uint64_t ts)
+   {
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Snapshot);
+      PutTimestamp (bytes, state, ts);
+      PutVarint (bytes, snapshot_id);
+      PutVarint (bytes, entries.size ());
+      for (const auto& entry : entries)
+      {
+         PutStacktraceRef (bytes, state, entry.StacktraceId);
+         PutVarint (bytes, entry.Count);
+         PutVarint (bytes, entry.Bytes);
+      }
+      EndObject (bytes, offset);
+   }
+
+   void LeakFileStreamSerializer::SerializeAggregate (
+      std::vector<uint8_t>& bytes,
+      SERIALIZER_STATE& state,
+      libLeak::PAGGREGATE_EVENT aggregate,
+      uint64_t stacktrace_id)
+   {
+      const size_t offset = BeginObject (bytes, state, LeakObjectType::Aggregate);
+      PutTimestamp (bytes, state, aggregate->TimestampEpochSeconds);
+      PutStacktraceRef (bytes, state, stacktrace_id);
+      PutVarint (bytes, aggregate->Allocations);
+      PutVarint (bytes, aggregate->Deallocations);
+      PutVarint (bytes, aggregate->LiveBytes);
+      PutVarint (bytes, aggregate->PeakBytes);
+      EndObject (bytes, offset);
    }
-}
\ No newline at end of file
+}
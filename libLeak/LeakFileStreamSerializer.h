@@ -1,9 +1,43 @@
 #pragma once
 
 #include "libLeak.h"
+#include "LeakObject.h"
+#include "LeakEventColumns.h"
+
+#include <unordered_map>
 
 namespace libLeak
 {
+   /// State of a serialized stream; the encoding of an object depends on the objects before it.
+   typedef struct SERIALIZER_STATE_ {
+      uint64_t timestamp = 0;                                     // Timestamp of the previous object
+      uint64_t pointer = 0;                                       // Pointer of the previous object
+      std::unordered_map<uint64_t, uint32_t> stacktraces;         // stacktrace id -> stacktrace index
+      uint32_t stacktrace_count = 0;
+      LeakObjectBlock block{};                                    // Header of the current block
+   } SERIALIZER_STATE;
+
+   ///
+   /// Serializes objects in the compact encoding of version 4, grouped into blocks (version 5).
+   ///
+   /// Each object is written as [uint8_t type][varint payload size][payload]. The fields of the
+   /// payload follow the order of the structures in LeakObject.h:
+   ///
+   /// - Sizes, counters and ids are unsigned LEB128 varints.
+   /// - Timestamps and pointers are zigzag varints of the difference to the previous
+   ///   timestamp and pointer of the stream; frames of a raw stacktrace to the previous frame.
+   /// - Stacktrace ids are written as 8 bytes where a stacktrace is defined. References to a
+   ///   stacktrace are varints of its index (the number of stacktraces written before) + 1;
+   ///   0 is followed by the 8 byte id of a stacktrace that was not written in the block and
+   ///   assigns it the next index as well.
+   /// - The state is reset at the start of each block (SerializeBlock).
+   /// - Columnar chunks of events (version 6) are encoded by LeakEventColumns. They share the
+   ///   indices of the stacktraces; timestamps and pointers do not depend on the state.
+   ///
+   /// The header is not encoded; it identifies the version.
+   ///
+   /// Each method appends the object to 'bytes', so many objects can be collected in one buffer.
+   ///
    class LeakFileStreamSerializer
    {
       LeakFileStreamSerializer () = delete;
@@ -15,17 +49,51 @@ namespace libLeak
    public:
       /// Serializes the native binary header
       static void SerializeHeader (std::vector<uint8_t>& bytes);
-      
-      /// Serializes session information (process identifier, epoch timestamp)
-      static void SerializeSession (std::vector<uint8_t>& bytes, DWORD pid, uint64_t ts);
-      
+
+      /// Starts a block: appends a header that is completed by FinishBlock and resets the state.
+      /// Objects serialized afterwards are counted in the header of the block.
+      static void SerializeBlock (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state);
+
+      /// Completes the header of the current block of 'size' bytes of objects.
+      static LeakObjectBlock FinishBlock (SERIALIZER_STATE& state, uint64_t size);
+
+      /// Serializes the index of the given blocks that starts at 'offset', followed by the footer
+      static void SerializeBlockIndex (std::vector<uint8_t>& bytes, const std::vector<LeakObjectBlockIndexEntry>& blocks, uint64_t offset);
+
+      /// Serializes session information (process identifier, epoch timestamp, sampling interval)
+      static void SerializeSession (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, DWORD pid, uint64_t ts, uint64_t samplingInterval);
+
       /// Serializes an allocation
-      static void SerializeAllocation (std::vector<uint8_t>& bytes, libLeak::PALLOCATION_EVENT allocation, uint32_t stacktrace_id);
-      
+      static void SerializeAllocation (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, libLeak::PALLOCATION_EVENT allocation, uint64_t stacktrace_id);
+
+      /// Serializes a reallocation
+      static void SerializeReallocation (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, libLeak::PALLOCATION_EVENT reallocation, uint64_t stacktrace_id);
+
       /// Serializes a deallocation
-      static void SerializeDeallocation (std::vector<uint8_t>& bytes, libLeak::PDELLOCATION_EVENT deallocation);
-      
-      /// Serializes a stacktrace
-      static void SerializeStacktrace (std::vector<uint8_t>& bytes, uint32_t stacktrace_id, const std::vector<libLeak::SYMBOL_ENTRY>& symbols, uint64_t ts);
+      static void SerializeDeallocation (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, libLeak::PDELLOCATION_EVENT deallocation);
+
+      /// Serializes a columnar chunk of allocations and deallocations; 'events' must not be empty
+      static void SerializeEvents (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, const EVENT_COLUMNS& events);
+
+      /// Serializes a stacktrace referring to written frames
+      static void SerializeStacktrace (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, uint64_t stacktrace_id, const std::vector<uint32_t>& frame_ids, uint64_t ts);
+
+      /// Serializes an interned string
+      static void SerializeString (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, uint32_t string_id, const std::string& text);
+
+      /// Serializes a frame referring to written strings
+      static void SerializeFrame (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, uint32_t frame_id, uint32_t name_id, uint32_t file_id, uint32_t line);
+
+      /// Serializes the raw frames of a stacktrace
+      static void SerializeRawStacktrace (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, uint64_t stacktrace_id, const libLeak::STACKTRACE& stacktrace, uint64_t ts);
+
+      /// Serializes a module of the profiled process
+      static void SerializeModule (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, const libLeak::MODULE_ENTRY& module, uint64_t ts);
+
+      /// Serializes the counters of a stacktrace
+      static void SerializeAggregate (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, libLeak::PAGGREGATE_EVENT aggregate, uint64_t stacktrace_id);
+
+      /// Serializes a snapshot of outstanding allocations
+      static void SerializeSnapshot (std::vector<uint8_t>& bytes, SERIALIZER_STATE& state, uint32_t snapshot_id, const std::vector<LeakObjectSnapshotEntry>& entries, uint64_t ts);
    };
 }
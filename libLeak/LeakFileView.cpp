@@ -0,0 +1,343 @@
+#include "LeakFileView.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace libLeak
+{
+   LeakFileView::LeakFileView ()
+      : data (nullptr)
+      , size (0)
+      , position (nullptr)
+      , shared (false)
+#ifdef _WIN32
+      , file (INVALID_HANDLE_VALUE)
+      , mapping (NULL)
+#endif
+      , header{ 0 }
+   {
+   }
+
+   LeakFileView::~LeakFileView ()
+   {
+      Close ();
+   }
+
+   bool LeakFileView::Open (const std::string& path)
+   {
+      Close ();
+
+#ifdef _WIN32
+      file = CreateFileA (path.c_str (), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if (file == INVALID_HANDLE_VALUE)
+         return false;
+
+      LARGE_INTEGER file_size{ 0 };
+      if (!GetFileSizeEx (file, &file_size) || file_size.QuadPart == 0 || (uint64_t)file_size.QuadPart > (uint64_t)SIZE_MAX)
+      {
+         Close ();
+         return false;
+      }
+
+      mapping = CreateFileMappingA (file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mapping == NULL)
+      {
+         Close ();
+         return false;
+      }
+
+      data = (const uint8_t*)MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+      if (data == nullptr)
+      {
+         Close ();
+         return false;
+      }
+
+      size = (size_t)file_size.QuadPart;
+#else
+      const int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+         return false;
+
+      struct stat info;
+      if (fstat (fd, &info) == 0 && info.st_size > 0)
+      {
+         void* view = mmap (nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (view != MAP_FAILED)
+         {
+            // The file is read once from the start to the end.
+            madvise (view, (size_t)info.st_size, MADV_SEQUENTIAL);
+            data = (const uint8_t*)view;
+            size = (size_t)info.st_size;
+         }
+      }
+
+      close (fd);
+      if (data == nullptr)
+         return false;
+#endif
+
+      position = data;
+      return true;
+   }
+
+   void LeakFileView::Close ()
+   {
+#ifdef _WIN32
+      if (data && !shared)
+         UnmapViewOfFile (data);
+
+      if (mapping)
+         CloseHandle (mapping);
+
+      if (file != INVALID_HANDLE_VALUE)
+         CloseHandle (file);
+
+      mapping = NULL;
+      file = INVALID_HANDLE_VALUE;
+#else
+      if (data && !shared)
+         munmap ((void*)data, size);
+#endif
+
+      data = nullptr;
+      size = 0;
+      position = nullptr;
+      shared = false;
+      parser = PARSER_STATE ();
+      record.clear ();
+   }
+
+   bool LeakFileView::ParseHeader (LeakObjectHeader& result)
+   {
+      if (position != data || size < sizeof (LeakObjectHeader))
+         return false;
+
+      memcpy (&header, data, sizeof (LeakObjectHeader));
+      if (!LeakFileStreamParser::IsSupportedHeader (header))
+         return false;
+
+      parser.version = header.Version;
+      parser.architecture = header.Architecture;
+      position = data + sizeof (LeakObjectHeader);
+      result = header;
+      return true;
+   }
+
+   bool LeakFileView::OpenBlock (const LeakFileView& file, const LeakObjectBlockIndexEntry& block)
+   {
+      Close ();
+
+      if (file.position == nullptr || file.position == file.data || file.header.Version < 5 ||
+         block.Offset < sizeof (LeakObjectHeader) || block.Offset >= file.size)
+      {
+         return false;
+      }
+
+      // The view ends with the block; reading stops there.
+      const uint64_t end = block.Offset + sizeof (LeakObjectBlock) + block.Block.Size;
+      data = file.data;
+      size = end < file.size ? (size_t)end : file.size;
+      position = data + block.Offset;
+      shared = true;
+
+      header = file.header;
+      parser.version = header.Version;
+      parser.architecture = header.Architecture;
+      parser.defer_definitions = true;
+      parser.event_columns = file.parser.event_columns;
+      return true;
+   }
+
+   void LeakFileView::SetEventColumns (bool enabled)
+   {
+      parser.event_columns = enabled;
+   }
+
+   const LeakObject* LeakFileView::ReadObject ()
+   {
+      // The header is parsed first.
+      if (position == nullptr || position == data)
+         return nullptr;
+
+      if (!LeakFileStreamParser::ReadObject (position, data + size, parser, record))
+      {
+         record.clear ();
+         return nullptr;
+      }
+
+      return (const LeakObject*)record.data ();
+   }
+
+   const LeakObject* LeakFileView::ApplyObject (const LeakObject& object)
+   {
+      // The columns of a chunk belong to the view of its block.
+      record.clear ();
+      if (object.ObjectType == (uint8_t)LeakObjectType::Events)
+         return nullptr;
+
+      record.assign ((const uint8_t*)&object, (const uint8_t*)&object + object.ObjectSize);
+      if (object.ObjectType == (uint8_t)LeakObjectType::String || object.ObjectType == (uint8_t)LeakObjectType::Frame)
+      {
+         LeakFileStreamParser::AddDefinition (record, parser);
+         record.clear ();
+         return nullptr;
+      }
+
+      return (const LeakObject*)record.data ();
+   }
+
+   bool LeakFileView::ReadBlockIndex (std::vector<LeakObjectBlockIndexEntry>& blocks) const
+   {
+      blocks.clear ();
+      if (position == nullptr || position == data || header.Version < 5)
+         return false;
+
+      const uint64_t first = sizeof (LeakObjectHeader);
+      if (size >= first + sizeof (LeakObjectBlockIndex) + sizeof (LeakObjectBlockFooter))
+      {
+         LeakObjectBlockFooter footer;
+         memcpy (&footer, data + size - sizeof (footer), sizeof (footer));
+
+         const uint64_t end = size - sizeof (footer);
+         if (footer.Magic == LeakObjectBlockFooterMagic &&
+            footer.IndexOffset >= first &&
+            footer.IndexOffset <= end - sizeof (LeakObjectBlockIndex))
+         {
+            LeakObjectBlockIndex index;
+            memcpy (&index, data + footer.IndexOffset, sizeof (index));
+
+            const uint64_t entries = footer.IndexOffset + sizeof (index);
+            if (index.Magic != LeakObjectBlockIndexMagic ||
+               (uint64_t)index.NumBlocks * sizeof (LeakObjectBlockIndexEntry) != end - entries)
+            {
+               return false;
+            }
+
+            blocks.resize (index.NumBlocks);
+            if (index.NumBlocks)
+               memcpy (blocks.data (), data + entries, (size_t)index.NumBlocks * sizeof (LeakObjectBlockIndexEntry));
+
+            return true;
+         }
+      }
+
+      // The file was not closed; its last block ends at the end of the file.
+      for (uint64_t offset = first; offset + sizeof (LeakObjectBlock) <= size; )
+      {
+         LeakObjectBlockIndexEntry entry;
+         entry.Offset = offset;
+         memcpy (&entry.Block, data + offset, sizeof (LeakObjectBlock));
+         if (entry.Block.Magic != LeakObjectBlockMagic)
+            break;
+
+         const uint64_t available = size - offset - sizeof (LeakObjectBlock);
+         if (entry.Block.Size == 0 || entry.Block.Size > available)
+            entry.Block.Size = available;
+
+         blocks.push_back (entry);
+         offset += sizeof (LeakObjectBlock) + entry.Block.Size;
+      }
+
+      return true;
+   }
+
+   bool LeakFileView::SeekBlock (const LeakObjectBlockIndexEntry& block)
+   {
+      if (position == nullptr || position == data || header.Version < 5 ||
+         block.Offset < sizeof (LeakObjectHeader) || block.Offset >= size)
+      {
+         return false;
+      }
+
+      position = data + block.Offset;
+      parser.block_remaining = 0;
+      parser.events.clear ();
+      parser.next_event = 0;
+      return true;
+   }
+
+   const LeakObjectSession* LeakFileView::GetSession () const
+   {
+      return Get<LeakObjectSession> (LeakObjectType::Session);
+   }
+
+   const LeakObjectAllocation* LeakFileView::GetAllocation () const
+   {
+      return Get<LeakObjectAllocation> (LeakObjectType::Allocation);
+   }
+
+   const LeakObjectReallocation* LeakFileView::GetReallocation () const
+   {
+      return Get<LeakObjectReallocation> (LeakObjectType::Reallocation);
+   }
+
+   const LeakObjectDeallocation* LeakFileView::GetDeallocation () const
+   {
+      return Get<LeakObjectDeallocation> (LeakObjectType::Deallocation);
+   }
+
+   const LeakObjectAggregate* LeakFileView::GetAggregate () const
+   {
+      return Get<LeakObjectAggregate> (LeakObjectType::Aggregate);
+   }
+
+   const EVENT_COLUMNS* LeakFileView::GetEventColumns () const
+   {
+      return Get<LeakObjectEvents> (LeakObjectType::Events) ? &parser.events : nullptr;
+   }
+
+   const LeakObjectStacktrace* LeakFileView::GetStacktrace (std::vector<FRAME_VIEW>& frames) const
+   {
+      frames.clear ();
+
+      const LeakObjectStacktrace* stacktrace = Get<LeakObjectStacktrace> (LeakObjectType::Stacktrace);
+      if (stacktrace == nullptr)
+         return nullptr;
+
+      // The ids follow the packed structure unaligned; they are copied byte-wise.
+      const uint8_t* frame_ids = record.data () + sizeof (LeakObjectStacktrace);
+      for (uint64_t i = 0; i < stacktrace->NumEntries; i++)
+      {
+         uint32_t frame_id;
+         memcpy (&frame_id, frame_ids + i * sizeof (frame_id), sizeof (frame_id));
+         if (frame_id >= parser.frames.size ())
+            return nullptr;
+
+         frames.push_back (parser.frames[frame_id]);
+      }
+
+      return stacktrace;
+   }
+
+   const LeakObjectRawStacktrace* LeakFileView::GetRawStacktrace (const uint64_t*& frames) const
+   {
+      const LeakObjectRawStacktrace* stacktrace = Get<LeakObjectRawStacktrace> (LeakObjectType::RawStacktrace);
+      if (stacktrace)
+         frames = (const uint64_t*)(record.data () + sizeof (LeakObjectRawStacktrace));
+
+      return stacktrace;
+   }
+
+   const LeakObjectModule* LeakFileView::GetModule (std::string_view& path) const
+   {
+      const LeakObjectModule* module = Get<LeakObjectModule> (LeakObjectType::Module);
+      if (module)
+         path = std::string_view ((const char*)record.data () + sizeof (LeakObjectModule), (size_t)module->PathSize);
+
+      return module;
+   }
+
+   const LeakObjectSnapshot* LeakFileView::GetSnapshot (const LeakObjectSnapshotEntry*& entries) const
+   {
+      const LeakObjectSnapshot* snapshot = Get<LeakObjectSnapshot> (LeakObjectType::Snapshot);
+      if (snapshot)
+         entries = (const LeakObjectSnapshotEntry*)(record.data () + sizeof (LeakObjectSnapshot));
+
+      return snapshot;
+   }
+}
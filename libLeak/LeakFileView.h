@@ -0,0 +1,137 @@
+#pragma once
+
+#include "libLeak.h"
+#include "LeakObject.h"
+#include "LeakFileStreamParser.h"
+
+#include <string_view>
+
+namespace libLeak
+{
+   ///
+   /// The LeakFileView class reads a Leak.dat file of any version and architecture
+   /// from a read-only mapping of the file.
+   ///
+   /// Objects are decoded in place, one after another, into a record that is reused for
+   /// every object; reading an object takes no system call and, once the record has grown
+   /// to the largest object, no allocation. Strings refer to the mapped file. Objects,
+   /// frames and paths stay valid until the next object is read; the strings of frames
+   /// stay valid while the file is open.
+   ///
+   /// The whole file is mapped at once; on 32 bit platforms files of more than a few
+   /// hundred megabytes may not fit into the address space.
+   ///
+   /// The blocks of a file of version 5 can also be read by views of their own on several
+   /// threads (OpenBlock); their strings and frames are applied to the view of the file in
+   /// the order of the blocks (ApplyObject).
+   ///
+   /// Columnar chunks of events are read as allocation and deallocation objects, unless the
+   /// view returns them as one object (SetEventColumns); their columns are scanned without
+   /// converting each event then.
+   ///
+   class LeakFileView
+   {
+      const uint8_t* data;
+      size_t size;
+      const uint8_t* position;
+      bool shared;                                                                 // Reads the mapping of another view
+#ifdef _WIN32
+      HANDLE file;
+      HANDLE mapping;
+#endif
+
+      LeakObjectHeader header;
+      PARSER_STATE parser;
+      std::vector<uint8_t> record;                                                 // Object returned by ReadObject
+
+   public:
+      LeakFileView ();
+
+      /// Destructor. Unmaps the file.
+      ~LeakFileView ();
+
+      LeakFileView (const LeakFileView&) = delete;
+      LeakFileView (LeakFileView&&) = delete;
+      LeakFileView& operator = (const LeakFileView&) = delete;
+
+      /// Maps the given file.
+      /// Returns true on success, otherwise false.
+      bool Open (const std::string& path);
+
+      /// Unmaps the file.
+      void Close ();
+
+      /// Parses the header object.
+      /// Returns true on success, otherwise false (also for files of a newer version).
+      bool ParseHeader (LeakObjectHeader& result);
+
+      /// Reads the given block of 'file' with this view; 'file' must stay open while the block
+      /// is read. String and frame objects are returned instead of being consumed; they are
+      /// passed to ApplyObject of 'file' before the objects of later blocks that use them.
+      /// Returns true on success, otherwise false.
+      bool OpenBlock (const LeakFileView& file, const LeakObjectBlockIndexEntry& block);
+
+      /// Returns columnar chunks of events as one LeakObjectEvents object (GetEventColumns)
+      /// instead of one object per event. Call after Open; views of blocks opened with this view
+      /// (OpenBlock) return them the same way.
+      void SetEventColumns (bool enabled);
+
+      /// Reads the next object; string and frame objects are consumed.
+      /// Returns nullptr at the end of the file or at a corrupt object.
+      const LeakObject* ReadObject ();
+
+      /// Makes an object read by the view of a block the current object of this view.
+      /// String and frame objects are added to the tables of this view instead.
+      /// Columnar chunks are not applied; decode their events with the view of the block.
+      /// Returns the current object, or nullptr for string, frame and chunk objects.
+      const LeakObject* ApplyObject (const LeakObject& object);
+
+      /// Reads the blocks of a file of version 5 from the index at the end of the file, or
+      /// from the block headers if the file was not closed; the counters and the time range
+      /// of its last block are zero then. Call after ParseHeader.
+      /// Returns true on success, otherwise false (also for files of older versions).
+      bool ReadBlockIndex (std::vector<LeakObjectBlockIndexEntry>& blocks) const;
+
+      /// Continues reading at the start of the given block, for instance the first block of a
+      /// time window. Strings, frames and stacktraces are only known from the objects read
+      /// before; read the blocks with Definitions first to resolve the stacktraces.
+      /// Returns true on success, otherwise false.
+      bool SeekBlock (const LeakObjectBlockIndexEntry& block);
+
+      /// Returns the current object, or nullptr if it has another type.
+      const LeakObjectSession* GetSession () const;
+      const LeakObjectAllocation* GetAllocation () const;
+      const LeakObjectReallocation* GetReallocation () const;
+      const LeakObjectDeallocation* GetDeallocation () const;
+      const LeakObjectAggregate* GetAggregate () const;
+
+      /// Returns the columns of the current chunk of events, or nullptr if the current
+      /// object is no LeakObjectEvents.
+      const EVENT_COLUMNS* GetEventColumns () const;
+
+      /// Returns the current stacktrace and its frames, or nullptr if the current object
+      /// is no stacktrace or refers to an unknown frame. 'frames' is cleared first.
+      /// The frames of a view of a block are not known; apply the stacktrace to the view
+      /// of the file first.
+      const LeakObjectStacktrace* GetStacktrace (std::vector<FRAME_VIEW>& frames) const;
+
+      /// Returns the current raw stacktrace and its 'NumFrames' frames.
+      const LeakObjectRawStacktrace* GetRawStacktrace (const uint64_t*& frames) const;
+
+      /// Returns the current module and its path.
+      const LeakObjectModule* GetModule (std::string_view& path) const;
+
+      /// Returns the current snapshot and its 'NumEntries' entries.
+      const LeakObjectSnapshot* GetSnapshot (const LeakObjectSnapshotEntry*& entries) const;
+
+   private:
+      template <typename T>
+      const T* Get (LeakObjectType type) const
+      {
+         if (record.size () < sizeof (T) || ((const LeakObject*)record.data ())->ObjectType != (uint8_t)type)
+            return nullptr;
+
+         return (const T*)record.data ();
+      }
+   };
+}
@@ -12,14 +12,36 @@ namespace libLeak
       Session     = 1,
       Allocation  = 2,
       Deallocation = 3,
-      Stacktrace  = 4
+      Stacktrace  = 4,
+      Snapshot    = 5,
+      Aggregate   = 6,
+      Reallocation = 7,
+      Module      = 8,
+      RawStacktrace = 9,
+      String      = 10,
+      Frame       = 11,
+      Events      = 12
    };
    
+   /// Version of the file format written by LeakFileStream.
+   /// 1 - 32-bit stacktrace ids
+   /// 2 - 64-bit stacktrace ids
+   /// 3 - stacktraces refer to frames and strings written once (LeakObjectFrame, LeakObjectString)
+   /// 4 - compact encoding independent of the architecture (see LeakFileStreamSerializer)
+   /// 5 - objects are grouped into blocks, indexed at the end of the file (see LeakObjectBlock)
+   /// 6 - allocations and deallocations may be written in columnar chunks (see LeakObjectEvents)
+   constexpr uint16_t LeakObjectVersion = 6;
+
+   constexpr uint32_t LeakObjectBlockMagic = 'KCLB';
+   constexpr uint32_t LeakObjectBlockIndexMagic = 'XDNI';
+   constexpr uint32_t LeakObjectBlockFooterMagic = 'RTOF';
+
    /// LeakObjectHeader
    /// File Header information.
    /// Indicates whether the given file is a LeakObject file or not.
    /// Architecture is set to 32 for a file that was written on a 32 bit platform,
-   /// otherwise 64.
+   /// otherwise 64. Files of all versions up to LeakObjectVersion and of both
+   /// architectures can be parsed; objects are converted to the layout below.
    struct LeakObjectHeader {
       uint32_t Magic;
       uint16_t Version;
@@ -27,7 +49,7 @@ namespace libLeak
 
       static uint16_t GetArchitecture ()
       {
-      #ifdef _WIN64
+      #if defined(_WIN64) || defined(__LP64__)
          return (uint16_t)64;
       #else
          return (uint16_t)32;
@@ -35,43 +57,115 @@ namespace libLeak
       }
    };
 
+   /// LeakObjectBlock
+   /// Files of version 5 group the objects after the header into blocks:
+   ///
+   /// [LeakObjectHeader][LeakObjectBlock][objects]...[LeakObjectBlock][objects]
+   /// [LeakObjectBlockIndex][LeakObjectBlockIndexEntry * NumBlocks][LeakObjectBlockFooter]
+   ///
+   /// Timestamps, pointers and stacktrace references are encoded relative to the start of
+   /// their block, so a block is decoded without the objects of the blocks before it. Strings,
+   /// frames, stacktraces and modules are still written once; the symbols of a stacktrace may
+   /// be defined in an earlier block (Definitions counts those of the block).
+   ///
+   /// The header of a block is completed when the block is closed; Size is zero for the last
+   /// block of a file that was not closed, it then ends at the end of the file. Such a file has
+   /// no index either; its blocks are found by walking the block headers.
+   struct LeakObjectBlock {
+      uint32_t Magic;
+      uint32_t Objects;                                           // Each event of a columnar chunk counts as one
+      uint64_t Size;                                              // Bytes of the objects after the header
+      uint64_t FirstTimestamp;                                    // Range of the timestamps of the objects
+      uint64_t LastTimestamp;
+      uint32_t Allocations;
+      uint32_t Reallocations;
+      uint32_t Deallocations;
+      uint32_t Definitions;                                       // Strings, frames, stacktraces and modules
+   };
+
+   /// LeakObjectBlockIndex
+   /// Starts the index of all blocks after the last block of a closed file.
+   /// Note: This is a dynamic structure. 'NumBlocks' LeakObjectBlockIndexEntry
+   /// structures are written after this structure.
+   struct LeakObjectBlockIndex {
+      uint32_t Magic;
+      uint32_t NumBlocks;
+
+      // [Entries]
+   };
+
+   /// LeakObjectBlockIndexEntry
+   /// A block and the offset of its header in the file.
+   struct LeakObjectBlockIndexEntry {
+      uint64_t Offset;
+      LeakObjectBlock Block;
+   };
+
+   /// LeakObjectBlockFooter
+   /// Last bytes of a closed file; locates the index.
+   struct LeakObjectBlockFooter {
+      uint64_t IndexOffset;
+      uint32_t Magic;
+   };
+
    /// LeakObject
-   /// All objects in the raw file format inherit from LeakObject.
+   /// All parsed objects inherit from LeakObject.
+   ///
+   /// The structures are the layout of parsed objects. Files of version 4 and later encode their fields
+   /// compactly; files of version 3 and older contain the structures as they are, with the word
+   /// size of their Architecture for the fields that were size_t and intptr_t before.
    struct LeakObject
    {
       uint8_t ObjectType;
       uint8_t Reserved1;
-      size_t ObjectSize;
+      uint64_t ObjectSize;
    };
 
    /// LeakObjectSession
    /// Meta information about the injected session.
+   /// SamplingInterval is the mean sampling interval in bytes if allocations were sampled,
+   /// otherwise zero. Sessions written by older versions end after Timestamp.
    struct LeakObjectSession : public LeakObject {
       int32_t  ProcessId;
       uint64_t Timestamp;
+      uint64_t SamplingInterval;
    };
 
    /// LeakObjectAllocation
    /// Indicates a single allocation.
    struct LeakObjectAllocation : public LeakObject {
-      uint32_t StacktraceId;
+      uint64_t StacktraceId;
       uint64_t Timestamp;
-      intptr_t Pointer;
-      size_t   PointerSize;
+      uint64_t Pointer;
+      uint64_t PointerSize;
    };
 
    /// LeakObjectDeallocation
    /// Indicates a single deallocation.
    struct LeakObjectDeallocation : public LeakObject {
       uint64_t Timestamp;
-      intptr_t Pointer;
+      uint64_t Pointer;
+   };
+
+   /// LeakObjectReallocation
+   /// Indicates a block that was resized in place or moved (HeapReAlloc and friends).
+   /// Replaces the allocation of PreviousPointer; it is neither a new allocation
+   /// nor a deallocation. PreviousPointer equals Pointer if resized in place.
+   struct LeakObjectReallocation : public LeakObject {
+      uint64_t StacktraceId;
+      uint64_t Timestamp;
+      uint64_t PreviousPointer;
+      uint64_t Pointer;
+      uint64_t PointerSize;
    };
 
    /// LeakObjectStacktrace
    /// Indicates a stacktrace.
    /// Note: This is a dynamic structure. The size depends on 'NumEntries'.
-   /// All Entries are written after this structure.
-   /// The layout of a single entry is stored in the following format.
+   /// All Entries are written after this structure; each entry is the id (uint32_t)
+   /// of a LeakObjectFrame written before.
+   ///
+   /// Files of version 2 and older store each entry inline in the following format.
    ///
    /// [size_t name_size  ]
    /// [char[name_size] name]
@@ -80,11 +174,108 @@ namespace libLeak
    /// [char[file_size] file]
    struct LeakObjectStacktrace : public LeakObject {
       uint64_t Timestamp;
-      uint32_t StacktraceId;
-      size_t   NumEntries;
+      uint64_t StacktraceId;
+      uint64_t NumEntries;
       
       // [Entries]
    };
+
+   /// LeakObjectString
+   /// A symbol name or source file, written once before the first frame that refers to it.
+   /// Ids are assigned in ascending order, starting at zero.
+   /// Note: This is a dynamic structure. 'Size' characters are written after this structure.
+   struct LeakObjectString : public LeakObject {
+      uint32_t StringId;
+      uint64_t Size;
+
+      // [Characters]
+   };
+
+   /// LeakObjectFrame
+   /// A resolved frame, written once before the first stacktrace that refers to it.
+   /// Ids are assigned in ascending order, starting at zero.
+   struct LeakObjectFrame : public LeakObject {
+      uint32_t FrameId;
+      uint32_t NameId;
+      uint32_t FileId;
+      uint32_t Line;
+   };
+
+   /// LeakObjectModule
+   /// A module loaded into the profiled process, written by the deferred symbol mode
+   /// before the first raw stacktrace with a frame inside of it. A module written again
+   /// at the same base address replaces the previous one (unloaded and loaded again).
+   /// Identity identifies the matching symbols: the CodeView GUID of the PDB (with Age
+   /// and the TimeDateStamp of the image) on Windows, the GNU build id on Linux.
+   /// Note: This is a dynamic structure. 'PathSize' characters of the path of the module
+   /// are written after this structure.
+   struct LeakObjectModule : public LeakObject {
+      uint64_t Timestamp;
+      uint64_t BaseAddress;
+      uint64_t Size;
+      uint32_t TimeDateStamp;
+      uint32_t Age;
+      uint8_t  IdentitySize;
+      uint8_t  Identity[32];
+      uint64_t PathSize;
+
+      // [Path]
+   };
+
+   /// LeakObjectRawStacktrace
+   /// Indicates a stacktrace whose symbols are resolved by LeakConverter (deferred symbol mode).
+   /// Note: This is a dynamic structure. 'NumFrames' frame addresses (uint64_t)
+   /// are written after this structure.
+   struct LeakObjectRawStacktrace : public LeakObject {
+      uint64_t Timestamp;
+      uint64_t StacktraceId;
+      uint64_t NumFrames;
+
+      // [Frames]
+   };
+
+   /// LeakObjectSnapshotEntry
+   /// Outstanding allocations of a single stacktrace at the time of a snapshot.
+   /// In a sampled session, Count and Bytes are estimates (see GetSamplingWeight).
+   struct LeakObjectSnapshotEntry {
+      uint64_t StacktraceId;
+      uint64_t Count;
+      uint64_t Bytes;
+   };
+
+   /// LeakObjectSnapshot
+   /// Indicates a snapshot of all outstanding allocations, aggregated per stacktrace.
+   /// Note: This is a dynamic structure. 'NumEntries' LeakObjectSnapshotEntry
+   /// structures are written after this structure.
+   struct LeakObjectSnapshot : public LeakObject {
+      uint64_t Timestamp;
+      uint32_t SnapshotId;
+      uint64_t NumEntries;
+
+      // [Entries]
+   };
+
+   /// LeakObjectAggregate
+   /// Counters of a single stacktrace, written periodically by the aggregate mode.
+   /// The counters are cumulative since profiling started; the latest object
+   /// of a stacktrace supersedes the previous ones.
+   struct LeakObjectAggregate : public LeakObject {
+      uint64_t Timestamp;
+      uint64_t StacktraceId;
+      uint64_t Allocations;
+      uint64_t Deallocations;
+      uint64_t LiveBytes;
+      uint64_t PeakBytes;
+   };
+
+   /// LeakObjectEvents
+   /// A chunk of allocations and deallocations stored in columns (see LeakEventColumns),
+   /// written instead of their objects if the stream writes event columns.
+   /// Readers return its events as LeakObjectAllocation and LeakObjectDeallocation objects,
+   /// in order, unless columns were requested; this record only holds their number then.
+   struct LeakObjectEvents : public LeakObject {
+      uint64_t NumEvents;
+   };
 }
 
-#pragma pack(pop, 1) // explicit padding
+#pragma pack(pop) // explicit padding
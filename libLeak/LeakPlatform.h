@@ -0,0 +1,145 @@
+#pragma once
+
+//
+// Platform abstraction of libLeak.
+// On Windows this is the Windows SDK. Other platforms (the Linux interposer) get the
+// subset of Win32 types and interlocked functions used by the shared libLeak headers.
+//
+
+#ifdef _WIN32
+
+#include <Windows.h>
+
+#else
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <ctime>
+#include <sched.h>
+
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int64_t LONG64;
+typedef unsigned int UINT;
+typedef int BOOL;
+typedef size_t SIZE_T;
+typedef void* PVOID;
+typedef void* LPVOID;
+typedef void* HANDLE;
+typedef int32_t HRESULT;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#ifndef S_OK
+#define S_OK ((HRESULT)0)
+#endif
+
+#ifndef S_FALSE
+#define S_FALSE ((HRESULT)1)
+#endif
+
+#define __forceinline inline __attribute__((always_inline))
+#define _In_
+#define UNREFERENCED_PARAMETER(P) (void)(P)
+
+//
+// Interlocked functions with the semantics of the Win32 API (full barrier,
+// Increment / Decrement / Add return the new value, Exchange / CompareExchange the initial value).
+//
+
+__forceinline LONG InterlockedIncrement (volatile LONG* target)
+{
+   return __atomic_add_fetch (target, 1, __ATOMIC_SEQ_CST);
+}
+
+__forceinline LONG InterlockedDecrement (volatile LONG* target)
+{
+   return __atomic_sub_fetch (target, 1, __ATOMIC_SEQ_CST);
+}
+
+__forceinline LONG InterlockedExchange (volatile LONG* target, LONG value)
+{
+   return __atomic_exchange_n (target, value, __ATOMIC_SEQ_CST);
+}
+
+__forceinline LONG InterlockedCompareExchange (volatile LONG* target, LONG exchange, LONG comparand)
+{
+   __atomic_compare_exchange_n (target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+   return comparand;
+}
+
+__forceinline LONG64 InterlockedIncrement64 (volatile LONG64* target)
+{
+   return __atomic_add_fetch (target, 1, __ATOMIC_SEQ_CST);
+}
+
+__forceinline LONG64 InterlockedAdd64 (volatile LONG64* target, LONG64 value)
+{
+   return __atomic_add_fetch (target, value, __ATOMIC_SEQ_CST);
+}
+
+__forceinline LONG64 InterlockedExchange64 (volatile LONG64* target, LONG64 value)
+{
+   return __atomic_exchange_n (target, value, __ATOMIC_SEQ_CST);
+}
+
+__forceinline LONG64 InterlockedCompareExchange64 (volatile LONG64* target, LONG64 exchange, LONG64 comparand)
+{
+   __atomic_compare_exchange_n (target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+   return comparand;
+}
+
+__forceinline PVOID InterlockedExchangePointer (PVOID volatile* target, PVOID value)
+{
+   return __atomic_exchange_n (target, value, __ATOMIC_SEQ_CST);
+}
+
+__forceinline PVOID InterlockedCompareExchangePointer (PVOID volatile* target, PVOID exchange, PVOID comparand)
+{
+   __atomic_compare_exchange_n (target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+   return comparand;
+}
+
+/// Suspends the calling thread for the given number of milliseconds.
+inline void Sleep (DWORD milliseconds)
+{
+   struct timespec ts;
+   ts.tv_sec = milliseconds / 1000;
+   ts.tv_nsec = (long)(milliseconds % 1000) * 1000000L;
+   nanosleep (&ts, nullptr);
+}
+
+/// Secure CRT functions used by the shared code.
+inline int fopen_s (FILE** fp, const char* filename, const char* mode)
+{
+   *fp = fopen (filename, mode);
+   return *fp ? 0 : errno;
+}
+
+inline int localtime_s (struct tm* result, const time_t* time)
+{
+   return localtime_r (time, result) ? 0 : errno;
+}
+
+/// Hint to the processor that the thread is spinning.
+__forceinline void YieldProcessor ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause ();
+#else
+   sched_yield ();
+#endif
+}
+
+#endif
@@ -0,0 +1,413 @@
+#pragma once
+
+#include "libLeak.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+namespace libLeak
+{
+   //
+   // Shared memory structures
+   // that are mapped into both the instrumented process and the monitoring process.
+   // The monitoring process creates the mapping and publishes the settings,
+   // the instrumented process opens it as soon as profiling is started.
+   //
+   // Layout of the mapping:
+   //
+   // [LEAK_SHARED_CONTROL                ]
+   // [LEAK_RING_SLOT[RingCapacity]       ]
+   // [LEAK_STACK_ENTRY[StackTableCapacity]]
+   //
+
+   const DWORD SharedControlMagic = 'CAEL';
+   const DWORD SharedControlVersion = 5;
+
+   /// Default number of slots in the event ring.
+   const DWORD DefaultRingCapacity = 65536;
+
+   /// Default number of distinct stacktraces in the stack table.
+   const DWORD DefaultStackTableCapacity = 65536;
+
+   /// A single event published by the instrumented process.
+   /// Fixed-size, so it can be stored in the ring without any allocation.
+   /// The frames are published once in the stack table and referenced by StackId.
+   typedef struct LEAK_EVENT_RECORD_ {
+      DWORD Type;                            // InstrumentType
+      DWORD ThreadId;                        // Thread that issued the event
+      DWORD StackId;                         // Stack table entry [if Type is Allocation or Reallocation], 0 if unknown
+      SIZE_T Size;                           // Allocated Size [if Type is Allocation or Reallocation]
+      intptr_t Pointer;                      // Allocated / released Pointer
+      intptr_t PreviousPointer;              // Released Pointer [if Type is Reallocation]
+      uint64_t Timestamp;                    // FILETIME (100ns intervals since 1601-01-01)
+   } LEAK_EVENT_RECORD, *PLEAK_EVENT_RECORD;
+
+   /// State of a stack table entry.
+   enum class StackEntryState
+   {
+      Empty          = 0,
+      Writing        = 1,                    // Claimed by a producer, frames are not yet valid.
+      Published      = 2,                    // Frames are valid and never change again.
+   };
+
+   /// A single distinct stacktrace.
+   /// The stack id of an entry is its index in the table plus one.
+   /// The counters are only maintained by the aggregate transport.
+   typedef struct LEAK_STACK_ENTRY_ {
+      volatile LONG State;                   // StackEntryState
+      volatile LONG64 Hash;                  // Hash of the frames (CreateUniqueId)
+      volatile LONG64 Allocations;           // Number of allocations
+      volatile LONG64 Deallocations;         // Number of deallocations
+      volatile LONG64 LiveBytes;             // Currently allocated bytes
+      volatile LONG64 PeakBytes;             // Maximum of LiveBytes
+      STACKTRACE Stacktrace;
+   } LEAK_STACK_ENTRY, *PLEAK_STACK_ENTRY;
+
+   /// A single slot of the event ring.
+   /// The slot holds the record of 'position' once Sequence == position + 1.
+   /// Slots are released by advancing ReadIndex only, so a consumer that reads
+   /// the ring with a copy (process_vm_readv) never writes to the slots.
+   typedef struct LEAK_RING_SLOT_ {
+      volatile LONG64 Sequence;
+      LEAK_EVENT_RECORD Record;
+   } LEAK_RING_SLOT, *PLEAK_RING_SLOT;
+
+   /// Control block at the start of the shared mapping.
+   /// Write and read positions are kept on separate cache lines since
+   /// they are updated by different processes.
+   typedef struct LEAK_SHARED_CONTROL_ {
+      DWORD Magic;
+      DWORD Version;
+      DWORD Transport;                       // TransportMode
+      DWORD Overflow;                        // OverflowPolicy
+      DWORD RingCapacity;                    // Number of slots, always a power of two
+      DWORD StackCapture;                    // StackCaptureMode
+      DWORD StackTableCapacity;              // Number of stack table entries, always a power of two
+      DWORD SamplingInterval;                // Mean sampling interval in bytes, 0 if sampling is disabled
+      DWORD MinimumLifetime;                 // Allocations freed within this many milliseconds are not reported, 0 if disabled
+
+      alignas(64) volatile LONG64 WriteIndex;   // Next position reserved by a producer
+      alignas(64) volatile LONG64 ReadIndex;    // Next position drained by the monitor
+      volatile LONG64 LostEvents;                // Events dropped by OverflowPolicy::Drop
+      volatile LONG64 LostStacks;                // Stacktraces not stored since the stack table was full
+   } LEAK_SHARED_CONTROL, *PLEAK_SHARED_CONTROL;
+
+   /// Rounds the given capacity up to the next power of two.
+   /// Used for the ring and the stack table.
+   inline DWORD GetRingCapacity (DWORD requested)
+   {
+      DWORD capacity = 2;
+      while (capacity < requested && capacity < 0x40000000)
+         capacity <<= 1;
+
+      return capacity;
+   }
+
+   /// Returns the number of bytes required to map the control block including the ring
+   /// and the stack table.
+   inline SIZE_T GetSharedControlSize (DWORD ringCapacity, DWORD stackTableCapacity)
+   {
+      return sizeof (LEAK_SHARED_CONTROL) 
+         + (SIZE_T)ringCapacity * sizeof (LEAK_RING_SLOT)
+         + (SIZE_T)stackTableCapacity * sizeof (LEAK_STACK_ENTRY);
+   }
+
+   /// Returns the first ring slot which is stored right after the control block.
+   __forceinline PLEAK_RING_SLOT GetRingSlots (PLEAK_SHARED_CONTROL control)
+   {
+      return (PLEAK_RING_SLOT)(control + 1);
+   }
+
+   /// Returns the first stack table entry which is stored right after the ring.
+   __forceinline PLEAK_STACK_ENTRY GetStackTable (PLEAK_SHARED_CONTROL control)
+   {
+      return (PLEAK_STACK_ENTRY)(GetRingSlots (control) + control->RingCapacity);
+   }
+
+   /// Initializes a freshly created control block. Called by the monitoring process.
+   inline void InitializeSharedControl (
+      PLEAK_SHARED_CONTROL control,
+      TransportMode transport,
+      OverflowPolicy overflow,
+      StackCaptureMode stackCapture,
+      DWORD ringCapacity,
+      DWORD stackTableCapacity,
+      DWORD samplingInterval,
+      DWORD minimumLifetime)
+   {
+      memset (control, 0, sizeof (LEAK_SHARED_CONTROL));
+      control->Magic = SharedControlMagic;
+      control->Version = SharedControlVersion;
+      control->Transport = (DWORD)transport;
+      control->Overflow = (DWORD)overflow;
+      control->RingCapacity = ringCapacity;
+
+      // The stack of the remote process cannot be walked once it continued.
+      control->StackCapture = transport != TransportMode::Rendezvous
+         ? (DWORD)StackCaptureMode::Local
+         : (DWORD)stackCapture;
+
+      control->StackTableCapacity = stackTableCapacity;
+      control->SamplingInterval = samplingInterval;
+
+      // Held back allocations are published asynchronously, which requires the ring.
+      control->MinimumLifetime = transport == TransportMode::Ring
+         ? minimumLifetime
+         : 0;
+
+      PLEAK_RING_SLOT slots = GetRingSlots (control);
+      for (DWORD i = 0; i < ringCapacity; i++)
+         slots[i].Sequence = i;
+
+      memset (GetStackTable (control), 0, (SIZE_T)stackTableCapacity * sizeof (LEAK_STACK_ENTRY));
+   }
+
+   /// Compares the frames of two stacktraces.
+   __forceinline bool IsEqualStackFrames (const STACKTRACE& a, const STACKTRACE& b)
+   {
+      return a.FrameCount == b.FrameCount
+         && memcmp (a.Frames, b.Frames, a.FrameCount * sizeof (intptr_t)) == 0;
+   }
+
+   /// Looks up the given stacktrace in the stack table and inserts it if it is not known yet.
+   /// Lock-free; safe to be called by multiple threads. Entries are never removed.
+   /// Returns the stack id, or zero if the table is full.
+   __forceinline DWORD StackTableInsert (PLEAK_SHARED_CONTROL control, const STACKTRACE& stacktrace)
+   {
+      const DWORD capacity = control->StackTableCapacity;
+      if (capacity == 0)
+         return 0;
+
+      const DWORD mask = capacity - 1;
+      const LONG64 hash = (LONG64)CreateUniqueId (stacktrace);
+      PLEAK_STACK_ENTRY table = GetStackTable (control);
+
+      // Linear probing.
+      for (DWORD probe = 0; probe < capacity; probe++)
+      {
+         const DWORD index = (DWORD)(((uint64_t)hash + probe) & mask);
+         PLEAK_STACK_ENTRY entry = &table[index];
+
+         LONG state = entry->State;
+         if (state == (LONG)StackEntryState::Empty)
+         {
+            state = InterlockedCompareExchange (&entry->State, (LONG)StackEntryState::Writing, (LONG)StackEntryState::Empty);
+            if (state == (LONG)StackEntryState::Empty)
+            {
+               // Claimed the entry.
+               entry->Hash = hash;
+               entry->Stacktrace = stacktrace;
+               InterlockedExchange (&entry->State, (LONG)StackEntryState::Published);
+               return index + 1;
+            }
+         }
+
+         // Another producer is writing this entry; it may be our stacktrace.
+         while (state == (LONG)StackEntryState::Writing)
+         {
+            YieldProcessor ();
+            state = entry->State;
+         }
+
+         if (entry->Hash == hash && IsEqualStackFrames (entry->Stacktrace, stacktrace))
+            return index + 1;
+      }
+
+      return 0;
+   }
+
+   /// Returns the published stack table entry of the given stack id, or NULL.
+   inline PLEAK_STACK_ENTRY GetStackEntry (PLEAK_SHARED_CONTROL control, DWORD stackId)
+   {
+      if (stackId == 0 || stackId > control->StackTableCapacity)
+         return NULL;
+
+      PLEAK_STACK_ENTRY entry = &GetStackTable (control)[stackId - 1];
+      if (entry->State != (LONG)StackEntryState::Published)
+         return NULL;
+
+      return entry;
+   }
+
+   /// Counts an allocation of the given stack table entry.
+   __forceinline void StackEntryAddAllocation (PLEAK_STACK_ENTRY entry, SIZE_T size)
+   {
+      InterlockedIncrement64 (&entry->Allocations);
+      const LONG64 live = InterlockedAdd64 (&entry->LiveBytes, (LONG64)size);
+
+      LONG64 peak = entry->PeakBytes;
+      while (live > peak)
+      {
+         const LONG64 previous = InterlockedCompareExchange64 (&entry->PeakBytes, live, peak);
+         if (previous == peak)
+            break;
+
+         peak = previous;
+      }
+   }
+
+   /// Counts a deallocation of the given stack table entry.
+   __forceinline void StackEntryAddDeallocation (PLEAK_STACK_ENTRY entry, SIZE_T size)
+   {
+      InterlockedIncrement64 (&entry->Deallocations);
+      InterlockedAdd64 (&entry->LiveBytes, -(LONG64)size);
+   }
+
+   /// Reserves the next slot of the ring. Safe to be called by multiple threads.
+   /// Returns false if the ring is full. 'signal' is set if this slot filled the ring
+   /// up to half of its capacity, so the caller should wake up the monitor.
+   /// The consumer stops at the slot until it is committed by RingCommit.
+   __forceinline bool RingTryReserve (PLEAK_SHARED_CONTROL control, LONG64& position, bool& signal)
+   {
+      const LONG64 capacity = (LONG64)control->RingCapacity;
+
+      position = control->WriteIndex;
+      for (;;)
+      {
+         // The consumer did not release the slot of the previous lap yet; the ring is full.
+         if (position - control->ReadIndex >= capacity)
+            return false;
+
+         // Try to reserve the slot.
+         LONG64 previous = InterlockedCompareExchange64 (&control->WriteIndex, position + 1, position);
+         if (previous == position)
+            break;
+
+         // Another producer reserved this slot in the meantime.
+         position = previous;
+      }
+
+      signal = (position - control->ReadIndex) == capacity / 2;
+      return true;
+   }
+
+   /// Writes a record into a slot reserved by RingTryReserve and publishes it to the consumer.
+   __forceinline void RingCommit (PLEAK_SHARED_CONTROL control, LONG64 position, const LEAK_EVENT_RECORD& record)
+   {
+      const LONG64 capacity = (LONG64)control->RingCapacity;
+      PLEAK_RING_SLOT slot = &GetRingSlots (control)[position & (capacity - 1)];
+      slot->Record = record;
+
+      // Publish the slot to the consumer.
+      InterlockedExchange64 (&slot->Sequence, position + 1);
+   }
+
+   /// Appends a record to the ring. Safe to be called by multiple threads.
+   /// Returns false if the ring is full (see RingTryReserve).
+   __forceinline bool RingTryPush (PLEAK_SHARED_CONTROL control, const LEAK_EVENT_RECORD& record, bool& signal)
+   {
+      LONG64 position;
+      if (!RingTryReserve (control, position, signal))
+         return false;
+
+      RingCommit (control, position, record);
+      return true;
+   }
+
+   /// Drains up to 'maximum' published records into 'records'.
+   /// Must only be called by a single consumer (the monitoring process).
+   /// Returns the number of drained records.
+   inline SIZE_T RingDrain (PLEAK_SHARED_CONTROL control, PLEAK_EVENT_RECORD records, SIZE_T maximum)
+   {
+      const LONG64 mask = (LONG64)control->RingCapacity - 1;
+      PLEAK_RING_SLOT slots = GetRingSlots (control);
+
+      LONG64 position = control->ReadIndex;
+      SIZE_T count = 0;
+      while (count < maximum)
+      {
+         PLEAK_RING_SLOT slot = &slots[position & mask];
+         if (slot->Sequence != position + 1)
+         {
+            // Either empty or a producer has reserved but not yet published the slot.
+            break;
+         }
+
+         records[count++] = slot->Record;
+         position++;
+      }
+
+      // Hand the slots back to the producers for the next lap.
+      if (count)
+         InterlockedExchange64 (&control->ReadIndex, position);
+
+      return count;
+   }
+
+#ifndef _WIN32
+   //
+   // Linux rendezvous
+   // The instrumented process keeps the control block, the ring and the stack table in
+   // private memory; the monitor reads them with process_vm_readv. Only this small block
+   // is shared (POSIX shared memory, VL_MEMORY_SHARED_CONTROL). It replaces the named
+   // events of the Windows implementation:
+   //
+   // 1. The monitor creates the block, publishes the settings and requests the start.
+   // 2. The instrumented process sets up the ring, publishes its address and confirms the start.
+   // 3. Producers wake up the monitor with Signal if the ring is half-full or full.
+   // 4. The monitor requests the stop; the instrumented process confirms it.
+   //
+
+   const DWORD SharedRendezvousMagic = 'RAEL';
+   const DWORD SharedRendezvousVersion = 1;
+
+   /// State of the rendezvous; each transition wakes up the other side.
+   enum class RendezvousState
+   {
+      StartRequested = 0,                    // Published by the monitor, settings are valid.
+      Started        = 1,                    // Ring is set up, profiling is enabled.
+      StopRequested  = 2,                    // Published by the monitor.
+      Stopped        = 3,                    // Profiling is disabled, all announced events are published.
+   };
+
+   typedef struct LEAK_SHARED_RENDEZVOUS_ {
+      DWORD Magic;
+      DWORD Version;
+      DWORD MonitorProcessId;                // Allowed to read the instrumented process (PR_SET_PTRACER)
+      DWORD Overflow;                        // OverflowPolicy
+      DWORD RingCapacity;                    // Number of slots, always a power of two
+      DWORD StackTableCapacity;              // Number of stack table entries, always a power of two
+
+      volatile LONG State;                   // RendezvousState (futex)
+      volatile LONG Signal;                  // Incremented by producers to wake up the monitor (futex)
+      volatile LONG MonitorWaiting;          // The monitor is waiting for Signal
+      uint64_t ControlAddress;               // Address of LEAK_SHARED_CONTROL in the instrumented process
+      uint64_t ControlSize;                  // Size of the control block including the ring and the stack table
+   } LEAK_SHARED_RENDEZVOUS, *PLEAK_SHARED_RENDEZVOUS;
+
+   /// Waits until the futex word no longer has the value 'expected', it is woken up,
+   /// or 'timeoutMs' elapsed. The word may be shared between processes.
+   inline void FutexWait (volatile LONG* address, LONG expected, DWORD timeoutMs)
+   {
+      struct timespec timeout;
+      timeout.tv_sec = timeoutMs / 1000;
+      timeout.tv_nsec = (long)(timeoutMs % 1000) * 1000000L;
+      syscall (SYS_futex, (LONG*)address, FUTEX_WAIT, expected, &timeout, nullptr, 0);
+   }
+
+   /// Wakes up all waiters of the futex word.
+   inline void FutexWake (volatile LONG* address)
+   {
+      syscall (SYS_futex, (LONG*)address, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+   }
+
+   /// Updates the state of the rendezvous and wakes up the other side.
+   inline void SetRendezvousState (PLEAK_SHARED_RENDEZVOUS rendezvous, RendezvousState state)
+   {
+      InterlockedExchange (&rendezvous->State, (LONG)state);
+      FutexWake (&rendezvous->State);
+   }
+
+   /// Wakes up the monitor; the system call is skipped if it is not waiting.
+   __forceinline void SignalMonitor (PLEAK_SHARED_RENDEZVOUS rendezvous)
+   {
+      InterlockedIncrement (&rendezvous->Signal);
+      if (rendezvous->MonitorWaiting)
+         FutexWake (&rendezvous->Signal);
+   }
+#endif
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "libLeak.h"
+
+#include <unordered_map>
+
+namespace libLeak
+{
+   ///
+   /// StacktraceIds
+   /// Assigns the stacktrace ids of a session: the hash of the raw frames (CreateUniqueId).
+   ///
+   /// A second hash with another seed is kept per id. If two different stacktraces share
+   /// an id, the later one is rehashed (seeded with the id) until it finds a free id or its
+   /// own, so each stacktrace keeps a single id for the whole session.
+   ///
+   class StacktraceIds
+   {
+      static constexpr uint64_t CheckSeed = 0x3C6EF372FE94F82BULL;
+
+      std::unordered_map<uint64_t, uint64_t> mKnown;           // stacktrace id -> check hash
+      std::unordered_map<uint32_t, uint64_t> mStackIds;        // stack id (remote) -> stacktrace id
+      uint64_t mCollisions = 0;
+
+   public:
+      ///
+      /// Returns the id of a stacktrace. Stacks shared by the remote process are hashed
+      /// once per stack id (0 if unknown). 'added' is set for the first occurrence of
+      /// a stacktrace; it must be written before the id is referenced.
+      ///
+      uint64_t get (uint32_t stack_id, const libLeak::STACKTRACE& stacktrace, bool& added)
+      {
+         added = false;
+         auto known_stack_id = stack_id != 0 ? mStackIds.find (stack_id) : mStackIds.end ();
+         if (known_stack_id != mStackIds.end ())
+            return known_stack_id->second;
+
+         uint64_t id = CreateUniqueId (stacktrace);
+         const uint64_t check = CreateUniqueId (stacktrace, CheckSeed);
+         bool collided = false;
+         for (;;)
+         {
+            auto known = mKnown.find (id);
+            if (known == mKnown.end ())
+            {
+               mKnown.emplace (id, check);
+               added = true;
+               break;
+            }
+
+            if (known->second == check)
+               break;
+
+            collided = true;
+            id = CreateUniqueId (stacktrace, id);
+         }
+
+         if (added && collided)
+            mCollisions++;
+
+         if (stack_id != 0)
+            mStackIds[stack_id] = id;
+
+         return id;
+      }
+
+      /// Number of stacktraces whose id was taken by a different stacktrace.
+      uint64_t collisions () const
+      {
+         return mCollisions;
+      }
+   };
+}
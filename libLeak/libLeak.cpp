@@ -1,8 +1,8 @@
 #include "libLeak.h"
 
+#include <cmath>
 #include <locale>
 #include <string>
-#include <sstream>
 
 ///
 /// Template Identifiers where $dynamic is replaces with the target
@@ -14,6 +14,11 @@ const char* libLeak::VL_MEMORY_EVENT_START_CONFIRM = "Global\\vl.leak.$dynamic.s
 const char* libLeak::VL_MEMORY_EVENT_REMOTE_STOP = "Global\\vl.leak.$dynamic.stop";
 const char* libLeak::VL_MEMORY_EVENT_STOP_CONFIRM = "Global\\vl.leak.$dynamic.stop.confirm";
 const char* libLeak::VL_MEMORY_EVENT_REMOTE_INTERRUPT_CONTINUE = "Global\\vl.leak.$dynamic.interrupt.continue";
+#ifdef _WIN32
+const char* libLeak::VL_MEMORY_SHARED_CONTROL = "Global\\vl.leak.$dynamic.shared";
+#else
+const char* libLeak::VL_MEMORY_SHARED_CONTROL = "/vl.leak.$dynamic.shared";
+#endif
 
 /// Utility: Replace substring.
 void replace(std::string& str, const std::string& from, const std::string& to) 
@@ -33,49 +38,74 @@ std::string libLeak::ReplaceEventName (const char* eventName, DWORD processId)
    return result;
 }
 
-/// Default by http://isthe.com/chongo/tech/comp/fnv/
-const uint32_t Prime = 0x01000193;
-const uint32_t Seed  = 0x811C9DC5;
-
-/// Hash a single byte..
-inline uint32_t fnv1a(unsigned char byte, uint32_t hash = Seed)
+///
+/// Each byte is sampled with probability 1 / samplingInterval, so an allocation of 'size' bytes
+/// is reported with probability 1 - exp(-size / samplingInterval). Weighting each reported
+/// allocation by the inverse of that probability gives unbiased count and byte estimates.
+///
+double libLeak::GetSamplingWeight (uint64_t size, uint64_t samplingInterval)
 {
-  return (byte ^ hash) * Prime;
+   if (samplingInterval == 0)
+      return 1.0;
+
+   const double probability = 1.0 - exp (-(double)size / (double)samplingInterval);
+   return probability > 0.0 ? 1.0 / probability : 1.0;
 }
 
-/// Hash a block of memory..
-uint32_t fnv1a(const void* data, size_t numBytes, uint32_t hash = Seed)
+/// Primes of xxHash64.
+const uint64_t Prime1 = 0x9E3779B185EBCA87ULL;
+const uint64_t Prime2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t Prime3 = 0x165667B19E3779F9ULL;
+
+inline uint64_t rotl64 (uint64_t value, int bits)
 {
-   const unsigned char* ptr = (const unsigned char*)data;
-   while (numBytes--)
-   {
-      hash = fnv1a (*ptr++, hash);
-   }
-   return hash;
+   return (value << bits) | (value >> (64 - bits));
 }
 
-/// Hash a std::string
-uint32_t fnv1a(const std::string& text, uint32_t hash = Seed)
+/// Mixes a frame into a lane.
+inline uint64_t round64 (uint64_t lane, uint64_t frame)
 {
-   return fnv1a (text.c_str(), text.length(), hash);
+   return rotl64 (lane + frame * Prime2, 31) * Prime1;
 }
 
 ///
-/// Generates a "unique" identifier by the given symbols.
-/// We need this to write down a stacktrace once and have a reference to to the stacktrace
+/// Generates a "unique" identifier by the raw frames of a stacktrace.
+/// We need this to write down a stacktrace once and have a reference to the stacktrace
 /// for each allocation.
 ///
-uint32_t libLeak::CreateUniqueId (
-   const std::vector<libLeak::SYMBOL_ENTRY>& symbols)
+/// The frames are mixed into four independent lanes (frame i into lane i % 4), so the
+/// rounds of consecutive frames do not depend on each other; the lanes are merged and
+/// the result is finalized like xxHash64. No allocation, no symbols required.
+///
+uint64_t libLeak::CreateUniqueId (
+   const libLeak::STACKTRACE& stacktrace,
+   uint64_t seed)
 {
-   std::stringstream ss;
-   for (const auto& entry : symbols)
-   {
-      if (entry.name.size () == 0)
-         continue;
+   const UINT count = stacktrace.FrameCount < (UINT)libLeak::MaximumStackTraceFrames
+      ? stacktrace.FrameCount
+      : (UINT)libLeak::MaximumStackTraceFrames;
 
-      ss << "[" << entry.name << "]";
+   uint64_t lanes[4] = { seed + Prime1 + Prime2, seed + Prime2, seed, seed - Prime1 };
+
+   UINT i = 0;
+   for (; i + 4 <= count; i += 4)
+   {
+      for (UINT lane = 0; lane < 4; lane++)
+         lanes[lane] = round64 (lanes[lane], (uint64_t)stacktrace.Frames[i + lane]);
    }
 
-   return fnv1a (ss.str ());
+   for (; i < count; i++)
+      lanes[i % 4] = round64 (lanes[i % 4], (uint64_t)stacktrace.Frames[i]);
+
+   uint64_t hash = rotl64 (lanes[0], 1) + rotl64 (lanes[1], 7) + rotl64 (lanes[2], 12) + rotl64 (lanes[3], 18);
+   for (UINT lane = 0; lane < 4; lane++)
+      hash = (hash ^ round64 (0, lanes[lane])) * Prime1 + Prime3;
+
+   hash += count;
+   hash ^= hash >> 33;
+   hash *= Prime2;
+   hash ^= hash >> 29;
+   hash *= Prime3;
+   hash ^= hash >> 32;
+   return hash;
 }
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <Windows.h>
+#include "LeakPlatform.h"
 
 #include <string>
 #include <vector>
@@ -13,6 +13,29 @@ namespace libLeak
       Invalid        = 0,
       Allocation     = 1,
       Deallocation    = 2,
+      Reallocation   = 3,                    // Block was resized or moved; releases 'PreviousPointer'.
+   };
+
+   // IPC transport between the instrumented process and the monitoring process.
+   enum class TransportMode
+   {
+      Rendezvous     = 0,                    // Each event interrupts the process until the monitor has read 'Metadata'.
+      Ring           = 1,                    // Events are appended to the shared ring and drained asynchronously.
+      Aggregate      = 2,                    // No events; the process maintains counters per stacktrace.
+   };
+
+   // Where the stacktrace of an event is captured.
+   enum class StackCaptureMode
+   {
+      Remote         = 0,                    // The monitor walks the interrupted stack using 'Metadata.Context'.
+      Local          = 1,                    // The instrumented process walks its own stack.
+   };
+
+   // Behaviour of the shared ring if the monitoring process cannot keep up.
+   enum class OverflowPolicy
+   {
+      Block          = 0,                    // The instrumented thread waits until a slot is released.
+      Drop           = 1,                    // The event is discarded and counted as lost.
    };
 
    //
@@ -21,13 +44,6 @@ namespace libLeak
    // and the monitoring process.
    //
 
-   typedef struct ANALYZER_METADATA_ {
-      CONTEXT Context;                       // CPU Context
-      DWORD Type;                            // Type
-      SIZE_T Size;                           // Allocated Size [if Type is Allocate]
-      intptr_t Pointer;                      // Allocated Pointer
-   } ANALYZER_METADATA, *PANALYZER_METADATA;
-
    const int MaximumStackTraceFrames = 24;
    typedef struct _STACKTRACE 
    {
@@ -35,11 +51,25 @@ namespace libLeak
       intptr_t Frames[MaximumStackTraceFrames];
    } STACKTRACE, * PSTACKTRACE;
 
+#ifdef _WIN32
+   typedef struct ANALYZER_METADATA_ {
+      CONTEXT Context;                       // CPU Context [if StackCapture is Remote]
+      DWORD Type;                            // Type
+      SIZE_T Size;                           // Allocated Size [if Type is Allocate]
+      intptr_t Pointer;                      // Allocated Pointer
+      intptr_t PreviousPointer;              // Released Pointer [if Type is Reallocation]
+      DWORD StackCapture;                    // StackCaptureMode
+      STACKTRACE Stacktrace;                 // Captured Frames [if StackCapture is Local]
+   } ANALYZER_METADATA, *PANALYZER_METADATA;
+#endif
+
    typedef struct ALLOCATION_EVENT_ {
       SIZE_T Size;
       intptr_t Pointer;
       uint64_t TimestampEpochSeconds;
       libLeak::STACKTRACE Stacktrace;
+      uint32_t StackId;                      // Stack table id of the remote process, 0 if unknown
+      intptr_t PreviousPointer;              // Pointer released by a reallocation, 0 for plain allocations
    } ALLOCATION_EVENT, *PALLOCATION_EVENT;
 
    typedef struct DELLOCATION_EVENT_ {
@@ -47,22 +77,57 @@ namespace libLeak
       uint64_t TimestampEpochSeconds;
    } DELLOCATION_EVENT, *PDELLOCATION_EVENT;
 
+   typedef struct AGGREGATE_EVENT_ {
+      uint32_t StackId;                      // Stack table id of the remote process
+      libLeak::STACKTRACE Stacktrace;
+      uint64_t Allocations;                  // Number of allocations
+      uint64_t Deallocations;                // Number of deallocations
+      uint64_t LiveBytes;                    // Currently allocated bytes
+      uint64_t PeakBytes;                    // Maximum of LiveBytes
+      uint64_t TimestampEpochSeconds;
+   } AGGREGATE_EVENT, *PAGGREGATE_EVENT;
+
    typedef struct SYMBOL_ENTRY_ {
       std::string name;
       std::string file;
       DWORD line;
    } SYMBOL_ENTRY, *PSYMBOL_ENTRY;
 
+   /// A module loaded into the remote process; identifies the symbols of its frames.
+   typedef struct MODULE_ENTRY_ {
+      uint64_t base;
+      uint64_t size;
+      std::string path;
+      std::vector<uint8_t> identity;         // CodeView GUID of the PDB (Windows), GNU build id (Linux)
+      DWORD age;                             // PDB age (Windows)
+      DWORD timestamp;                       // TimeDateStamp of the PE header (Windows)
+   } MODULE_ENTRY, *PMODULE_ENTRY;
+
    extern const char* VL_MEMORY_EVENT_INTERRUPT;
    extern const char* VL_MEMORY_EVENT_REMOTE_START;
    extern const char* VL_MEMORY_EVENT_START_CONFIRM;
    extern const char* VL_MEMORY_EVENT_REMOTE_STOP;
    extern const char* VL_MEMORY_EVENT_STOP_CONFIRM;
    extern const char* VL_MEMORY_EVENT_REMOTE_INTERRUPT_CONTINUE;
+   extern const char* VL_MEMORY_SHARED_CONTROL;
 
    /// Replaces a template-event name to a pid-specific-event name.
    std::string ReplaceEventName (const char* eventName, DWORD processId);
 
-   /// Returns a hash from given symbol entries.
-   uint32_t CreateUniqueId (const std::vector<libLeak::SYMBOL_ENTRY>& symbols);
+   /// Converts a FILETIME timestamp (100ns intervals since 1601-01-01) to epoch seconds.
+   inline uint64_t FileTimeToEpochSeconds (uint64_t filetime)
+   {
+      return (filetime - 116444736000000000ULL) / 10000000ULL;
+   }
+
+   /// Returns the number of allocations a sampled allocation of the given size represents.
+   /// Returns 1 if allocations were not sampled (samplingInterval is zero).
+   double GetSamplingWeight (uint64_t size, uint64_t samplingInterval);
+
+   /// Default seed of CreateUniqueId.
+   constexpr uint64_t StacktraceIdSeed = 0x27D4EB2F165667C5ULL;
+
+   /// Returns a 64-bit hash of the raw frames of a stacktrace, used as stacktrace id.
+   /// A different seed gives an independent hash, used to detect collisions.
+   uint64_t CreateUniqueId (const libLeak::STACKTRACE& stacktrace, uint64_t seed = StacktraceIdSeed);
 }
\ No newline at end of file